@@ -0,0 +1,976 @@
+/*
+ * OSCam ECM replay benchmark
+ * Replays a trace of ECMs through get_cw() against in-process stub readers
+ * and reports throughput, per stage latency percentiles and lock contention.
+ * Build this file using `make bench`, then run f.e.
+ *   BENCH_TRACE=ecm.trace ./bench.bin -c /path/to/bench/config
+ *
+ * The config directory needs no readers or users, the benchmark creates its own.
+ * Settings are taken from the environment:
+ *   BENCH_TRACE     trace file, one ecm per line: <ms> <caid> <prid> <srvid> <ecm>
+ *                   ms is the decimal offset from the trace start, all others are hex.
+ *                   Without a trace a synthetic one is generated:
+ *   BENCH_ECMS      number of synthetic ecms (20000)
+ *   BENCH_SERVICES  number of synthetic services, ecms change every 10 s (50)
+ *   BENCH_RATE      synthetic ecms per second (1000)
+ *   BENCH_SPEED     replay speed factor, 0 = as fast as possible (1)
+ *   BENCH_CLIENTS   clients replaying the trace in parallel (4)
+ *   BENCH_READERS   stub readers (4)
+ *   BENCH_LATENCY   reader answer time in ms: const:N, uniform:A-B or exp:MEAN (uniform:20-80),
+ *                   +P%:T appended lets P percent of the answers take T ms, a comma separated
+ *                   list sets the readers one by one and the last entry repeats
+ *   BENCH_FAIL      percent of not found answers (5)
+ *   BENCH_LOST      percent of requests never answered (0)
+ *   BENCH_LOG       keep logging enabled (0)
+ *
+ * BENCH_MODE=llist runs microbenchmarks of the LLIST operations instead:
+ *   BENCH_LLIST_SIZE    list length (10000)
+ *   BENCH_LLIST_ROUNDS  repetitions of each operation (200)
+ *   BENCH_CLIENTS       threads iterating in parallel (4)
+ *
+ * BENCH_MODE=lb times stat_get_best_reader() with learned statistics, lb_mode from the config (1 if unset):
+ *   BENCH_READERS       stub readers matching every ecm (4)
+ *   BENCH_SERVICES      services with statistics (50)
+ *   BENCH_LB_ROUNDS     selections per service (100)
+ */
+#include "globals.h"
+
+#include <math.h>
+#include <sys/resource.h>
+
+#include "oscam-client.h"
+#include "oscam-config.h"
+#include "oscam-ecm.h"
+#include "oscam-latency.h"
+#include "oscam-lock.h"
+#include "oscam-reader.h"
+#include "oscam-string.h"
+#include "oscam-time.h"
+#include "module-stat.h"
+
+extern CS_MUTEX_LOCK system_lock;
+extern CS_MUTEX_LOCK ecmcache_lock;
+extern CS_MUTEX_LOCK ecm_deadline_lock;
+extern CS_MUTEX_LOCK ecm_pushed_deleted_lock;
+extern CS_MUTEX_LOCK cwcycle_lock;
+
+#define BENCH_MAX_READERS	64
+#define BENCH_MAX_CLIENTS	64
+
+enum bench_dist
+{
+	DIST_CONST = 0,
+	DIST_UNIFORM,
+	DIST_EXP
+};
+
+struct bench_ecm
+{
+	int64_t			ts;								// us from trace start
+	uint16_t		caid;
+	uint32_t		prid;
+	uint16_t		srvid;
+	int16_t			ecmlen;
+	uint8_t			*ecm;
+};
+
+// answer of a stub reader, travels through the reader socket
+struct bench_msg
+{
+	int32_t			idx;
+	int32_t			rc;
+	uint8_t			cw[16];
+};
+
+struct bench_answer
+{
+	int64_t			due;							// us
+	int32_t			fd;
+	struct bench_msg msg;
+};
+
+struct bench_latency
+{
+	int8_t			dist;
+	uint32_t		a, b;							// ms
+	uint32_t		tail_pct, tail;					// percent of answers taking tail ms
+};
+
+struct bench_reader
+{
+	struct s_reader	*rdr;
+	int32_t			fd;								// our end of the reader socket
+};
+
+struct bench_client
+{
+	struct s_client	*cl;
+	int32_t			num;
+	pthread_t		thread;
+};
+
+static struct
+{
+	const char		*trace;
+	uint32_t		ecms;
+	uint32_t		services;
+	uint32_t		rate;
+	double			speed;
+	int32_t			clients;
+	int32_t			readers;
+	struct bench_latency lat[BENCH_MAX_READERS];
+	uint32_t		fail;							// percent
+	uint32_t		lost;							// percent
+} bench;
+
+static struct s_module *bench_module;
+static struct bench_ecm *bench_trace;
+static uint32_t bench_trace_count;
+static struct bench_reader bench_readers[BENCH_MAX_READERS];
+static struct bench_client bench_clients[BENCH_MAX_CLIENTS];
+
+// pending stub answers, min heap on due
+static struct bench_answer *answers;
+static uint32_t answers_count, answers_size;
+static uint64_t bench_seed = 0x9E3779B97F4A7C15ULL;
+static pthread_mutex_t answer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t answer_cond;
+static int8_t answer_stop;
+
+static int64_t bench_start;
+static uint32_t ecms_sent, ecms_answered, ecms_overflow;
+static uint32_t answer_rc[E_STOPPED + 2];
+
+static const char *bench_getenv(const char *name, const char *def)
+{
+	const char *val = getenv(name);
+	return (val && val[0]) ? val : def;
+}
+
+static uint32_t bench_getenv_int(const char *name, uint32_t def)
+{
+	const char *val = getenv(name);
+	return (val && val[0]) ? strtoul(val, NULL, 10) : def;
+}
+
+// answer_lock must be held
+static uint64_t bench_rand(void)
+{
+	bench_seed ^= bench_seed << 13;
+	bench_seed ^= bench_seed >> 7;
+	bench_seed ^= bench_seed << 17;
+	return bench_seed;
+}
+
+// answer_lock must be held, returns us
+static int64_t bench_latency(const struct bench_latency *lat)
+{
+	double u = (double)(bench_rand() >> 11) / (double)(1ULL << 53);
+
+	if(lat->tail_pct && bench_rand() % 100 < lat->tail_pct)
+		{ return (int64_t)lat->tail * 1000; }
+
+	switch(lat->dist)
+	{
+		case DIST_UNIFORM:
+			return (int64_t)((lat->a + u * (lat->b - lat->a)) * 1000);
+		case DIST_EXP:
+			return (int64_t)(-log(1.0 - u) * lat->a * 1000);
+		default:
+			return (int64_t)lat->a * 1000;
+	}
+}
+
+static int32_t bench_parse_latency(const char *spec, struct bench_latency *lat)
+{
+	const char *tail = strchr(spec, '+'), *next = strchr(spec, ',');
+
+	memset(lat, 0, sizeof(*lat));
+	if(tail && (!next || tail < next) && (sscanf(tail, "+%u%%:%u", &lat->tail_pct, &lat->tail) != 2 || lat->tail_pct > 100))
+		{ return 0; }
+
+	if(sscanf(spec, "const:%u", &lat->a) == 1)
+	{
+		lat->dist = DIST_CONST;
+		return 1;
+	}
+	if(sscanf(spec, "uniform:%u-%u", &lat->a, &lat->b) == 2 && lat->a <= lat->b)
+	{
+		lat->dist = DIST_UNIFORM;
+		return 1;
+	}
+	if(sscanf(spec, "exp:%u", &lat->a) == 1)
+	{
+		lat->dist = DIST_EXP;
+		return 1;
+	}
+	return 0;
+}
+
+// one spec per reader, the last one repeats
+static int32_t bench_parse_latencies(const char *specs)
+{
+	const char *spec = specs;
+	int32_t i;
+
+	for(i = 0; i < BENCH_MAX_READERS; i++)
+	{
+		if(!bench_parse_latency(spec, &bench.lat[i]))
+			{ return 0; }
+		if(strchr(spec, ','))
+			{ spec = strchr(spec, ',') + 1; }
+	}
+	return 1;
+}
+
+/*
+ * trace handling
+ */
+
+static int32_t bench_add_ecm(int64_t ts, uint16_t caid, uint32_t prid, uint16_t srvid, uint8_t *ecm, int16_t ecmlen)
+{
+	struct bench_ecm *e;
+
+	if(!(bench_trace_count & 1023) && !cs_realloc(&bench_trace, (bench_trace_count + 1024) * sizeof(struct bench_ecm)))
+		{ return 0; }
+
+	e = &bench_trace[bench_trace_count];
+	if(!cs_malloc(&e->ecm, ecmlen))
+		{ return 0; }
+
+	e->ts = ts;
+	e->caid = caid;
+	e->prid = prid;
+	e->srvid = srvid;
+	e->ecmlen = ecmlen;
+	memcpy(e->ecm, ecm, ecmlen);
+	bench_trace_count++;
+	return 1;
+}
+
+static int32_t bench_load_trace(const char *file)
+{
+	FILE *fp;
+	char line[2 * MAX_ECM_SIZE + 64], *hex;
+	uint8_t ecm[MAX_ECM_SIZE];
+	uint32_t caid, prid, srvid, n = 0;
+	int64_t ms;
+	int32_t len, pos;
+
+	if(!(fp = fopen(file, "r")))
+	{
+		printf("Can't open trace %s: %s\n", file, strerror(errno));
+		return 0;
+	}
+
+	while(fgets(line, sizeof(line), fp))
+	{
+		n++;
+		if(line[0] == '#' || !trim(line)[0])
+			{ continue; }
+
+		pos = 0;
+		if(sscanf(line, "%"SCNd64" %x %x %x %n", &ms, &caid, &prid, &srvid, &pos) != 4 || !pos
+				|| (len = cs_strlen(hex = line + pos) / 2) < 3 || len > MAX_ECM_SIZE || cs_atob(ecm, hex, len) < 0)
+		{
+			printf("Ignoring invalid trace line %u\n", n);
+			continue;
+		}
+
+		if(!bench_add_ecm(ms * 1000, caid, prid, srvid, ecm, len))
+			{ break; }
+	}
+	fclose(fp);
+	return bench_trace_count > 0;
+}
+
+// every service changes its ecm each 10 s, requests in between are cache hits
+static int32_t bench_make_trace(void)
+{
+	uint8_t ecm[64];
+	uint32_t i, k, period, srvid;
+	int64_t ts;
+
+	for(i = 0; i < bench.ecms; i++)
+	{
+		ts = (int64_t)i * 1000000 / (bench.rate ? bench.rate : 1);
+		srvid = 0x1000 + (uint32_t)((i * 2654435761u) % bench.services);
+		period = ts / 10000000;
+
+		ecm[0] = 0x80 | (period & 1);
+		ecm[1] = 0x70;
+		ecm[2] = sizeof(ecm) - 3;
+		ecm[3] = srvid >> 8;
+		ecm[4] = srvid & 0xFF;
+		ecm[5] = period >> 8;
+		ecm[6] = period & 0xFF;
+		for(k = 7; k < sizeof(ecm); k++)
+			{ ecm[k] = (srvid * 31 + period * 17 + k * 7) & 0xFF; }
+
+		if(!bench_add_ecm(ts, 0x0B00, 0, srvid, ecm, sizeof(ecm)))
+			{ return 0; }
+	}
+	return bench_trace_count > 0;
+}
+
+/*
+ * stub answers: queued on c_send_ecm, sent through the reader socket when due
+ */
+
+static void bench_queue_answer(struct bench_answer *a)
+{
+	uint32_t i, parent;
+
+	if(answers_count == answers_size)
+	{
+		if(!cs_realloc(&answers, (answers_size + 1024) * sizeof(struct bench_answer)))
+			{ return; }
+		answers_size += 1024;
+	}
+
+	for(i = answers_count++; i > 0; i = parent)
+	{
+		parent = (i - 1) / 2;
+		if(answers[parent].due <= a->due)
+			{ break; }
+		answers[i] = answers[parent];
+	}
+	answers[i] = *a;
+}
+
+static void bench_pop_answer(void)
+{
+	struct bench_answer last = answers[--answers_count];
+	uint32_t i = 0, child;
+
+	while((child = 2 * i + 1) < answers_count)
+	{
+		if(child + 1 < answers_count && answers[child + 1].due < answers[child].due)
+			{ child++; }
+		if(last.due <= answers[child].due)
+			{ break; }
+		answers[i] = answers[child];
+		i = child;
+	}
+	answers[i] = last;
+}
+
+static void *bench_answer_thread(void *UNUSED(arg))
+{
+	struct bench_answer a;
+	struct timespec ts;
+	int64_t now;
+
+	set_thread_name(__func__);
+	SAFE_MUTEX_LOCK(&answer_lock);
+	while(!answer_stop)
+	{
+		if(!answers_count)
+		{
+			SAFE_COND_WAIT(&answer_cond, &answer_lock);
+			continue;
+		}
+
+		now = lat_now();
+		if(answers[0].due > now)
+		{
+			add_ms_to_timespec(&ts, (answers[0].due - now + 999) / 1000);
+			SAFE_COND_TIMEDWAIT(&answer_cond, &answer_lock, &ts);
+			continue;
+		}
+
+		a = answers[0];
+		bench_pop_answer();
+		SAFE_MUTEX_UNLOCK(&answer_lock);
+		if(send(a.fd, &a.msg, sizeof(a.msg), 0) < 0)
+			{ cs_log("bench answer send failed: %s", strerror(errno)); }
+		SAFE_MUTEX_LOCK(&answer_lock);
+	}
+	SAFE_MUTEX_UNLOCK(&answer_lock);
+	return NULL;
+}
+
+/*
+ * stub reader and client protocol
+ */
+
+static struct bench_reader *bench_get_reader(struct s_client *cl)
+{
+	int32_t i;
+
+	for(i = 0; i < bench.readers; i++)
+	{
+		if(bench_readers[i].rdr == cl->reader)
+			{ return &bench_readers[i]; }
+	}
+	return NULL;
+}
+
+static int32_t bench_client_init(struct s_client *cl)
+{
+	struct bench_reader *br = bench_get_reader(cl);
+	int32_t fds[2];
+
+	if(!br || socketpair(AF_UNIX, SOCK_DGRAM, 0, fds))
+		{ return -1; }
+
+	cl->pfd = fds[0];
+	br->fd = fds[1];
+	cl->reader->tcp_connected = 2;
+	cl->reader->card_status = CARD_INSERTED;
+	return 0;
+}
+
+static int32_t bench_send_ecm(struct s_client *cl, ECM_REQUEST *er)
+{
+	struct bench_reader *br = bench_get_reader(cl);
+	struct bench_answer a;
+	uint32_t roll, i;
+
+	if(!br)
+		{ return -1; }
+
+	memset(&a, 0, sizeof(a));
+	a.fd = br->fd;
+	a.msg.idx = er->idx;
+
+	SAFE_MUTEX_LOCK(&answer_lock);
+	roll = bench_rand() % 100;
+	if(roll >= bench.lost)
+	{
+		a.due = lat_now() + bench_latency(&bench.lat[br - bench_readers]);
+		if(roll >= bench.lost + bench.fail)
+		{
+			// all readers agree on the cw of an ecm
+			a.msg.rc = 1;
+			for(i = 0; i < sizeof(a.msg.cw); i++)
+				{ a.msg.cw[i] = er->ecmd5[i % CS_ECMSTORESIZE] ^ (i * 0x5B); }
+			a.msg.cw[3] = a.msg.cw[0] + a.msg.cw[1] + a.msg.cw[2];
+			a.msg.cw[7] = a.msg.cw[4] + a.msg.cw[5] + a.msg.cw[6];
+			a.msg.cw[11] = a.msg.cw[8] + a.msg.cw[9] + a.msg.cw[10];
+			a.msg.cw[15] = a.msg.cw[12] + a.msg.cw[13] + a.msg.cw[14];
+		}
+		bench_queue_answer(&a);
+		SAFE_COND_SIGNAL(&answer_cond);
+	}
+	SAFE_MUTEX_UNLOCK(&answer_lock);
+	return 0;
+}
+
+static int32_t bench_recv(struct s_client *cl, uint8_t *buf, int32_t l)
+{
+	int32_t n = recv(cl->pfd, buf, l, MSG_DONTWAIT);
+	return n == sizeof(struct bench_msg) ? n : -1;
+}
+
+static int32_t bench_recv_chk(struct s_client *UNUSED(cl), uint8_t *dcw, int32_t *rc, uint8_t *buf, int32_t n)
+{
+	struct bench_msg msg;
+
+	if(n != sizeof(msg))
+		{ return -1; }
+
+	memcpy(&msg, buf, sizeof(msg));
+	*rc = msg.rc;
+	memcpy(dcw, msg.cw, sizeof(msg.cw));
+	return msg.idx;
+}
+
+static void bench_send_dcw(struct s_client *UNUSED(cl), ECM_REQUEST *er)
+{
+	__sync_fetch_and_add(&answer_rc[er->rc <= E_STOPPED ? er->rc : E_STOPPED + 1], 1);
+	__sync_fetch_and_add(&ecms_answered, 1);
+}
+
+void module_bench(struct s_module *ph)
+{
+	ph->desc = "bench";
+	ph->type = MOD_CONN_UDP;
+	ph->large_ecm_support = 1;
+	ph->recv = bench_recv;
+	ph->send_dcw = bench_send_dcw;
+
+	ph->c_init = bench_client_init;
+	ph->c_recv_chk = bench_recv_chk;
+	ph->c_send_ecm = bench_send_ecm;
+	// num stays 0, so configured readers are never attached to the stub
+	bench_module = ph;
+}
+
+/*
+ * setup
+ */
+
+static int32_t bench_create_readers(void)
+{
+	struct s_reader *rdr;
+	int32_t i;
+
+	for(i = 0; i < bench.readers; i++)
+	{
+		if(!cs_malloc(&rdr, sizeof(struct s_reader)))
+			{ return 0; }
+
+		reader_set_defaults(rdr);
+		snprintf(rdr->label, sizeof(rdr->label), "bench%d", i + 1);
+		cs_strncpy(rdr->device, "bench", sizeof(rdr->device));
+		rdr->typ = R_CAMD35;
+		rdr->ph = *bench_module;
+		rdr->ph.num = R_CAMD35;
+		rdr->enable = 1;
+		rdr->grp = 1;
+		bench_readers[i].rdr = rdr;
+		ll_append(configured_readers, rdr);
+
+		if(!restart_cardreader(rdr, 0))
+			{ return 0; }
+	}
+
+	// wait for reader_init() on the reader threads
+	for(i = 0; i < 100; i++)
+	{
+		int32_t k, done = 1;
+		for(k = 0; k < bench.readers; k++)
+		{
+			if(!bench_readers[k].rdr->client->init_done)
+				{ done = 0; }
+		}
+		if(done)
+			{ return 1; }
+		cs_sleepms(50);
+	}
+	return 0;
+}
+
+static int32_t bench_create_clients(void)
+{
+	struct s_auth *account;
+	struct s_client *cl;
+	int32_t i, idx;
+
+	if(!cs_malloc(&account, sizeof(struct s_auth)))
+		{ return 0; }
+
+	account_set_defaults(account);
+	cs_strncpy(account->usr, "bench", sizeof(account->usr));
+	account->grp = 1;
+
+	for(i = 0; i < bench.clients; i++)
+	{
+		if(!(cl = create_client(first_client->ip)))
+			{ return 0; }
+
+		cl->typ = 'c';
+		for(idx = 0; idx < CS_MAX_MOD; idx++)
+		{
+			cl->module_idx = idx;
+			if(get_module(cl) == bench_module)
+				{ break; }
+		}
+		if(cs_auth_client(cl, account, NULL))
+			{ return 0; }
+
+		bench_clients[i].cl = cl;
+		bench_clients[i].num = i;
+	}
+	return 1;
+}
+
+/*
+ * replay and report
+ */
+
+static void *bench_replay_thread(void *arg)
+{
+	struct bench_client *bc = arg;
+	struct bench_ecm *e;
+	ECM_REQUEST *er;
+	int64_t wait;
+	uint32_t i;
+
+	set_thread_name(__func__);
+	SAFE_SETSPECIFIC(getclient, bc->cl);
+
+	for(i = bc->num; i < bench_trace_count; i += bench.clients)
+	{
+		e = &bench_trace[i];
+		if(bench.speed > 0 && (wait = bench_start + (int64_t)(e->ts / bench.speed) - lat_now()) > 0)
+			{ cs_sleepus(wait); }
+
+		if(!(er = get_ecmtask()))
+		{
+			__sync_fetch_and_add(&ecms_overflow, 1);
+			continue;
+		}
+
+		er->caid = e->caid;
+		er->prid = e->prid;
+		er->srvid = e->srvid;
+		er->ecmlen = e->ecmlen;
+		memcpy(er->ecm, e->ecm, e->ecmlen);
+		__sync_fetch_and_add(&ecms_sent, 1);
+		get_cw(bc->cl, er);
+	}
+	return NULL;
+}
+
+static void bench_print_hist(const char *name, LAT_HIST *hist)
+{
+	if(!hist->count)
+		{ return; }
+
+	printf("  %-10s %8u %9u %9u %9u %9u\n", name, hist->count, lat_percentile(hist, 500),
+			lat_percentile(hist, 900), lat_percentile(hist, 990), hist->max);
+}
+
+static void bench_print_locks(void)
+{
+	LOCK_PROF_STAT *stats;
+	int32_t i, count;
+
+	if(!(stats = lock_prof_get(&count)))
+		{ return; }
+
+	printf("\nLock contention:\n  %-24s %10s %8s %10s %9s %9s\n", "lock", "locks", "waits", "wait ms", "p99 us", "hold max");
+	for(i = 0; i < count && i < 16; i++)
+	{
+		printf("  %-24s %10" PRIu64 " %8u %10.3f %9u %9u\n", stats[i].name, stats[i].locks, stats[i].waits,
+				(double)stats[i].wait_us / 1000, stats[i].wait_p99, stats[i].hold_max);
+	}
+	NULLFREE(stats);
+}
+
+static void bench_report(int64_t replay, int64_t duration, struct rusage *ru_start)
+{
+	static const char *rc_txt[] = { "found", "cache1", "cache2", "cacheex", "not found", "timeout", "sleeping",
+									"fake", "invalid", "corrupt", "no card", "expdate", "disabled", "stopped", "other" };
+	struct rusage ru;
+	LAT_SERIES *series;
+	int8_t stage;
+	int32_t i;
+
+	getrusage(RUSAGE_SELF, &ru);
+
+	printf("\nReplayed %u ecms in %.3f s (%.1f ecm/s), %u answers after %.3f s (%.1f ecm/s)", ecms_sent, (double)replay / 1000000,
+			replay ? (double)ecms_sent * 1000000 / replay : 0, ecms_answered, (double)duration / 1000000,
+			duration ? (double)ecms_answered * 1000000 / duration : 0);
+	if(ecms_overflow)
+		{ printf(", %u ecms dropped", ecms_overflow); }
+	printf("\n\nAnswers:\n");
+	for(i = 0; i <= E_STOPPED + 1; i++)
+	{
+		if(answer_rc[i])
+			{ printf("  %-10s %8u (%.1f%%)\n", rc_txt[i], answer_rc[i], 100.0 * answer_rc[i] / (ecms_answered ? ecms_answered : 1)); }
+	}
+
+	printf("\nLatency per stage (us):\n  %-10s %8s %9s %9s %9s %9s\n", "stage", "count", "p50", "p90", "p99", "max");
+	for(series = lat_get_first(); series; series = series->next)
+	{
+		if(series->type == LAT_TYPE_PROTOCOL && !strcmp(series->name, bench_module->desc))
+		{
+			for(stage = 0; stage < LAT_STAGES; stage++)
+				{ bench_print_hist(lat_stage_name(stage), &series->hist[stage]); }
+		}
+	}
+
+	printf("\nReader answer time (us):\n  %-10s %8s %9s %9s %9s %9s\n", "reader", "count", "p50", "p90", "p99", "max");
+	for(series = lat_get_first(); series; series = series->next)
+	{
+		if(series->type == LAT_TYPE_READER)
+			{ bench_print_hist(series->name, &series->hist[LAT_READER]); }
+	}
+
+	printf("\nCPU: user %.3f s, system %.3f s, context switches: %ld voluntary, %ld involuntary\n",
+			(ru.ru_utime.tv_sec - ru_start->ru_utime.tv_sec) + (ru.ru_utime.tv_usec - ru_start->ru_utime.tv_usec) / 1e6,
+			(ru.ru_stime.tv_sec - ru_start->ru_stime.tv_sec) + (ru.ru_stime.tv_usec - ru_start->ru_stime.tv_usec) / 1e6,
+			ru.ru_nvcsw - ru_start->ru_nvcsw, ru.ru_nivcsw - ru_start->ru_nivcsw);
+}
+
+// list microbenchmarks, BENCH_MODE=llist
+struct bench_llist_iter
+{
+	LLIST			*l;
+	uint32_t		rounds;
+	uint64_t		sum;
+	pthread_t		thread;
+};
+
+static void bench_llist_result(const char *name, int64_t us, uint64_t ops)
+{
+	printf("  %-24s %10" PRIu64 " %10.1f\n", name, ops, ops ? (double)us * 1000 / ops : 0);
+}
+
+static void *bench_llist_iter_thread(void *arg)
+{
+	struct bench_llist_iter *it = arg;
+	LL_ITER itr;
+	uint32_t i;
+	void *obj;
+
+	for(i = 0; i < it->rounds; i++)
+	{
+		itr = ll_iter_create(it->l);
+		while((obj = ll_iter_next(&itr)))
+			{ it->sum += (uintptr_t)obj; }
+	}
+	return NULL;
+}
+
+static void run_llist_bench(void)
+{
+	struct bench_llist_iter iters[BENCH_MAX_CLIENTS];
+	uint32_t size = MAX(bench_getenv_int("BENCH_LLIST_SIZE", 10000), 1);
+	uint32_t rounds = MAX(bench_getenv_int("BENCH_LLIST_ROUNDS", 200), 1);
+	int32_t threads = MIN(MAX((int32_t)bench_getenv_int("BENCH_CLIENTS", 4), 1), BENCH_MAX_CLIENTS);
+	uint32_t i, r;
+	uint64_t sum = 0;
+	int64_t start;
+	LL_ITER itr;
+	LLIST *l;
+	void *obj;
+	int32_t t;
+
+	printf("List microbenchmark: %u elements, %u rounds, %d threads\n\n  %-24s %10s %10s\n",
+			size, rounds, threads, "operation", "ops", "ns/op");
+
+	l = ll_create("bench");
+	start = lat_now();
+	for(r = 0; r < rounds; r++)
+	{
+		for(i = 1; i <= size; i++)
+			{ ll_append(l, (void *)(uintptr_t)i); }
+		ll_clear(l);
+	}
+	bench_llist_result("append", lat_now() - start, (uint64_t)rounds * size);
+
+	for(i = 1; i <= size; i++)
+		{ ll_append(l, (void *)(uintptr_t)i); }
+
+	start = lat_now();
+	for(r = 0; r < rounds; r++)
+	{
+		itr = ll_iter_create(l);
+		while((obj = ll_iter_next(&itr)))
+			{ sum += (uintptr_t)obj; }
+	}
+	bench_llist_result("iterate", lat_now() - start, (uint64_t)rounds * size);
+
+	start = lat_now();
+	for(t = 0; t < threads; t++)
+	{
+		iters[t].l = l;
+		iters[t].rounds = rounds;
+		iters[t].sum = 0;
+		start_thread("bench llist", bench_llist_iter_thread, &iters[t], &iters[t].thread, 0, 1);
+	}
+	for(t = 0; t < threads; t++)
+	{
+		SAFE_THREAD_JOIN(iters[t].thread, NULL);
+		sum += iters[t].sum;
+	}
+	bench_llist_result("iterate parallel", lat_now() - start, (uint64_t)rounds * size * threads);
+
+	// every second element, then the rest from the head like a queue
+	start = lat_now();
+	for(r = 0; r < rounds; r++)
+	{
+		if(r)
+		{
+			for(i = 1; i <= size; i++)
+				{ ll_append(l, (void *)(uintptr_t)i); }
+		}
+		itr = ll_iter_create(l);
+		while((obj = ll_iter_next(&itr)))
+		{
+			if((uintptr_t)obj & 1)
+				{ ll_iter_remove(&itr); }
+		}
+		while(ll_remove_first(l)) { ; }
+	}
+	bench_llist_result("append+remove", lat_now() - start, (uint64_t)rounds * size);
+
+	// short lists are the common case: create, fill, walk, destroy
+	start = lat_now();
+	for(r = 0; r < rounds * 100; r++)
+	{
+		LLIST *s = ll_create("bench small");
+		for(i = 1; i <= 4; i++)
+			{ ll_append(s, (void *)(uintptr_t)i); }
+		itr = ll_iter_create(s);
+		while((obj = ll_iter_next(&itr)))
+			{ sum += (uintptr_t)obj; }
+		ll_destroy(&s);
+	}
+	bench_llist_result("small list", lat_now() - start, (uint64_t)rounds * 100);
+
+	ll_destroy(&l);
+	printf("\n(checksum %" PRIu64 ")\n", sum);
+}
+
+// loadbalancer microbenchmark, BENCH_MODE=lb
+static void run_lb_bench(void)
+{
+	uint32_t rounds = MAX(bench_getenv_int("BENCH_LB_ROUNDS", 100), 1);
+	struct s_ecm_answer *eas, *ea;
+	uint64_t active = 0;
+	ECM_REQUEST *er;
+	uint32_t i, r;
+	int32_t k, n;
+	int64_t start, us;
+	uint64_t ops;
+
+	bench.services = MAX(bench_getenv_int("BENCH_SERVICES", 50), 1);
+	bench.readers = MIN(MAX((int32_t)bench_getenv_int("BENCH_READERS", 4), 1), BENCH_MAX_READERS);
+	bench.clients = 1;
+	if(!cfg.lb_mode)
+		{ cfg.lb_mode = 1; }
+	cfg.lb_save = 0;
+	if(!bench_getenv_int("BENCH_LOG", 0))
+		{ cfg.disablelog = 1; }
+
+	printf("Loadbalancer microbenchmark: lb_mode %d, %d readers, %u services, %u rounds\n\n",
+			cfg.lb_mode, bench.readers, bench.services, rounds);
+
+	if(!bench_create_readers() || !bench_create_clients())
+	{
+		printf("Can't create stub readers and clients\n");
+		return;
+	}
+
+	SAFE_SETSPECIFIC(getclient, bench_clients[0].cl);
+	n = bench.readers;
+	if(!(er = get_ecmtask()) || !cs_malloc(&eas, n * sizeof(struct s_ecm_answer)))
+		{ return; }
+
+	er->caid = 0x0B00;
+	er->ecmlen = 0x80;
+	er->reader_avail = n;
+	er->matching_rdr = eas;
+	for(k = 0; k < n; k++)
+	{
+		eas[k].reader = bench_readers[k].rdr;
+		eas[k].er = er;
+		eas[k].next = k + 1 < n ? &eas[k + 1] : NULL;
+	}
+
+	// learn: every reader answers every service, with a different speed per reader and service
+	for(i = 0; i < bench.services; i++)
+	{
+		er->srvid = i + 1;
+		for(k = 0; k < n; k++)
+		{
+			for(r = 0; r < (uint32_t)cfg.lb_min_ecmcount; r++)
+			{
+				eas[k].rc = E_FOUND;
+				eas[k].ecm_time = 20 + (k * 7 + i * 13) % 60;
+				send_reader_stat(eas[k].reader, er, &eas[k], E_FOUND);
+			}
+		}
+	}
+
+	start = lat_now();
+	for(r = 0; r < rounds; r++)
+	{
+		for(i = 0; i < bench.services; i++)
+		{
+			er->srvid = i + 1;
+			stat_get_best_reader(er);
+			for(ea = er->matching_rdr; ea; ea = ea->next)
+				{ active += (ea->status & READER_ACTIVE) ? 1 : 0; }
+		}
+	}
+	us = lat_now() - start;
+	ops = (uint64_t)rounds * bench.services;
+
+	printf("  %-24s %10s %10s %10s\n", "operation", "ops", "ns/op", "active");
+	printf("  %-24s %10" PRIu64 " %10.1f %10.2f\n", "stat_get_best_reader", ops, (double)us * 1000 / ops, (double)active / ops);
+}
+
+void run_ecm_bench(void)
+{
+	struct rusage ru_start;
+	pthread_t answer_thread;
+	int64_t replay, duration;
+	int32_t i;
+
+	if(!strcmp(bench_getenv("BENCH_MODE", "ecm"), "llist"))
+	{
+		run_llist_bench();
+		return;
+	}
+
+	if(!strcmp(bench_getenv("BENCH_MODE", "ecm"), "lb"))
+	{
+		run_lb_bench();
+		return;
+	}
+
+	bench.trace = getenv("BENCH_TRACE");
+	bench.ecms = bench_getenv_int("BENCH_ECMS", 20000);
+	bench.services = bench_getenv_int("BENCH_SERVICES", 50);
+	bench.rate = bench_getenv_int("BENCH_RATE", 1000);
+	bench.speed = atof(bench_getenv("BENCH_SPEED", "1"));
+	bench.clients = MIN(MAX((int32_t)bench_getenv_int("BENCH_CLIENTS", 4), 1), BENCH_MAX_CLIENTS);
+	bench.readers = MIN(MAX((int32_t)bench_getenv_int("BENCH_READERS", 4), 1), BENCH_MAX_READERS);
+	bench.fail = MIN(bench_getenv_int("BENCH_FAIL", 5), 100);
+	bench.lost = MIN(bench_getenv_int("BENCH_LOST", 0), 100 - bench.fail);
+	if(!bench.services)
+		{ bench.services = 1; }
+
+	if(!bench_parse_latencies(bench_getenv("BENCH_LATENCY", "uniform:20-80")))
+	{
+		printf("Invalid BENCH_LATENCY, use const:N, uniform:A-B or exp:MEAN (ms), optionally +P%%:T\n");
+		return;
+	}
+
+	if(!bench_getenv_int("BENCH_LOG", 0))
+		{ cfg.disablelog = 1; }
+	cfg.lock_profile = 1; // lock contention report
+
+	if(!(bench.trace ? bench_load_trace(bench.trace) : bench_make_trace()))
+	{
+		printf("No ecms to replay\n");
+		return;
+	}
+
+	printf("ECM replay: %u ecms from %s, %d clients, %d readers, latency %s ms, %u%% not found, %u%% lost, speed %g\n",
+			bench_trace_count, bench.trace ? bench.trace : "synthetic trace", bench.clients, bench.readers,
+			bench_getenv("BENCH_LATENCY", "uniform:20-80"), bench.fail, bench.lost, bench.speed);
+
+	SAFE_COND_INIT(&answer_cond, NULL);
+	if(start_thread("bench answer", bench_answer_thread, NULL, &answer_thread, 0, 1))
+		{ return; }
+
+	if(!bench_create_readers() || !bench_create_clients())
+	{
+		printf("Can't create stub readers and clients\n");
+		return;
+	}
+
+	lat_reset();
+	lock_prof_reset();
+	getrusage(RUSAGE_SELF, &ru_start);
+	bench_start = lat_now();
+
+	for(i = 0; i < bench.clients; i++)
+		{ start_thread("bench replay", bench_replay_thread, &bench_clients[i], &bench_clients[i].thread, 0, 1); }
+	for(i = 0; i < bench.clients; i++)
+		{ SAFE_THREAD_JOIN(bench_clients[i].thread, NULL); }
+
+	replay = lat_now() - bench_start;
+
+	// wait for the outstanding answers, timeouts included
+	while(ecms_answered < ecms_sent && lat_now() - bench_start - replay < (int64_t)(cfg.ctimeout + 2000) * 1000)
+		{ cs_sleepms(10); }
+	duration = lat_now() - bench_start;
+
+	bench_report(replay, duration, &ru_start);
+
+	bench_print_locks();
+
+	SAFE_MUTEX_LOCK(&answer_lock);
+	answer_stop = 1;
+	SAFE_COND_SIGNAL(&answer_cond);
+	SAFE_MUTEX_UNLOCK(&answer_lock);
+	SAFE_THREAD_JOIN(answer_thread, NULL);
+}
@@ -0,0 +1,17 @@
+// This file is generated by ./config.sh --objdir build/x86_64-linux-gnu-ssl --make-config.mak
+const char *config_mak =
+  "\nCFG: strings FILE | sed -n 's/^CFG~//p' | openssl enc -d -base64 | gzip -d\n"
+  "CFG~H4sIAPqP0moCA32VS3IcIQyG9zlFqnyBeFwz5Sy8UAs1jQ2ow2Me3nCD7H37MC83\n"
+  "CFG~DUxWM3wS0i8Q6qefyHZUMh1UmJIPMKu3vz+eWrptMDLrnvuNb9o48ffrr4bC58DH\n"
+  "CFG~hhqEzEqi1YDuNAd++/rmNKixWma/PWmWNX7/E8mdFho44lQ4XQR6vZAJ9pTEfjiX\n"
+  "CFG~+FWpsxSDU5YXiY5AJC9Cwgmcp+CXQMoJCpxkJO+VLYShT2CDQvBYCRE0xMLRsIia\n"
+  "CFG~8o9VgV3lq4dVRASciI6l5IUmUIVmPCQ8YQ6cbfhR7tAofJxndqG8GE0FvRc373d3\n"
+  "CFG~uNaF4IRWvsZkYn3qPAYEU1FwJh8z21LW7Ryys3h5WTSUeNuc2hWngHNjsnQ4W9st\n"
+  "CFG~uNKzUJ8vlxqDPDdwDR0IklCWfzP4XmxPToFuU7L1AQ8Nn8EKdtAqmUKYO/dw7k4q\n"
+  "CFG~Gue6ThZkGaSkyZDTyjbGazM3OK/g2NLLez2w+/CNzRO2qfcKEPMz6RgEsYy5lMYk\n"
+  "CFG~yhu5scBWjlC+tXvWkP+YfqB3Cg0bor4U0RikU+PYOR8hK//l+NM8MVm1fpqLVdlA\n"
+  "CFG~zoJuB2LPqTN8/+O2KR59x8uj6gr2+Krsc9dk5vKplXsMOMldkxg2yOZB+c2np7Zt\n"
+  "CFG~uzX4kEdq2dplPpd7zD/Kl3WGB/lmzBP5O1v+8CSjrNKfvJqRGQP5tZ/DXe2TZ8bz\n"
+  "CFG~2klQ0eBnkJsb1iQceFR+qmMNStpoKmkCN+vNYx47F2krmnVstrsHrz3fi7nM2n+6\n"
+  "CFG~NUepEAgAAA==\n"
+  ;
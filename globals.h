@@ -32,6 +32,7 @@
 #include <signal.h>
 #include <errno.h>
 #include <pthread.h>
+#include <sched.h>
 #include <dirent.h>
 #include <termios.h>
 #include <inttypes.h>
@@ -550,6 +551,7 @@
 #define DEFAULT_NFB								1
 #define DEFAULT_RETRYLIMIT						0
 #define DEFAULT_LB_MODE							0
+#define DEFAULT_LB_PERCENTILE					90
 #define DEFAULT_LB_STAT_CLEANUP					336
 #define DEFAULT_UPDATEINTERVAL					240
 #define DEFAULT_LB_AUTO_BETATUNNEL				1
@@ -557,6 +559,8 @@
 #define DEFAULT_LB_AUTO_BETATUNNEL_PREFER_BETA	50
 
 #define DEFAULT_MAX_CACHE_TIME					15
+#define DEFAULT_CACHE_SHARDS					8
+#define MAX_CACHE_SHARDS						64
 #define DEFAULT_MAX_HITCACHE_TIME				15
 
 #define DEFAULT_LB_AUTO_TIMEOUT					0
@@ -601,6 +605,7 @@ enum {E2_GLOBAL = 0, E2_GROUP, E2_CAID, E2_IDENT, E2_CLASS, E2_CHID, E2_QUEUE, E
 #define CXM_FMT_LEN				209		// 160
 
 #define LB_MAX_STAT_TIME		10
+#define LB_TIME_HIST_BUCKETS	52		// 4 buckets per power of two up to 16 s
 
 #if defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__)
 #define OSCAM_SIGNAL_WAKEUP		SIGCONT
@@ -695,6 +700,8 @@ typedef struct cs_mutexlock
 	const char		*name;
 	int8_t			flag;
 	int16_t			writelock, readlock;
+	struct s_lock_prof *prof;						// lock profiler entry of this name
+	int64_t			hold_start;						// us, write lock taken while profiling
 } CS_MUTEX_LOCK;
 
 #include "oscam-llist.h"
@@ -717,6 +724,8 @@ typedef struct s_classtab
 	uint8_t			bn;
 	uint8_t			*aclass;
 	uint8_t			*bclass;
+	uint32_t		abits[8];						// aclass and bclass as bitmaps, set by chk_cltab()
+	uint32_t		bbits[8];
 } CLASSTAB;
 
 typedef struct s_caidtab_data
@@ -730,6 +739,7 @@ typedef struct s_caidtab
 {
 	int32_t			ctnum;
 	CAIDTAB_DATA	*ctdata;
+	struct s_caidtab_idx *idx;						// caid bitmap, rebuilt by caidtab_add/clear/clone()
 } CAIDTAB;
 
 typedef struct s_tuntab_data
@@ -759,6 +769,9 @@ typedef struct s_sidtab
 	uint16_t		*caid;
 	uint32_t		*provid;
 	uint16_t		*srvid;
+	uint16_t		*caid_sorted;					// sorted copies for lookups, order above is kept for display
+	uint32_t		*provid_sorted;
+	uint16_t		*srvid_sorted;
 	struct s_sidtab	*next;
 } SIDTAB;
 
@@ -773,6 +786,7 @@ typedef struct s_ftab
 {
 	int32_t			nfilts;
 	FILTER			*filts;
+	struct s_ftab_idx *idx;							// sorted idents, rebuilt by ftab_add/clear/clone()
 } FTAB;
 
 typedef struct s_ncd_ftab
@@ -1069,6 +1083,11 @@ typedef struct ecm_request_t
 	int8_t			checked;						// for doublecheck
 	uint8_t			cw_checked[16];					// for doublecheck
 	int8_t			readers_timeout_check;			// set to 1 after ctimeout occurs and readers not answered are checked
+	int64_t			deadline;						// next pending stage timeout in ms (cw_process scheduler)
+	uint32_t		deadline_pos;					// 1-based position in the deadline heap, 0 = not scheduled
+	uint8_t			deadline_fired;					// stage timeouts already dispatched by cw_process
+	int32_t			lb_hedge_time;					// ms after tps to ask the fallback readers early, 0 = no hedging
+	int64_t			lat_recv;						// us receive time stamp for the latency histograms
 	struct s_reader	*origin_reader;
 
 #if defined MODULE_CCCAM
@@ -1117,6 +1136,13 @@ typedef struct ecm_request_t
 #endif
 	struct ecm_request_t *parent;
 	struct ecm_request_t *next;
+	struct ecm_request_t *idx_next;					// next ecm in the same ecmcwcache index bucket
+	struct ecm_request_t *client_prev;				// client's in-flight ecm chain (cl->ecmchain)
+	struct ecm_request_t *client_next;
+	struct ecm_request_t *flight_leader;			// in-flight ecm this one waits for (single-flight), protected by ecmcache_lock
+	struct ecm_request_t *flight_waiters;			// ecms waiting for the answer of this one
+	struct ecm_request_t *flight_next;
+	uint8_t			flight_open;					// waiters may still attach to this ecm
 #ifdef HAVE_DVBAPI
 	uint8_t			adapter_index;
 #endif
@@ -1135,10 +1161,12 @@ struct s_ecm_answer
 	char			msglog[MSGLOGSIZE];
 	struct timeb	time_request_sent;				// using for evaluate ecm_time
 	int32_t			ecm_time;
+	int64_t			lat_answer;						// us time stamp of the answer, for the chk_dcw latency
 	uint16_t		tier;							// only filled by local videoguard reader atm
 #ifdef WITH_LB
 	int32_t			value;
 	int32_t			time;
+	struct reader_stat_t *stat;						// lb stat of reader for this request, set by stat_get_best_reader
 #endif
 	struct s_ecm_answer *next;
 	CS_MUTEX_LOCK	ecmanswer_lock;
@@ -1191,6 +1219,14 @@ struct s_zap_list
 	time_t			lasttime;
 };
 
+// thread wakeup, see cs_wakeup() in oscam-time.c
+struct s_wakeup
+{
+	int32_t			fd[2];							// eventfd in both, or a pipe
+	volatile int32_t pending;
+	volatile int32_t sleeping;
+};
+
 // EMM reassemply
 struct emm_rass
 {
@@ -1207,7 +1243,12 @@ struct s_client
 	int8_t			thread_active;
 	int8_t			kill;
 	int8_t			kill_started;
-	LLIST			*joblist;
+	struct job_ring	*job_ring;						// pending jobs, see oscam-work.c
+	LLIST			*job_spill;						// jobs added while job_ring was full
+	volatile int8_t	job_spilled;					// job_spill has jobs, new jobs follow them
+	struct s_wakeup	work_wakeup;					// wakes the work thread polling its socket
+	uint32_t		job_drops;						// jobs dropped, mostly cache push-outs of a long queue
+	uint32_t		job_highwater;					// most jobs queued at once
 	IN_ADDR_T		ip;
 	in_port_t		port;
 	time_t			login;							// connection
@@ -1282,6 +1323,7 @@ struct s_client
 	int32_t			cwcacheexpushlg;				// count pushed localgenerated-flagged CWs
 #endif
 	uint8_t			cacheex_needfilter;				// flag for cachex mode 3 used with camd35
+	uint16_t		cacheex_push_id;				// bit in the cw cache pushed bitmaps + 1, 0 = not assigned
 #ifdef CS_CACHEEX_AIO
 	uint8_t			cacheex_aio_checked;			// flag for cacheex aio detection done
 #endif
@@ -1340,6 +1382,7 @@ struct s_client
 	struct s_reader	*reader;						// points to s_reader when cl->typ='r'
 
 	ECM_REQUEST *ecmtask;
+	ECM_REQUEST		*ecmchain;						// in-flight ecms of this client in ecmcwcache, protected by ecmcache_lock
 
 	pthread_t		thread;
 
@@ -1371,7 +1414,9 @@ struct s_client
 	int32_t			n_request[2];					// count for number of request per minute by client
 
 	void			*work_mbuf;						// Points to local data allocated in work_thread when the thread is running
-	void			*work_job_data;					// Points to current job_data when work_thread is running
+	int8_t			work_pool;						// jobs and socket events are run by the worker pool (threading_mode = 1)
+	volatile uint32_t work_state;					// worker pool WORK_* flags, changed atomically
+	struct s_client	*work_next;						// worker pool run queue
 
 #ifdef MODULE_PANDORA
 	int32_t			pand_autodelay;
@@ -1389,6 +1434,7 @@ struct s_client
 	struct s_client	*nexthashed;
 
 	int8_t			start_hidecards;
+	time_t			hidecards_until;				// ACTION_CLIENT_UNHIDECARDS is due then
 };
 
 typedef struct s_ecm_whitelist_data
@@ -1853,6 +1899,9 @@ struct s_reader										// contains device info, reader info and card info
 	struct timeb	lb_last;						// time for oldest reader
 	LLIST			*lb_stat;						// loadbalancer reader statistics
 	CS_MUTEX_LOCK	lb_stat_lock;
+	struct reader_stat_t **lb_stat_hash;		// index into lb_stat by caid/prid/srvid/chid
+	uint32_t		lb_stat_hsize;
+	uint32_t		lb_stat_hcount;
 	int32_t			lb_stat_busy;					// do not add while saving
 #endif
 
@@ -1875,6 +1924,7 @@ struct s_reader										// contains device info, reader info and card info
 	uint32_t		webif_ecmsnok;
 	uint32_t		ecmstout;
 	uint32_t		webif_ecmstout;
+	struct s_lat_series *lat_series;				// latency histograms of this reader
 	uint32_t		ecmnotfoundlimit;				// config setting. restart reader if ecmsnok >= ecmnotfoundlimit
 	int32_t			ecmsfilteredhead;				// count filtered ECM's by ECM Headerwhitelist
 	int32_t			ecmsfilteredlen;				// count filtered ECM's by ECM Whitelist
@@ -2369,10 +2419,13 @@ struct s_config
 	int8_t			lb_reopen_invalid;				// default=1; if 0, rc=E_INVALID will be blocked until stats cleaned
 	int8_t			lb_force_reopen_always;			// force reopening immediately all failing readers if no matching reader found
 	int32_t			lb_retrylimit;					// reopen only happens if reader response time > retrylimit
+	int32_t			lb_percentile;					// percentile of the ecm time used by lb_mode 4
+	int32_t			lb_hedge;						// max percent of ecms sent to fallback readers early, 0 = no hedging
 	CAIDVALUETAB	lb_retrylimittab;
 	CAIDVALUETAB	lb_nbest_readers_tab;			// like nbest_readers, but for special caids
 	CAIDTAB			lb_noproviderforcaid;			// do not store loadbalancer stats with providers for this caid
 	char			*lb_savepath;					// path where the stat file is save. Empty=default=/tmp/.oscam/stat
+	int8_t			lb_save_binary;					// save the stat file in binary format, appending changed stats only
 	int32_t			lb_stat_cleanup;				// duration in hours for cleaning old statistics
 	int32_t			lb_max_readers;					// limit the amount of readers during learning
 	int32_t			lb_auto_betatunnel_prefer_beta; // prefer-beta-over-nagra factor
@@ -2383,6 +2436,10 @@ struct s_config
 	int32_t			resolve_gethostbyname;
 	int8_t			double_check;					// schlocke: Double checks each ecm+dcw from two (or more) readers
 	FTAB			double_check_caid;				// do not store loadbalancer stats with providers for this caid
+	int8_t			ecm_singleflight;				// identical in-flight ecms wait for the first one instead of asking the readers again
+	int8_t			threading_mode;					// 0 = one work thread per client, 1 = epoll reactor and worker pool for network clients
+	int32_t			threading_workers;				// worker pool size, 0 = number of cpu cores
+	int8_t			lock_profile;					// count acquisitions, wait and hold times per lock name
 
 #ifdef HAVE_DVBAPI
 	int8_t			dvbapi_enabled;
@@ -2460,6 +2517,9 @@ struct s_config
 #endif
 
 	int32_t			max_cache_time;					// seconds ecms are stored in ecmcwcache
+	uint8_t			cache_shards;					// cw cache partitions, power of two, fixed at startup
+	uint32_t		cache_snapshot_interval;		// seconds between cache snapshots, 0 = off
+	char			*cache_snapshot_file;			// Empty=default=<tmp dir>/oscam.cache
 	int32_t			max_hitcache_time;				// seconds hits are stored in cspec_hitcache (to detect dyn wait_time)
 
 	int8_t			reload_useraccounts;
@@ -2575,8 +2635,15 @@ typedef struct reader_stat_t
 	int32_t			time_avg;
 	int32_t			time_stat[LB_MAX_STAT_TIME];
 	int32_t			time_idx;
+	uint8_t			time_hist[LB_TIME_HIST_BUCKETS];	// decaying ecm time histogram for lb_mode 4
+	uint16_t		time_hist_count;
+	uint8_t			found_count;					// decaying found/failed counts for lb_mode 4
+	uint8_t			failed_count;
 
 	int32_t			fail_factor;
+	int8_t			dirty;							// changed since the last binary save
+
+	struct reader_stat_t *hnext;				// next stat in the same lb_stat_hash bucket
 } READER_STAT;
 
 typedef struct cs_stat_query
@@ -52,17 +52,18 @@ typedef struct cache_hit_t {
 	int32_t			waittime_block;
 #endif
 	node			ht_node;
-	node			ll_node;
+	node			ring_node;						// hitcache_ring, see hitcache_next_check()
 } CACHE_HIT;
 
 static pthread_rwlock_t hitcache_lock;
 static hash_table ht_hitcache;
-static list ll_hitcache;
+static expiry_ring hitcache_ring;
 static bool cacheex_running;
 
 void cacheex_init_hitcache(void)
 {
-	init_hash_table(&ht_hitcache, &ll_hitcache);
+	tommy_hashlin_init(&ht_hitcache);
+	init_expiry_ring(&hitcache_ring);
 	if (pthread_rwlock_init(&hitcache_lock,NULL) != 0)
 		cs_log("Error creating lock hitcache_lock!");
 	cacheex_running = true;
@@ -87,6 +88,20 @@ static int cacheex_compare_hitkey(const void *arg, const void *obj)
 	return 1;
 }
 
+// second the cleanup has to look at the entry again: expiry, grp rotation or waittime_block count
+static time_t hitcache_next_check(CACHE_HIT *cachehit)
+{
+	int32_t timeout = (cfg.max_hitcache_time + (cfg.max_hitcache_time / 2)) * 1000; // 1,5
+	time_t expire = cachehit->time.time + (timeout + 999) / 1000 + 1;
+	time_t rotate = cachehit->max_hitcache_time.time + cfg.max_hitcache_time + 1;
+
+#ifdef CS_CACHEEX_AIO
+	if(cfg.waittime_block_start && cachehit->waittime_block >= cfg.waittime_block_start)
+		{ return time(NULL); } // every cleanup tick
+#endif
+	return rotate < expire ? rotate : expire;
+}
+
 static int32_t cacheex_check_hitcache(ECM_REQUEST *er, struct s_client *cl)
 {
 	CACHE_HIT *result;
@@ -154,7 +169,9 @@ static void cacheex_add_hitcache(struct s_client *cl, ECM_REQUEST *er)
 #ifdef CS_CACHEEX_AIO
 			result->waittime_block = 0;
 #endif
-			add_hash_table(&ht_hitcache, &result->ht_node, &ll_hitcache, &result->ll_node, result, &result->key, sizeof(HIT_KEY));
+			cs_ftime(&result->time);
+			tommy_hashlin_insert(&ht_hitcache, &result->ht_node, result, tommy_hash_u32(0, &result->key, sizeof(HIT_KEY)));
+			add_expiry_ring(&hitcache_ring, &result->ring_node, result, hitcache_next_check(result));
 		}
 	}
 
@@ -165,7 +182,7 @@ static void cacheex_add_hitcache(struct s_client *cl, ECM_REQUEST *er)
 			result->grp |= cl->grp;
 			result->grp_last_max_hitcache_time |= cl->grp;
 		}
-		cs_ftime(&result->time); //always update time;
+		cs_ftime(&result->time); //always update time; the ring entry is checked again when due
 	}
 
 	SAFE_RWLOCK_UNLOCK(&hitcache_lock);
@@ -176,50 +193,49 @@ static void cacheex_del_hitcache(struct s_client *cl, ECM_REQUEST *er)
 	HIT_KEY search;
 	CACHE_HIT *result;
 
+	(void)cl;
 	memset(&search, 0, sizeof(HIT_KEY));
 	search.caid = er->caid;
 	search.prid = er->prid;
 	search.srvid = er->srvid;
 
-	if(cl && cl->grp)
-		{
-			result = find_hash_table(&ht_hitcache, &search, sizeof(HIT_KEY), &cacheex_compare_hitkey);
-			while(result)
-			{
-				result->grp &= ~cl->grp;
-				result->grp_last_max_hitcache_time &= ~cl->grp;
-				result = find_hash_table(&ht_hitcache, &search, sizeof(HIT_KEY), &cacheex_compare_hitkey);
-			}
-		}
-
 	SAFE_RWLOCK_WRLOCK(&hitcache_lock);
-	search_remove_elem_hash_table(&ht_hitcache, &search, sizeof(HIT_KEY), &cacheex_compare_hitkey);
+	result = search_remove_elem_hash_table(&ht_hitcache, &search, sizeof(HIT_KEY), &cacheex_compare_hitkey);
+	if(result)
+	{
+		remove_expiry_ring(&hitcache_ring, &result->ring_node);
+		NULLFREE(result);
+	}
 	SAFE_RWLOCK_UNLOCK(&hitcache_lock);
 }
 
 void cacheex_cleanup_hitcache(bool force)
 {
 	CACHE_HIT *cachehit;
-	node *i,*i_next;
-	struct timeb now;
+	node *i;
+	list todo;
+	struct timeb now, ts, te;
 	int64_t gone, gone_max_hitcache_time;
 	int32_t timeout = (cfg.max_hitcache_time + (cfg.max_hitcache_time / 2)) * 1000; // 1,5
 	int32_t clean_grp = (cfg.max_hitcache_time * 1000);
+	uint32_t due = 0, freed = 0;
 
+	tommy_list_init(&todo);
+	cs_ftimeus(&ts);
 	SAFE_RWLOCK_WRLOCK(&hitcache_lock);
-	i = get_first_node_list(&ll_hitcache);
-	while (i)
+
+	cs_ftime(&now);
+	if(force)
+		{ all_expiry_ring(&hitcache_ring, &todo); }
+	else
+		{ due_expiry_ring(&hitcache_ring, now.time, &todo); }
+
+	while((i = get_first_node_list(&todo)))
 	{
-		i_next = i->next;
 		cachehit = get_data_from_node(i);
+		remove_elem_list(&todo, i);
+		due++;
 
-		if(!cachehit)
-		{
-			i = i_next;
-			continue;
-		}
-
-		cs_ftime(&now);
 		gone = comp_timeb(&now, &cachehit->time);
 		gone_max_hitcache_time = comp_timeb(&now, &cachehit->max_hitcache_time);
 
@@ -229,9 +245,10 @@ void cacheex_cleanup_hitcache(bool force)
 #endif
 		)
 		{
-			remove_elem_list(&ll_hitcache, &cachehit->ll_node);
 			remove_elem_hash_table(&ht_hitcache, &cachehit->ht_node);
 			NULLFREE(cachehit);
+			freed++;
+			continue;
 		}
 		else if(gone_max_hitcache_time >= clean_grp){
 			cachehit->grp = cachehit->grp_last_max_hitcache_time;
@@ -240,14 +257,20 @@ void cacheex_cleanup_hitcache(bool force)
 		}
 
 #ifdef CS_CACHEEX_AIO
-		if(cfg.waittime_block_start && (cachehit && cachehit->waittime_block >= cfg.waittime_block_start))
+		if(cfg.waittime_block_start && cachehit->waittime_block >= cfg.waittime_block_start)
 		{
 			cachehit->waittime_block++;
 		}
 #endif
-		i = i_next;
+		add_expiry_ring(&hitcache_ring, &cachehit->ring_node, cachehit, hitcache_next_check(cachehit));
 	}
 	SAFE_RWLOCK_UNLOCK(&hitcache_lock);
+
+	if(due)
+	{
+		cs_ftimeus(&te);
+		cs_log_dbg(D_CACHEEX, "hitcache cleanup: %u due, %u freed in %"PRId64" us", due, freed, comp_timebus(&te, &ts));
+	}
 }
 
 static int32_t cacheex_ecm_hash_calc(uint8_t *buf, int32_t n)
@@ -372,7 +395,7 @@ static void *chkcache_process(void)
 					wfc = NULL;
 					if(!cs_malloc(&wfc, sizeof(struct s_write_from_cache)))
 					{
-						NULLFREE(ecm);
+						release_ecm(ecm);
 						continue;
 					}
 
@@ -381,13 +404,13 @@ static void *chkcache_process(void)
 
 					if(!add_job(er->client, ACTION_ECM_ANSWER_CACHE, wfc, sizeof(struct s_write_from_cache))) // write_ecm_answer_fromcache
 					{
-						NULLFREE(ecm);
+						release_ecm(ecm);
 						continue;
 					}
 				}
 				else
 				{
-					NULLFREE(ecm);
+					release_ecm(ecm);
 				}
 			}
 		}
@@ -1335,12 +1358,14 @@ void cacheex_push_out(struct s_client *cl, ECM_REQUEST *er)
 
 bool cacheex_check_queue_length(struct s_client *cl)
 {
-	// Avoid full running queues:
-	if(ll_count(cl->joblist) <= 2000)
+	uint32_t count = job_queue_length(cl), limit = job_queue_size(cl) / 4 * 3;
+
+	// Avoid full running queues, keep some room for ecm answers:
+	if(count <= limit)
 		return 0;
 
-	cs_log_dbg(D_TRACE, "WARNING: job queue %s %s has more than 2000 jobs! count=%d, dropped!",
-					cl->typ == 'c' ? "client" : "reader", username(cl), ll_count(cl->joblist));
+	cs_log_dbg(D_TRACE, "WARNING: job queue %s %s has more than %u jobs! count=%u, dropped!",
+					cl->typ == 'c' ? "client" : "reader", username(cl), limit, count);
 
 	// Thread down???
 	SAFE_MUTEX_LOCK(&cl->thread_lock);
@@ -1397,6 +1422,8 @@ void cacheex_timeout(ECM_REQUEST *er)
 			if(cfg.waittime_block_start && (result->waittime_block <= cfg.waittime_block_start))
 			{
 				result->waittime_block++;
+				if(result->waittime_block >= cfg.waittime_block_start) // counted by the cleanup from now on
+					{ move_expiry_ring(&hitcache_ring, &result->ring_node, time(NULL)); }
 				cs_log_dbg(D_LB, "{client %s, caid %04X, prid %06X, srvid %04X} waittime_block count: %u ",
 					(check_client(er->client) ? er->client->account->usr : "-"), er->caid, er->prid, er->srvid, result->waittime_block);
 			}
@@ -1416,13 +1443,13 @@ void cacheex_timeout(ECM_REQUEST *er)
 				struct s_write_from_cache *wfc = NULL;
 				if(!cs_malloc(&wfc, sizeof(struct s_write_from_cache)))
 				{
-					NULLFREE(ecm);
+					release_ecm(ecm);
 					return;
 				}
 				wfc->er_new = er;
 				wfc->er_cache = ecm;
 				if(!add_job(er->client, ACTION_ECM_ANSWER_CACHE, wfc, sizeof(struct s_write_from_cache))) // write_ecm_answer_fromcache
-					{ NULLFREE(ecm); }
+					{ release_ecm(ecm); }
 				return;
 			}
 		}
@@ -1564,6 +1591,7 @@ void caidtab2ftab_add(CAIDTAB *lgonly_ctab, FTAB *lgonly_tab)
 						{
 							lgonly_tab->filts[k].nprids = 1;
 							lgonly_tab->filts[k].prids[0] = NO_PROVID_VALUE;
+							ftab_index(lgonly_tab);
 							rc = 1;
 						}
 						break;
@@ -185,7 +185,7 @@ static void camd33_process_ecm(uint8_t *buf, int32_t l)
 
 	if(er->ecmlen < 0 || er->ecmlen > MAX_ECM_SIZE)
 	{
-		NULLFREE(er);
+		release_ecm(er);
 		return;
 	}
 
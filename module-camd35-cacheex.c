@@ -138,6 +138,7 @@ void camd35_cacheex_feature_trigger_in(struct s_client *cl, uint8_t *buf)
 								{
 									lgonly_tab->filts[l].prids[lgonly_tab->filts[l].nprids] = d.prids[0];
 									lgonly_tab->filts[l].nprids++;
+									ftab_index(lgonly_tab);
 								}
 								else
 								{
@@ -363,6 +364,7 @@ void camd35_cacheex_feature_trigger_in(struct s_client *cl, uint8_t *buf)
 									{
 										lgonly_tab->filts[l].prids[lgonly_tab->filts[l].nprids] = d.prids[k];
 										lgonly_tab->filts[l].nprids++;
+										ftab_index(lgonly_tab);
 									}
 									else
 									{
@@ -1338,7 +1340,7 @@ static void camd35_cacheex_push_in(struct s_client *cl, uint8_t *buf)
 		if(count > cacheex_maxhop(cl))
 		{
 			cs_log_dbg(D_CACHEEX, "cacheex: received %d nodes (max=%d), ignored! %s", (int32_t)count, cacheex_maxhop(cl), username(cl));
-			NULLFREE(er);
+			release_ecm(er);
 			return;
 		}
 #endif
@@ -706,7 +706,7 @@ static void camd35_process_ecm(uint8_t *buf, int buflen)
 
 	if(!cs_malloc(&er->src_data, 0x34 + 20 + er->ecmlen))
 	{
-		NULLFREE(er);
+		release_ecm(er);
 		return;
 	}
 
@@ -140,6 +140,7 @@ void cc_cacheex_feature_trigger_in(struct s_client *cl, uint8_t *buf)
 								{
 									lgonly_tab->filts[l].prids[lgonly_tab->filts[l].nprids] = d.prids[0];
 									lgonly_tab->filts[l].nprids++;
+									ftab_index(lgonly_tab);
 								}
 								else
 								{
@@ -365,6 +366,7 @@ void cc_cacheex_feature_trigger_in(struct s_client *cl, uint8_t *buf)
 									{
 										lgonly_tab->filts[l].prids[lgonly_tab->filts[l].nprids] = d.prids[k];
 										lgonly_tab->filts[l].nprids++;
+										ftab_index(lgonly_tab);
 									}
 									else
 									{
@@ -1395,7 +1397,7 @@ void cc_cacheex_push_in(struct s_client *cl, uint8_t *buf)
 		cs_log_dbg(D_CACHEEX, "cacheex: received %d nodes (max=%d), ignored! %s",
 					(int32_t)count, cacheex_maxhop(cl), username(cl));
 
-		NULLFREE(er);
+		release_ecm(er);
 		return;
 	}
 #endif
@@ -171,7 +171,7 @@ static int32_t csp_recv(struct s_client *client, uint8_t *buf, int32_t l)
 				cs_log_dump_dbg(D_TRACE, er->cw, sizeof(er->cw), "received cw from csp onid=%04X caid=%04X srvid=%04X hash=%08X (org connector: %s, tags: %02X/%02X)", er->onid, er->caid, er->srvid, er->csp_hash, orgname, commandTag, rplTag);
 				cacheex_add_to_cache_from_csp(client, er);
 			}
-			else { NULLFREE(er); }
+			else { release_ecm(er); }
 		}
 		break;
 
@@ -190,7 +190,7 @@ static int32_t csp_recv(struct s_client *client, uint8_t *buf, int32_t l)
 				cs_log_dump_dbg(D_TRACE, buf, l, "received ecm request from csp onid=%04X caid=%04X srvid=%04X hash=%08X (tag: %02X)", er->onid, er->caid, er->srvid, er->csp_hash, commandTag);
 				cacheex_add_to_cache_from_csp(client, er);
 			}
-			else { NULLFREE(er); }
+			else { release_ecm(er); }
 		}
 		break;
 
@@ -239,7 +239,7 @@ static int32_t csp_recv(struct s_client *client, uint8_t *buf, int32_t l)
 				er->rcEx = 0;
 				memcpy(er->cw, result->cw, 16);
 				er->grp |= result->grp;
-				NULLFREE(result);
+				release_ecm(result);
 
 				int32_t status = csp_cache_push_out(client, er);
 				cs_log_dbg(D_TRACE, "received resend request from cache peer: %s:%d (replied: %d)", cs_inet_ntoa(SIN_GET_ADDR(client->udp_sa)), port, status);
@@ -248,7 +248,7 @@ static int32_t csp_recv(struct s_client *client, uint8_t *buf, int32_t l)
 			{
 				cs_log_dbg(D_TRACE, "received resend request from cache peer: %s:%d (not found)", cs_inet_ntoa(SIN_GET_ADDR(client->udp_sa)), port);
 			}
-			NULLFREE(er);
+			release_ecm(er);
 		}
 		break;
 
@@ -2865,7 +2865,7 @@ int32_t dvbapi_start_descrambling(int32_t demux_id, int32_t pid, int8_t checked,
 
 	if(!fake_ecm)
 	{
-		NULLFREE(er);
+		release_ecm(er);
 	}
 	return started;
 }
@@ -4057,7 +4057,7 @@ void request_cw(struct s_client *client, ECM_REQUEST *er, int32_t demux_id, uint
 	if(filternum < 0)
 	{
 		cs_log_dbg(D_DVBAPI, "Demuxer %d not requesting cw -> ecm filter was killed!", demux_id);
-		NULLFREE(er);
+		release_ecm(er);
 		return;
 	}
 
@@ -4075,7 +4075,7 @@ void request_cw(struct s_client *client, ECM_REQUEST *er, int32_t demux_id, uint
 			if(demux[demux_id].demux_fd[filternum].prevresult < E_NOTFOUND)
 			{
 				cs_log_dbg(D_DVBAPI, "Demuxer %d not requesting same ecm again! -> SKIP!", demux_id);
-				NULLFREE(er);
+				release_ecm(er);
 				return;
 			}
 			else
@@ -4088,7 +4088,7 @@ void request_cw(struct s_client *client, ECM_REQUEST *er, int32_t demux_id, uint
 			if(demux[demux_id].demux_fd[filternum].lastresult < E_NOTFOUND)
 			{
 				cs_log_dbg(D_DVBAPI, "Demuxer %d not requesting same ecm again! -> SKIP!", demux_id);
-				NULLFREE(er);
+				release_ecm(er);
 				return;
 			}
 			else
@@ -5790,7 +5790,7 @@ void dvbapi_process_input(int32_t demux_id, int32_t filter_num, uint8_t *buffer,
 				er->chid = chid;
 				er->msgid = msgid;
 				dvbapi_set_section_filter(demux_id, er, filter_num);
-				NULLFREE(er);
+				release_ecm(er);
 				return;
 			}
 
@@ -5854,7 +5854,7 @@ void dvbapi_process_input(int32_t demux_id, int32_t filter_num, uint8_t *buffer,
 		{
 			curpid->table = 0;
 			dvbapi_set_section_filter(demux_id, er, filter_num);
-			NULLFREE(er);
+			release_ecm(er);
 			return;
 		}
 
@@ -5878,7 +5878,7 @@ void dvbapi_process_input(int32_t demux_id, int32_t filter_num, uint8_t *buffer,
 					// this ecm doesn't match with current irdeto index
 					dvbapi_set_section_filter(demux_id, er, filter_num);
 
-					NULLFREE(er);
+					release_ecm(er);
 					return;
 				}
 			}
@@ -5886,7 +5886,7 @@ void dvbapi_process_input(int32_t demux_id, int32_t filter_num, uint8_t *buffer,
 			{
 				if(curpid->table == buffer[0])
 				{
-					NULLFREE(er);
+					release_ecm(er);
 					return;
 				}
 			}
@@ -5925,7 +5925,7 @@ void dvbapi_process_input(int32_t demux_id, int32_t filter_num, uint8_t *buffer,
 						}
 
 						dvbapi_stop_filternum(demux_id, filter_num, msgid); // stop this ecm filter!
-						NULLFREE(er);
+						release_ecm(er);
 						return;
 					}
 				}
@@ -5946,7 +5946,7 @@ void dvbapi_process_input(int32_t demux_id, int32_t filter_num, uint8_t *buffer,
 				// this ecm doesn't match with current irdeto index
 				dvbapi_set_section_filter(demux_id, er, filter_num);
 
-				NULLFREE(er);
+				release_ecm(er);
 				return;
 			}
 			else // all non irdeto cas systems
@@ -5960,7 +5960,7 @@ void dvbapi_process_input(int32_t demux_id, int32_t filter_num, uint8_t *buffer,
 
 				if(forceentry && forceentry->force)
 				{
-					NULLFREE(er);
+					release_ecm(er);
 					return; // forced pid? keep trying the forced ecmpid!
 				}
 
@@ -5976,7 +5976,7 @@ void dvbapi_process_input(int32_t demux_id, int32_t filter_num, uint8_t *buffer,
 				}
 
 				dvbapi_stop_filternum(demux_id, filter_num, msgid); // stop this ecm filter!
-				NULLFREE(er);
+				release_ecm(er);
 				return;
 			}
 		}
@@ -5996,7 +5996,7 @@ void dvbapi_process_input(int32_t demux_id, int32_t filter_num, uint8_t *buffer,
 			if((uint)p->delay == sctlen && p->force < 6)
 			{
 				p->force++;
-				NULLFREE(er);
+				release_ecm(er);
 				return;
 			}
 
@@ -6021,7 +6021,7 @@ void dvbapi_process_input(int32_t demux_id, int32_t filter_num, uint8_t *buffer,
 				// this ecm doesn't match with current irdeto index
 				dvbapi_set_section_filter(demux_id, er, filter_num);
 
-				NULLFREE(er);
+				release_ecm(er);
 				return;
 			}
 		}
@@ -6075,7 +6075,7 @@ void dvbapi_process_input(int32_t demux_id, int32_t filter_num, uint8_t *buffer,
 
 					dvbapi_stop_filternum(demux_id, filter_num, msgid); // stop this ecm filter!
 				}
-				NULLFREE(er);
+				release_ecm(er);
 				return;
 			}
 		}
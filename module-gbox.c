@@ -1267,7 +1267,7 @@ static int8_t gbox_incoming_ecm(struct s_client *cli, uint8_t *data, int32_t n)
 	struct gbox_ecm_request_ext *ere;
 	if(!cs_malloc(&ere, sizeof(struct gbox_ecm_request_ext)))
 	{
-		NULLFREE(er);
+		release_ecm(er);
 		return -1;
 	}
 
@@ -1287,7 +1287,7 @@ static int8_t gbox_incoming_ecm(struct s_client *cli, uint8_t *data, int32_t n)
 	if(er->ecmlen < 3 || er->ecmlen > MAX_ECM_SIZE || er->ecmlen + 18 > n)
 	{
 		NULLFREE(ere);
-		NULLFREE(er);
+		release_ecm(er);
 		return -1;
 	}
 
@@ -851,7 +851,7 @@ static void scam_server_recv_ecm(struct s_client *cl, uint8_t *buf, int32_t len)
 	}
 	else
 	{
-		NULLFREE(er);
+		release_ecm(er);
 		cs_log("WARNING: ECM-request corrupt");
 	}
 }
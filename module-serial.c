@@ -1098,7 +1098,7 @@ static void oscam_ser_process_ecm(uint8_t *buf, int32_t l)
 		case 3:
 		case 2:
 			//er->rc = E_CORRUPT;
-			NULLFREE(er);
+			release_ecm(er);
 			return; // error without log
 		case 1:
 			er->rc = E_CORRUPT; // error with log
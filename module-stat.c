@@ -16,6 +16,7 @@
 #include "oscam-lock.h"
 #include "oscam-string.h"
 #include "oscam-time.h"
+#include "oscam-latency.h"
 
 #define UNDEF_AVG_TIME 99999 // NOT set here 0 or small value! Could cause there reader get selected
 #define MAX_ECM_SEND_CACHE 16
@@ -24,20 +25,47 @@
 #define LB_FASTEST_READER_FIRST 1
 #define LB_OLDEST_READER_FIRST 2
 #define LB_LOWEST_USAGELEVEL 3
+#define LB_LATENCY_PERCENTILE 4
 
 #define DEFAULT_LOCK_TIMEOUT 1000000
 
 extern CS_MUTEX_LOCK ecmcache_lock;
-extern struct ecm_request_t *ecmcwcache;
 
 static int32_t stat_load_save;
 
 static struct timeb last_housekeeping;
 
+/**
+ * Per service cache of the stats resolved for the matching readers of an ecm.
+ * An entry is valid while no stat was removed anywhere (lb_rank_gen) and no stat
+ * was added for its caid/prid/srvid/chid (lb_rank_keygen).
+ **/
+#define LB_RANK_SLOTS 4096
+#define LB_RANK_KEYS 1024
+
+struct lb_rank
+{
+	STAT_QUERY		q;
+	uint32_t		gen;
+	uint32_t		keygen;
+	int32_t			count;
+	int32_t			size;
+	struct s_reader	**rdr;
+	READER_STAT		**stat;
+};
+
+static struct lb_rank *lb_rank_cache;
+static uint32_t lb_rank_keygen[LB_RANK_KEYS];
+static uint32_t lb_rank_gen;
+static CS_MUTEX_LOCK lb_rank_lock;
+
 void init_stat(void)
 {
 	stat_load_save = -100;
 
+	if(!lb_rank_cache && cs_malloc(&lb_rank_cache, LB_RANK_SLOTS * sizeof(struct lb_rank)))
+		{ cs_lock_create(__func__, &lb_rank_lock, "lb_rank_lock", DEFAULT_LOCK_TIMEOUT); }
+
 	//checking config
 	if(cfg.lb_nbest_readers < 2)
 		{ cfg.lb_nbest_readers = DEFAULT_NBEST; }
@@ -51,6 +79,10 @@ void init_stat(void)
 		{ cfg.lb_reopen_seconds = DEFAULT_REOPEN_SECONDS; }
 	if(cfg.lb_retrylimit < 0)
 		{ cfg.lb_retrylimit = DEFAULT_RETRYLIMIT; }
+	if(cfg.lb_percentile < 50 || cfg.lb_percentile > 99)
+		{ cfg.lb_percentile = DEFAULT_LB_PERCENTILE; }
+	if(cfg.lb_hedge < 0 || cfg.lb_hedge > 100)
+		{ cfg.lb_hedge = 0; }
 	if(cfg.lb_stat_cleanup <= 0)
 		{ cfg.lb_stat_cleanup = DEFAULT_LB_STAT_CLEANUP; }
 }
@@ -86,21 +118,592 @@ static void get_stat_query(ECM_REQUEST *er, STAT_QUERY *q)
 	q->ecmlen = er->ecmlen;
 }
 
+#define LB_STAT_HASH_MIN 64
+
+static inline uint32_t lb_stat_hash(uint16_t caid, uint32_t prid, uint16_t srvid, uint32_t chid)
+{
+	uint32_t h = ((uint32_t)caid << 16 | srvid) * 0x9E3779B1;
+	h ^= (prid + 0x7F4A7C15 + (h << 6) + (h >> 2));
+	h ^= (chid + 0x7F4A7C15 + (h << 6) + (h >> 2));
+	return h ^ (h >> 15);
+}
+
+/**
+ * rebuilds the hash index of rdr->lb_stat with size buckets, lb_stat_lock must be write locked
+ **/
+static void lb_stat_index_rebuild(struct s_reader *rdr, uint32_t size)
+{
+	READER_STAT **hash;
+	if(!cs_malloc(&hash, size * sizeof(READER_STAT *)))
+		{ return; }
+
+	uint32_t count = 0;
+	READER_STAT *s;
+	LL_ITER it = ll_iter_create(rdr->lb_stat);
+	while((s = ll_iter_next(&it)))
+	{
+		uint32_t b = lb_stat_hash(s->caid, s->prid, s->srvid, s->chid) & (size - 1);
+		s->hnext = hash[b];
+		hash[b] = s;
+		count++;
+	}
+
+	NULLFREE(rdr->lb_stat_hash);
+	rdr->lb_stat_hash = hash;
+	rdr->lb_stat_hsize = size;
+	rdr->lb_stat_hcount = count;
+}
+
+/**
+ * adds a stat already stored in rdr->lb_stat to the hash index, lb_stat_lock must be write locked
+ **/
+static void lb_stat_index_add(struct s_reader *rdr, READER_STAT *s)
+{
+	__sync_add_and_fetch(&lb_rank_keygen[lb_stat_hash(s->caid, s->prid, s->srvid, s->chid) & (LB_RANK_KEYS - 1)], 1);
+
+	if(!rdr->lb_stat_hash || rdr->lb_stat_hcount >= rdr->lb_stat_hsize)
+	{
+		uint32_t size = rdr->lb_stat_hsize ? rdr->lb_stat_hsize * 2 : LB_STAT_HASH_MIN;
+		while(size < (uint32_t)ll_count(rdr->lb_stat))
+			{ size *= 2; }
+		lb_stat_index_rebuild(rdr, size); // includes s
+		if(rdr->lb_stat_hsize == size || !rdr->lb_stat_hash)
+			{ return; }
+	}
+
+	uint32_t b = lb_stat_hash(s->caid, s->prid, s->srvid, s->chid) & (rdr->lb_stat_hsize - 1);
+	s->hnext = rdr->lb_stat_hash[b];
+	rdr->lb_stat_hash[b] = s;
+	rdr->lb_stat_hcount++;
+}
+
+/**
+ * removes a stat from the hash index before it is removed from rdr->lb_stat, lb_stat_lock must be write locked
+ **/
+static void lb_stat_index_remove(struct s_reader *rdr, READER_STAT *s)
+{
+	__sync_add_and_fetch(&lb_rank_gen, 1);
+
+	if(!rdr->lb_stat_hash)
+		{ return; }
+
+	READER_STAT **p = &rdr->lb_stat_hash[lb_stat_hash(s->caid, s->prid, s->srvid, s->chid) & (rdr->lb_stat_hsize - 1)];
+	while(*p)
+	{
+		if(*p == s)
+		{
+			*p = s->hnext;
+			s->hnext = NULL;
+			rdr->lb_stat_hcount--;
+			return;
+		}
+		p = &(*p)->hnext;
+	}
+}
+
+static void lb_stat_index_clear(struct s_reader *rdr)
+{
+	__sync_add_and_fetch(&lb_rank_gen, 1);
+	NULLFREE(rdr->lb_stat_hash);
+	rdr->lb_stat_hsize = 0;
+	rdr->lb_stat_hcount = 0;
+}
+
+/*
+ * Sweeps over all stats of a reader take the lb_stat_lock for LB_STAT_SLICE stats
+ * at a time only, so add_stat() and the reader selection are not held up for the
+ * whole list. The iterator stays valid in between, it relocates itself when the
+ * list was changed meanwhile.
+ */
+#define LB_STAT_SLICE 256
+
+typedef int8_t (*lb_stat_walk_fn)(struct s_reader *rdr, READER_STAT *s, void *arg);
+
+/**
+ * calls fn for every stat of rdr, with writelock the stats fn returns 1 for are removed.
+ * Returns the number of removed stats.
+ **/
+static int32_t lb_stat_walk(struct s_reader *rdr, int8_t writelock, lb_stat_walk_fn fn, void *arg)
+{
+	LL_ITER it = ll_iter_create(rdr->lb_stat);
+	READER_STAT *s;
+	int32_t n, count = 0;
+
+	do
+	{
+		if(writelock)
+		{
+			rdr->lb_stat_busy = 1;
+			cs_writelock(__func__, &rdr->lb_stat_lock);
+		}
+		else
+			{ cs_readlock(__func__, &rdr->lb_stat_lock); }
+
+		for(n = 0; n < LB_STAT_SLICE && (s = ll_iter_next(&it)); n++)
+		{
+			if(fn(rdr, s, arg) && writelock)
+			{
+				lb_stat_index_remove(rdr, s);
+				ll_iter_remove_data(&it);
+				count++;
+			}
+		}
+
+		if(writelock)
+		{
+			cs_writeunlock(__func__, &rdr->lb_stat_lock);
+			rdr->lb_stat_busy = 0;
+		}
+		else
+			{ cs_readunlock(__func__, &rdr->lb_stat_lock); }
+
+		if(s)
+			{ sched_yield(); } // let the waiting ecms in
+	}
+	while(s);
+
+	return count;
+}
+
+struct stat_cleanup
+{
+	struct timeb now;
+	int64_t timeout;
+};
+
+static int8_t stat_expired(struct s_reader *UNUSED(rdr), READER_STAT *s, void *arg)
+{
+	struct stat_cleanup *c = arg;
+	return comp_timeb(&c->now, &s->last_received) > c->timeout;
+}
+
+/*
+ * Binary stat file (lb_save_binary): a header followed by reader records, each
+ * selecting the reader for the fixed size stat records after it, all in host byte
+ * order so the file can be mapped and read in place. Saves append the stats changed
+ * since the last save, on load later records override earlier ones. The file is
+ * rewritten through a temp file when stats were deleted or it holds more than
+ * twice the records needed.
+ */
+#define LB_STAT_FILE_MAGIC		"OSLBSTAT"
+#define LB_STAT_FILE_VERSION	1
+#define LB_STAT_FILE_BYTEORDER	0x01020304
+
+#define LB_REC_READER	'R'
+#define LB_REC_STAT		'S'
+
+typedef struct lb_stat_file_header_t
+{
+	char			magic[8];
+	uint32_t		version;
+	uint32_t		byteorder;
+	uint32_t		header_size;
+	uint32_t		record_size;
+} LB_STAT_FILE_HEADER;
+
+typedef struct lb_stat_file_record_t
+{
+	uint8_t			type;							// LB_REC_STAT
+	uint8_t			reserved;
+	int16_t			rc;
+	uint16_t		caid;
+	uint16_t		srvid;
+	uint32_t		prid;
+	uint32_t		chid;
+	int16_t			ecmlen;
+	int16_t			reserved2;
+	int32_t			time_avg;
+	int32_t			ecm_count;
+	int32_t			fail_factor;
+	int64_t			last_received;					// s since epoch
+} LB_STAT_FILE_RECORD;
+
+// a reader record is the type, the label length and the label without 0
+
+static pthread_mutex_t lb_file_lock = PTHREAD_MUTEX_INITIALIZER;
+static char lb_file_name[256];						// binary file the state below belongs to
+static int8_t lb_file_binary;
+static int8_t lb_file_rewrite;						// the file misses changes, don't append
+static uint32_t lb_file_records;
+static uint32_t lb_file_deleted, lb_file_deleted_saved;	// deletions of stats, can't be appended
+
+static void get_stat_filename(char *buf, size_t bufsize)
+{
+	if(cfg.lb_savepath)
+		{ cs_strncpy(buf, cfg.lb_savepath, bufsize); }
+	else
+		{ get_tmp_dir_filename(buf, bufsize, "stat"); }
+}
+
+/**
+ * stats were deleted, the next binary save rewrites the file
+ **/
+static void stat_file_deleted(void)
+{
+	__sync_add_and_fetch(&lb_file_deleted, 1);
+}
+
+static READER_STAT *lb_stat_find(struct s_reader *rdr, const LB_STAT_FILE_RECORD *rec)
+{
+	READER_STAT *s;
+
+	if(!rdr->lb_stat_hash)
+		{ return NULL; }
+
+	for(s = rdr->lb_stat_hash[lb_stat_hash(rec->caid, rec->prid, rec->srvid, rec->chid) & (rdr->lb_stat_hsize - 1)]; s; s = s->hnext)
+	{
+		if(s->caid == rec->caid && s->prid == rec->prid && s->srvid == rec->srvid && s->chid == rec->chid && s->ecmlen == rec->ecmlen)
+			{ break; }
+	}
+	return s;
+}
+
+static struct s_reader *get_stat_reader(const char *label)
+{
+	struct s_reader *rdr;
+	LL_ITER itr = ll_iter_create(configured_readers);
+
+	while((rdr = ll_iter_next(&itr)))
+	{
+		if(strcmp(rdr->label, label) == 0)
+			{ break; }
+	}
+	return rdr;
+}
+
+/**
+ * maps fname and loads a binary stat file, returns the number of stats
+ * or -1 when fname is no binary stat file
+ **/
+static int32_t load_stat_from_bin(const char *fname)
+{
+	const LB_STAT_FILE_HEADER *hdr;
+	LB_STAT_FILE_RECORD rec;
+	const uint8_t *data;
+	struct s_reader *rdr = NULL;
+	struct stat st;
+	READER_STAT *s;
+	char label[sizeof(rdr->label)];
+	uint32_t records = 0;
+	int32_t count = 0;
+	size_t pos;
+	int fd;
+
+	if((fd = open(fname, O_RDONLY)) < 0)
+		{ return -1; }
+	if(fstat(fd, &st) || (size_t)st.st_size < sizeof(LB_STAT_FILE_HEADER)
+		|| (data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+	{
+		close(fd);
+		return -1;
+	}
+	close(fd);
+
+	hdr = (const LB_STAT_FILE_HEADER *)data;
+	if(memcmp(hdr->magic, LB_STAT_FILE_MAGIC, sizeof(hdr->magic)))
+	{
+		munmap((void *)data, st.st_size);
+		return -1;
+	}
+
+	SAFE_MUTEX_LOCK(&lb_file_lock);
+	cs_strncpy(lb_file_name, fname, sizeof(lb_file_name));
+	lb_file_binary = 0;
+	lb_file_rewrite = 0;
+	lb_file_deleted_saved = lb_file_deleted;
+
+	if(hdr->version != LB_STAT_FILE_VERSION || hdr->byteorder != LB_STAT_FILE_BYTEORDER
+		|| hdr->header_size != sizeof(LB_STAT_FILE_HEADER) || hdr->record_size != sizeof(LB_STAT_FILE_RECORD))
+	{
+		SAFE_MUTEX_UNLOCK(&lb_file_lock);
+		cs_log("loadbalancer: ignoring statistics %s: wrong version", fname);
+		munmap((void *)data, st.st_size);
+		return 0;
+	}
+
+	madvise((void *)data, st.st_size, MADV_SEQUENTIAL);
+	time_t expire = time(NULL) - (time_t)cfg.lb_stat_cleanup * 60 * 60;
+
+	for(pos = sizeof(LB_STAT_FILE_HEADER); pos < (size_t)st.st_size;)
+	{
+		if(data[pos] == LB_REC_READER)
+		{
+			if(pos + 2 > (size_t)st.st_size || pos + 2 + data[pos + 1] > (size_t)st.st_size || data[pos + 1] >= sizeof(label))
+				{ break; }
+			memcpy(label, data + pos + 2, data[pos + 1]);
+			label[data[pos + 1]] = 0;
+			pos += 2 + data[pos + 1];
+
+			if(rdr)
+				{ cs_writeunlock(__func__, &rdr->lb_stat_lock); }
+			if((rdr = get_stat_reader(label)))
+			{
+				if(!rdr->lb_stat)
+				{
+					rdr->lb_stat = ll_create("lb_stat");
+					cs_lock_create(__func__, &rdr->lb_stat_lock, "lb_stat_lock", DEFAULT_LOCK_TIMEOUT);
+				}
+				cs_writelock(__func__, &rdr->lb_stat_lock);
+			}
+			else
+				{ cs_log("loadbalancer: statistics could not be loaded for %s", label); }
+			continue;
+		}
+
+		if(data[pos] != LB_REC_STAT || pos + sizeof(rec) > (size_t)st.st_size)
+			{ break; }
+		memcpy(&rec, data + pos, sizeof(rec));
+		pos += sizeof(rec);
+		records++;
+
+		if(!rdr || rec.ecmlen <= 0 || rec.last_received < expire)
+			{ continue; }
+
+		if(!(s = lb_stat_find(rdr, &rec)))
+		{
+			if(!cs_malloc(&s, sizeof(READER_STAT)))
+				{ continue; }
+			s->caid = rec.caid;
+			s->prid = rec.prid;
+			s->srvid = rec.srvid;
+			s->chid = rec.chid;
+			s->ecmlen = rec.ecmlen;
+			ll_append(rdr->lb_stat, s);
+			lb_stat_index_add(rdr, s);
+			count++;
+		}
+		s->rc = rec.rc;
+		s->time_avg = rec.time_avg;
+		s->ecm_count = rec.ecm_count;
+		s->fail_factor = rec.fail_factor;
+		s->last_received.time = rec.last_received;
+		s->last_received.millitm = 0;
+		s->dirty = 0;
+	}
+	if(rdr)
+		{ cs_writeunlock(__func__, &rdr->lb_stat_lock); }
+
+	if(pos < (size_t)st.st_size)
+	{
+		cs_log("loadbalancer: statistics %s damaged at offset %zu, the rest is ignored", fname, pos);
+		lb_file_rewrite = 1;
+	}
+	lb_file_binary = 1;
+	lb_file_records = records;
+	SAFE_MUTEX_UNLOCK(&lb_file_lock);
+
+	munmap((void *)data, st.st_size);
+	return count;
+}
+
+struct stat_buf
+{
+	uint8_t			*data;
+	size_t			len;
+	size_t			size;
+	int8_t			failed;
+};
+
+static void stat_buf_add(struct stat_buf *buf, const void *data, size_t n)
+{
+	if(buf->failed)
+		{ return; }
+
+	if(buf->len + n > buf->size)
+	{
+		size_t size = MAX(buf->size * 2, buf->len + n + 4096);
+		if(!cs_realloc(&buf->data, size))
+		{
+			buf->failed = 1;
+			return;
+		}
+		buf->size = size;
+	}
+	memcpy(buf->data + buf->len, data, n);
+	buf->len += n;
+}
+
+struct stat_save_bin
+{
+	struct stat_cleanup cleanup;
+	struct stat_buf	*buf;
+	int8_t			rewrite;
+	int8_t			rdr_added;
+	uint8_t			rdr_rec[2 + sizeof(((struct s_reader *)0)->label)];
+	uint32_t		count;
+};
+
+static int8_t stat_save_bin(struct s_reader *rdr, READER_STAT *s, void *arg)
+{
+	struct stat_save_bin *b = arg;
+	LB_STAT_FILE_RECORD rec;
+
+	if(stat_expired(rdr, s, &b->cleanup) || !s->ecmlen) // cleanup old stats
+		{ return 1; }
+
+	if(!b->rewrite && !s->dirty)
+		{ return 0; }
+
+	if(!b->rdr_added)
+	{
+		stat_buf_add(b->buf, b->rdr_rec, 2 + b->rdr_rec[1]);
+		b->rdr_added = 1;
+	}
+
+	memset(&rec, 0, sizeof(rec));
+	rec.type = LB_REC_STAT;
+	rec.rc = s->rc;
+	rec.caid = s->caid;
+	rec.srvid = s->srvid;
+	rec.prid = s->prid;
+	rec.chid = s->chid;
+	rec.ecmlen = s->ecmlen;
+	rec.time_avg = s->time_avg;
+	rec.ecm_count = s->ecm_count;
+	rec.fail_factor = s->fail_factor;
+	rec.last_received = s->last_received.time;
+	stat_buf_add(b->buf, &rec, sizeof(rec));
+	s->dirty = 0;
+	b->count++;
+	return 0;
+}
+
+/**
+ * saves the stats to a binary stat file: the changed stats are appended, or the
+ * whole file is rewritten when it is no binary stat file yet, stats were deleted
+ * or less than half of its records are still needed
+ **/
+static void save_stat_to_bin(const char *fname)
+{
+	LB_STAT_FILE_HEADER hdr;
+	struct stat_save_bin b;
+	struct stat_buf buf;
+	char tmpname[288];
+	struct timeb ts, te;
+	struct s_reader *rdr;
+	uint32_t count, live = 0;
+	int8_t rewrite, ok;
+	int32_t err;
+	FILE *file;
+
+	cs_ftime(&ts);
+	memset(&buf, 0, sizeof(buf));
+	memset(&b, 0, sizeof(b));
+	b.cleanup.now = ts;
+	b.cleanup.timeout = (int64_t)cfg.lb_stat_cleanup * 60 * 60 * 1000;
+	b.buf = &buf;
+
+	SAFE_MUTEX_LOCK(&lb_file_lock);
+	uint32_t deleted = lb_file_deleted;
+
+	LL_ITER itr = ll_iter_create(configured_readers);
+	while((rdr = ll_iter_next(&itr)))
+	{
+		if(rdr->lb_stat)
+			{ live += ll_count(rdr->lb_stat); }
+	}
+
+	rewrite = !lb_file_binary || lb_file_rewrite || deleted != lb_file_deleted_saved || strcmp(lb_file_name, fname)
+				|| lb_file_records > 2 * live + 1024;
+
+	if(rewrite)
+	{
+		memset(&hdr, 0, sizeof(hdr));
+		memcpy(hdr.magic, LB_STAT_FILE_MAGIC, sizeof(hdr.magic));
+		hdr.version = LB_STAT_FILE_VERSION;
+		hdr.byteorder = LB_STAT_FILE_BYTEORDER;
+		hdr.header_size = sizeof(hdr);
+		hdr.record_size = sizeof(LB_STAT_FILE_RECORD);
+		stat_buf_add(&buf, &hdr, sizeof(hdr));
+	}
+
+	b.rewrite = rewrite;
+	itr = ll_iter_create(configured_readers);
+	while((rdr = ll_iter_next(&itr)))
+	{
+		if(!rdr->lb_stat)
+			{ continue; }
+
+		b.rdr_rec[0] = LB_REC_READER;
+		b.rdr_rec[1] = strnlen(rdr->label, sizeof(rdr->label) - 1);
+		memcpy(b.rdr_rec + 2, rdr->label, b.rdr_rec[1]);
+		b.rdr_added = 0;
+		lb_stat_walk(rdr, 1, stat_save_bin, &b);
+	}
+	count = b.count;
+
+	ok = 0;
+	if(buf.failed)
+		{ errno = ENOMEM; }
+	else if(rewrite)
+	{
+		snprintf(tmpname, sizeof(tmpname), "%s.tmp", fname);
+		if((file = fopen(tmpname, "w")))
+		{
+			ok = fwrite(buf.data, 1, buf.len, file) == buf.len;
+			ok = fflush(file) == 0 && ok;
+			ok = fsync(fileno(file)) == 0 && ok;
+			ok = fclose(file) == 0 && ok;
+		}
+		if(ok)
+			{ ok = rename(tmpname, fname) == 0; }
+		if(!ok)
+			{ unlink(tmpname); }
+	}
+	else if(!buf.len)
+		{ ok = 1; }
+	else if((file = fopen(fname, "a")))
+	{
+		ok = fwrite(buf.data, 1, buf.len, file) == buf.len;
+		ok = fclose(file) == 0 && ok;
+	}
+	err = errno;
+
+	if(ok)
+	{
+		cs_strncpy(lb_file_name, fname, sizeof(lb_file_name));
+		lb_file_binary = 1;
+		lb_file_rewrite = 0;
+		lb_file_deleted_saved = deleted;
+		lb_file_records = rewrite ? count : lb_file_records + count;
+	}
+	else
+		{ lb_file_rewrite = 1; } // the changes are not in the file, write all stats next time
+	SAFE_MUTEX_UNLOCK(&lb_file_lock);
+	NULLFREE(buf.data);
+
+	cs_ftime(&te);
+	if(!ok)
+		{ cs_log("can't write to file %s (errno=%d %s)", fname, err, strerror(err)); }
+	else
+		{ cs_log("loadbalancer: statistic %s %u records to %s in %"PRId64" ms", rewrite ? "saved" : "appended", count, fname, comp_timeb(&te, &ts)); }
+}
+
 void load_stat_from_file(void)
 {
 	stat_load_save = 0;
 	char buf[256];
+	char fname[256];
 	char *line;
-	char *fname;
 	FILE *file;
+	int32_t count;
+
+	get_stat_filename(fname, sizeof(fname));
+
+	struct timeb ts, te;
+	cs_ftime(&ts);
 
-	if(!cfg.lb_savepath)
+	if((count = load_stat_from_bin(fname)) >= 0)
 	{
-		get_tmp_dir_filename(buf, sizeof(buf), "stat");
-		fname = buf;
+		cs_ftime(&te);
+		cs_log_dbg(D_LB, "loadbalancer: statistics loaded %d records from %s in %"PRId64" ms", count, fname, comp_timeb(&te, &ts));
+		return;
 	}
-	else
-		{ fname = cfg.lb_savepath; }
+
+	// text stat file, the next binary save rewrites it
+	SAFE_MUTEX_LOCK(&lb_file_lock);
+	lb_file_binary = 0;
+	SAFE_MUTEX_UNLOCK(&lb_file_lock);
 
 	file = fopen(fname, "r");
 	if(!file)
@@ -117,16 +720,13 @@ void load_stat_from_file(void)
 
 	cs_log_dbg(D_LB, "loadbalancer: load statistics from %s", fname);
 
-	struct timeb ts, te;
-	cs_ftime(&ts);
-
 	struct s_reader *rdr = NULL;
 	READER_STAT *s;
 
 	int32_t i = 1;
 	int32_t valid = 0;
-	int32_t count = 0;
 	int32_t type = 0;
+	count = 0;
 	char *ptr, *saveptr1 = NULL;
 	char *split[12];
 
@@ -192,10 +792,13 @@ void load_stat_from_file(void)
 				if(!rdr->lb_stat)
 				{
 					rdr->lb_stat = ll_create("lb_stat");
-					cs_lock_create(__func__, &rdr->lb_stat_lock, rdr->label, DEFAULT_LOCK_TIMEOUT);
+					cs_lock_create(__func__, &rdr->lb_stat_lock, "lb_stat_lock", DEFAULT_LOCK_TIMEOUT);
 				}
 
+				cs_writelock(__func__, &rdr->lb_stat_lock);
 				ll_append(rdr->lb_stat, s);
+				lb_stat_index_add(rdr, s);
+				cs_writeunlock(__func__, &rdr->lb_stat_lock);
 				count++;
 			}
 			else
@@ -227,6 +830,7 @@ void lb_destroy_stats(struct s_reader *rdr)
 		return;
 	cs_lock_destroy(__func__, &rdr->lb_stat_lock);
 	ll_destroy_data(&rdr->lb_stat);
+	lb_stat_index_clear(rdr);
 }
 
 /**
@@ -237,39 +841,34 @@ static READER_STAT *get_stat_lock(struct s_reader *rdr, STAT_QUERY *q, int8_t lo
 	if(!rdr->lb_stat)
 	{
 		rdr->lb_stat = ll_create("lb_stat");
-		cs_lock_create(__func__, &rdr->lb_stat_lock, rdr->label, DEFAULT_LOCK_TIMEOUT);
+		cs_lock_create(__func__, &rdr->lb_stat_lock, "lb_stat_lock", DEFAULT_LOCK_TIMEOUT);
 	}
 
 	if(lock) { cs_readlock(__func__, &rdr->lb_stat_lock); }
 
-	LL_ITER it = ll_iter_create(rdr->lb_stat);
-	READER_STAT *s;
-	int32_t i = 0;
-	while((s = ll_iter_next(&it)))
+	READER_STAT *s = NULL;
+	if(rdr->lb_stat_hash)
 	{
-		i++;
-		if(s->caid == q->caid && s->prid == q->prid && s->srvid == q->srvid && s->chid == q->chid)
+		s = rdr->lb_stat_hash[lb_stat_hash(q->caid, q->prid, q->srvid, q->chid) & (rdr->lb_stat_hsize - 1)];
+		for(; s; s = s->hnext)
 		{
-			if(s->ecmlen == q->ecmlen)
-				{ break; }
-			if(!s->ecmlen)
+			if(s->caid == q->caid && s->prid == q->prid && s->srvid == q->srvid && s->chid == q->chid)
 			{
-				s->ecmlen = q->ecmlen;
-				break;
+				if(s->ecmlen == q->ecmlen)
+					{ break; }
+				if(!s->ecmlen)
+				{
+					s->ecmlen = q->ecmlen;
+					s->dirty = 1;
+					break;
+				}
+				if(!q->ecmlen) // Query without ecmlen from dvbapi
+					{ break; }
 			}
-			if(!q->ecmlen) // Query without ecmlen from dvbapi
-				{ break; }
 		}
 	}
 	if(lock) { cs_readunlock(__func__, &rdr->lb_stat_lock); }
 
-	// Move stat to list start for faster access:
-	if (i > 10 && s && !rdr->lb_stat_busy) {
-		if (lock) cs_writelock(__func__, &rdr->lb_stat_lock);
-		ll_iter_move_first(&it);
-		if (lock) cs_writeunlock(__func__, &rdr->lb_stat_lock);
-	}
-
 	return s;
 }
 
@@ -301,24 +900,187 @@ static void calc_stat(READER_STAT *s)
 		{ s->time_avg = t / c; }
 }
 
+/*
+ * lb_mode 4 keeps a histogram of the ecm times with four log buckets per power of
+ * two. It is halved whenever it holds LB_TIME_HIST_WINDOW times, so older ecms fade
+ * out but a slow tail stays visible far longer than in the time_avg window.
+ */
+#define LB_TIME_HIST_WINDOW 128
+#define LB_SUCCESS_WINDOW 64
+
+static int32_t time_hist_bucket(int32_t ecm_time)
+{
+	int32_t msb, idx;
+
+	if(ecm_time < 4)
+		{ return ecm_time < 0 ? 0 : ecm_time; }
+
+	for(msb = 2; ecm_time >> (msb + 1); msb++) { ; }
+	idx = (msb - 1) * 4 + ((ecm_time >> (msb - 2)) & 3);
+	return MIN(idx, LB_TIME_HIST_BUCKETS - 1);
+}
+
+static int32_t time_hist_value(int32_t idx)
+{
+	int32_t shift;
+
+	if(idx < 4)
+		{ return idx; }
+
+	shift = idx / 4 - 1;
+	return ((4 + (idx & 3)) << shift) + ((1 << shift) >> 1); // middle of the bucket
+}
+
+static void add_time_hist(READER_STAT *s, int32_t ecm_time)
+{
+	int32_t i;
+
+	if(s->time_hist_count >= LB_TIME_HIST_WINDOW)
+	{
+		s->time_hist_count = 0;
+		for(i = 0; i < LB_TIME_HIST_BUCKETS; i++)
+		{
+			s->time_hist[i] >>= 1;
+			s->time_hist_count += s->time_hist[i];
+		}
+	}
+	s->time_hist[time_hist_bucket(ecm_time)]++;
+	s->time_hist_count++;
+}
+
+static void add_success(READER_STAT *s, int8_t found)
+{
+	if(s->found_count + s->failed_count >= LB_SUCCESS_WINDOW)
+	{
+		s->found_count >>= 1;
+		s->failed_count >>= 1;
+	}
+	if(found)
+		{ s->found_count++; }
+	else
+		{ s->failed_count++; }
+}
+
+/**
+ * returns the percentile ecm time of the histogram
+ * or 0 when it has less than lb_min_ecmcount times
+ **/
+static int32_t time_hist_percentile(READER_STAT *s, int32_t percentile)
+{
+	int32_t i, n = 0, rank;
+
+	if(!s->time_hist_count || s->time_hist_count < cfg.lb_min_ecmcount)
+		{ return 0; }
+
+	rank = (s->time_hist_count * percentile + 99) / 100;
+	for(i = 0; i < LB_TIME_HIST_BUCKETS; i++)
+	{
+		n += s->time_hist[i];
+		if(n >= rank)
+			{ break; }
+	}
+	return time_hist_value(MIN(i, LB_TIME_HIST_BUCKETS - 1));
+}
+
+/**
+ * lbvalue of lb_mode 4: the lb_percentile ecm time divided by the success rate,
+ * time_avg as long as the histogram has less than lb_min_ecmcount times
+ **/
+static int32_t get_percentile_time(READER_STAT *s)
+{
+	int32_t t = time_hist_percentile(s, cfg.lb_percentile);
+
+	if(!t)
+		{ t = s->time_avg; }
+
+	if(s->found_count && s->failed_count)
+		{ t = (int64_t)t * (s->found_count + s->failed_count) / s->found_count; }
+
+	return t;
+}
+
+/*
+ * Hedging (lb_hedge): when the primary readers of an ecm are slower than their
+ * LB_HEDGE_PERCENTILE ecm time, the fallback readers are asked at once instead of
+ * at the fallback timeout. The hedged ecms are kept below lb_hedge percent of the
+ * load balanced ecms, both counts are halved every LB_HEDGE_WINDOW ecms.
+ */
+#define LB_HEDGE_PERCENTILE 90
+#define LB_HEDGE_WINDOW 1000
+
+static uint32_t lb_hedge_ecms, lb_hedge_sent;
+
+static void lb_hedge_count_ecm(void)
+{
+	if(__sync_add_and_fetch(&lb_hedge_ecms, 1) >= LB_HEDGE_WINDOW)
+	{
+		__sync_fetch_and_sub(&lb_hedge_ecms, LB_HEDGE_WINDOW / 2);
+		__sync_fetch_and_sub(&lb_hedge_sent, lb_hedge_sent / 2);
+	}
+}
+
+/**
+ * takes one hedged ecm from the budget, returns 0 when it is used up
+ **/
+int8_t lb_hedge_allowed(void)
+{
+	uint32_t sent = lb_hedge_sent;
+
+	if((uint64_t)(sent + 1) * 100 > (uint64_t)lb_hedge_ecms * cfg.lb_hedge)
+		{ return 0; }
+
+	__sync_add_and_fetch(&lb_hedge_sent, 1);
+	return 1;
+}
+
+struct stat_save_txt
+{
+	struct stat_cleanup cleanup;
+	FILE			*file;
+	int32_t			count;
+};
+
+static int8_t stat_save_txt(struct s_reader *rdr, READER_STAT *s, void *arg)
+{
+	struct stat_save_txt *t = arg;
+
+	if(stat_expired(rdr, s, &t->cleanup) || !s->ecmlen) // cleanup old stats
+		{ return 1; }
+
+	//Old version, too slow to parse:
+	//fprintf(file, "%s rc %d caid %04hX prid %06X srvid %04hX time avg %d ms ecms %d last %ld fail %d len %02hX\n",
+	//  rdr->label, s->rc, s->caid, s->prid,
+	//  s->srvid, s->time_avg, s->ecm_count, s->last_received, s->fail_factor, s->ecmlen);
+
+	//New version:
+	fprintf(t->file, "%s,%d,%04hX,%06X,%04hX,%04hX,%d,%d,%ld,%d,%02hX\n",
+			rdr->label, s->rc, s->caid, s->prid,
+			s->srvid, (uint16_t)s->chid, s->time_avg, s->ecm_count, s->last_received.time, s->fail_factor, s->ecmlen);
+
+	t->count++;
+	return 0;
+}
+
 /**
  * Saves statistik to /tmp/.oscam/stat.n where n is reader-index
  */
 static void save_stat_to_file_thread(void)
 {
 	stat_load_save = 0;
-	char buf[256];
+	char fname[256];
 
 	set_thread_name(__func__);
 
-	char *fname;
-	if(!cfg.lb_savepath)
+	get_stat_filename(fname, sizeof(fname));
+	if(cfg.lb_save_binary)
 	{
-		get_tmp_dir_filename(buf, sizeof(buf), "stat");
-		fname = buf;
+		save_stat_to_bin(fname);
+		return;
 	}
-	else
-		{ fname = cfg.lb_savepath; }
+
+	SAFE_MUTEX_LOCK(&lb_file_lock);
+	lb_file_binary = 0;
+	SAFE_MUTEX_UNLOCK(&lb_file_lock);
 
 	FILE *file = fopen(fname, "w");
 
@@ -331,52 +1093,20 @@ static void save_stat_to_file_thread(void)
 	struct timeb ts, te;
 	cs_ftime(&ts);
 
-	int32_t cleanup_timeout = (cfg.lb_stat_cleanup * 60 * 60 * 1000);
+	struct stat_save_txt t;
+	t.cleanup.now = ts;
+	t.cleanup.timeout = (int64_t)cfg.lb_stat_cleanup * 60 * 60 * 1000;
+	t.file = file;
+	t.count = 0;
 
-	int32_t count = 0;
 	struct s_reader *rdr;
 	LL_ITER itr = ll_iter_create(configured_readers);
 	while((rdr = ll_iter_next(&itr)))
 	{
-
 		if(rdr->lb_stat)
-		{
-			rdr->lb_stat_busy = 1;
-
-			cs_writelock(__func__, &rdr->lb_stat_lock);
-			LL_ITER it = ll_iter_create(rdr->lb_stat);
-			READER_STAT *s;
-			while((s = ll_iter_next(&it)))
-			{
-				int64_t gone = comp_timeb(&ts, &s->last_received);
-				if(gone > cleanup_timeout || !s->ecmlen) // cleanup old stats
-				{
-					ll_iter_remove_data(&it);
-					continue;
-				}
-
-				//Old version, too slow to parse:
-				//fprintf(file, "%s rc %d caid %04hX prid %06X srvid %04hX time avg %d ms ecms %d last %ld fail %d len %02hX\n",
-				//  rdr->label, s->rc, s->caid, s->prid,
-				//  s->srvid, s->time_avg, s->ecm_count, s->last_received, s->fail_factor, s->ecmlen);
-
-				//New version:
-				fprintf(file, "%s,%d,%04hX,%06X,%04hX,%04hX,%d,%d,%ld,%d,%02hX\n",
-						rdr->label, s->rc, s->caid, s->prid,
-						s->srvid, (uint16_t)s->chid, s->time_avg, s->ecm_count, s->last_received.time, s->fail_factor, s->ecmlen);
-
-				count++;
-				//if(count % 500 == 0) { // Saving stats is using too much cpu and causes high file load. so we need a break
-				//	cs_readunlock(__func__, &rdr->lb_stat_lock);
-				//	cs_sleepms(100);
-				//	cs_readlock(__func__, &rdr->lb_stat_lock);
-				//}
-			}
-			cs_writeunlock(__func__, &rdr->lb_stat_lock);
-
-			rdr->lb_stat_busy = 0;
-		}
+			{ lb_stat_walk(rdr, 1, stat_save_txt, &t); }
 	}
+	int32_t count = t.count;
 
 	fclose(file);
 
@@ -415,7 +1145,7 @@ static READER_STAT *get_add_stat(struct s_reader *rdr, STAT_QUERY *q)
 	if(!rdr->lb_stat)
 	{
 		rdr->lb_stat = ll_create("lb_stat");
-		cs_lock_create(__func__, &rdr->lb_stat_lock, rdr->label, DEFAULT_LOCK_TIMEOUT);
+		cs_lock_create(__func__, &rdr->lb_stat_lock, "lb_stat_lock", DEFAULT_LOCK_TIMEOUT);
 	}
 
 	cs_writelock(__func__, &rdr->lb_stat_lock);
@@ -435,7 +1165,9 @@ static READER_STAT *get_add_stat(struct s_reader *rdr, STAT_QUERY *q)
 			cs_ftime(&s->last_received);
 			s->fail_factor = 0;
 			s->ecm_count = 0;
+			s->dirty = 1;
 			ll_prepend(rdr->lb_stat, s);
+			lb_stat_index_add(rdr, s);
 		}
 	}
 	cs_writeunlock(__func__, &rdr->lb_stat_lock);
@@ -453,6 +1185,7 @@ void readerinfofix_get_stat_query(ECM_REQUEST *er, STAT_QUERY *q)
 void readerinfofix_inc_fail(READER_STAT *s)
 {
 	inc_fail(s);
+	s->dirty = 1;
 }
 
 READER_STAT *readerinfofix_get_add_stat(struct s_reader *rdr, STAT_QUERY *q)
@@ -597,6 +1330,7 @@ static void add_stat(struct s_reader *rdr, ECM_REQUEST *er, int32_t ecm_time, in
 	cs_ftime(&now);
 
 	cs_ftime(&s->last_received);
+	s->dirty = 1;
 
 	if(rc == E_FOUND) // found
 	{
@@ -612,6 +1346,10 @@ static void add_stat(struct s_reader *rdr, ECM_REQUEST *er, int32_t ecm_time, in
 		s->time_stat[s->time_idx] = ecm_time;
 		calc_stat(s);
 
+		// LATENCY PERCENTILE:
+		add_time_hist(s, ecm_time);
+		add_success(s, 1);
+
 		// OLDEST READER now set by get best reader!
 
 
@@ -636,6 +1374,11 @@ static void add_stat(struct s_reader *rdr, ECM_REQUEST *er, int32_t ecm_time, in
 	{
 		inc_fail(s);
 		s->rc = rc;
+
+		// a timeout is the slowest answer of all
+		if(rc == E_TIMEOUT)
+			{ add_time_hist(s, ecm_time); }
+		add_success(s, 0);
 	}
 	else if(rc == E_INVALID) // invalid
 	{
@@ -676,26 +1419,28 @@ static void add_stat(struct s_reader *rdr, ECM_REQUEST *er, int32_t ecm_time, in
 
 }
 
+struct clean_rc
+{
+	int8_t rc;
+	int8_t inverse;
+};
+
+static int8_t stat_has_rc(struct s_reader *UNUSED(rdr), READER_STAT *s, void *arg)
+{
+	struct clean_rc *c = arg;
+	return (!c->inverse && s->rc == c->rc) || (c->inverse && s->rc != c->rc);
+}
+
 int32_t clean_stat_by_rc(struct s_reader *rdr, int8_t rc, int8_t inverse)
 {
 	int32_t count = 0;
 	if(rdr && rdr->lb_stat)
 	{
 		if (rdr->lb_stat_busy) return 0;
-		rdr->lb_stat_busy = 1;
-		cs_writelock(__func__, &rdr->lb_stat_lock);
-		READER_STAT *s;
-		LL_ITER itr = ll_iter_create(rdr->lb_stat);
-		while((s = ll_iter_next(&itr)))
-		{
-			if((!inverse && s->rc == rc) || (inverse && s->rc != rc))
-			{
-				ll_iter_remove_data(&itr);
-				count++;
-			}
-		}
-		cs_writeunlock(__func__, &rdr->lb_stat_lock);
-		rdr->lb_stat_busy = 0;
+		struct clean_rc c = { .rc = rc, .inverse = inverse };
+		count = lb_stat_walk(rdr, 1, stat_has_rc, &c);
+		if(count)
+			{ stat_file_deleted(); }
 	}
 	return count;
 }
@@ -732,6 +1477,7 @@ int32_t clean_stat_by_id(struct s_reader *rdr, uint16_t caid, uint32_t prid, uin
 					s->chid == chid &&
 					s->ecmlen == ecmlen)
 			{
+				lb_stat_index_remove(rdr, s);
 				ll_iter_remove_data(&itr);
 				count++;
 				break; // because the entry should unique we can left here
@@ -739,6 +1485,8 @@ int32_t clean_stat_by_id(struct s_reader *rdr, uint16_t caid, uint32_t prid, uin
 		}
 		cs_writeunlock(__func__, &rdr->lb_stat_lock);
 		rdr->lb_stat_busy = 0;
+		if(count)
+			{ stat_file_deleted(); }
 	}
 	return count;
 }
@@ -915,6 +1663,7 @@ static void reset_ecmcount_reader(READER_STAT *s, struct s_reader *rdr)
 		if(s)
 		{
 			s->ecm_count = 0;
+			s->dirty = 1;
 		}
 	}
 	cs_readunlock(__func__, &rdr->lb_stat_lock);
@@ -932,24 +1681,109 @@ static void reset_avgtime_reader(READER_STAT *s, struct s_reader *rdr)
 			if(s->time_stat[i] > 0) { s->time_stat[i] = 0; }
 		}
 		s->time_avg = UNDEF_AVG_TIME;
+		s->dirty = 1;
 	}
 	cs_readunlock(__func__, &rdr->lb_stat_lock);
 }
 
+static int8_t lb_rank_match(STAT_QUERY *a, STAT_QUERY *b)
+{
+	return a->caid == b->caid && a->prid == b->prid && a->srvid == b->srvid && a->chid == b->chid && a->ecmlen == b->ecmlen;
+}
+
+/**
+ * sets ea->stat of all matching readers, from the rank cache when the same
+ * readers were already resolved for this service and no stat changed since
+ **/
+static void resolve_reader_stats(ECM_REQUEST *er, STAT_QUERY *q)
+{
+	struct s_ecm_answer *ea;
+	uint32_t sig = 2166136261U;
+	int32_t i, n = 0;
+
+	for(ea = er->matching_rdr; ea; ea = ea->next, n++)
+		{ sig = (sig ^ (uint32_t)(uintptr_t)ea->reader) * 16777619U; }
+
+	if(!lb_rank_cache || !n)
+	{
+		for(ea = er->matching_rdr; ea; ea = ea->next)
+			{ ea->stat = get_stat(ea->reader, q); }
+		return;
+	}
+
+	uint32_t key = lb_stat_hash(q->caid, q->prid, q->srvid, q->chid);
+	uint32_t *keygen = &lb_rank_keygen[key & (LB_RANK_KEYS - 1)];
+	struct lb_rank *r = &lb_rank_cache[(key ^ sig ^ ((uint32_t)q->ecmlen * 0x9E3779B1)) & (LB_RANK_SLOTS - 1)];
+
+	// read the generations before resolving, stats added or removed meanwhile invalidate the new entry
+	uint32_t gen = lb_rank_gen;
+	uint32_t kgen = *keygen;
+	__sync_synchronize();
+
+	int8_t hit = 0;
+	cs_readlock(__func__, &lb_rank_lock);
+	if(r->count == n && r->gen == gen && r->keygen == kgen && lb_rank_match(&r->q, q))
+	{
+		hit = 1;
+		for(ea = er->matching_rdr, i = 0; ea; ea = ea->next, i++)
+		{
+			if(r->rdr[i] != ea->reader)
+			{
+				hit = 0;
+				break;
+			}
+			ea->stat = r->stat[i];
+		}
+	}
+	cs_readunlock(__func__, &lb_rank_lock);
+
+	if(hit)
+		{ return; }
+
+	for(ea = er->matching_rdr; ea; ea = ea->next)
+		{ ea->stat = get_stat(ea->reader, q); }
+
+	cs_writelock(__func__, &lb_rank_lock);
+	if(r->size < n)
+	{
+		NULLFREE(r->rdr);
+		NULLFREE(r->stat);
+		r->size = 0;
+		r->count = 0;
+		if(cs_malloc(&r->rdr, n * sizeof(struct s_reader *)) && cs_malloc(&r->stat, n * sizeof(READER_STAT *)))
+			{ r->size = n; }
+	}
+	if(r->size >= n)
+	{
+		for(ea = er->matching_rdr, i = 0; ea; ea = ea->next, i++)
+		{
+			r->rdr[i] = ea->reader;
+			r->stat[i] = ea->stat;
+		}
+		r->q = *q;
+		r->gen = gen;
+		r->keygen = kgen;
+		r->count = n;
+	}
+	cs_writeunlock(__func__, &lb_rank_lock);
+}
+
 /* force_reopen=1 -> force opening of block readers
  * force_reopen=0 -> no force opening of block readers, use reopen_seconds
  */
-static void try_open_blocked_readers(ECM_REQUEST *er, STAT_QUERY *q, int32_t *max_reopen, int32_t *force_reopen)
+static void try_open_blocked_readers(ECM_REQUEST *er, int32_t *max_reopen, int32_t *force_reopen)
 {
 	struct s_ecm_answer *ea;
 	READER_STAT *s;
 	struct s_reader *rdr;
+	struct timeb now;
+	cs_ftime(&now);
 
 	for(ea = er->matching_rdr; ea; ea = ea->next)
 	{
 		if((ea->status & READER_FALLBACK) || (ea->status & READER_ACTIVE)) { continue; }
 		rdr = ea->reader;
-		s = get_stat(rdr, q);
+		s = ea->stat;
 		if(!s) { continue; }
 
 		if(!cfg.lb_reopen_invalid && s->rc == E_INVALID){
@@ -963,12 +1797,11 @@ static void try_open_blocked_readers(ECM_REQUEST *er, STAT_QUERY *q, int32_t *ma
 			cs_log_dbg(D_LB, "loadbalancer: force opening reader %s and reset fail_factor! --> ACTIVE", rdr->label);
 			ea->status |= READER_ACTIVE;
 			s->fail_factor = 0;
+			s->dirty = 1;
 			continue;
 		}
 
 		//active readers reach get_reopen_seconds(s)
-		struct timeb now;
-		cs_ftime(&now);
 		int64_t gone = comp_timeb(&now, &s->last_received);
 		int32_t reopenseconds = get_reopen_seconds(s);
 		if(s->rc != E_FOUND && gone > reopenseconds*1000 )
@@ -1006,7 +1839,7 @@ static void try_open_blocked_readers(ECM_REQUEST *er, STAT_QUERY *q, int32_t *ma
  */
 void stat_get_best_reader(ECM_REQUEST *er)
 {
-	if(!cfg.lb_mode || cfg.lb_mode > 3)
+	if(!cfg.lb_mode || cfg.lb_mode > 4)
 		{ return; }
 
 	if(!er->reader_avail)
@@ -1316,6 +2149,8 @@ void stat_get_best_reader(ECM_REQUEST *er)
 			{ return; }
 	}
 
+	resolve_reader_stats(er, &q);
+
 	struct timeb check_time;
 	cs_ftime(&check_time);
 	int64_t current = -1;
@@ -1387,7 +2222,7 @@ void stat_get_best_reader(ECM_REQUEST *er)
 	for(ea = er->matching_rdr; ea; ea = ea->next)
 	{
 		rdr = ea->reader;
-		s = get_stat(rdr, &q);
+		s = ea->stat;
 
 		int32_t weight = rdr->lb_weight <= 0 ? 100 : rdr->lb_weight;
 		//struct s_client *cl = rdr->client;
@@ -1441,6 +2276,10 @@ void stat_get_best_reader(ECM_REQUEST *er)
 							{ current = current - 1; } //so when all reaches retrylimit (all have lb_value=1000) or all have same current, it prioritizes the one with s->time_avg<=retrylimit! This avoid a loop!
 					}
 					break;
+
+				case LB_LATENCY_PERCENTILE:
+					current = (int64_t)get_percentile_time(s) * 100 / weight;
+					break;
 			}
 
 			if(cfg.lb_mode != LB_OLDEST_READER_FIRST) // Adjust selection to reader load:
@@ -1481,6 +2320,7 @@ void stat_get_best_reader(ECM_REQUEST *er)
 	struct s_reader *best_rdr = NULL;
 	struct s_reader *best_rdri = NULL;
 	int32_t best_time = 0;
+	int32_t hedge_time = 0, t;
 
 	// Here choose nbest readers. We evaluate only readers with valid stats (they have ea->value>0, calculated above)
 	while(1)
@@ -1524,6 +2364,23 @@ void stat_get_best_reader(ECM_REQUEST *er)
 		}
 		else
 			{ break; }
+
+		// hedge when the slowest primary reader is late, not without its ecm times
+		if(cfg.lb_hedge && hedge_time >= 0)
+		{
+			t = time_hist_percentile(best->stat, LB_HEDGE_PERCENTILE);
+			hedge_time = t ? MAX(hedge_time, t) : -1;
+		}
+	}
+
+	if(cfg.lb_hedge)
+	{
+		lb_hedge_count_ecm();
+		if(hedge_time > 0)
+		{
+			er->lb_hedge_time = hedge_time;
+			cs_log_dbg(D_LB, "loadbalancer: hedge to the fallback readers after %d ms", hedge_time);
+		}
 	}
 
 	/* Here choose nfb_readers
@@ -1553,7 +2410,7 @@ void stat_get_best_reader(ECM_REQUEST *er)
 			rdr = ea->reader;
 			if(chk_is_fixed_fallback(rdr, er) && !rdr->lb_force_fallback && !(ea->status & READER_ACTIVE)){
 
-				s = get_stat(rdr, &q);
+				s = ea->stat;
 				if(s && s->rc == E_FOUND
 					&& s->ecm_count >= cfg.lb_min_ecmcount
 					&& (s->ecm_count <= cfg.lb_max_ecmcount || (retrylimit && s->time_avg <= retrylimit)))
@@ -1593,7 +2450,7 @@ void stat_get_best_reader(ECM_REQUEST *er)
 	for(ea = er->matching_rdr; ea; ea = ea->next)
 	{
 		rdr = ea->reader;
-		s = get_stat(rdr, &q);
+		s = ea->stat;
 
 #ifdef CS_CACHEEX
 		// if cacheex reader, always active and no stats
@@ -1636,9 +2493,7 @@ void stat_get_best_reader(ECM_REQUEST *er)
 			continue;
 		}
 
-		struct timeb now;
-		cs_ftime(&now);
-		int64_t gone = comp_timeb(&now, &s->last_received);
+		int64_t gone = comp_timeb(&check_time, &s->last_received);
 		// reset avg-time and active reader with s->last_received older than 5 min and avg-time>retrylimit
 		if(retrylimit && s->rc == E_FOUND && (gone >= 300*1000) && s->time_avg > retrylimit)
 		{
@@ -1677,7 +2532,7 @@ void stat_get_best_reader(ECM_REQUEST *er)
 #ifdef CS_CACHEEX
 				if(rdr->cacheex.mode == 1) { continue; }
 #endif
-				s = get_stat(rdr, &q);
+				s = ea->stat;
 
 				//reset avg time and ACTIVE all valid lbvalue readers
 				if(s && s->rc == E_FOUND
@@ -1703,7 +2558,7 @@ void stat_get_best_reader(ECM_REQUEST *er)
 	}
 
 	//try to reopen max_reopen blocked readers (readers with last ecm not "e_found"); if force_reopen=1, force reopen valid blocked readers!
-	try_open_blocked_readers(er, &q, &max_reopen, &force_reopen);
+	try_open_blocked_readers(er, &max_reopen, &force_reopen);
 
 	cs_log_dbg(D_LB, "loadbalancer: --------------------------------------------");
 
@@ -1758,7 +2613,11 @@ void clear_reader_stat(struct s_reader *rdr)
 	if(!rdr->lb_stat)
 		{ return; }
 
+	cs_writelock(__func__, &rdr->lb_stat_lock);
 	ll_clear_data(rdr->lb_stat);
+	lb_stat_index_clear(rdr);
+	cs_writeunlock(__func__, &rdr->lb_stat_lock);
+	stat_file_deleted();
 }
 
 void clear_all_stat(void)
@@ -1773,9 +2632,9 @@ void clear_all_stat(void)
 
 static void housekeeping_stat_thread(void)
 {
-	struct timeb now;
-	cs_ftime(&now);
-	int32_t cleanup_timeout = cfg.lb_stat_cleanup * 60 * 60 * 1000;
+	struct stat_cleanup c;
+	cs_ftime(&c.now);
+	c.timeout = (int64_t)cfg.lb_stat_cleanup * 60 * 60 * 1000;
 	int32_t cleaned = 0;
 	struct s_reader *rdr;
 	set_thread_name(__func__);
@@ -1784,24 +2643,7 @@ static void housekeeping_stat_thread(void)
 	while((rdr = ll_iter_next(&itr)))
 	{
 		if(rdr->lb_stat)
-		{
-			rdr->lb_stat_busy = 1;
-			cs_writelock(__func__, &rdr->lb_stat_lock);
-			LL_ITER it = ll_iter_create(rdr->lb_stat);
-			READER_STAT *s;
-
-			while((s = ll_iter_next(&it)))
-			{
-				int64_t gone = comp_timeb(&now, &s->last_received);
-				if(gone > cleanup_timeout)
-				{
-					ll_iter_remove_data(&it);
-					cleaned++;
-				}
-			}
-			cs_writeunlock(__func__, &rdr->lb_stat_lock);
-			rdr->lb_stat_busy = 0;
-		}
+			{ cleaned += lb_stat_walk(rdr, 1, stat_expired, &c); }
 	}
 	cs_readunlock(__func__, &readerlist_lock);
 	cs_log_dbg(D_LB, "loadbalancer cleanup: removed %d entries", cleaned);
@@ -1877,23 +2719,19 @@ static int8_t add_to_ecmlen(struct s_reader *rdr, READER_STAT *s)
 	return 0;
 }
 
+static int8_t stat_add_ecmlen(struct s_reader *rdr, READER_STAT *s, void *UNUSED(arg))
+{
+	if(s->rc == E_FOUND && !stat_in_ecmlen(rdr, s))
+		{ add_to_ecmlen(rdr, s); }
+	return 0;
+}
+
 void update_ecmlen_from_stat(struct s_reader *rdr)
 {
 	if(!rdr || !rdr->lb_stat)
 		{ return; }
 
-	cs_readlock(__func__, &rdr->lb_stat_lock);
-	LL_ITER it = ll_iter_create(rdr->lb_stat);
-	READER_STAT *s;
-	while((s = ll_iter_next(&it)))
-	{
-		if(s->rc == E_FOUND)
-		{
-			if(!stat_in_ecmlen(rdr, s))
-				{ add_to_ecmlen(rdr, s); }
-		}
-	}
-	cs_readunlock(__func__, &rdr->lb_stat_lock);
+	lb_stat_walk(rdr, 0, stat_add_ecmlen, NULL);
 }
 
 /**
@@ -1993,7 +2831,7 @@ static struct ecm_request_t *check_same_ecm(ECM_REQUEST *er)
 	uint8_t rdrs = 0;
 
 	cs_readlock(__func__, &ecmcache_lock);
-	for(ecm = ecmcwcache; ecm; ecm = ecm->next)
+	for(ecm = ecmcwcache_first_same(er); ecm; ecm = ecmcwcache_next_same(ecm, er))
 	{
 		timeout = time(NULL) - ((cfg.ctimeout + 500) / 1000);
 
@@ -2002,9 +2840,6 @@ static struct ecm_request_t *check_same_ecm(ECM_REQUEST *er)
 
 		if(ecm == er) { continue; }
 
-		if(er->caid != ecm->caid || memcmp(ecm->ecmd5, er->ecmd5, CS_ECMSTORESIZE))
-			{ continue; }
-
 		if(!er->readers || !ecm->readers || er->readers != ecm->readers)
 			{ continue; }
 
@@ -26,6 +26,8 @@
 #include "oscam-client.h"
 #include "oscam-lock.h"
 #include "oscam-net.h"
+#include "oscam-latency.h"
+#include "oscam-pool.h"
 #include "oscam-reader.h"
 #include "oscam-string.h"
 #include "oscam-time.h"
@@ -200,6 +202,24 @@ static void set_status_info(struct templatevars *vars, struct pstat stats){
 	}
 }
 
+/*
+* Creates var POOL_INFO (object pool usage) for status_page
+*/
+static void set_pool_info(struct templatevars *vars)
+{
+	POOL *pool;
+	POOL_STATS stats;
+
+	tpl_addVar(vars, TPLADD, "POOL_INFO", "");
+	for(pool = pool_get_first(); pool; pool = pool->next)
+	{
+		pool_get_stats(pool, &stats);
+		tpl_printf(vars, TPLAPPEND, "POOL_INFO", "%s<B>%s:</B>&nbsp;%"PRId64" in use, %u free, %.1f%% reused",
+					pool == pool_get_first() ? "" : " &nbsp; ", pool->name, stats.in_use, stats.free_count,
+					stats.allocs ? (double)stats.reused * 100.0 / (double)stats.allocs : 0.0);
+	}
+}
+
 static void clear_account_stats(struct s_auth *account)
 {
 	account->cwfound = 0;
@@ -805,6 +825,7 @@ static char *send_oscam_config_loadbalancer(struct templatevars *vars, struct ur
 
 	tpl_printf(vars, TPLADD, "LBSAVE", "%d", cfg.lb_save);
 	if(cfg.lb_savepath) { tpl_addVar(vars, TPLADD, "LBSAVEPATH", cfg.lb_savepath); }
+	if(cfg.lb_save_binary) { tpl_addVar(vars, TPLADD, "LBSAVEBINARY", "checked"); }
 
 	tpl_printf(vars, TPLADD, "LBNBESTREADERS", "%d", cfg.lb_nbest_readers);
 	char *value = mk_t_caidvaluetab(&cfg.lb_nbest_readers_tab);
@@ -815,6 +836,8 @@ static char *send_oscam_config_loadbalancer(struct templatevars *vars, struct ur
 	tpl_printf(vars, TPLADD, "LBMINECMCOUNT", "%d", cfg.lb_min_ecmcount);
 	tpl_printf(vars, TPLADD, "LBMAXECEMCOUNT", "%d", cfg.lb_max_ecmcount);
 	tpl_printf(vars, TPLADD, "LBRETRYLIMIT", "%d", cfg.lb_retrylimit);
+	tpl_printf(vars, TPLADD, "LBPERCENTILE", "%d", cfg.lb_percentile);
+	tpl_printf(vars, TPLADD, "LBHEDGE", "%d", cfg.lb_hedge);
 
 	value = mk_t_caidvaluetab(&cfg.lb_retrylimittab);
 	tpl_addVar(vars, TPLADD, "LBRETRYLIMITS", value);
@@ -6285,6 +6308,10 @@ static char *send_oscam_status(struct templatevars * vars, struct uriparams * pa
 						tpl_printf(vars, TPLADD, "CLIENTIDLESECS", "%d", isec);
 					}
 
+					tpl_printf(vars, TPLADD, "CLIENTJOBS", "%u", job_queue_length(cl));
+					tpl_printf(vars, TPLADD, "CLIENTJOBSMAX", "%u", cl->job_highwater);
+					tpl_printf(vars, TPLADD, "CLIENTJOBSDROPPED", "%u", cl->job_drops);
+
 					if(con == 2) { tpl_addVar(vars, TPLADD, "CLIENTCON", "Duplicate"); }
 					else if(con == 1) { tpl_addVar(vars, TPLADD, "CLIENTCON", "Sleep"); }
 					else
@@ -6664,6 +6691,9 @@ static char *send_oscam_status(struct templatevars * vars, struct uriparams * pa
 #ifdef CS_CACHEEX_AIO
 	tpl_printf(vars, TPLADD, "TOTAL_CACHESIZE_LG", "%d", cache_size_lg());
 #endif
+	uint32_t cachemem_cw;
+	tpl_printf(vars, TPLADD, "TOTAL_CACHEMEM", "%" PRIu64, cache_memory(&cachemem_cw) / 1024);
+	tpl_printf(vars, TPLADD, "CACHEMEM_CW", "%u", cachemem_cw);
 	tpl_printf(vars, TPLADD, "REL_CACHEXHIT", "%.2f", (first_client ? first_client->cwcacheexhit : 0) * 100 / cachesum);
 	tpl_addVar(vars, TPLADD, "CACHEEXSTATS", tpl_getTpl(vars, "STATUSCACHEX"));
 #endif
@@ -6765,6 +6795,7 @@ static char *send_oscam_status(struct templatevars * vars, struct uriparams * pa
 	p_stat_cur.check_available = 65535;
 #endif
 	set_status_info(vars, p_stat_cur);
+	set_pool_info(vars);
 
 	if(cfg.http_showmeminfo || cfg.http_showuserinfo || cfg.http_showreaderinfo || cfg.http_showloadinfo || cfg.http_showecminfo || (cfg.http_showcacheexinfo  && config_enabled(CS_CACHEEX)) || (cfg.http_showcacheexinfo  && config_enabled(CS_CACHEEX_AIO))){
 		tpl_addVar(vars, TPLADD, "DISPLAYINFO", "visible");
@@ -7726,6 +7757,154 @@ static char *send_oscam_failban(struct templatevars * vars, struct uriparams * p
 		{ return tpl_getTpl(vars, "APIFAILBAN"); }
 }
 
+static char *send_oscam_latency(struct templatevars * vars, struct uriparams * params, int8_t apicall)
+{
+	static const char *stage_desc[LAT_STAGES] = { "ecm received to get_cw", "cache lookup", "request to readers",
+												"request sent to reader answer", "reader answer to chk_dcw", "send_dcw to client",
+												"ecm received to answer sent" };
+	LAT_SERIES *series;
+	LAT_HIST *hist;
+	int8_t stage, type, stages_delimiter, series_delimiter = 0;
+
+	if(!apicall) { setActiveMenu(vars, MNU_STATUS); }
+
+	if(strcmp(getParam(params, "action"), "reset") == 0)
+		{ lat_reset(); }
+
+	if(!apicall)
+	{
+		int8_t show = LAT_TOTAL;
+		for(stage = 0; stage < LAT_STAGES; stage++)
+		{
+			if(!strcmp(getParam(params, "stage"), lat_stage_name(stage)))
+				{ show = stage; }
+			tpl_addVar(vars, TPLADD, "LATSTAGE", lat_stage_name(stage));
+			tpl_addVar(vars, TPLAPPEND, "LATENCYSTAGES", tpl_getTpl(vars, "LATENCYSTAGEBIT"));
+		}
+
+		// rows grouped by type: protocols, readers, caids
+		for(type = 0; type < LAT_TYPES; type++)
+		{
+			for(series = lat_get_first(); series; series = series->next)
+			{
+				hist = &series->hist[show];
+				if(series->type != type || !hist->count)
+					{ continue; }
+				tpl_addVar(vars, TPLADD, "LATTYPE", lat_type_name(series->type));
+				tpl_addVar(vars, TPLADD, "LATNAME", xml_encode(vars, series->name));
+				tpl_printf(vars, TPLADD, "LATCOUNT", "%u", hist->count);
+				tpl_printf(vars, TPLADD, "LATP50", "%.3f", lat_percentile(hist, 500) / 1000.0);
+				tpl_printf(vars, TPLADD, "LATP95", "%.3f", lat_percentile(hist, 950) / 1000.0);
+				tpl_printf(vars, TPLADD, "LATP99", "%.3f", lat_percentile(hist, 990) / 1000.0);
+				tpl_printf(vars, TPLADD, "LATMAX", "%.3f", hist->max / 1000.0);
+				tpl_addVar(vars, TPLAPPEND, "LATENCYROWS", tpl_getTpl(vars, "LATENCYROWBIT"));
+			}
+		}
+		tpl_addVar(vars, TPLADD, "LATSTAGE", lat_stage_name(show));
+		tpl_addVar(vars, TPLADD, "LATSTAGEDESC", stage_desc[show]);
+		return tpl_getTpl(vars, "LATENCY");
+	}
+
+	for(series = lat_get_first(); series; series = series->next)
+	{
+		tpl_addVar(vars, TPLADD, apicall == 1 ? "APILATENCYSTAGES" : "JSONLATENCYSTAGES", "");
+		for(stage = 0, stages_delimiter = 0; stage < LAT_STAGES; stage++)
+		{
+			hist = &series->hist[stage];
+			tpl_addVar(vars, TPLADD, "LATSTAGE", lat_stage_name(stage));
+			tpl_printf(vars, TPLADD, "LATCOUNT", "%u", hist->count);
+			tpl_printf(vars, TPLADD, "LATP50", "%u", lat_percentile(hist, 500));
+			tpl_printf(vars, TPLADD, "LATP95", "%u", lat_percentile(hist, 950));
+			tpl_printf(vars, TPLADD, "LATP99", "%u", lat_percentile(hist, 990));
+			tpl_printf(vars, TPLADD, "LATMAX", "%u", hist->max);
+			if(apicall == 1)
+				{ tpl_addVar(vars, TPLAPPEND, "APILATENCYSTAGES", tpl_getTpl(vars, "APILATENCYSTAGEBIT")); }
+			else
+			{
+				tpl_addVar(vars, TPLADD, "JSONSTAGEDELIMITER", stages_delimiter++ ? "," : "");
+				tpl_addVar(vars, TPLAPPEND, "JSONLATENCYSTAGES", tpl_getTpl(vars, "JSONLATENCYSTAGEBIT"));
+			}
+		}
+		tpl_addVar(vars, TPLADD, "LATTYPE", lat_type_name(series->type));
+		tpl_addVar(vars, TPLADD, "LATNAME", xml_encode(vars, series->name));
+		if(apicall == 1)
+			{ tpl_addVar(vars, TPLAPPEND, "APILATENCYSERIES", tpl_getTpl(vars, "APILATENCYSERIESBIT")); }
+		else
+		{
+			tpl_addVar(vars, TPLADD, "JSONDELIMITER", series_delimiter++ ? "," : "");
+			tpl_addVar(vars, TPLAPPEND, "JSONLATENCYSERIES", tpl_getTpl(vars, "JSONLATENCYSERIESBIT"));
+		}
+	}
+	return tpl_getTpl(vars, apicall == 1 ? "APILATENCY" : "JSONLATENCY");
+}
+
+static char *send_oscam_locks(struct templatevars * vars, struct uriparams * params, int8_t apicall)
+{
+	LOCK_PROF_STAT *stats, *st;
+	int32_t i, count, top;
+	const char *action = getParam(params, "action");
+
+	if(!apicall) { setActiveMenu(vars, MNU_STATUS); }
+
+	// enable/disable only switch the running profiler, lock_profile in the config stays as it is
+	if(strcmp(action, "enable") == 0)
+		{ cfg.lock_profile = 1; }
+	else if(strcmp(action, "disable") == 0)
+		{ cfg.lock_profile = 0; }
+	else if(strcmp(action, "reset") == 0)
+		{ lock_prof_reset(); }
+
+	top = atoi(getParam(params, "top"));
+	stats = lock_prof_get(&count);
+	if(top > 0 && top < count)
+		{ count = top; }
+
+	for(i = 0; i < count; i++)
+	{
+		st = &stats[i];
+		tpl_addVar(vars, TPLADD, "LOCKNAME", xml_encode(vars, st->name));
+		tpl_printf(vars, TPLADD, "LOCKCOUNT", "%" PRIu64, st->locks);
+		tpl_printf(vars, TPLADD, "LOCKWRITES", "%" PRIu64, st->writelocks);
+		tpl_printf(vars, TPLADD, "LOCKWAITS", "%u", st->waits);
+		tpl_printf(vars, TPLADD, "LOCKTIMEOUTS", "%u", st->timeouts);
+		if(!apicall)
+		{
+			tpl_printf(vars, TPLADD, "LOCKWAITTOTAL", "%.3f", st->wait_us / 1000.0);
+			tpl_printf(vars, TPLADD, "LOCKWAITP50", "%.3f", st->wait_p50 / 1000.0);
+			tpl_printf(vars, TPLADD, "LOCKWAITP99", "%.3f", st->wait_p99 / 1000.0);
+			tpl_printf(vars, TPLADD, "LOCKWAITMAX", "%.3f", st->wait_max / 1000.0);
+			tpl_printf(vars, TPLADD, "LOCKHOLDAVG", "%.1f", st->writelocks ? (double)st->hold_us / st->writelocks : 0);
+			tpl_printf(vars, TPLADD, "LOCKHOLDMAX", "%.3f", st->hold_max / 1000.0);
+			tpl_addVar(vars, TPLAPPEND, "LOCKROWS", tpl_getTpl(vars, "LOCKSROWBIT"));
+			continue;
+		}
+		tpl_printf(vars, TPLADD, "LOCKWAITTOTAL", "%" PRIu64, st->wait_us);
+		tpl_printf(vars, TPLADD, "LOCKWAITP50", "%u", st->wait_p50);
+		tpl_printf(vars, TPLADD, "LOCKWAITP99", "%u", st->wait_p99);
+		tpl_printf(vars, TPLADD, "LOCKWAITMAX", "%u", st->wait_max);
+		tpl_printf(vars, TPLADD, "LOCKHOLDAVG", "%" PRIu64, st->writelocks ? st->hold_us / st->writelocks : 0);
+		tpl_printf(vars, TPLADD, "LOCKHOLDMAX", "%u", st->hold_max);
+		if(apicall == 1)
+			{ tpl_addVar(vars, TPLAPPEND, "APILOCKS", tpl_getTpl(vars, "APILOCKSBIT")); }
+		else
+		{
+			tpl_addVar(vars, TPLADD, "JSONDELIMITER", i ? "," : "");
+			tpl_addVar(vars, TPLAPPEND, "JSONLOCKS", tpl_getTpl(vars, "JSONLOCKSBIT"));
+		}
+	}
+	NULLFREE(stats);
+
+	tpl_printf(vars, TPLADD, "LOCKPROFILE", "%d", cfg.lock_profile);
+	if(!apicall)
+	{
+		tpl_addVar(vars, TPLADD, "LOCKPROFILESTATE", cfg.lock_profile ? "enabled" : "disabled");
+		tpl_addVar(vars, TPLADD, "LOCKTOGGLE", cfg.lock_profile ? "disable" : "enable");
+		tpl_addVar(vars, TPLADD, "LOCKTOGGLETEXT", cfg.lock_profile ? "Disable" : "Enable");
+		return tpl_getTpl(vars, "LOCKS");
+	}
+	return tpl_getTpl(vars, apicall == 1 ? "APILOCKS" : "JSONLOCKS");
+}
+
 static bool send_EMM(struct s_reader * rdr, uint16_t caid, const struct s_cardsystem *csystem, const uint8_t *emmhex, uint32_t len)
 {
 	if(NULL != rdr && NULL != emmhex && 0 != len)
@@ -7841,7 +8020,7 @@ static bool process_emm_file(struct templatevars * vars, struct s_reader * rdr,
 					if(send_EMM(rdr, caid, csystem, emmhex, len))
 					{
 						++wemms;
-						int32_t jcount = ll_count(rdr->client->joblist);
+						int32_t jcount = job_queue_length(rdr->client);
 						if (jcount > 200)
 						{
 							/* Give more time to process EMMs */
@@ -8392,6 +8571,9 @@ static char *send_oscam_cacheex(struct templatevars * vars, struct uriparams * p
 #ifdef CS_CACHEEX_AIO
 	tpl_printf(vars, TPLADD, "TOTAL_CACHESIZE_LG", "%d", cache_size_lg());
 #endif
+	uint32_t cachemem_cw;
+	tpl_printf(vars, TPLADD, "TOTAL_CACHEMEM", "%" PRIu64, cache_memory(&cachemem_cw) / 1024);
+	tpl_printf(vars, TPLADD, "CACHEMEM_CW", "%u", cachemem_cw);
 
 	tpl_printf(vars, TPLADD, "REL_CACHEXHIT", "%.2f", (first_client ? first_client->cwcacheexhit : 0) * 100 / cachesum);
 
@@ -8424,6 +8606,14 @@ static char *send_oscam_api(struct templatevars * vars, FILE * f, struct uripara
 	{
 		return send_oscam_failban(vars, params, apicall);
 	}
+	else if(strcmp(getParam(params, "part"), "latency") == 0)
+	{
+		return send_oscam_latency(vars, params, apicall);
+	}
+	else if(strcmp(getParam(params, "part"), "locks") == 0)
+	{
+		return send_oscam_locks(vars, params, apicall);
+	}
 #ifdef CS_CACHEEX
 	else if(strcmp(getParam(params, "part"), "cacheex") == 0)
 	{
@@ -9119,6 +9309,8 @@ static int32_t process_request(FILE * f, IN_ADDR_T in)
 			"/ghttp.html",
 			"/logpoll.html",
 			"/jquery.js",
+			"/latency.html",
+			"/locks.html",
 		};
 
 		int32_t pagescnt = sizeof(pages) / sizeof(char *); // Calculate the amount of items in array
@@ -9543,6 +9735,12 @@ static int32_t process_request(FILE * f, IN_ADDR_T in)
 				break;
 			//case 30: jquery.js
 #endif
+			case 31:
+				result = send_oscam_latency(vars, &params, 0);
+				break;
+			case 32:
+				result = send_oscam_locks(vars, &params, 0);
+				break;
 			default:
 				result = send_oscam_status(vars, &params, 0);
 				break;
@@ -1,6 +1,7 @@
 #define MODULE_LOG_PREFIX "array"
 
 #include "globals.h"
+#include "oscam-garbage.h"
 #include "oscam-string.h"
 
 void array_clear(void **arr_data, int32_t *arr_num_entries)
@@ -34,14 +35,228 @@ bool array_add(void **arr_data, int32_t *arr_num_entries, uint32_t entry_size, v
 	return true;
 }
 
-/* Array functions for different types */
-#define DECLARE_ARRAY_FUNCS(NAME, BASE_TYPE, DATA_TYPE, DATA_FIELD, NUM_FIELD) \
+/* Sorted arrays of plain integers, used for the service (sidtab) lookups */
+#define DECLARE_SORTED_FUNCS(NAME, TYPE) \
+	static int NAME##_cmp(const void *a, const void *b) \
+	{ \
+		TYPE x = *(const TYPE *)a, y = *(const TYPE *)b; \
+		return (x > y) - (x < y); \
+	} \
+	\
+	void array_sort_##NAME(TYPE *arr, int32_t num) \
+	{ \
+		if (arr && num > 1) \
+			qsort(arr, num, sizeof(TYPE), NAME##_cmp); \
+	} \
+	\
+	bool array_find_##NAME(const TYPE *arr, int32_t num, TYPE value) \
+	{ \
+		const TYPE *base = arr; \
+		if (num <= 0) return false; \
+		while (num > 1) /* branch free, the compiler turns this into a cmov */ \
+		{ \
+			int32_t half = num / 2; \
+			base = (base[half] <= value) ? base + half : base; \
+			num -= half; \
+		} \
+		return *base == value; \
+	}
+
+DECLARE_SORTED_FUNCS(u16, uint16_t); // Declare array_sort_u16(), array_find_u16()
+DECLARE_SORTED_FUNCS(u32, uint32_t); // Declare array_sort_u32(), array_find_u32()
+
+#undef DECLARE_SORTED_FUNCS
+
+/* Compiled ftab: an open addressing hash set holding every caid:ident
+   pair, every filter caid and every ident, so the ident and chid filters
+   need a probe or two instead of a scan over all filters. Slots store
+   key + 1, 0 is an empty slot */
+struct s_ftab_idx
+{
+	uint32_t		mask;
+	uint64_t		slot[];
+};
+
+#define FTAB_KEY_IDENT(caid, ident)	(((uint64_t)(caid) << 32) | (uint32_t)(ident))
+#define FTAB_KEY_CAID(caid)			((1ULL << 48) | (caid))
+#define FTAB_KEY_ANY(ident)			((2ULL << 48) | (uint32_t)(ident))
+
+static inline uint32_t ftab_hash(struct s_ftab_idx *idx, uint64_t key)
+{
+	return (uint32_t)((key * 0x9E3779B97F4A7C15ULL) >> 32) & idx->mask;
+}
+
+static void ftab_idx_put(struct s_ftab_idx *idx, uint64_t key)
+{
+	uint32_t i = ftab_hash(idx, key);
+	while (idx->slot[i] && idx->slot[i] != key + 1)
+		i = (i + 1) & idx->mask;
+	idx->slot[i] = key + 1;
+}
+
+static bool ftab_idx_has(struct s_ftab_idx *idx, uint64_t key)
+{
+	uint32_t i = ftab_hash(idx, key);
+	while (idx->slot[i])
+	{
+		if (idx->slot[i] == key + 1)
+			return true;
+		i = (i + 1) & idx->mask;
+	}
+	return false;
+}
+
+void ftab_index(FTAB *ftab)
+{
+	struct s_ftab_idx *idx = NULL, *old = ftab->idx;
+	uint32_t size = 4;
+	int32_t i, j, nkeys = 0;
+
+	for (i = 0; i < ftab->nfilts; i++)
+		nkeys += 1 + 2 * ftab->filts[i].nprids;
+	while (size < 2 * (uint32_t)nkeys) // keep the load below one half
+		size <<= 1;
+
+	if (ftab->nfilts && cs_malloc(&idx, sizeof(*idx) + size * sizeof(idx->slot[0])))
+	{
+		idx->mask = size - 1;
+		for (i = 0; i < ftab->nfilts; i++)
+		{
+			FILTER *f = &ftab->filts[i];
+			ftab_idx_put(idx, FTAB_KEY_CAID(f->caid));
+			for (j = 0; j < f->nprids; j++)
+			{
+				ftab_idx_put(idx, FTAB_KEY_IDENT(f->caid, f->prids[j]));
+				ftab_idx_put(idx, FTAB_KEY_ANY(f->prids[j]));
+			}
+		}
+	}
+
+	ftab->idx = idx;
+	add_garbage(old); // lookups may still run on it
+}
+
+bool ftab_has_caid(FTAB *ftab, uint16_t caid)
+{
+	int32_t i;
+
+	if (ftab->idx)
+		return ftab_idx_has(ftab->idx, FTAB_KEY_CAID(caid));
+
+	for (i = 0; i < ftab->nfilts; i++)
+		if (ftab->filts[i].caid == caid)
+			return true;
+	return false;
+}
+
+bool ftab_has_ident(FTAB *ftab, uint16_t caid, uint32_t ident)
+{
+	int32_t i, j;
+
+	if (ftab->idx)
+		return ftab_idx_has(ftab->idx, FTAB_KEY_IDENT(caid, ident));
+
+	for (i = 0; i < ftab->nfilts; i++)
+		if (ftab->filts[i].caid == caid)
+			for (j = 0; j < ftab->filts[i].nprids; j++)
+				if (ftab->filts[i].prids[j] == ident)
+					return true;
+	return false;
+}
+
+bool ftab_has_any_ident(FTAB *ftab, uint32_t ident)
+{
+	int32_t i, j;
+
+	if (ftab->idx)
+		return ftab_idx_has(ftab->idx, FTAB_KEY_ANY(ident));
+
+	for (i = 0; i < ftab->nfilts; i++)
+		for (j = 0; j < ftab->filts[i].nprids; j++)
+			if (ftab->filts[i].prids[j] == ident)
+				return true;
+	return false;
+}
+
+#undef FTAB_KEY_IDENT
+#undef FTAB_KEY_CAID
+#undef FTAB_KEY_ANY
+
+/* Compiled caidtab: a 256 bit page of low bytes for every caid high byte
+   that any caid&mask entry can match. Entries after the first zero caid
+   are never reached by chk_ctab(), so they are left out here as well */
+struct s_caidtab_idx
+{
+	uint16_t		page[256];						// 1-based page per caid high byte, 0 = no match
+	uint32_t		bits[][8];
+};
+
+static bool caidtab_entry_matches_hi(CAIDTAB_DATA *d, int32_t hi)
+{
+	return (d->caid & d->mask) == d->caid && (hi & (d->mask >> 8)) == (d->caid >> 8);
+}
+
+void caidtab_index(CAIDTAB *ctab)
+{
+	struct s_caidtab_idx *idx = NULL, *old = ctab->idx;
+	uint16_t page[256];
+	int32_t i, hi, lo, num, npages = 0;
+
+	memset(page, 0, sizeof(page));
+	for (num = 0; num < ctab->ctnum && ctab->ctdata[num].caid; num++)
+	{
+		for (hi = 0; hi < 256; hi++)
+			if (!page[hi] && caidtab_entry_matches_hi(&ctab->ctdata[num], hi))
+				page[hi] = ++npages;
+	}
+
+	if (ctab->ctnum && cs_malloc(&idx, sizeof(*idx) + npages * sizeof(idx->bits[0])))
+	{
+		memcpy(idx->page, page, sizeof(page));
+		for (i = 0; i < num; i++)
+		{
+			CAIDTAB_DATA *d = &ctab->ctdata[i];
+			for (hi = 0; hi < 256; hi++)
+			{
+				if (!caidtab_entry_matches_hi(d, hi))
+					continue;
+				uint32_t *bits = idx->bits[page[hi] - 1];
+				for (lo = 0; lo < 256; lo++)
+					if ((lo & d->mask & 0xFF) == (d->caid & 0xFF))
+						bits[lo >> 5] |= 1U << (lo & 31);
+			}
+		}
+	}
+
+	ctab->idx = idx;
+	add_garbage(old);
+}
+
+bool caidtab_has_caid(CAIDTAB *ctab, uint16_t caid)
+{
+	int32_t i;
+
+	if (ctab->idx)
+	{
+		uint16_t p = ctab->idx->page[caid >> 8];
+		return p && (ctab->idx->bits[p - 1][(caid & 0xFF) >> 5] & (1U << (caid & 31)));
+	}
+
+	for (i = 0; i < ctab->ctnum && ctab->ctdata[i].caid; i++)
+		if ((caid & ctab->ctdata[i].mask) == ctab->ctdata[i].caid)
+			return true;
+	return false;
+}
+
+/* Array functions for different types, INDEX_FN is called after every change */
+#define DECLARE_INDEXED_ARRAY_FUNCS(NAME, BASE_TYPE, DATA_TYPE, DATA_FIELD, NUM_FIELD, INDEX_FN) \
 	void NAME##_clear(BASE_TYPE *in) \
 	{ \
 		if (!in) return; \
 		void *pin = in->DATA_FIELD; /* Prevent warnings about strict-aliasing rules */ \
 		array_clear(&pin, &in->NUM_FIELD); \
 		in->DATA_FIELD = pin; \
+		INDEX_FN(in); \
 	} \
 	\
 	bool NAME##_clone(BASE_TYPE *src, BASE_TYPE *dst) \
@@ -50,6 +265,7 @@ bool array_add(void **arr_data, int32_t *arr_num_entries, uint32_t entry_size, v
 		void *psrc = src->DATA_FIELD, *pdst = dst->DATA_FIELD; /* Prevent warnings about strict-aliasing rules */ \
 		bool ret = array_clone(&psrc, &src->NUM_FIELD, sizeof(*src->DATA_FIELD), &pdst, &dst->NUM_FIELD); \
 		dst->DATA_FIELD = pdst; \
+		INDEX_FN(dst); \
 		return ret; \
 	} \
 	\
@@ -59,16 +275,21 @@ bool array_add(void **arr_data, int32_t *arr_num_entries, uint32_t entry_size, v
 		void *pin = in->DATA_FIELD; /* Prevent warnings about strict-aliasing rules */ \
 		bool ret = array_add(&pin, &in->NUM_FIELD, sizeof(*in->DATA_FIELD), td); \
 		in->DATA_FIELD = pin; \
+		INDEX_FN(in); \
 		return ret; \
 	}
 
-DECLARE_ARRAY_FUNCS(ftab, FTAB, FILTER, filts, nfilts); // Declare ftab_clear(), ftab_clone(), ftab_add()
+#define DECLARE_ARRAY_FUNCS(NAME, BASE_TYPE, DATA_TYPE, DATA_FIELD, NUM_FIELD) \
+	DECLARE_INDEXED_ARRAY_FUNCS(NAME, BASE_TYPE, DATA_TYPE, DATA_FIELD, NUM_FIELD, (void))
+
+DECLARE_INDEXED_ARRAY_FUNCS(ftab, FTAB, FILTER, filts, nfilts, ftab_index); // Declare ftab_clear(), ftab_clone(), ftab_add()
 DECLARE_ARRAY_FUNCS(tuntab, TUNTAB, TUNTAB_DATA, ttdata, ttnum); // Declare tuntab_clear(), tuntab_clone(), tuntab_add()
 DECLARE_ARRAY_FUNCS(ecm_whitelist, ECM_WHITELIST, ECM_WHITELIST_DATA, ewdata, ewnum); // Declare ecm_whitelist_clear(), ecm_whitelist_clone(), ecm_whitelist_add()
 DECLARE_ARRAY_FUNCS(ecm_hdr_whitelist, ECM_HDR_WHITELIST, ECM_HDR_WHITELIST_DATA, ehdata, ehnum); // Declare ecm_hdr_whitelist_clear(), ecm_hdr_whitelist_clone(), ecm_hdr_whitelist_add()
 DECLARE_ARRAY_FUNCS(caidvaluetab, CAIDVALUETAB, CAIDVALUETAB_DATA, cvdata, cvnum); // Declare caidvaluetab_clear(), caidvaluetab_clone(), caidvaluetab_add()
-DECLARE_ARRAY_FUNCS(caidtab, CAIDTAB, CAIDTAB_DATA, ctdata, ctnum); // Declare caidtab_clear(), caidtab_clone(), caidtab_add()
+DECLARE_INDEXED_ARRAY_FUNCS(caidtab, CAIDTAB, CAIDTAB_DATA, ctdata, ctnum, caidtab_index); // Declare caidtab_clear(), caidtab_clone(), caidtab_add()
 DECLARE_ARRAY_FUNCS(cecspvaluetab, CECSPVALUETAB, CECSPVALUETAB_DATA, cevdata, cevnum); // Declare cecspvaluetab_clear(), cecspvaluetab_clone(), cecspvaluetab_add()
 DECLARE_ARRAY_FUNCS(cwcheckvaluetab, CWCHECKTAB, CWCHECKTAB_DATA, cwcheckdata, cwchecknum); // Declare cwcheckvaluetab_clear(), cwcheckvaluetab_clone(), cwcheckvaluetab_add()
 
 #undef DECLARE_ARRAY_FUNCS
+#undef DECLARE_INDEXED_ARRAY_FUNCS
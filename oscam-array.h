@@ -12,6 +12,24 @@ bool array_clone(void **src_arr_data, int32_t *src_arr_num_entries, uint32_t ent
 /* Add element at the end of array */
 bool array_add(void **arr_data, int32_t *arr_num_entries, uint32_t entry_size, void *new_entry);
 
+/* Sort and binary search plain integer arrays */
+void array_sort_u16(uint16_t *arr, int32_t num);
+void array_sort_u32(uint32_t *arr, int32_t num);
+bool array_find_u16(const uint16_t *arr, int32_t num, uint16_t value);
+bool array_find_u32(const uint32_t *arr, int32_t num, uint32_t value);
+
+/* Rebuild the compiled lookup of a table. ftab_add/clear/clone() and
+   caidtab_add/clear/clone() do this already, call it only after changing
+   the table entries in place */
+void ftab_index(FTAB *ftab);
+void caidtab_index(CAIDTAB *ctab);
+
+/* Lookups that use the compiled table */
+bool ftab_has_caid(FTAB *ftab, uint16_t caid);
+bool ftab_has_ident(FTAB *ftab, uint16_t caid, uint32_t ident);
+bool ftab_has_any_ident(FTAB *ftab, uint32_t ident);
+bool caidtab_has_caid(CAIDTAB *ctab, uint16_t caid);
+
 /* Array functions for different types */
 #define DECLARE_ARRAY_FUNCS(NAME, BASE_TYPE, DATA_TYPE, DATA_FIELD, NUM_FIELD) \
 	void NAME##_clear(BASE_TYPE *in); \
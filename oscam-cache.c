@@ -7,6 +7,7 @@
 #include "oscam-chk.h"
 #include "oscam-client.h"
 #include "oscam-ecm.h"
+#include "oscam-files.h"
 #include "oscam-garbage.h"
 #include "oscam-lock.h"
 #include "oscam-net.h"
@@ -19,51 +20,58 @@
 
 
 // CACHE functions **************************************************************+
-struct s_pushclient
-{
-	struct s_client *cl;
-	struct s_pushclient *next_push;
-};
+
+/*
+ * Clients we push cws to get a small id (cl->cacheex_push_id), the cw entry remembers
+ * the pushed ones in a bitmap: the first CACHE_PUSH_INLINE ids inline, the others in
+ * an overflow block allocated on first use. Ids are given back in remove_client_from_cache()
+ * and reused only after the cws marked for the old owner expired, a reconnecting peer
+ * gets a new client and must not inherit its pushed bits.
+ */
+#define CACHE_PUSH_INLINE   32
+#define CACHE_PUSH_IDS      1024                 // clients beyond get every cw pushed again
+#define CACHE_PUSH_EXT_SIZE ((CACHE_PUSH_IDS - CACHE_PUSH_INLINE) / 8)
 
 typedef struct cw_t
 {
 	uint8_t             cw[16];
-	uint8_t             odd_even;            // odd/even byte (0x80 0x81)
-	uint8_t             cwc_cycletime;
-	uint8_t             cwc_next_cw_cycle;
-	uint8_t             got_bad_cwc;         // used by cycle check
-	uint16_t            caid;                // first caid received
-	uint32_t            prid;                // first prid received
-	uint16_t            srvid;               // first srvid received
+	uint64_t            grp;                 // updated grp
 	struct s_reader     *selected_reader;    // first answering: reader
 	struct s_client     *cacheex_src;        // first answering: cacheex client
-	uint64_t            grp;                 // updated grp
-	uint8_t             csp;                 // updated if answer from csp
-	uint8_t             cacheex;             // updated if answer from cacheex
-	uint8_t             localcards;          // updated if answer from local cards (or proxy using localcards option)
-	uint8_t             proxy;               // updated if answer from local reader
+	uint32_t            prid;                // first prid received
 	uint32_t            count;               // count of same cws receved
+	uint16_t            caid;                // first caid received
+	uint16_t            srvid;               // first srvid received
+	uint8_t             odd_even;            // odd/even byte (0x80 0x81)
+	uint8_t             cwc_cycletime;
+	uint8_t             cwc_next_cw_cycle;
+	uint8_t             got_bad_cwc;         // used by cycle check, written by lock-free readers
+	// only written under the shard lock
+	uint8_t             csp:1;               // updated if answer from csp
+	uint8_t             cacheex:1;           // updated if answer from cacheex
+	uint8_t             localcards:1;        // updated if answer from local cards (or proxy using localcards option)
+	uint8_t             proxy:1;             // updated if answer from local reader
 #ifdef CS_CACHEEX_AIO
-	uint8_t				localgenerated;      // flag for local generated CWs
+	uint8_t             localgenerated:1;    // flag for local generated CWs
 #endif
 	// for push out
-	pthread_rwlock_t    pushout_client_lock;
-	struct s_pushclient *pushout_client;     // list of clients that pushing cw
-	// end push out
-	node                ht_node;             // node for hash table
-	node                ll_node;             // node for linked list
+	uint32_t            pushed;              // push ids < CACHE_PUSH_INLINE
+	uint32_t            *pushed_ext;         // CACHE_PUSH_EXT_SIZE bytes for the others
 } CW;
 
-typedef struct cache_t
+#define MAX_CACHE_CWS 10                     // max different cws stored per ecm
+
+typedef struct cache_t ECMHASH;
+struct cache_t
 {
-	hash_table          ht_cw;
-	list                ll_cw;
+	CW *volatile        cws[MAX_CACHE_CWS];  // in insert order, slots are published once and read lock-free
+	uint8_t             cw_count;
 	struct timeb        upd_time;            // updated time. Update time at each cw got
 	struct timeb        first_recv_time;     // time of first cw received
 	uint32_t            csp_hash;
-	node                ht_node;             // node for hash table
-	node                ll_node;             // node for linked list
-} ECMHASH;
+	ECMHASH *volatile   next_hash;           // bucket chain, read lock-free
+	node                ring_node;           // shard expiry ring, by upd_time + max_cache_time
+};
 
 #ifdef CS_CACHEEX_AIO
 typedef struct cw_cache_t
@@ -75,7 +83,7 @@ typedef struct cw_cache_t
 	struct timeb        first_recv_time;     // time of first cw received
 	struct timeb        upd_time;            // updated time. Update time at each cw got
 	node				ht_node;
-	node				ll_node;
+	node				ll_node;             // ll_cw_cache is kept in upd_time order
 } CW_CACHE;
 
 typedef struct cw_cache_setting_t
@@ -85,23 +93,53 @@ typedef struct cw_cache_setting_t
 } CW_CACHE_SETTING;
 #endif
 
-static pthread_rwlock_t cache_lock;
+/*
+ * The cw cache is split into cfg.cache_shards independent partitions selected by
+ * csp_hash bits, so cw pushes and cleanup of different ecms don't wait for each
+ * other. Every partition has its own write lock, bucket array and cleanup list.
+ *
+ * check_cache() takes no lock at all: writers publish new ECMHASH and CW entries
+ * with a single pointer store after a write barrier, and unlinked entries are
+ * retired with add_garbage_epoch(), so they stay valid for readers inside
+ * epoch_enter()/epoch_leave(). CWs are the exception: er->cw_cache carries them
+ * into queued push-out jobs, which hold no epoch, so they go to the timed
+ * add_garbage() that outlives the job queues.
+ */
+#define CACHE_HASH_BUCKETS 16384             // over all shards
+
+typedef struct cache_shard_t
+{
+	pthread_rwlock_t    lock;                // writers only
+	ECMHASH             **buckets;           // chains are read lock-free, see get_cache_bucket()
+	uint32_t            bucket_mask;
+	uint32_t            count;
+	uint32_t            cw_count;
+	expiry_ring         ring;                // ECMHASH by expire second
 #ifdef CS_CACHEEX_AIO
-static pthread_rwlock_t cw_cache_lock;
+	uint32_t            lg_size;             // lg-flagged cws
 #endif
-static hash_table ht_cache;
-#ifdef CS_CACHEEX_AIO
-static hash_table ht_cw_cache;
+} CACHE_SHARD;
+
+static CACHE_SHARD *cache_shards;
+static uint32_t cache_shard_mask;
+#ifdef CS_CACHEEX
+static uint32_t push_ids[CACHE_PUSH_IDS / 32];   // ids in use
+static time_t push_id_reuse[CACHE_PUSH_IDS];     // released ids are free again at this time
+static pthread_mutex_t push_id_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t push_ext_count;
+static uint32_t push_ext_retired;                // cw->pushed_ext of expired cws, see cleanup_cache_shard()
 #endif
-static list ll_cache;
 #ifdef CS_CACHEEX_AIO
+static pthread_rwlock_t cw_cache_lock;
+static hash_table ht_cw_cache;
 static list ll_cw_cache;
 #endif
 static int8_t cache_init_done = 0;
 
+static void load_cache_snapshot(void);
+
 #ifdef CS_CACHEEX_AIO
 static int8_t cw_cache_init_done = 0;
-static uint32_t lg_cache_size = 0;
 
 void init_cw_cache(void)
 {
@@ -120,15 +158,42 @@ void init_cw_cache(void)
 
 void init_cache(void)
 {
-	init_hash_table(&ht_cache, &ll_cache);
-	if (pthread_rwlock_init(&cache_lock,NULL) != 0)
-		{ cs_log("Error creating lock cache_lock!"); }
-	else
-		{ cache_init_done = 1; }
+	uint32_t i, count = cfg.cache_shards ? cfg.cache_shards : 1;
+	uint32_t buckets = CACHE_HASH_BUCKETS / count;
+
+	if(!cs_malloc(&cache_shards, count * sizeof(CACHE_SHARD)))
+		{ return; }
+
+	for(i = 0; i < count; i++)
+	{
+		init_expiry_ring(&cache_shards[i].ring);
+		cache_shards[i].bucket_mask = buckets - 1;
+		if(!cs_malloc(&cache_shards[i].buckets, buckets * sizeof(ECMHASH *))
+			|| pthread_rwlock_init(&cache_shards[i].lock, NULL) != 0)
+		{
+			cs_log("Error creating lock cache_lock!");
+			NULLFREE(cache_shards[i].buckets);
+			while(i--)
+			{
+				pthread_rwlock_destroy(&cache_shards[i].lock);
+				NULLFREE(cache_shards[i].buckets);
+			}
+			NULLFREE(cache_shards);
+			return;
+		}
+	}
+	cache_shard_mask = count - 1;
+	cache_init_done = 1;
+	cs_log_dbg(D_TRACE, "cw cache uses %u shards", count);
+
+	load_cache_snapshot();
 }
 
 void free_cache(void)
 {
+	uint32_t i;
+
+	save_cache_snapshot(true);
 	cleanup_cache(true);
 #ifdef CS_CACHEEX_AIO
 	cw_cache_cleanup(true);
@@ -137,81 +202,185 @@ void free_cache(void)
 	deinitialize_hash_table(&ht_cw_cache);
 	pthread_rwlock_destroy(&cw_cache_lock);
 #endif
+	if(!cache_init_done)
+		{ return; }
+
 	cache_init_done = 0;
-	deinitialize_hash_table(&ht_cache);
-	pthread_rwlock_destroy(&cache_lock);
+	for(i = 0; i <= cache_shard_mask; i++)
+	{
+		NULLFREE(cache_shards[i].buckets);
+		pthread_rwlock_destroy(&cache_shards[i].lock);
+	}
+	NULLFREE(cache_shards);
+}
+
+static inline CACHE_SHARD *get_cache_shard(uint32_t csp_hash)
+{
+	return &cache_shards[(csp_hash ^ (csp_hash >> 16)) & cache_shard_mask];
+}
+
+static inline ECMHASH *volatile *get_cache_bucket(CACHE_SHARD *shard, uint32_t csp_hash)
+{
+	// shard selection used the low bits, spread the rest over the buckets
+	return (ECMHASH *volatile *)&shard->buckets[((csp_hash * 0x9E3779B1) >> 16) & shard->bucket_mask];
+}
+
+// lock-free, caller is inside epoch_enter() or holds shard->lock
+static ECMHASH *find_ecmhash(CACHE_SHARD *shard, uint32_t csp_hash)
+{
+	ECMHASH *ecmhash;
+
+	for(ecmhash = *get_cache_bucket(shard, csp_hash); ecmhash; ecmhash = ecmhash->next_hash)
+	{
+		if(ecmhash->csp_hash == csp_hash)
+			{ return ecmhash; }
+	}
+	return NULL;
 }
 
 #ifdef CS_CACHEEX_AIO
 uint32_t cache_size_lg(void)
 {
+	uint32_t i, size = 0;
+
 	if(!cache_init_done)
 		{ return 0; }
 
-	return lg_cache_size;
+	for(i = 0; i <= cache_shard_mask; i++)
+		{ size += cache_shards[i].lg_size; }
+	return size;
 }
 #endif
 
 uint32_t cache_size(void)
 {
+	uint32_t i, size = 0;
+
 	if(!cache_init_done)
 		{ return 0; }
 
-	return count_hash_table(&ht_cache);
+	for(i = 0; i <= cache_shard_mask; i++)
+		{ size += cache_shards[i].count; }
+	return size;
 }
 
-static uint8_t count_sort(CW *a, CW *b)
+#ifdef CS_CACHEEX
+static uint16_t get_push_id(struct s_client *cl)
 {
-	if (a->count == b->count) return 0;
-	return (a->count > b->count) ? -1 : 1; // DESC order by count
-}
+	uint32_t i;
+	time_t now;
 
-#ifdef CS_CACHEEX_AIO
-static uint8_t time_sort(CW_CACHE *a, CW_CACHE *b)
-{
-	if (((int64_t)(a->upd_time.time) * 1000ull + (int64_t) a->upd_time.millitm) == ((int64_t)(b->upd_time.time) * 1000ull + (int64_t) b->upd_time.millitm)) return 0;
-	return (((int64_t)(a->upd_time.time) * 1000ull + (int64_t) a->upd_time.millitm) > ((int64_t)(b->upd_time.time) * 1000ull + (int64_t) b->upd_time.millitm)) ? -1 : 1;
+	if(cl->cacheex_push_id)
+		{ return cl->cacheex_push_id; }
+
+	SAFE_MUTEX_LOCK(&push_id_lock);
+	if(!cl->cacheex_push_id)
+	{
+		now = time(NULL);
+		for(i = 0; i < CACHE_PUSH_IDS; i++)
+		{
+			if(!(push_ids[i / 32] & (1u << (i % 32))) && push_id_reuse[i] <= now)
+			{
+				push_ids[i / 32] |= 1u << (i % 32);
+				cl->cacheex_push_id = i + 1;
+				break;
+			}
+		}
+	}
+	SAFE_MUTEX_UNLOCK(&push_id_lock);
+	return cl->cacheex_push_id;
 }
 #endif
 
+// returns 1 if cw was already pushed to cl, otherwise marks it pushed and returns 0
 uint8_t check_is_pushed(void *cwp, struct s_client *cl)
 {
-	struct s_pushclient *cl_tmp;
-	CW* cw = (CW*)cwp;
-	bool pushed=false;
+	(void)cwp; (void)cl;
+#ifdef CS_CACHEEX
+	CW *cw = (CW *)cwp;
+	uint32_t *word, *ext, bit;
+	uint16_t id;
+
+	if(!cw || !(id = get_push_id(cl)))
+		{ return 0; }
+	id--;
 
-	SAFE_RWLOCK_RDLOCK(&cw->pushout_client_lock);
-	for (cl_tmp = cw->pushout_client; cl_tmp; cl_tmp = cl_tmp->next_push)
+	if(id < CACHE_PUSH_INLINE)
+		{ word = &cw->pushed; }
+	else
 	{
-		if(cl_tmp->cl==cl)
+		if(!(ext = cw->pushed_ext))
 		{
-			pushed=true;
-			break;
+			if(!cs_malloc(&ext, CACHE_PUSH_EXT_SIZE))
+				{ return 0; }
+			if(__sync_bool_compare_and_swap(&cw->pushed_ext, NULL, ext))
+				{ __sync_fetch_and_add(&push_ext_count, 1); }
+			else
+			{
+				NULLFREE(ext);
+				ext = cw->pushed_ext;
+			}
 		}
+		if(ext == &push_ext_retired)
+			{ return 1; } // cw expired meanwhile, don't push it anymore
+		id -= CACHE_PUSH_INLINE;
+		word = &ext[id / 32];
 	}
+	bit = 1u << (id % 32);
 
-	if(!pushed)
-	{
-		SAFE_RWLOCK_UNLOCK(&cw->pushout_client_lock);
-		SAFE_RWLOCK_WRLOCK(&cw->pushout_client_lock);
+	return (__sync_fetch_and_or(word, bit) & bit) ? 1 : 0;
+#else
+	return 0;
+#endif
+}
 
-		struct s_pushclient *new_push_client;
-		if(cs_malloc(&new_push_client, sizeof(struct s_pushclient)))
-		{
-			new_push_client->cl=cl;
+void remove_client_from_cache(struct s_client *cl)
+{
+	(void)cl;
+#ifdef CS_CACHEEX
+	uint16_t id = cl->cacheex_push_id;
 
-			new_push_client->next_push=cw->pushout_client;
-			cw->pushout_client=new_push_client;
-		}
+	if(!id--)
+		{ return; }
 
-		SAFE_RWLOCK_UNLOCK(&cw->pushout_client_lock);
-		return 0;
-	}
-	else
+	// cws pushed to the old owner of the id stay marked until they expire
+	SAFE_MUTEX_LOCK(&push_id_lock);
+	push_ids[id / 32] &= ~(1u << (id % 32));
+	push_id_reuse[id] = time(NULL) + cfg.max_cache_time + 1;
+	cl->cacheex_push_id = 0;
+	SAFE_MUTEX_UNLOCK(&push_id_lock);
+#endif
+}
+
+/*
+ * memory used by the cw cache, *per_cw gets the average per stored cw including
+ * its share of the ECMHASH and the bucket arrays
+ */
+uint64_t cache_memory(uint32_t *per_cw)
+{
+	uint64_t mem = 0;
+	uint32_t i, ecms = 0, cws = 0;
+
+	if(per_cw)
+		{ *per_cw = 0; }
+	if(!cache_init_done)
+		{ return 0; }
+
+	for(i = 0; i <= cache_shard_mask; i++)
 	{
-		SAFE_RWLOCK_UNLOCK(&cw->pushout_client_lock);
-		return 1;
+		ecms += cache_shards[i].count;
+		cws += cache_shards[i].cw_count;
+		mem += (cache_shards[i].bucket_mask + 1) * sizeof(ECMHASH *);
 	}
+	mem += sizeof(CACHE_SHARD) * (cache_shard_mask + 1);
+	mem += (uint64_t)ecms * sizeof(ECMHASH) + (uint64_t)cws * sizeof(CW);
+#ifdef CS_CACHEEX
+	mem += (uint64_t)push_ext_count * CACHE_PUSH_EXT_SIZE;
+#endif
+
+	if(per_cw && cws)
+		{ *per_cw = mem / cws; }
+	return mem;
 }
 
 uint8_t get_odd_even(ECM_REQUEST *er)
@@ -220,24 +389,21 @@ uint8_t get_odd_even(ECM_REQUEST *er)
 }
 
 
+// mostly counted usable cw, the first one inserted wins on equal count
 CW *get_first_cw(ECMHASH *ecmhash, ECM_REQUEST *er)
 {
 	if(!ecmhash) return NULL;
 
-	node *j;
-	CW *cw;
-
-	j = get_first_node_list(&ecmhash->ll_cw);
-	while (j) {
-		cw = get_data_from_node(j);
-
-		if(cw && cw->odd_even == get_odd_even(er) && !cw->got_bad_cwc)
-			return cw;
+	CW *cw, *best = NULL;
+	uint8_t i, odd_even = get_odd_even(er);
 
-		j = j->next;
+	for(i = 0; i < MAX_CACHE_CWS && (cw = ecmhash->cws[i]); i++)
+	{
+		if(cw->odd_even == odd_even && !cw->got_bad_cwc && (!best || cw->count > best->count))
+			best = cw;
 	}
 
-	return NULL;
+	return best;
 }
 
 int compare_csp_hash(const void *arg, const void *obj)
@@ -246,11 +412,6 @@ int compare_csp_hash(const void *arg, const void *obj)
 	return memcmp(arg, &h, 4);
 }
 
-static int compare_cw(const void *arg, const void *obj)
-{
-	return memcmp(arg, ((const CW*)obj)->cw, 16);
-}
-
 #ifdef CS_CACHEEX_AIO
 static int compare_cw_cache(const void *arg, const void *obj)
 {
@@ -310,10 +471,11 @@ struct ecm_request_t *check_cache(ECM_REQUEST *er, struct s_client *cl)
 	ECMHASH *result;
 	CW *cw;
 	uint64_t grp = cl?cl->grp:0;
+	CACHE_SHARD *shard = get_cache_shard(er->csp_hash);
 
-	SAFE_RWLOCK_RDLOCK(&cache_lock);
+	epoch_enter();
 
-	result = find_hash_table(&ht_cache, &er->csp_hash, sizeof(uint32_t),&compare_csp_hash);
+	result = find_ecmhash(shard, er->csp_hash);
 	cw = get_first_cw(result, er);
 	if (!cw)
 		goto out_err;
@@ -356,7 +518,7 @@ struct ecm_request_t *check_cache(ECM_REQUEST *er, struct s_client *cl)
 		if (!cwcycle_check_cache(cl, er, cw))
 			goto out_err;
 
-		if (cs_malloc(&ecm, sizeof(ECM_REQUEST)))
+		if ((ecm = alloc_ecm()))
 		{
 			ecm->rc = E_FOUND;
 			ecm->rcEx = 0;
@@ -374,7 +536,7 @@ struct ecm_request_t *check_cache(ECM_REQUEST *er, struct s_client *cl)
 	}
 
 out_err:
-	SAFE_RWLOCK_UNLOCK(&cache_lock);
+	epoch_leave();
 	return ecm;
 }
 
@@ -547,6 +709,13 @@ CW_CACHE_SETTING get_cw_cache(ECM_REQUEST *er)
 	return cw_cache_setting;
 }
 
+// upd_time changed: move to the tail, ll_cw_cache stays sorted without sort_list()
+static inline void cw_cache_touch(CW_CACHE *cw_cache)
+{
+	remove_elem_list(&ll_cw_cache, &cw_cache->ll_node);
+	tommy_list_insert_tail(&ll_cw_cache, &cw_cache->ll_node, cw_cache);
+}
+
 static bool cw_cache_check(ECM_REQUEST *er)
 {
 	if(cw_cache_init_done)
@@ -625,6 +794,7 @@ static bool cw_cache_check(ECM_REQUEST *er)
 					if(cw_cache->srvid == er->srvid && cw_cache->caid == er->caid) // same cw for same caid&srvid
 					{
 						cs_ftime(&cw_cache->upd_time);
+						cw_cache_touch(cw_cache);
 						cs_log_dbg(D_CW_CACHE,"[late CW] cache: %04X:%06X:%04X:%s | in: %04X:%06X:%04X:%s | diff(now): %"PRIi64" ms > %"PRIu16" - %s - hop %i%s", cw_cache->caid, cw_cache->prid, cw_cache->srvid, cw1, er->caid, er->prid, er->srvid, cw2, gone_diff, cw_cache_setting.timediff_old_cw, (er->selected_reader && cs_strlen(er->selected_reader->label)) ? er->selected_reader->label : username(er->cacheex_src), ll_count(er->csp_lastnodes), (er->localgenerated) ? " (lg)" : "");
 						drop_cw=1;
 
@@ -632,6 +802,7 @@ static bool cw_cache_check(ECM_REQUEST *er)
 					else if(cw_cache->srvid != er->srvid) // same cw for different srvid & late
 					{
 						cs_ftime(&cw_cache->upd_time);
+						cw_cache_touch(cw_cache);
 						cs_log_dbg(D_CW_CACHE,"[dupe&late CW] cache: %04X:%06X:%04X:%s | in: %04X:%06X:%04X:%s| diff(now): %"PRIi64" ms - %s - hop %i%s", cw_cache->caid, cw_cache->prid, cw_cache->srvid, cw1, er->caid, er->prid, er->srvid, cw2, gone_diff, (er->selected_reader && cs_strlen(er->selected_reader->label)) ? er->selected_reader->label : username(er->cacheex_src), ll_count(er->csp_lastnodes), (er->localgenerated) ? " (lg)" : "");
 						drop_cw = 1;
 					}
@@ -684,23 +855,31 @@ void add_cache(ECM_REQUEST *er)
 	ECMHASH *result = NULL;
 	CW *cw = NULL;
 	bool add_new_cw=false;
+	CACHE_SHARD *shard = get_cache_shard(er->csp_hash);
+	ECMHASH *volatile *bucket;
+	uint8_t i;
 
-	SAFE_RWLOCK_WRLOCK(&cache_lock);
+	SAFE_RWLOCK_WRLOCK(&shard->lock);
 
 	// add csp_hash to cache
-	result = find_hash_table(&ht_cache, &er->csp_hash, sizeof(uint32_t), &compare_csp_hash);
+	result = find_ecmhash(shard, er->csp_hash);
 	if(!result)
 	{
 		if(cs_malloc(&result, sizeof(ECMHASH)))
 		{
 			result->csp_hash = er->csp_hash;
-			init_hash_table(&result->ht_cw, &result->ll_cw);
 			cs_ftime(&result->first_recv_time);
-			add_hash_table(&ht_cache, &result->ht_node, &ll_cache, &result->ll_node, result, &result->csp_hash, sizeof(uint32_t));
+			cs_ftime(&result->upd_time);
+			bucket = get_cache_bucket(shard, er->csp_hash);
+			result->next_hash = *bucket;
+			__sync_synchronize(); // entry is complete before readers can see it
+			*bucket = result;
+			add_expiry_ring(&shard->ring, &result->ring_node, result, result->upd_time.time + cfg.max_cache_time + 1);
+			shard->count++;
 		}
 		else
 		{
-			SAFE_RWLOCK_UNLOCK(&cache_lock);
+			SAFE_RWLOCK_UNLOCK(&shard->lock);
 			cs_log("ERROR: NO added HASH to cache!!");
 			return;
 		}
@@ -709,13 +888,20 @@ void add_cache(ECM_REQUEST *er)
 	cs_ftime(&result->upd_time); // need to be updated at each cw! We use it for deleting this hash when no more cws arrive inside max_cache_time!
 
 	//add cw to this csp hash
-	cw = find_hash_table(&result->ht_cw, er->cw, sizeof(er->cw), &compare_cw);
+	for(i = 0; i < result->cw_count; i++)
+	{
+		if(!memcmp(result->cws[i]->cw, er->cw, sizeof(er->cw)))
+		{
+			cw = result->cws[i];
+			break;
+		}
+	}
 
 	if(!cw)
 	{
-		if(count_hash_table(&result->ht_cw) >= 10) // max 10 different cws stored
+		if(result->cw_count >= MAX_CACHE_CWS) // max 10 different cws stored
 		{
-			SAFE_RWLOCK_UNLOCK(&cache_lock);
+			SAFE_RWLOCK_UNLOCK(&shard->lock);
 			return;
 		}
 
@@ -727,29 +913,15 @@ void add_cache(ECM_REQUEST *er)
 				cw->odd_even = get_odd_even(er);
 				cw->cwc_cycletime = er->cwc_cycletime;
 				cw->cwc_next_cw_cycle = er->cwc_next_cw_cycle;
-				cw->count= 0;
-				cw->csp = 0;
-				cw->cacheex = 0;
-				cw->localcards=0;
-				cw->proxy=0;
-				cw->grp = 0;
 				cw->caid = er->caid;
 				cw->prid = er->prid;
 				cw->srvid = er->srvid;
 				cw->selected_reader=er->selected_reader;
 				cw->cacheex_src=er->cacheex_src;
-				cw->pushout_client = NULL;
 
-				while(1)
-				{
-					if (pthread_rwlock_init(&cw->pushout_client_lock, NULL) == 0)
-						break;
-
-					cs_log("Error creating lock pushout_client_lock!");
-					cs_sleepms(1);
-				}
-
-				add_hash_table(&result->ht_cw, &cw->ht_node, &result->ll_cw, &cw->ll_node, cw, cw->cw, sizeof(er->cw));
+				__sync_synchronize(); // cw is complete before readers can see it
+				result->cws[result->cw_count++] = cw;
+				shard->cw_count++;
 				add_new_cw=true;
 				break;
 			}
@@ -778,7 +950,7 @@ void add_cache(ECM_REQUEST *er)
 		if(cw->count < 0x0F000000)
 		{
 			cw->count |= 0x0F000000;
-			lg_cache_size++;
+			shard->lg_size++;
 		}
 	}
 	else
@@ -795,10 +967,6 @@ void add_cache(ECM_REQUEST *er)
 	// add count to er for checking @ cacheex_push
 	er->cw_count += cw->count;
 #endif
-	// sort cw_list by counter (DESC order)
-	if(cw->count>1)
-		sort_list(&result->ll_cw, count_sort);
-
 #ifdef CS_CACHEEX_AIO
 	// dont push not flagged CWs - global
 	if(!er->localgenerated &&
@@ -808,7 +976,7 @@ void add_cache(ECM_REQUEST *er)
 		)	)
 	{
 		cs_log_dbg(D_CACHEEX, "cacheex: push denied, cacheex_localgenerated_only->global");
-		SAFE_RWLOCK_UNLOCK(&cache_lock);
+		SAFE_RWLOCK_UNLOCK(&shard->lock);
 		return;
 	}
 
@@ -816,22 +984,25 @@ void add_cache(ECM_REQUEST *er)
 	if(er->rc < 3 && er->ecm_time && get_cacheex_nopushafter(er) != 0 &&(get_cacheex_nopushafter(er) < er->ecm_time ))
 	{
 		cs_log_dbg(D_CACHEEX, "cacheex: push denied, cacheex_nopushafter %04X:%u < %i, reader: %s", er->caid, get_cacheex_nopushafter(er), er->ecm_time, er->selected_reader->label);
-		SAFE_RWLOCK_UNLOCK(&cache_lock);
+		SAFE_RWLOCK_UNLOCK(&shard->lock);
 		return;
 	}
 
 	// no cacheex-push on diff-cw's if no localgenerated flag exist
-	if(cfg.cacheex_dropdiffs && (count_hash_table(&result->ht_cw) > 1) && !er->localgenerated)
+	if(cfg.cacheex_dropdiffs && (result->cw_count > 1) && !er->localgenerated)
 	{
 		cs_log_dbg(D_CACHEEX,"cacheex: diff CW - cacheex push denied src: %s", er->selected_reader->label);
-		SAFE_RWLOCK_UNLOCK(&cache_lock);
+		SAFE_RWLOCK_UNLOCK(&shard->lock);
 		return;
 	}
 #endif
 
-	SAFE_RWLOCK_UNLOCK(&cache_lock);
+	SAFE_RWLOCK_UNLOCK(&shard->lock);
 
+	// result and cw may get cleaned up meanwhile
+	epoch_enter();
 	cacheex_cache_add(er, result, cw, add_new_cw);
+	epoch_leave();
 }
 
 #ifdef CS_CACHEEX_AIO
@@ -840,132 +1011,583 @@ void cw_cache_cleanup(bool force)
 	if(!cw_cache_init_done)
 		{ return; }
 
+	CW_CACHE *cw_cache;
+	node *i;
+	uint32_t freed = 0, ll_ten_percent;
+	struct timeb ts, te;
+
+	cs_ftimeus(&ts);
 	SAFE_RWLOCK_WRLOCK(&cw_cache_lock);
 
-	CW_CACHE *cw_cache;
-	node *i, *i_next;
+	// oldest first, drop 10 percent of cache
+	ll_ten_percent = (uint)tommy_list_count(&ll_cw_cache)*0.1;
+	while((i = get_first_node_list(&ll_cw_cache)) && (force || freed + 1 < ll_ten_percent))
+	{
+		cw_cache = get_data_from_node(i);
+		remove_elem_list(&ll_cw_cache, &cw_cache->ll_node);
+		remove_elem_hash_table(&ht_cw_cache, &cw_cache->ht_node);
+		NULLFREE(cw_cache);
+		freed++;
+	}
 
-	uint32_t ll_c = 0;
-	uint32_t ll_ten_percent = (uint)tommy_list_count(&ll_cw_cache)*0.1; // 10 percent of cache
+	SAFE_RWLOCK_UNLOCK(&cw_cache_lock);
+	cs_ftimeus(&te);
+	cs_log_dbg(D_CW_CACHE, "[cw_cache] cleanup freed %u in %"PRId64" us", freed, comp_timebus(&te, &ts));
+}
+#endif
 
-	if(!force)
-		sort_list(&ll_cw_cache, time_sort);
+// frees the entries due in the expiry ring, requeues the ones updated meanwhile
+static void cleanup_cache_shard(CACHE_SHARD *shard, bool force, uint32_t *due, uint32_t *freed)
+{
+	ECMHASH *ecmhash;
+	ECMHASH *volatile *prev;
+	CW *cw;
+#ifdef CS_CACHEEX
+	uint32_t *ext;
+#endif
+	node *i;
+	list todo;
+	uint8_t j;
+
+	struct timeb now;
+	int64_t gone_upd;
 
-	i = get_first_node_list(&ll_cw_cache);
-	while(i)
+	tommy_list_init(&todo);
+	SAFE_RWLOCK_WRLOCK(&shard->lock);
+
+	cs_ftime(&now);
+	if(force)
+		{ all_expiry_ring(&shard->ring, &todo); }
+	else
+		{ due_expiry_ring(&shard->ring, now.time, &todo); }
+
+	while((i = get_first_node_list(&todo)))
 	{
-		i_next = i->next;
+		ecmhash = get_data_from_node(i);
+		remove_elem_list(&todo, i);
+		(*due)++;
 
-		cw_cache = get_data_from_node(i);
+		gone_upd = comp_timeb(&now, &ecmhash->upd_time);
 
-		if(!cw_cache)
+		if(!force && gone_upd<=(cfg.max_cache_time*1000))
 		{
-			i = i_next;
+			add_expiry_ring(&shard->ring, &ecmhash->ring_node, ecmhash, ecmhash->upd_time.time + cfg.max_cache_time + 1);
 			continue;
 		}
-		if(!force)
-		{
-			++ll_c;
 
-			if(ll_c < ll_ten_percent)
+		// unlink first, readers still walking through it see a valid next_hash
+		for(prev = get_cache_bucket(shard, ecmhash->csp_hash); *prev && *prev != ecmhash; prev = &(*prev)->next_hash) { ; }
+		if(*prev)
+			{ *prev = ecmhash->next_hash; }
+		shard->count--;
+
+		for(j = 0; j < ecmhash->cw_count; j++)
+		{
+			cw = ecmhash->cws[j];
+			shard->cw_count--;
+#ifdef CS_CACHEEX
+			// a late push-out must not attach a new pushed_ext to the retired cw
+			if((ext = __sync_lock_test_and_set(&cw->pushed_ext, &push_ext_retired)))
 			{
-				remove_elem_list(&ll_cw_cache, &cw_cache->ll_node);
-				remove_elem_hash_table(&ht_cw_cache, &cw_cache->ht_node);
-				NULLFREE(cw_cache);
+				__sync_fetch_and_sub(&push_ext_count, 1);
+				add_garbage(ext);
 			}
-			else{
-				break;
+#endif
+#ifdef CS_CACHEEX_AIO
+			if(cw->count >= 0x0F000000)
+			{
+				shard->lg_size--;
 			}
-		}
-		else
-		{
-			remove_elem_list(&ll_cw_cache, &cw_cache->ll_node);
-			remove_elem_hash_table(&ht_cw_cache, &cw_cache->ht_node);
-			NULLFREE(cw_cache);
+#endif
+			add_garbage(cw); // queued push-out jobs may still use it
 		}
 
-		i = i_next;
+		add_garbage_epoch(ecmhash);
+		(*freed)++;
 	}
+	SAFE_RWLOCK_UNLOCK(&shard->lock);
+}
 
-	SAFE_RWLOCK_UNLOCK(&cw_cache_lock);
+void cleanup_cache(bool force)
+{
+	uint32_t i, due = 0, freed = 0;
+	struct timeb ts, te;
+
+	if(!cache_init_done)
+		{ return; }
+
+	// one shard at a time, cw pushes to the other shards go on meanwhile
+	cs_ftimeus(&ts);
+	for(i = 0; i <= cache_shard_mask; i++)
+		{ cleanup_cache_shard(&cache_shards[i], force, &due, &freed); }
+	cs_ftimeus(&te);
+
+	if(due)
+		{ cs_log_dbg(D_TRACE, "cache cleanup: %u due, %u freed in %"PRId64" us", due, freed, comp_timebus(&te, &ts)); }
+}
+
+/*
+ * Cache snapshot: a header followed by fixed size records of the cw cache, the cw_cache
+ * and the ecm_cache (CS_CACHEEX_AIO), all in host byte order so the file can be mapped
+ * and read in place. It is written to a temp file and renamed, a crash while saving
+ * leaves the previous snapshot intact.
+ */
+#define CACHE_SNAP_MAGIC	"OSCSNAP"
+#define CACHE_SNAP_VERSION	1
+#define CACHE_SNAP_BYTEORDER	0x01020304
+
+enum cache_snap_section { SNAP_CW = 0, SNAP_CW_CACHE, SNAP_ECM_CACHE, SNAP_SECTIONS };
+
+typedef struct cache_snap_header_t
+{
+	char                magic[8];
+	uint32_t            version;
+	uint32_t            byteorder;
+	uint32_t            header_size;
+	uint32_t            crc;                 // over all records
+	int64_t             saved;               // ms since epoch
+	uint32_t            count[SNAP_SECTIONS];
+	uint32_t            record_size[SNAP_SECTIONS];
+} CACHE_SNAP_HEADER;
+
+#define SNAP_CW_CSP         0x01
+#define SNAP_CW_CACHEEX     0x02
+#define SNAP_CW_LOCALCARDS  0x04
+#define SNAP_CW_PROXY       0x08
+#define SNAP_CW_LG          0x10
+
+typedef struct cache_snap_cw_t
+{
+	int64_t             first_recv_time;     // ms since epoch, of the ECMHASH
+	int64_t             upd_time;
+	uint64_t            grp;
+	uint32_t            csp_hash;
+	uint32_t            prid;
+	uint32_t            count;
+	uint16_t            caid;
+	uint16_t            srvid;
+	uint8_t             cw[16];
+	uint8_t             odd_even;
+	uint8_t             cwc_cycletime;
+	uint8_t             cwc_next_cw_cycle;
+	uint8_t             flags;               // SNAP_CW_*
+} CACHE_SNAP_CW;
+
+typedef struct cache_snap_cw_cache_t
+{
+	int64_t             first_recv_time;
+	int64_t             upd_time;
+	uint32_t            prid;
+	uint16_t            caid;
+	uint16_t            srvid;
+	uint8_t             cw[16];
+} CACHE_SNAP_CW_CACHE;
+
+typedef struct cache_snap_ecm_cache_t
+{
+	int64_t             first_recv_time;
+	int64_t             upd_time;
+	uint32_t            csp_hash;
+	uint32_t            pad;
+} CACHE_SNAP_ECM_CACHE;
+
+static const uint32_t cache_snap_record_size[SNAP_SECTIONS] = { sizeof(CACHE_SNAP_CW), sizeof(CACHE_SNAP_CW_CACHE), sizeof(CACHE_SNAP_ECM_CACHE) };
+
+typedef struct cache_snap_buf_t
+{
+	uint8_t             *data[SNAP_SECTIONS];
+	uint32_t            count[SNAP_SECTIONS];
+	uint32_t            alloc[SNAP_SECTIONS];
+} CACHE_SNAP_BUF;
+
+static time_t cache_snapshot_last;
+
+static char *get_cache_snapshot_filename(char *dest, size_t destlen)
+{
+	if(cfg.cache_snapshot_file && cfg.cache_snapshot_file[0])
+		{ cs_strncpy(dest, cfg.cache_snapshot_file, destlen); }
+	else
+		{ get_tmp_dir_filename(dest, destlen, "oscam.cache"); }
+	return dest;
+}
+
+static inline int64_t snap_time(struct timeb *tb)
+{
+	return (int64_t)tb->time * 1000 + tb->millitm;
+}
+
+static inline void snap_timeb(int64_t ms, struct timeb *tb)
+{
+	tb->time = ms / 1000;
+	tb->millitm = ms % 1000;
+}
+
+// room for n more records in section, false if out of memory
+static bool snap_reserve(CACHE_SNAP_BUF *buf, int8_t section, uint32_t n)
+{
+	uint32_t want = buf->count[section] + n;
+
+	if(want <= buf->alloc[section])
+		{ return true; }
+	want += want / 2 + 64;
+	if(!cs_realloc(&buf->data[section], (size_t)want * cache_snap_record_size[section]))
+		{ return false; }
+	buf->alloc[section] = want;
+	return true;
+}
+
+static void *snap_next(CACHE_SNAP_BUF *buf, int8_t section)
+{
+	void *rec = buf->data[section] + (size_t)buf->count[section]++ * cache_snap_record_size[section];
+	memset(rec, 0, cache_snap_record_size[section]);
+	return rec;
+}
+
+#ifdef CS_CACHEEX_AIO
+static void snap_add_ecm_cache(uint32_t csp_hash, struct timeb *first_recv_time, struct timeb *upd_time, void *arg)
+{
+	CACHE_SNAP_BUF *buf = arg;
+	CACHE_SNAP_ECM_CACHE *rec;
+
+	if(!snap_reserve(buf, SNAP_ECM_CACHE, 1))
+		{ return; }
+	rec = snap_next(buf, SNAP_ECM_CACHE);
+	rec->csp_hash = csp_hash;
+	rec->first_recv_time = snap_time(first_recv_time);
+	rec->upd_time = snap_time(upd_time);
 }
 #endif
 
-void cleanup_cache(bool force)
+static void snap_collect(CACHE_SNAP_BUF *buf)
 {
+	CACHE_SHARD *shard;
 	ECMHASH *ecmhash;
 	CW *cw;
-	struct s_pushclient *pc, *nxt;
-	node *i,*i_next,*j,*j_next;
+	CACHE_SNAP_CW *rec;
+	node *i;
+	uint32_t s, k;
+	uint8_t j;
 
-	struct timeb now;
-	int64_t gone_first, gone_upd;
+	for(s = 0; s <= cache_shard_mask; s++)
+	{
+		shard = &cache_shards[s];
+		SAFE_RWLOCK_RDLOCK(&shard->lock);
+		if(snap_reserve(buf, SNAP_CW, shard->cw_count))
+		{
+			for(k = 0; k < EXPIRY_RING_SLOTS; k++)
+			{
+				for(i = get_first_node_list(&shard->ring.slot[k]); i; i = i->next)
+				{
+					if(!(ecmhash = get_data_from_node(i)))
+						{ continue; }
+					for(j = 0; j < ecmhash->cw_count; j++)
+					{
+						cw = ecmhash->cws[j];
+						rec = snap_next(buf, SNAP_CW);
+						rec->csp_hash = ecmhash->csp_hash;
+						rec->first_recv_time = snap_time(&ecmhash->first_recv_time);
+						rec->upd_time = snap_time(&ecmhash->upd_time);
+						rec->grp = cw->grp;
+						rec->prid = cw->prid;
+						rec->count = cw->count;
+						rec->caid = cw->caid;
+						rec->srvid = cw->srvid;
+						memcpy(rec->cw, cw->cw, sizeof(rec->cw));
+						rec->odd_even = cw->odd_even;
+						rec->cwc_cycletime = cw->cwc_cycletime;
+						rec->cwc_next_cw_cycle = cw->cwc_next_cw_cycle;
+						rec->flags = (cw->csp ? SNAP_CW_CSP : 0) | (cw->cacheex ? SNAP_CW_CACHEEX : 0)
+							| (cw->localcards ? SNAP_CW_LOCALCARDS : 0) | (cw->proxy ? SNAP_CW_PROXY : 0);
+#ifdef CS_CACHEEX_AIO
+						if(cw->localgenerated)
+							{ rec->flags |= SNAP_CW_LG; }
+#endif
+					}
+				}
+			}
+		}
+		SAFE_RWLOCK_UNLOCK(&shard->lock);
+	}
 
-	if(!cache_init_done)
-		{ return; }
+#ifdef CS_CACHEEX_AIO
+	if(cw_cache_init_done)
+	{
+		CW_CACHE *cw_cache;
+		CACHE_SNAP_CW_CACHE *crec;
 
-	SAFE_RWLOCK_WRLOCK(&cache_lock);
+		SAFE_RWLOCK_RDLOCK(&cw_cache_lock);
+		if(snap_reserve(buf, SNAP_CW_CACHE, tommy_list_count(&ll_cw_cache)))
+		{
+			for(i = get_first_node_list(&ll_cw_cache); i; i = i->next)
+			{
+				if(!(cw_cache = get_data_from_node(i)))
+					{ continue; }
+				crec = snap_next(buf, SNAP_CW_CACHE);
+				crec->first_recv_time = snap_time(&cw_cache->first_recv_time);
+				crec->upd_time = snap_time(&cw_cache->upd_time);
+				crec->prid = cw_cache->prid;
+				crec->caid = cw_cache->caid;
+				crec->srvid = cw_cache->srvid;
+				memcpy(crec->cw, cw_cache->cw, sizeof(crec->cw));
+			}
+		}
+		SAFE_RWLOCK_UNLOCK(&cw_cache_lock);
+	}
+	ecm_cache_foreach(snap_add_ecm_cache, buf);
+#endif
+}
 
-	i = get_first_node_list(&ll_cache);
-	while(i)
+/*
+ * writes the snapshot if snapshot_interval passed since the last one,
+ * force writes it anyway (shutdown)
+ */
+void save_cache_snapshot(bool force)
+{
+	CACHE_SNAP_BUF buf;
+	CACHE_SNAP_HEADER hdr;
+	char fname[256], tmpname[288];
+	struct timeb ts, te;
+	FILE *file;
+	int8_t section;
+	bool ok;
+
+	if(!cache_init_done || !cfg.cache_snapshot_interval)
+		{ return; }
+	if(!force && cache_snapshot_last && time(NULL) - cache_snapshot_last < (time_t)cfg.cache_snapshot_interval)
+		{ return; }
+	cache_snapshot_last = time(NULL);
+
+	cs_ftime(&ts);
+	memset(&buf, 0, sizeof(buf));
+	snap_collect(&buf);
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, CACHE_SNAP_MAGIC, sizeof(hdr.magic));
+	hdr.version = CACHE_SNAP_VERSION;
+	hdr.byteorder = CACHE_SNAP_BYTEORDER;
+	hdr.header_size = sizeof(hdr);
+	hdr.saved = snap_time(&ts);
+	for(section = 0; section < SNAP_SECTIONS; section++)
 	{
-		i_next = i->next;
-		ecmhash = get_data_from_node(i);
+		hdr.count[section] = buf.count[section];
+		hdr.record_size[section] = cache_snap_record_size[section];
+		if(buf.count[section])
+			{ hdr.crc = crc32(hdr.crc, buf.data[section], buf.count[section] * cache_snap_record_size[section]); }
+	}
+
+	get_cache_snapshot_filename(fname, sizeof(fname));
+	snprintf(tmpname, sizeof(tmpname), "%s.tmp", fname);
 
-		if(!ecmhash)
+	ok = false;
+	if((file = fopen(tmpname, "w")))
+	{
+		ok = fwrite(&hdr, sizeof(hdr), 1, file) == 1;
+		for(section = 0; ok && section < SNAP_SECTIONS; section++)
 		{
-			i = i_next;
-			continue;
+			if(buf.count[section])
+				{ ok = fwrite(buf.data[section], cache_snap_record_size[section], buf.count[section], file) == buf.count[section]; }
 		}
+		ok = fflush(file) == 0 && ok;
+		ok = fsync(fileno(file)) == 0 && ok;
+		ok = fclose(file) == 0 && ok;
+	}
+	if(ok)
+		{ ok = rename(tmpname, fname) == 0; }
 
-		cs_ftime(&now);
-		gone_first = comp_timeb(&now, &ecmhash->first_recv_time);
-		gone_upd = comp_timeb(&now, &ecmhash->upd_time);
+	if(!ok)
+	{
+		cs_log("can't write cache snapshot %s (errno=%d %s)", fname, errno, strerror(errno));
+		unlink(tmpname);
+	}
+	else
+	{
+		cs_ftime(&te);
+		cs_log_dbg(D_TRACE, "saved cache snapshot with %u cws, %u cw_cache, %u ecm_cache entries to %s in %"PRId64" ms",
+			buf.count[SNAP_CW], buf.count[SNAP_CW_CACHE], buf.count[SNAP_ECM_CACHE], fname, comp_timeb(&te, &ts));
+	}
+
+	for(section = 0; section < SNAP_SECTIONS; section++)
+		{ NULLFREE(buf.data[section]); }
+}
+
+static void snap_restore_cw(const CACHE_SNAP_CW *rec)
+{
+	CACHE_SHARD *shard = get_cache_shard(rec->csp_hash);
+	ECMHASH *ecmhash, *volatile *bucket;
+	CW *cw;
+	uint8_t j;
 
-		if(!force && gone_first<=(cfg.max_cache_time*1000)) // not continue, useless check for nexts one!
+	SAFE_RWLOCK_WRLOCK(&shard->lock);
+	if(!(ecmhash = find_ecmhash(shard, rec->csp_hash)))
+	{
+		if(!cs_malloc(&ecmhash, sizeof(ECMHASH)))
 		{
-			break;
+			SAFE_RWLOCK_UNLOCK(&shard->lock);
+			return;
 		}
+		ecmhash->csp_hash = rec->csp_hash;
+		snap_timeb(rec->first_recv_time, &ecmhash->first_recv_time);
+		snap_timeb(rec->upd_time, &ecmhash->upd_time);
+		bucket = get_cache_bucket(shard, rec->csp_hash);
+		ecmhash->next_hash = *bucket;
+		__sync_synchronize();
+		*bucket = ecmhash;
+		add_expiry_ring(&shard->ring, &ecmhash->ring_node, ecmhash, ecmhash->upd_time.time + cfg.max_cache_time + 1);
+		shard->count++;
+	}
+
+	for(j = 0; j < ecmhash->cw_count; j++)
+	{
+		if(!memcmp(ecmhash->cws[j]->cw, rec->cw, sizeof(rec->cw)))
+			{ break; }
+	}
+	if(j == ecmhash->cw_count && j < MAX_CACHE_CWS && cs_malloc(&cw, sizeof(CW)))
+	{
+		memcpy(cw->cw, rec->cw, sizeof(cw->cw));
+		cw->grp = rec->grp;
+		cw->prid = rec->prid;
+		cw->count = rec->count;
+		cw->caid = rec->caid;
+		cw->srvid = rec->srvid;
+		cw->odd_even = rec->odd_even;
+		cw->cwc_cycletime = rec->cwc_cycletime;
+		cw->cwc_next_cw_cycle = rec->cwc_next_cw_cycle;
+		cw->csp = (rec->flags & SNAP_CW_CSP) ? 1 : 0;
+		cw->cacheex = (rec->flags & SNAP_CW_CACHEEX) ? 1 : 0;
+		cw->localcards = (rec->flags & SNAP_CW_LOCALCARDS) ? 1 : 0;
+		cw->proxy = (rec->flags & SNAP_CW_PROXY) ? 1 : 0;
+#ifdef CS_CACHEEX_AIO
+		cw->localgenerated = (rec->flags & SNAP_CW_LG) ? 1 : 0;
+		if(cw->count >= 0x0F000000)
+			{ shard->lg_size++; }
+#endif
+		__sync_synchronize();
+		ecmhash->cws[ecmhash->cw_count++] = cw;
+		shard->cw_count++;
+	}
+	SAFE_RWLOCK_UNLOCK(&shard->lock);
+}
+
+#ifdef CS_CACHEEX_AIO
+static void snap_restore_cw_cache(const CACHE_SNAP_CW_CACHE *rec)
+{
+	CW_CACHE *cw_cache;
+
+	if(!cw_cache_init_done)
+		{ return; }
 
-		if(force || gone_upd>(cfg.max_cache_time*1000))
+	SAFE_RWLOCK_WRLOCK(&cw_cache_lock);
+	if(!find_hash_table(&ht_cw_cache, (void *)rec->cw, sizeof(rec->cw), &compare_cw_cache)
+		&& (!cfg.cw_cache_size || cfg.cw_cache_size > tommy_hashlin_count(&ht_cw_cache))
+		&& cs_malloc(&cw_cache, sizeof(CW_CACHE)))
+	{
+		memcpy(cw_cache->cw, rec->cw, sizeof(cw_cache->cw));
+		cw_cache->caid = rec->caid;
+		cw_cache->prid = rec->prid;
+		cw_cache->srvid = rec->srvid;
+		snap_timeb(rec->first_recv_time, &cw_cache->first_recv_time);
+		snap_timeb(rec->upd_time, &cw_cache->upd_time);
+		tommy_hashlin_insert(&ht_cw_cache, &cw_cache->ht_node, cw_cache, tommy_hash_u32(0, cw_cache->cw, sizeof(cw_cache->cw)));
+		tommy_list_insert_tail(&ll_cw_cache, &cw_cache->ll_node, cw_cache);
+	}
+	SAFE_RWLOCK_UNLOCK(&cw_cache_lock);
+}
+#endif
+
+// maps the snapshot and restores all entries updated within max_cache_time
+static void load_cache_snapshot(void)
+{
+	const CACHE_SNAP_HEADER *hdr;
+	const uint8_t *data, *rec;
+	char fname[256];
+	struct stat st;
+	struct timeb ts, te;
+	uint64_t size;
+	uint32_t n, loaded[SNAP_SECTIONS] = { 0 }, crc = 0;
+	int64_t now, max_age = (int64_t)cfg.max_cache_time * 1000;
+	int8_t section;
+	int fd;
+
+	if(!cfg.cache_snapshot_interval)
+		{ return; }
+
+	get_cache_snapshot_filename(fname, sizeof(fname));
+	if((fd = open(fname, O_RDONLY)) < 0)
+	{
+		cs_log_dbg(D_TRACE, "no cache snapshot %s", fname);
+		return;
+	}
+	if(fstat(fd, &st) || (size_t)st.st_size < sizeof(CACHE_SNAP_HEADER)
+		|| (data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+	{
+		close(fd);
+		cs_log("can't read cache snapshot %s", fname);
+		return;
+	}
+	close(fd);
+
+	cs_ftime(&ts);
+	now = snap_time(&ts);
+	hdr = (const CACHE_SNAP_HEADER *)data;
+
+	size = sizeof(CACHE_SNAP_HEADER);
+	for(section = 0; section < SNAP_SECTIONS; section++)
+		{ size += (uint64_t)hdr->count[section] * cache_snap_record_size[section]; }
+
+	if(memcmp(hdr->magic, CACHE_SNAP_MAGIC, sizeof(hdr->magic)) || hdr->version != CACHE_SNAP_VERSION
+		|| hdr->byteorder != CACHE_SNAP_BYTEORDER || hdr->header_size != sizeof(CACHE_SNAP_HEADER)
+		|| memcmp(hdr->record_size, cache_snap_record_size, sizeof(cache_snap_record_size))
+		|| size != (uint64_t)st.st_size
+		|| (size > sizeof(CACHE_SNAP_HEADER) && (crc = crc32(0, data + sizeof(CACHE_SNAP_HEADER), size - sizeof(CACHE_SNAP_HEADER))) != hdr->crc))
+	{
+		cs_log("ignoring cache snapshot %s: wrong version or damaged", fname);
+		munmap((void *)data, st.st_size);
+		return;
+	}
+
+	if(now - hdr->saved <= max_age)
+	{
+		rec = data + sizeof(CACHE_SNAP_HEADER);
+		for(section = 0; section < SNAP_SECTIONS; section++)
 		{
-			j = get_first_node_list(&ecmhash->ll_cw);
-			while(j)
+			for(n = 0; n < hdr->count[section]; n++, rec += cache_snap_record_size[section])
 			{
-				j_next = j->next;
-				cw = get_data_from_node(j);
-				if(cw)
+				switch(section)
 				{
-					pthread_rwlock_destroy(&cw->pushout_client_lock);
-					pc = cw->pushout_client;
-					cw->pushout_client=NULL;
-					while(pc)
-					{
-						nxt = pc->next_push;
-						NULLFREE(pc);
-						pc = nxt;
-					}
+				case SNAP_CW:
+					if(now - ((const CACHE_SNAP_CW *)rec)->upd_time > max_age)
+						{ continue; }
+					snap_restore_cw((const CACHE_SNAP_CW *)rec);
+					break;
 #ifdef CS_CACHEEX_AIO
-					if(cw->count >= 0x0F000000)
-					{
-						lg_cache_size--;
-					}
+				case SNAP_CW_CACHE:
+					if(now - ((const CACHE_SNAP_CW_CACHE *)rec)->upd_time > max_age)
+						{ continue; }
+					snap_restore_cw_cache((const CACHE_SNAP_CW_CACHE *)rec);
+					break;
+				case SNAP_ECM_CACHE:
+				{
+					struct timeb first_recv_time, upd_time;
+					if(now - ((const CACHE_SNAP_ECM_CACHE *)rec)->upd_time > max_age)
+						{ continue; }
+					snap_timeb(((const CACHE_SNAP_ECM_CACHE *)rec)->first_recv_time, &first_recv_time);
+					snap_timeb(((const CACHE_SNAP_ECM_CACHE *)rec)->upd_time, &upd_time);
+					ecm_cache_restore(((const CACHE_SNAP_ECM_CACHE *)rec)->csp_hash, &first_recv_time, &upd_time);
+					break;
+				}
 #endif
-					remove_elem_list(&ecmhash->ll_cw, &cw->ll_node);
-					remove_elem_hash_table(&ecmhash->ht_cw, &cw->ht_node);
-					NULLFREE(cw);
+				default:
+					continue;
 				}
-				j = j_next;
+				loaded[section]++;
 			}
-
-			deinitialize_hash_table(&ecmhash->ht_cw);
-			remove_elem_list(&ll_cache, &ecmhash->ll_node);
-			remove_elem_hash_table(&ht_cache, &ecmhash->ht_node);
-			NULLFREE(ecmhash);
 		}
-		i = i_next;
 	}
-	SAFE_RWLOCK_UNLOCK(&cache_lock);
+	munmap((void *)data, st.st_size);
+
+	cs_ftime(&te);
+	cs_log("loaded %u cws, %u cw_cache, %u ecm_cache entries from cache snapshot %s in %"PRId64" ms",
+		loaded[SNAP_CW], loaded[SNAP_CW_CACHE], loaded[SNAP_ECM_CACHE], fname, comp_timeb(&te, &ts));
 }
 
 #ifdef CS_CACHEEX_AIO
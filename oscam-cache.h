@@ -9,8 +9,10 @@ void free_cache(void);
 void add_cache(ECM_REQUEST *er);
 struct ecm_request_t *check_cache(ECM_REQUEST *er, struct s_client *cl);
 void cleanup_cache(bool force);
+void save_cache_snapshot(bool force);
 void remove_client_from_cache(struct s_client *cl);
 uint32_t cache_size(void);
+uint64_t cache_memory(uint32_t *per_cw);
 #ifdef CS_CACHEEX_AIO
 uint32_t cache_size_lg(void);
 #endif
@@ -1,6 +1,7 @@
 #define MODULE_LOG_PREFIX "chk"
 
 #include "globals.h"
+#include "oscam-array.h"
 #include "oscam-cache.h"
 #include "oscam-chk.h"
 #include "oscam-ecm.h"
@@ -45,9 +46,11 @@ static int32_t find_nano(uint8_t *ecm, int32_t l, uint8_t nano, int32_t s)
 	return (s < l) ? ++s : 0;
 }
 
+#define CLASS_BIT(bits, c) ((bits)[(c) >> 5] & (1U << ((c) & 31)))
+
 static int32_t chk_class(ECM_REQUEST *er, CLASSTAB *clstab, const char *type, const char *name)
 {
-	int32_t i, j, an, cl_n, l;
+	int32_t j, an, cl_n, l;
 	uint8_t ecm_class;
 
 	if(er->caid != 0x0500 && er->caid != 0x4AE1) { return 1; }
@@ -65,25 +68,16 @@ static int32_t chk_class(ECM_REQUEST *er, CLASSTAB *clstab, const char *type, co
 			ecm_class = er->ecm[j + l];
 			cs_log_dbg(D_CLIENT, "ecm class=%02X", ecm_class);
 
-			for(i = 0; i < clstab->bn; i++) // search in blocked
+			if(CLASS_BIT(clstab->bbits, ecm_class)) // blocked
 			{
-				if(ecm_class == clstab->bclass[i])
-				{
-					cs_log_dbg(D_CLIENT, "class %02X rejected by %s '%s' !%02X filter",
-								ecm_class, type, name, ecm_class);
-					return 0;
-				}
+				cs_log_dbg(D_CLIENT, "class %02X rejected by %s '%s' !%02X filter",
+							ecm_class, type, name, ecm_class);
+				return 0;
 			}
 			cl_n++;
 
-			for(i = 0; i < clstab->an; i++) // search in allowed
-			{
-				if(ecm_class == clstab->aclass[i])
-				{
-					an++;
-					break;
-				}
-			}
+			if(CLASS_BIT(clstab->abits, ecm_class)) // allowed
+				{ an++; }
 			j += l;
 		}
 	}
@@ -95,24 +89,15 @@ static int32_t chk_class(ECM_REQUEST *er, CLASSTAB *clstab, const char *type, co
 		ecm_class = er->ecm[5];
 		cs_log_dbg(D_CLIENT, "ecm class=%02X", ecm_class);
 
-		for(i = 0; i < clstab->bn; i++) // search in blocked
+		if(CLASS_BIT(clstab->bbits, ecm_class)) // blocked
 		{
-			if(ecm_class == clstab->bclass[i])
-			{
-				cs_log_dbg(D_CLIENT, "class %02X rejected by %s '%s' !%02X filter",
-					ecm_class, type, name, ecm_class);
-				return 0;
-			}
+			cs_log_dbg(D_CLIENT, "class %02X rejected by %s '%s' !%02X filter",
+				ecm_class, type, name, ecm_class);
+			return 0;
 		}
 
-		for(i = 0; i < clstab->an; i++) // search in allowed
-		{
-			if(ecm_class == clstab->aclass[i])
-			{
-				an++;
-				break;
-			}
-		}
+		if(CLASS_BIT(clstab->abits, ecm_class)) // allowed
+			{ an++; }
 	}
 
 	if(cl_n && clstab->an)
@@ -129,29 +114,51 @@ static int32_t chk_class(ECM_REQUEST *er, CLASSTAB *clstab, const char *type, co
 	return 1;
 }
 
-int32_t chk_srvid_match(ECM_REQUEST *er, SIDTAB *sidtab)
+static int32_t sidtab_has_caid(SIDTAB *sidtab, uint16_t caid)
 {
-	int32_t i, rc = 0;
+	int32_t i;
 
-	if(!sidtab->num_caid)
-		{ rc |= 1; }
-	else
-		for(i = 0; (i < sidtab->num_caid) && (!(rc & 1)); i++)
-			if(er->caid == sidtab->caid[i]) { rc |= 1; }
+	if(sidtab->caid_sorted)
+		{ return array_find_u16(sidtab->caid_sorted, sidtab->num_caid, caid); }
 
-	if(!er->prid || !sidtab->num_provid)
-		{ rc |= 2; }
-	else
-		for(i = 0; (i < sidtab->num_provid) && (!(rc & 2)); i++)
-			if(er->prid == sidtab->provid[i]) { rc |= 2; }
+	for(i = 0; i < sidtab->num_caid; i++)
+		if(caid == sidtab->caid[i]) { return 1; }
+	return 0;
+}
 
-	if(!sidtab->num_srvid)
-		{ rc |= 4; }
-	else
-		for(i = 0; (i < sidtab->num_srvid) && (!(rc & 4)); i++)
-			if(er->srvid == sidtab->srvid[i]) { rc |= 4; }
+static int32_t sidtab_has_provid(SIDTAB *sidtab, uint32_t provid)
+{
+	int32_t i;
+
+	if(sidtab->provid_sorted)
+		{ return array_find_u32(sidtab->provid_sorted, sidtab->num_provid, provid); }
 
-	return (rc == 7);
+	for(i = 0; i < sidtab->num_provid; i++)
+		if(provid == sidtab->provid[i]) { return 1; }
+	return 0;
+}
+
+static int32_t sidtab_has_srvid(SIDTAB *sidtab, uint16_t srvid)
+{
+	int32_t i;
+
+	if(sidtab->srvid_sorted)
+		{ return array_find_u16(sidtab->srvid_sorted, sidtab->num_srvid, srvid); }
+
+	for(i = 0; i < sidtab->num_srvid; i++)
+		if(srvid == sidtab->srvid[i]) { return 1; }
+	return 0;
+}
+
+int32_t chk_srvid_match(ECM_REQUEST *er, SIDTAB *sidtab)
+{
+	if(sidtab->num_caid && !sidtab_has_caid(sidtab, er->caid))
+		{ return 0; }
+
+	if(er->prid && sidtab->num_provid && !sidtab_has_provid(sidtab, er->prid))
+		{ return 0; }
+
+	return !sidtab->num_srvid || sidtab_has_srvid(sidtab, er->srvid);
 }
 
 #ifdef CS_CACHEEX_AIO
@@ -263,21 +270,10 @@ int32_t has_lb_srvid(struct s_client *cl, ECM_REQUEST *er)
 
 int32_t chk_srvid_match_by_caid_prov(uint16_t caid, uint32_t provid, SIDTAB *sidtab)
 {
-	int32_t i, rc = 0;
-
-	if(!sidtab->num_caid)
-		{ rc |= 1; }
-	else
-		for(i = 0; (i < sidtab->num_caid) && (!(rc & 1)); i++)
-			if(caid == sidtab->caid[i]) { rc |= 1; }
-
-	if(!sidtab->num_provid)
-		{ rc |= 2; }
-	else
-		for(i = 0; (i < sidtab->num_provid) && (!(rc & 2)); i++)
-			if(provid == sidtab->provid[i]) { rc |= 2; }
+	if(sidtab->num_caid && !sidtab_has_caid(sidtab, caid))
+		{ return 0; }
 
-	return (rc == 3);
+	return !sidtab->num_provid || sidtab_has_provid(sidtab, provid);
 }
 
 int32_t chk_srvid_by_caid_prov(struct s_client *cl, uint16_t caid, uint32_t provid)
@@ -426,115 +422,60 @@ int32_t chk_sfilter(ECM_REQUEST *er, PTAB *ptab)
 
 static int32_t chk_chid(ECM_REQUEST *er, FTAB *fchid, char *type, char *name)
 {
-	int32_t rc = 1, i, j, found_caid = 0;
 	if(!fchid->nfilts) { return 1; }
 	if(er->chid == 0 && er->ecm[0] == 0) { return 1; } // skip empty ecm, chid 00 to avoid no matching readers in dvbapi
 
-	for(i = rc = 0; (!rc) && i < fchid->nfilts; i++)
+	if(ftab_has_ident(fchid, er->caid, er->chid))
 	{
-		if(er->caid == fchid->filts[i].caid)
-		{
-			found_caid = 1;
-			for(j = 0; (!rc) && j < fchid->filts[i].nprids; j++)
-			{
-				cs_log_dbg(D_CLIENT, "trying %s '%s' CHID filter %04X:%04X",
-						type, name, fchid->filts[i].caid, fchid->filts[i].prids[j]);
-
-				if(er->chid == fchid->filts[i].prids[j])
-				{
-					cs_log_dbg(D_CLIENT, "%04X:%04X allowed by %s '%s' CHID filter %04X:%04X",
-							er->caid, er->chid, type, name, fchid->filts[i].caid, fchid->filts[i].prids[j]);
-					rc = 1;
-				}
-			}
-		}
+		cs_log_dbg(D_CLIENT, "%04X:%04X allowed by %s '%s' CHID filter",
+					er->caid, er->chid, type, name);
+		return 1;
 	}
 
-	if(!rc)
+	if(ftab_has_caid(fchid, er->caid))
 	{
-		if(found_caid)
-			cs_log_dbg(D_CLIENT, "no match, %04X:%04X rejected by %s '%s' CHID filter(s)",
-						er->caid, er->chid, type, name);
-		else
-		{
-			rc = 1;
-			cs_log_dbg(D_CLIENT, "%04X:%04X allowed by %s '%s' CHID filter, CAID not spezified",
-						er->caid, er->chid, type, name);
-		}
+		cs_log_dbg(D_CLIENT, "no match, %04X:%04X rejected by %s '%s' CHID filter(s)",
+					er->caid, er->chid, type, name);
+		return 0;
 	}
-	return (rc);
+
+	cs_log_dbg(D_CLIENT, "%04X:%04X allowed by %s '%s' CHID filter, CAID not spezified",
+				er->caid, er->chid, type, name);
+	return 1;
 }
 
 int32_t chk_ident_filter(uint16_t rcaid, uint32_t rprid, FTAB *ftab)
 {
-	int32_t i, j, rc = 1;
-	uint16_t caid = 0;
-	uint32_t prid = 0;
-
-	if(ftab->nfilts)
-	{
-		for(rc = i = 0; (!rc) && (i < ftab->nfilts); i++)
-		{
-			caid = ftab->filts[i].caid;
-			if((caid != 0 && caid == rcaid) || caid == 0)
-			{
-				for(j = 0; (!rc) && (j < ftab->filts[i].nprids); j++)
-				{
-					prid = ftab->filts[i].prids[j];
-					if(prid == rprid)
-					{
-						rc=1;
-					}
-				}
-			}
-		}
-
-		if(!rc)
-			{ return 0; }
-	}
+	if(!ftab->nfilts)
+		{ return 1; }
 
-	return(rc);
+	// filters with caid 0 match any caid
+	return ftab_has_ident(ftab, rcaid, rprid) || ftab_has_ident(ftab, 0, rprid);
 }
 
 int32_t chk_ufilters(ECM_REQUEST *er)
 {
-	int32_t i, j, rc = 1;
-	uint16_t ucaid;
-	uint32_t uprid;
+	int32_t rc = 1;
 	struct s_client *cur_cl = cur_client();
 
 	if(cur_cl->ftab.nfilts)
 	{
 		FTAB *f = &cur_cl->ftab;
-		for(i = rc = 0; (!rc) && (i < f->nfilts); i++)
-		{
-			ucaid = f->filts[i].caid;
-			if(er->caid == 0 || ucaid == 0 || (er->caid != 0 && er->caid == ucaid))
-			{
-				if (er->prid == 0)
-				{
-					cs_log_dbg(D_CLIENT, "%04X@%06X allowed by user '%s' filter caid %04X prid %06X",
-								er->caid, er->prid, cur_cl->account->usr, ucaid, 0);
-					rc = 1;
-					break;
-				}
 
-				for(j = rc = 0; (!rc) && (j < f->filts[i].nprids); j++)
-				{
-					uprid = f->filts[i].prids[j];
-					cs_log_dbg(D_CLIENT, "trying user '%s' filter %04X@%06X", cur_cl->account->usr, ucaid, uprid);
+		// filters with caid 0 match any caid, an ecm without caid matches any filter
+		if(!er->caid)
+			{ rc = !er->prid || ftab_has_any_ident(f, er->prid); }
+		else if(!ftab_has_caid(f, er->caid) && !ftab_has_caid(f, 0))
+			{ rc = 0; }
+		else
+			{ rc = !er->prid || ftab_has_ident(f, er->caid, er->prid) || ftab_has_ident(f, 0, er->prid); }
 
-					if(er->prid == uprid)
-					{
-						rc = 1;
-						cs_log_dbg(D_CLIENT, "%04X@%06X allowed by user '%s' filter %04X@%06X",
-									er->caid, er->prid, cur_cl->account->usr, ucaid, uprid);
-					}
-				}
-			}
+		if(rc)
+		{
+			cs_log_dbg(D_CLIENT, "%04X@%06X allowed by user '%s' filter",
+						er->caid, er->prid, cur_cl->account->usr);
 		}
-
-		if(!rc)
+		else
 		{
 			cs_log_dbg(D_CLIENT, "no match, %04X@%06X rejected by user '%s' filters",
 						er->caid, er->prid, cur_cl->account->usr);
@@ -604,41 +545,19 @@ int32_t chk_rsfilter(struct s_reader *reader, ECM_REQUEST *er)
 
 int32_t chk_rfilter2(uint16_t rcaid, uint32_t rprid, struct s_reader *rdr)
 {
-	int32_t i, j, rc = 1;
-	uint16_t caid = 0;
-	uint32_t prid = 0;
+	if(!rdr->ftab.nfilts)
+		{ return 1; }
 
-	if(rdr->ftab.nfilts)
+	if(!chk_ident_filter(rcaid, rprid, &rdr->ftab))
 	{
-		for(rc = i = 0; (!rc) && (i < rdr->ftab.nfilts); i++)
-		{
-			caid = rdr->ftab.filts[i].caid;
-			if((caid != 0 && caid == rcaid) || caid == 0)
-			{
-				for(j = 0; (!rc) && (j < rdr->ftab.filts[i].nprids); j++)
-				{
-					prid = rdr->ftab.filts[i].prids[j];
-					cs_log_dbg(D_CLIENT, "trying reader '%s' filter %04X@%06X", rdr->label, caid, prid);
-
-					if(prid == rprid)
-					{
-						rc = 1;
-						cs_log_dbg(D_CLIENT, "%04X@%06X allowed by reader '%s' filter %04X@%06X",
-									rcaid, rprid, rdr->label, caid, prid);
-					}
-				}
-			}
-		}
-
-		if(!rc)
-		{
-			cs_log_dbg(D_CLIENT, "no match, %04X@%06X rejected by reader '%s' filters",
-						rcaid, rprid, rdr->label);
-			return 0;
-		}
+		cs_log_dbg(D_CLIENT, "no match, %04X@%06X rejected by reader '%s' filters",
+					rcaid, rprid, rdr->label);
+		return 0;
 	}
 
-	return (rc);
+	cs_log_dbg(D_CLIENT, "%04X@%06X allowed by reader '%s' filter",
+				rcaid, rprid, rdr->label);
+	return 1;
 }
 
 static int32_t chk_rfilter(ECM_REQUEST *er, struct s_reader *rdr)
@@ -651,18 +570,7 @@ int32_t chk_ctab(uint16_t caid, CAIDTAB *ctab)
 	if(!caid || !ctab->ctnum)
 		{ return 1; }
 
-	int32_t i;
-	for(i = 0; i < ctab->ctnum; i++)
-	{
-		CAIDTAB_DATA *d = &ctab->ctdata[i];
-		if(!d->caid)
-		{
-			return 0;
-		}
-		if((caid & d->mask) == d->caid)
-			{ return 1; }
-	}
-	return 0;
+	return caidtab_has_caid(ctab, caid);
 }
 
 int32_t chk_ctab_ex(uint16_t caid, CAIDTAB *ctab)
@@ -670,21 +578,7 @@ int32_t chk_ctab_ex(uint16_t caid, CAIDTAB *ctab)
 	if(!caid || !ctab->ctnum)
 		{ return 0; }
 
-	int32_t i;
-	for(i = 0; i < ctab->ctnum; i++)
-	{
-		CAIDTAB_DATA *d = &ctab->ctdata[i];
-		if(!d->caid)
-		{
-			return 0;
-		}
-
-		if((caid & d->mask) == d->caid)
-		{
-			return 1;
-		}
-	}
-	return 0;
+	return caidtab_has_caid(ctab, caid);
 }
 
 uint8_t is_localreader(struct s_reader *rdr, ECM_REQUEST *er) // to be used for LB/reader selections checks only
@@ -7,6 +7,7 @@
 #include "module-cccam.h"
 #include "module-webif.h"
 #include "oscam-array.h"
+#include "oscam-cache.h"
 #include "oscam-conf-chk.h"
 #include "oscam-client.h"
 #include "oscam-ecm.h"
@@ -693,6 +694,12 @@ void client_check_status(struct s_client *cl)
 				add_job(cl, ACTION_CLIENT_IDLE, NULL, 0);
 			}
 
+			if(cl->hidecards_until && time(NULL) >= cl->hidecards_until)
+			{
+				cl->hidecards_until = 0;
+				add_job(cl, ACTION_CLIENT_UNHIDECARDS, NULL, 0);
+			}
+
 			// Check umaxidle to avoid client is killed for inactivity, it has priority than cmaxidle
 			if(!cl->account->umaxidle)
 			{
@@ -812,7 +819,9 @@ void free_client(struct s_client *cl)
 	}
 
 	cs_writeunlock(__func__, &clientlist_lock);
+	work_pool_detach(cl);
 	cleanup_ecmtasks(cl);
+	remove_client_from_cache(cl);
 
 	// Clean reader. The cleaned structures should be only used by the reader thread, so we should be save without waiting
 	if(rdr)
@@ -863,6 +872,7 @@ void free_client(struct s_client *cl)
 	{
 		close(cl->pfd);
 	}
+	cs_wakeup_close(&cl->work_wakeup);
 
 	// Clean all remaining structures
 	free_joblist(cl);
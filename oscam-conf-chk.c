@@ -383,9 +383,15 @@ void chk_cltab(char *classasc, CLASSTAB *clstab)
 	{
 		ptr1 = trim(ptr1);
 		if(ptr1[0] == '!' && newclstab.bclass != NULL)
-			{ newclstab.bclass[newclstab.bn++] = (uint8_t)a2i(ptr1 + 1, 2); }
+		{
+			uint8_t c = newclstab.bclass[newclstab.bn++] = (uint8_t)a2i(ptr1 + 1, 2);
+			newclstab.bbits[c >> 5] |= 1U << (c & 31);
+		}
 		else if(newclstab.aclass != NULL)
-			{ newclstab.aclass[newclstab.an++] = (uint8_t)a2i(ptr1, 2); }
+		{
+			uint8_t c = newclstab.aclass[newclstab.an++] = (uint8_t)a2i(ptr1, 2);
+			newclstab.abits[c >> 5] |= 1U << (c & 31);
+		}
 	}
 
 	NULLFREE(classasc_org);
@@ -304,6 +304,7 @@ void global_fixups_fn(void *UNUSED(var))
 #endif
 	}
 	if(cfg.netprio <= 0 || cfg.netprio > 20) { cfg.netprio = 0; }
+	if(cfg.threading_workers < 0) { cfg.threading_workers = 0; }
 	if(cfg.max_log_size != 0 && cfg.max_log_size <= 10) { cfg.max_log_size = 10; }
 #ifdef WITH_LB
 	if(cfg.lb_save > 0 && cfg.lb_save < 100) { cfg.lb_save = 100; }
@@ -374,12 +375,15 @@ static const struct config_list global_opts[] =
 	DEF_OPT_INT8("lb_reopen_invalid"               , OFS(lb_reopen_invalid)             , 1),
 	DEF_OPT_INT8("lb_force_reopen_always"          , OFS(lb_force_reopen_always)        , 0),
 	DEF_OPT_INT32("lb_retrylimit"                  , OFS(lb_retrylimit)                 , DEFAULT_RETRYLIMIT),
+	DEF_OPT_INT32("lb_percentile"                  , OFS(lb_percentile)                 , DEFAULT_LB_PERCENTILE),
+	DEF_OPT_INT32("lb_hedge"                       , OFS(lb_hedge)                      , 0),
 	DEF_OPT_INT32("lb_stat_cleanup"                , OFS(lb_stat_cleanup)               , DEFAULT_LB_STAT_CLEANUP),
 	DEF_OPT_INT32("lb_max_readers"                 , OFS(lb_max_readers)                , 0),
 	DEF_OPT_INT32("lb_auto_betatunnel"             , OFS(lb_auto_betatunnel)            , DEFAULT_LB_AUTO_BETATUNNEL),
 	DEF_OPT_INT32("lb_auto_betatunnel_mode"        , OFS(lb_auto_betatunnel_mode)       , DEFAULT_LB_AUTO_BETATUNNEL_MODE),
 	DEF_OPT_INT32("lb_auto_betatunnel_prefer_beta" , OFS(lb_auto_betatunnel_prefer_beta), DEFAULT_LB_AUTO_BETATUNNEL_PREFER_BETA),
 	DEF_OPT_STR("lb_savepath"                      , OFS(lb_savepath)                   , NULL),
+	DEF_OPT_INT8("lb_save_binary"                  , OFS(lb_save_binary)                , 0),
 	DEF_OPT_FUNC("lb_retrylimits"                  , OFS(lb_retrylimittab)              , caidvaluetab_fn),
 	DEF_OPT_FUNC("lb_nbest_percaid"                , OFS(lb_nbest_readers_tab)          , caidvaluetab_fn),
 	DEF_OPT_FUNC("lb_noproviderforcaid"            , OFS(lb_noproviderforcaid)          , check_caidtab_fn),
@@ -395,6 +399,10 @@ static const struct config_list global_opts[] =
 	DEF_OPT_INT8("suppresscmd08"                   , OFS(c35_suppresscmd08)             , 0),
 	DEF_OPT_INT8("getblockemmauprovid"             , OFS(getblockemmauprovid)           , 0),
 	DEF_OPT_INT8("double_check"                    , OFS(double_check)                  , 0),
+	DEF_OPT_INT8("ecm_singleflight"                , OFS(ecm_singleflight)              , 1),
+	DEF_OPT_INT8("threading_mode"                  , OFS(threading_mode)                , 0),
+	DEF_OPT_INT32("threading_workers"              , OFS(threading_workers)             , 0),
+	DEF_OPT_INT8("lock_profile"                    , OFS(lock_profile)                  , 0),
 	DEF_OPT_INT8("disablecrccws"                   , OFS(disablecrccws)                 , 0),
 	DEF_OPT_FUNC("disablecrccws_only_for"          , OFS(disablecrccws_only_for)        , chk_ftab_fn),
 	DEF_LAST_OPT
@@ -623,6 +631,9 @@ static const struct config_list camd33_opts[] = { DEF_LAST_OPT };
 void cache_fixups_fn(void *UNUSED(var))
 {
 	if(cfg.max_cache_time < ((int32_t)(cfg.ctimeout + 500) / 1000 + 3)) { cfg.max_cache_time = ((cfg.ctimeout + 500) / 1000 + 3); }
+	if(cfg.cache_shards < 1) { cfg.cache_shards = 1; }
+	if(cfg.cache_shards > MAX_CACHE_SHARDS) { cfg.cache_shards = MAX_CACHE_SHARDS; }
+	while(cfg.cache_shards & (cfg.cache_shards - 1)) { cfg.cache_shards &= cfg.cache_shards - 1; } // round down to power of two
 #ifdef CW_CYCLE_CHECK
 	if(cfg.maxcyclelist > 4000) { cfg.maxcyclelist = 4000; }
 	if(cfg.keepcycletime > 240) { cfg.keepcycletime = 240; }
@@ -640,7 +651,7 @@ void cache_fixups_fn(void *UNUSED(var))
 
 static bool cache_should_save_fn(void *UNUSED(var))
 {
-	return cfg.delay > 0 || cfg.max_cache_time != 15
+	return cfg.delay > 0 || cfg.max_cache_time != 15 || cfg.cache_shards != DEFAULT_CACHE_SHARDS || cfg.cache_snapshot_interval
 #ifdef CS_CACHEEX
 #ifdef CS_CACHEEX_AIO
 			|| cfg.cacheex_lg_only_tab.nfilts || cfg.cacheex_lg_only_in_tab.nfilts || cfg.cacheex_lg_only_remote_settings || cfg.cacheex_lg_only_in_aio_only || cfg.cacheex_push_lg_groups || cfg.cacheex_filter_caidtab_aio.cevnum || cfg.cacheex_filter_caidtab.cevnum || cfg.cacheex_localgenerated_only_caidtab.ctnum || cfg.cacheex_localgenerated_only_in_caidtab.ctnum || cfg.cacheex_localgenerated_only_in || cfg.cacheex_localgenerated_only || cfg.cacheex_dropdiffs || cfg.cw_cache_settings.cwchecknum || cfg.cw_cache_size > 0 || cfg.cw_cache_memory > 0 || cfg.cacheex_wait_timetab.cevnum || cfg.cacheex_enable_stats > 0 || cfg.csp_port || cfg.csp.filter_caidtab.cevnum || cfg.csp.allow_request == 0 || cfg.csp.allow_reforward > 0
@@ -660,6 +671,9 @@ static const struct config_list cache_opts[] =
 	DEF_OPT_FIXUP_FUNC(cache_fixups_fn),
 	DEF_OPT_UINT32("delay"                , OFS(delay)                  , CS_DELAY),
 	DEF_OPT_INT32("max_time"              , OFS(max_cache_time)         , DEFAULT_MAX_CACHE_TIME),
+	DEF_OPT_UINT8("shards"                , OFS(cache_shards)           , DEFAULT_CACHE_SHARDS),
+	DEF_OPT_UINT32("snapshot_interval"    , OFS(cache_snapshot_interval), 0),
+	DEF_OPT_STR("snapshot_file"           , OFS(cache_snapshot_file)    , NULL),
 #ifdef CS_CACHEEX
 #ifdef CS_CACHEEX_AIO
 	DEF_OPT_UINT32("cw_cache_size"        , OFS(cw_cache_size)          , 0),
@@ -4,6 +4,7 @@
 
 #include "globals.h"
 
+#include "oscam-array.h"
 #include "oscam-conf.h"
 #include "oscam-conf-chk.h"
 #include "oscam-config.h"
@@ -107,6 +108,9 @@ void free_sidtab(struct s_sidtab *ptr)
 	add_garbage(ptr->caid); //no need to check on NULL first, freeing NULL doesnt do anything
 	add_garbage(ptr->provid);
 	add_garbage(ptr->srvid);
+	add_garbage(ptr->caid_sorted);
+	add_garbage(ptr->provid_sorted);
+	add_garbage(ptr->srvid_sorted);
 	add_garbage(ptr);
 }
 
@@ -170,22 +174,44 @@ static void chk_entry4sidtab(char *value, struct s_sidtab *sidtab, int32_t what)
 		else
 			{ llist[i++] = caid; }
 	}
+	// sorted copy for the lookups in chk_srvid_match(), keep the configured order for display
+	uint16_t *ssorted = NULL;
+	uint32_t *lsorted = NULL;
+	if(slist && i && cs_malloc(&ssorted, i * sizeof(uint16_t)))
+	{
+		memcpy(ssorted, slist, i * sizeof(uint16_t));
+		array_sort_u16(ssorted, i);
+	}
+	if(llist && i && cs_malloc(&lsorted, i * sizeof(uint32_t)))
+	{
+		memcpy(lsorted, llist, i * sizeof(uint32_t));
+		array_sort_u32(lsorted, i);
+	}
 	switch(what)
 	{
 	case 0:
+		add_garbage(sidtab->caid_sorted);
+		sidtab->caid_sorted = NULL;
 		add_garbage(sidtab->caid);
 		sidtab->caid = slist;
 		sidtab->num_caid = i;
+		sidtab->caid_sorted = ssorted;
 		break;
 	case 1:
+		add_garbage(sidtab->provid_sorted);
+		sidtab->provid_sorted = NULL;
 		add_garbage(sidtab->provid);
 		sidtab->provid = llist;
 		sidtab->num_provid = i;
+		sidtab->provid_sorted = lsorted;
 		break;
 	case 2:
+		add_garbage(sidtab->srvid_sorted);
+		sidtab->srvid_sorted = NULL;
 		add_garbage(sidtab->srvid);
 		sidtab->srvid = slist;
 		sidtab->num_srvid = i;
+		sidtab->srvid_sorted = ssorted;
 		break;
 	}
 }
@@ -1602,6 +1628,7 @@ int32_t chk_cccam_cfg_F_more(char *line,struct s_auth * account)
 						provid=(uint32_t)a2i(p3,6);
 						account->ftab.filts[dno].prids[account->ftab.filts[dno].nprids]=provid;
 						account->ftab.filts[dno].nprids++;
+						ftab_index(&account->ftab);
 					}
 					if(dno==2){
 #ifdef MODULE_CCCSHARE
@@ -18,7 +18,9 @@
 #include "oscam-garbage.h"
 #include "oscam-failban.h"
 #include "oscam-net.h"
+#include "oscam-pool.h"
 #include "oscam-time.h"
+#include "oscam-latency.h"
 #include "oscam-lock.h"
 #include "oscam-string.h"
 #include "oscam-work.h"
@@ -34,12 +36,12 @@ extern uint16_t len4caid[256];
 extern uint32_t ecmcwcache_size;
 extern int32_t exit_oscam;
 
+extern CS_MUTEX_LOCK ecm_deadline_lock;
+
 extern CS_MUTEX_LOCK ecm_pushed_deleted_lock;
 extern struct ecm_request_t	*ecm_pushed_deleted;
 
-static pthread_mutex_t cw_process_sleep_cond_mutex;
-static pthread_cond_t cw_process_sleep_cond;
-static int cw_process_wakeups;
+static struct s_wakeup cw_process_wakeup;
 int64_t ecmc_next, cache_next, msec_wait = 3000;
 
 #ifdef CS_CACHEEX_AIO
@@ -78,68 +80,78 @@ void init_ecm_cache(void)
 #endif
 }
 
-static uint8_t time_sort(ECM_CACHE *a, ECM_CACHE *b)
-{
-	if (((int64_t)(a->upd_time.time) * 1000ull + (int64_t) a->upd_time.millitm) == ((int64_t)(b->upd_time.time) * 1000ull + (int64_t) b->upd_time.millitm)) return 0;
-	return (((int64_t)(a->upd_time.time) * 1000ull + (int64_t) a->upd_time.millitm) > ((int64_t)(b->upd_time.time) * 1000ull + (int64_t) b->upd_time.millitm)) ? -1 : 1;
-}
-
 static int compare_csp_hash_ecmcache(const void *arg, const void *obj)
 {
 	uint32_t h = ((const ECM_CACHE*)obj)->csp_hash;
 	return memcmp(arg, &h, 4);
 }
 
-void ecm_cache_cleanup(bool force)
+// cache snapshot (oscam-cache.c): fn is called under the read lock
+void ecm_cache_foreach(void (*fn)(uint32_t csp_hash, struct timeb *first_recv_time, struct timeb *upd_time, void *arg), void *arg)
 {
+	ECM_CACHE *ecm_cache;
+	node *i;
+
 	if(!ecm_cache_init_done)
 		{ return; }
 
-	SAFE_RWLOCK_WRLOCK(&ecm_cache_lock);
+	SAFE_RWLOCK_RDLOCK(&ecm_cache_lock);
+	for(i = get_first_node_list(&ll_ecm_cache); i; i = i->next)
+	{
+		if((ecm_cache = get_data_from_node(i)))
+			{ fn(ecm_cache->csp_hash, &ecm_cache->first_recv_time, &ecm_cache->upd_time, arg); }
+	}
+	SAFE_RWLOCK_UNLOCK(&ecm_cache_lock);
+}
 
+void ecm_cache_restore(uint32_t csp_hash, struct timeb *first_recv_time, struct timeb *upd_time)
+{
 	ECM_CACHE *ecm_cache;
-	node *i, *i_next;
-	uint32_t ll_c = 0;
-	uint32_t ll_ten_percent = (uint)tommy_list_count(&ll_ecm_cache)*0.1; // 10 percent of cache
 
-	if(!force)
-		sort_list(&ll_ecm_cache, time_sort);
+	if(!ecm_cache_init_done)
+		{ return; }
 
-	i = get_first_node_list(&ll_ecm_cache);
-	while(i)
+	SAFE_RWLOCK_WRLOCK(&ecm_cache_lock);
+	if(!find_hash_table(&ht_ecm_cache, &csp_hash, sizeof(uint32_t), &compare_csp_hash_ecmcache)
+		&& (!cfg.ecm_cache_size || cfg.ecm_cache_size > tommy_hashlin_count(&ht_ecm_cache))
+		&& cs_malloc(&ecm_cache, sizeof(ECM_CACHE)))
 	{
-		i_next = i->next;
+		ecm_cache->csp_hash = csp_hash;
+		ecm_cache->first_recv_time = *first_recv_time;
+		ecm_cache->upd_time = *upd_time;
+		tommy_hashlin_insert(&ht_ecm_cache, &ecm_cache->ht_node, ecm_cache, tommy_hash_u32(0, &csp_hash, sizeof(csp_hash)));
+		tommy_list_insert_tail(&ll_ecm_cache, &ecm_cache->ll_node, ecm_cache);
+	}
+	SAFE_RWLOCK_UNLOCK(&ecm_cache_lock);
+}
 
-		ecm_cache = get_data_from_node(i);
+void ecm_cache_cleanup(bool force)
+{
+	if(!ecm_cache_init_done)
+		{ return; }
 
-		if(!ecm_cache)
-		{
-			i = i_next;
-			continue;
-		}
-		if(!force)
-		{
-			++ll_c;
+	ECM_CACHE *ecm_cache;
+	node *i;
+	uint32_t freed = 0, ll_ten_percent;
+	struct timeb ts, te;
 
-			if(ll_c < ll_ten_percent)
-			{
-				remove_elem_list(&ll_ecm_cache, &ecm_cache->ll_node);
-				remove_elem_hash_table(&ht_ecm_cache, &ecm_cache->ht_node);
-				NULLFREE(ecm_cache);
-			}
-			else{
-				break;
-			}
-		}
-		else{
-			remove_elem_list(&ll_ecm_cache, &ecm_cache->ll_node);
-			remove_elem_hash_table(&ht_ecm_cache, &ecm_cache->ht_node);
-			NULLFREE(ecm_cache);
-		}
-		i = i_next;
+	cs_ftimeus(&ts);
+	SAFE_RWLOCK_WRLOCK(&ecm_cache_lock);
+
+	// ll_ecm_cache is kept in upd_time order, oldest first: drop 10 percent of cache
+	ll_ten_percent = (uint)tommy_list_count(&ll_ecm_cache)*0.1;
+	while((i = get_first_node_list(&ll_ecm_cache)) && (force || freed + 1 < ll_ten_percent))
+	{
+		ecm_cache = get_data_from_node(i);
+		remove_elem_list(&ll_ecm_cache, &ecm_cache->ll_node);
+		remove_elem_hash_table(&ht_ecm_cache, &ecm_cache->ht_node);
+		NULLFREE(ecm_cache);
+		freed++;
 	}
 
 	SAFE_RWLOCK_UNLOCK(&ecm_cache_lock);
+	cs_ftimeus(&te);
+	cs_log_dbg(D_CW_CACHE, "[ecm_cache] cleanup freed %u in %"PRId64" us", freed, comp_timebus(&te, &ts));
 }
 #endif
 
@@ -185,6 +197,345 @@ void ecm_timeout(ECM_REQUEST *er)
 	}
 }
 
+/**
+ * ecmcwcache index: hash buckets over caid + ecmd5, protected by ecmcache_lock.
+ * Every bucket chains its ecms newest first (like ecmcwcache itself), so lookups
+ * can stop at the first entry older than the wanted age.
+ **/
+static ECM_REQUEST **ecmcwcache_index;
+static uint32_t ecmcwcache_index_mask;
+static uint32_t ecmcwcache_index_count;
+
+static inline uint32_t ecmcwcache_index_hash(ECM_REQUEST *er)
+{
+	uint32_t h;
+	memcpy(&h, er->ecmd5, sizeof(h));
+	return (h ^ (er->caid * 0x9E3779B1)) & ecmcwcache_index_mask;
+}
+
+static inline bool ecmcwcache_same(ECM_REQUEST *ecm, ECM_REQUEST *er)
+{
+	return ecm->caid == er->caid && !memcmp(ecm->ecmd5, er->ecmd5, CS_ECMSTORESIZE);
+}
+
+static bool ecmcwcache_index_resize(uint32_t buckets)
+{
+	ECM_REQUEST **index, *ecm, **pp;
+
+	if(!cs_malloc(&index, buckets * sizeof(ECM_REQUEST *)))
+		{ return false; }
+
+	NULLFREE(ecmcwcache_index);
+	ecmcwcache_index = index;
+	ecmcwcache_index_mask = buckets - 1;
+	ecmcwcache_index_count = 0;
+
+	// ecmcwcache is newest first, so appending keeps the bucket order
+	for(ecm = ecmcwcache; ecm; ecm = ecm->next, ecmcwcache_index_count++)
+	{
+		ecm->idx_next = NULL;
+		for(pp = &ecmcwcache_index[ecmcwcache_index_hash(ecm)]; *pp; pp = &(*pp)->idx_next) { ; }
+		*pp = ecm;
+	}
+	return true;
+}
+
+// ecmcache_lock must be write locked and er already linked into ecmcwcache
+static void ecmcwcache_index_add(ECM_REQUEST *er)
+{
+	if(!ecmcwcache_index || ecmcwcache_index_count >= (ecmcwcache_index_mask + 1) * 2)
+	{
+		// rebuilds from ecmcwcache, er included
+		if(ecmcwcache_index_resize(ecmcwcache_index ? (ecmcwcache_index_mask + 1) * 2 : 1024) || !ecmcwcache_index)
+			{ return; }
+	}
+
+	uint32_t h = ecmcwcache_index_hash(er);
+	er->idx_next = ecmcwcache_index[h];
+	ecmcwcache_index[h] = er;
+	ecmcwcache_index_count++;
+}
+
+// ecmcache_lock must be write locked
+static void ecmcwcache_index_remove(ECM_REQUEST *er)
+{
+	ECM_REQUEST **pp;
+
+	if(!ecmcwcache_index)
+		{ return; }
+
+	for(pp = &ecmcwcache_index[ecmcwcache_index_hash(er)]; *pp; pp = &(*pp)->idx_next)
+	{
+		if(*pp == er)
+		{
+			*pp = er->idx_next;
+			er->idx_next = NULL;
+			ecmcwcache_index_count--;
+			return;
+		}
+	}
+}
+
+// ecmcache_lock must be write locked
+static void ecmchain_add(ECM_REQUEST *er)
+{
+	struct s_client *cl = er->client;
+
+	er->client_prev = NULL;
+	er->client_next = cl->ecmchain;
+	if(cl->ecmchain)
+		{ cl->ecmchain->client_prev = er; }
+	cl->ecmchain = er;
+}
+
+// ecmcache_lock must be write locked
+static void ecmchain_remove(ECM_REQUEST *er)
+{
+	struct s_client *cl = er->client;
+
+	if(!cl)
+		{ return; }
+
+	if(er->client_prev)
+		{ er->client_prev->client_next = er->client_next; }
+	else if(cl->ecmchain == er)
+		{ cl->ecmchain = er->client_next; }
+	if(er->client_next)
+		{ er->client_next->client_prev = er->client_prev; }
+	er->client_prev = NULL;
+	er->client_next = NULL;
+}
+
+/**
+ * returns the newest ecm in ecmcwcache with the same caid and ecmd5 as er (er itself included).
+ * ecmcache_lock must be read locked by the caller.
+ **/
+ECM_REQUEST *ecmcwcache_first_same(ECM_REQUEST *er)
+{
+	ECM_REQUEST *ecm;
+
+	if(!ecmcwcache_index)
+		{ return NULL; }
+
+	for(ecm = ecmcwcache_index[ecmcwcache_index_hash(er)]; ecm && !ecmcwcache_same(ecm, er); ecm = ecm->idx_next) { ; }
+	return ecm;
+}
+
+// next (older) ecm in ecmcwcache with the same caid and ecmd5 as er
+ECM_REQUEST *ecmcwcache_next_same(ECM_REQUEST *ecm, ECM_REQUEST *er)
+{
+	for(ecm = ecm->idx_next; ecm && !ecmcwcache_same(ecm, er); ecm = ecm->idx_next) { ; }
+	return ecm;
+}
+
+/**
+ * single-flight: an ecm equal to one still in flight (same caid, ecmd5 and readers)
+ * is not sent to the readers again. It waits as flight_waiter of the first one and
+ * gets its cw as cache2 answer. Waiters are released to ask the readers themselves
+ * if the first ecm fails, and still have their own fallback and client timeouts.
+ * All flight_* links are protected by ecmcache_lock.
+ **/
+
+// ecmcache_lock must be write locked
+static ECM_REQUEST *ecm_flight_find(ECM_REQUEST *er)
+{
+	ECM_REQUEST *ecm;
+	struct s_ecm_answer *ea_ecm, *ea_er;
+	time_t timeout = time(NULL) - ((cfg.ctimeout + 500) / 1000);
+
+	for(ecm = ecmcwcache_first_same(er); ecm; ecm = ecmcwcache_next_same(ecm, er))
+	{
+		if(ecm->tps.time <= timeout)
+			{ break; }
+
+		if(ecm == er || !ecm->flight_open || ecm->rc < E_99 || ecm->readers != er->readers)
+			{ continue; }
+
+		for(ea_ecm = ecm->matching_rdr, ea_er = er->matching_rdr; ea_ecm && ea_er; ea_ecm = ea_ecm->next, ea_er = ea_er->next)
+		{
+			if(ea_ecm->reader != ea_er->reader
+				|| (ea_ecm->status & (READER_ACTIVE | READER_FALLBACK)) != (ea_er->status & (READER_ACTIVE | READER_FALLBACK)))
+				{ break; }
+		}
+
+		if(!ea_ecm && !ea_er)
+			{ return ecm; }
+	}
+	return NULL;
+}
+
+// ecmcache_lock must be write locked, returns the ecm er waits for or NULL if er has to ask the readers
+static ECM_REQUEST *ecm_flight_attach(ECM_REQUEST *er, uint8_t flight)
+{
+	ECM_REQUEST *leader = flight ? ecm_flight_find(er) : NULL;
+
+	if(leader)
+	{
+		er->flight_leader = leader;
+		er->flight_next = leader->flight_waiters;
+		leader->flight_waiters = er;
+	}
+	else
+		{ er->flight_open = flight; }
+	return leader;
+}
+
+// ecmcache_lock must be write locked
+static void ecm_flight_leave(ECM_REQUEST *er)
+{
+	ECM_REQUEST **pp;
+
+	if(!er->flight_leader)
+		{ return; }
+
+	for(pp = &er->flight_leader->flight_waiters; *pp; pp = &(*pp)->flight_next)
+	{
+		if(*pp == er)
+		{
+			*pp = er->flight_next;
+			break;
+		}
+	}
+	er->flight_leader = NULL;
+	er->flight_next = NULL;
+}
+
+// ecmcache_lock must be write locked, returns the detached waiters chained by flight_next
+static ECM_REQUEST *ecm_flight_drop(ECM_REQUEST *er)
+{
+	ECM_REQUEST *waiters = er->flight_waiters, *ecm;
+
+	ecm_flight_leave(er);
+	er->flight_open = 0;
+	er->flight_waiters = NULL;
+	for(ecm = waiters; ecm; ecm = ecm->flight_next)
+		{ ecm->flight_leader = NULL; }
+	return waiters;
+}
+
+static void ecm_flight_release_waiters(ECM_REQUEST *waiters)
+{
+	ECM_REQUEST *ecm;
+
+	while((ecm = waiters))
+	{
+		waiters = ecm->flight_next;
+		ecm->flight_next = NULL;
+		if(check_client(ecm->client))
+			{ add_job(ecm->client, ACTION_ECM_FLIGHT_RELEASE, ecm, 0); }
+	}
+}
+
+// answer the waiter ecm with the cw of its leader er, like a cw found in cache
+static int8_t ecm_flight_answer_fromcache(ECM_REQUEST *er, ECM_REQUEST *ecm)
+{
+	struct s_write_from_cache *wfc = NULL;
+	ECM_REQUEST *cached;
+
+	if(!check_client(ecm->client) || !(cached = alloc_ecm()))
+		{ return 0; }
+
+	cached->rc = E_FOUND;
+	memcpy(cached->cw, er->cw, 16);
+	cached->grp = er->grp;
+	cached->selected_reader = er->selected_reader;
+	cached->cwc_cycletime = er->cwc_cycletime;
+	cached->cwc_next_cw_cycle = er->cwc_next_cw_cycle;
+	cached->cacheex_src = er->cacheex_src;
+#ifdef CS_CACHEEX
+	cached->from_csp = er->from_csp;
+#endif
+#ifdef CS_CACHEEX_AIO
+	cached->localgenerated = er->localgenerated;
+#endif
+	cached->cw_count = er->cw_count;
+
+	if(!cs_malloc(&wfc, sizeof(struct s_write_from_cache)))
+	{
+		release_ecm(cached);
+		return 0;
+	}
+	wfc->er_new = ecm;
+	wfc->er_cache = cached;
+
+	if(!add_job(ecm->client, ACTION_ECM_ANSWER_CACHE, wfc, sizeof(struct s_write_from_cache))) // write_ecm_answer_fromcache
+	{
+		release_ecm(cached);
+		return 0;
+	}
+	return 1;
+}
+
+// er got its final answer: hand it to the waiters
+static void ecm_flight_answer(ECM_REQUEST *er)
+{
+	ECM_REQUEST *waiters, *ecm, *release = NULL;
+	struct s_ecm_answer *ea;
+
+	if(!er->flight_open)
+		{ return; }
+
+	cs_writelock(__func__, &ecmcache_lock);
+	waiters = ecm_flight_drop(er);
+	cs_writeunlock(__func__, &ecmcache_lock);
+
+	while((ecm = waiters))
+	{
+		waiters = ecm->flight_next;
+		ecm->flight_next = NULL;
+
+		if(er->rc >= E_NOTFOUND || ecm->rc < E_99)
+		{
+			// no cw from the leader: the waiter asks the readers itself
+			if(ecm->rc >= E_99)
+			{
+				ecm->flight_next = release;
+				release = ecm;
+			}
+			continue;
+		}
+
+		// like distribute_ea(): the waiter gets the cw from the same reader, as pending answer (cache2)
+		if((ea = get_ecm_answer(er->selected_reader, ecm)))
+		{
+			cs_log_dbg(D_LB, "{client %s, caid %04X, prid %06X, srvid %04X} [ecm_flight_answer] send cw by reader %s answering for client %s",
+						(check_client(ecm->client) ? ecm->client->account->usr : "-"), ecm->caid, ecm->prid, ecm->srvid,
+						ea->reader->label, (check_client(er->client) ? er->client->account->usr : "-"));
+#ifdef CS_CACHEEX_AIO
+			if(er->localgenerated)
+				{ ecm->localgenerated = 1; }
+#endif
+			ea->is_pending = true;
+			write_ecm_answer(ea->reader, ecm, E_FOUND, 0, er->cw, NULL, 0, &er->cw_ex);
+		}
+		// leader answered from cache, cacheex or a reader the waiter does not use: answer as cache
+		else if(ecm_flight_answer_fromcache(er, ecm))
+		{
+			cs_log_dbg(D_LB, "{client %s, caid %04X, prid %06X, srvid %04X} [ecm_flight_answer] send cw from cache answering for client %s",
+						(check_client(ecm->client) ? ecm->client->account->usr : "-"), ecm->caid, ecm->prid, ecm->srvid,
+						(check_client(er->client) ? er->client->account->usr : "-"));
+		}
+		else
+		{
+			ecm->flight_next = release;
+			release = ecm;
+		}
+	}
+
+	ecm_flight_release_waiters(release);
+}
+
+// waiter released by its failed leader: ask the readers now
+void ecm_flight_release(ECM_REQUEST *er)
+{
+	if(er->rc >= E_UNHANDLED && !er->stage && check_client(er->client))
+	{
+		cs_log_dbg(D_LB, "{client %s, caid %04X, prid %06X, srvid %04X} [ecm_flight_release] no cw from same ecm in flight, ask readers",
+					(check_client(er->client) ? er->client->account->usr : "-"), er->caid, er->prid, er->srvid);
+		request_cw_from_readers(er, 0);
+	}
+}
+
 void increment_n_request(struct s_client *cl)
 {
 	if(check_client(cl))
@@ -232,20 +583,249 @@ void update_n_request(void)
 	cs_readunlock(__func__, &clientlist_lock);
 }
 
-static void *cw_process(void)
+// stage timeouts already dispatched for an ecm (er->deadline_fired)
+#define ECM_DEADLINE_CACHEEX_WAIT	0x01
+#define ECM_DEADLINE_CACHEEX_MODE1	0x02
+#define ECM_DEADLINE_FALLBACK		0x04
+#define ECM_DEADLINE_CTIMEOUT		0x08
+
+// binary min-heap of pending ecms ordered by er->deadline, protected by ecm_deadline_lock
+static ECM_REQUEST **ecm_deadline_heap;
+static uint32_t ecm_deadline_count;
+static uint32_t ecm_deadline_alloc;
+
+static inline int64_t timeb_to_ms(struct timeb *tb)
 {
-	set_thread_name(__func__);
-	int64_t time_to_check_fbtimeout, time_to_check_ctimeout, next_check, n_request_next;
-	struct timeb t_now, tbc, ecmc_time, cache_time, n_request_time;
-	ECM_REQUEST *er = NULL;
-	time_t ecm_maxcachetime;
+	return (int64_t)tb->time * 1000 + tb->millitm;
+}
+
+static inline void ecm_deadline_set(uint32_t idx, ECM_REQUEST *er)
+{
+	ecm_deadline_heap[idx] = er;
+	er->deadline_pos = idx + 1;
+}
+
+static void ecm_deadline_sift_up(uint32_t idx)
+{
+	ECM_REQUEST *er = ecm_deadline_heap[idx];
+	while(idx > 0)
+	{
+		uint32_t parent = (idx - 1) / 2;
+		if(ecm_deadline_heap[parent]->deadline <= er->deadline)
+			{ break; }
+		ecm_deadline_set(idx, ecm_deadline_heap[parent]);
+		idx = parent;
+	}
+	ecm_deadline_set(idx, er);
+}
+
+static void ecm_deadline_sift_down(uint32_t idx)
+{
+	ECM_REQUEST *er = ecm_deadline_heap[idx];
+	while(1)
+	{
+		uint32_t child = idx * 2 + 1;
+		if(child >= ecm_deadline_count)
+			{ break; }
+		if(child + 1 < ecm_deadline_count && ecm_deadline_heap[child + 1]->deadline < ecm_deadline_heap[child]->deadline)
+			{ child++; }
+		if(er->deadline <= ecm_deadline_heap[child]->deadline)
+			{ break; }
+		ecm_deadline_set(idx, ecm_deadline_heap[child]);
+		idx = child;
+	}
+	ecm_deadline_set(idx, er);
+}
+
+// ecm_deadline_lock must be held. Returns 1 if er became the earliest deadline.
+static int8_t ecm_deadline_insert(ECM_REQUEST *er)
+{
+	if(ecm_deadline_count == ecm_deadline_alloc)
+	{
+		uint32_t alloc = ecm_deadline_alloc ? ecm_deadline_alloc * 2 : 256;
+		if(!cs_realloc(&ecm_deadline_heap, alloc * sizeof(ECM_REQUEST *)))
+			{ return 0; }
+		ecm_deadline_alloc = alloc;
+	}
+	ecm_deadline_set(ecm_deadline_count, er);
+	ecm_deadline_sift_up(ecm_deadline_count++);
+	return er->deadline_pos == 1;
+}
+
+// ecm_deadline_lock must be held
+static void ecm_deadline_delete(ECM_REQUEST *er)
+{
+	uint32_t idx = er->deadline_pos - 1;
+	ECM_REQUEST *last = ecm_deadline_heap[--ecm_deadline_count];
+	er->deadline_pos = 0;
+	if(idx < ecm_deadline_count)
+	{
+		ecm_deadline_set(idx, last);
+		ecm_deadline_sift_up(idx);
+		ecm_deadline_sift_down(last->deadline_pos - 1);
+	}
+}
+
+/**
+ * returns the next pending stage timeout (absolute, in ms) of an ecm or 0 if there is none left.
+ * With fire=1 every timeout reached at now_ms is dispatched to the client thread.
+ **/
+static int64_t ecm_next_deadline(ECM_REQUEST *er, int64_t now_ms, int8_t fire)
+{
+	int64_t next = 0, tps = timeb_to_ms(&er->tps), deadline;
 
+	if((er->from_cacheex || er->from_csp) // ignore ecms from cacheex/csp
+		|| er->readers_timeout_check      // ignore already checked
+		|| !check_client(er->client))     // ignore ecm of killed clients
+	{
+		return 0;
+	}
+
+	if(er->rc >= E_UNHANDLED)
+	{
 #ifdef CS_CACHEEX
-	int64_t time_to_check_cacheex_wait_time;
-	int64_t time_to_check_cacheex_mode1_delay;
+		// cacheex_wait_time
+		if(er->cacheex_wait_time && !er->cacheex_wait_time_expired && !(er->deadline_fired & ECM_DEADLINE_CACHEEX_WAIT))
+		{
+			deadline = tps + lb_auto_timeout(er, er->cacheex_wait_time);
+			if(fire && now_ms >= deadline)
+			{
+				add_job(er->client, ACTION_CACHEEX_TIMEOUT, (void *)er, 0);
+				er->deadline_fired |= ECM_DEADLINE_CACHEEX_WAIT;
+			}
+			else
+			{
+				next = deadline;
+
+				// check for cacheex_mode1_delay
+				if(er->cacheex_mode1_delay && !er->stage && er->cacheex_reader_count > 0 && !(er->deadline_fired & ECM_DEADLINE_CACHEEX_MODE1))
+				{
+					deadline = tps + lb_auto_timeout(er, er->cacheex_mode1_delay);
+					if(fire && now_ms >= deadline)
+					{
+						add_job(er->client, ACTION_CACHEEX1_DELAY, (void *)er, 0);
+						er->deadline_fired |= ECM_DEADLINE_CACHEEX_MODE1;
+					}
+					else if(deadline < next)
+						{ next = deadline; }
+				}
+			}
+		}
 #endif
+		// fbtimeout
+		if(er->stage < 4 && !(er->deadline_fired & ECM_DEADLINE_FALLBACK))
+		{
+			deadline = tps + lb_auto_timeout(er, get_fallbacktimeout(er->caid));
+
+			// hedging: the readers asked are slower than usual, ask the fallbacks before the fbtimeout
+			if(er->lb_hedge_time && tps + er->lb_hedge_time < deadline)
+			{
+				if(!fire || now_ms < tps + er->lb_hedge_time)
+					{ deadline = tps + er->lb_hedge_time; }
+				else if(er->stage >= 2 && er->reader_requested && er->fallback_reader_count && lb_hedge_allowed())
+				{
+					deadline = now_ms;
+					cs_log_dbg(D_LB, "{client %s, caid %04X, prid %06X, srvid %04X} hedge to the fallback readers after %d ms",
+								(check_client(er->client) ? er->client->account->usr : "-"), er->caid, er->prid, er->srvid, er->lb_hedge_time);
+				}
+				else
+					{ er->lb_hedge_time = 0; } // wait for the fbtimeout
+			}
+
+			if(fire && now_ms >= deadline)
+			{
+				add_job(er->client, ACTION_FALLBACK_TIMEOUT, (void *)er, 0);
+				er->deadline_fired |= ECM_DEADLINE_FALLBACK;
+			}
+			else if(!next || deadline < next)
+				{ next = deadline; }
+		}
+	}
+
+	// clienttimeout
+	if(!(er->deadline_fired & ECM_DEADLINE_CTIMEOUT)) // ecm stays in cache at least ctimeout+2seconds!
+	{
+		deadline = tps + lb_auto_timeout(er, cfg.ctimeout);
+		if(fire && now_ms >= deadline)
+		{
+			add_job(er->client, ACTION_CLIENT_TIMEOUT, (void *)er, 0);
+			er->deadline_fired |= ECM_DEADLINE_CTIMEOUT;
+		}
+		else if(!next || deadline < next)
+			{ next = deadline; }
+	}
+
+	return next;
+}
+
+/**
+ * registers a new pending ecm in the cw_process scheduler
+ * and wakes cw_process up if it is now the earliest one
+ **/
+static void ecm_deadline_register(ECM_REQUEST *er)
+{
+	struct timeb t_now;
+	int8_t first = 0;
 
-	cs_pthread_cond_init(__func__, &cw_process_sleep_cond_mutex, &cw_process_sleep_cond);
+	cs_ftime(&t_now);
+	int64_t deadline = ecm_next_deadline(er, timeb_to_ms(&t_now), 0);
+	if(!deadline)
+		{ return; }
+
+	cs_writelock(__func__, &ecm_deadline_lock);
+	if(!er->deadline_pos)
+	{
+		er->deadline = deadline;
+		first = ecm_deadline_insert(er);
+	}
+	cs_writeunlock(__func__, &ecm_deadline_lock);
+
+	if(first)
+		{ cw_process_thread_wakeup(); }
+}
+
+static void ecm_deadline_unregister(ECM_REQUEST *er)
+{
+	if(!er->deadline_pos)
+		{ return; }
+
+	cs_writelock(__func__, &ecm_deadline_lock);
+	if(er->deadline_pos)
+		{ ecm_deadline_delete(er); }
+	cs_writeunlock(__func__, &ecm_deadline_lock);
+}
+
+/**
+ * dispatches all stage timeouts due at t_now and returns the ms
+ * until the next pending one (0 if no ecm is waiting)
+ **/
+static int64_t ecm_deadline_process(struct timeb *t_now)
+{
+	ECM_REQUEST *er;
+	int64_t now_ms = timeb_to_ms(t_now), next_check = 0;
+
+	cs_writelock(__func__, &ecm_deadline_lock);
+	while(ecm_deadline_count && ecm_deadline_heap[0]->deadline <= now_ms)
+	{
+		er = ecm_deadline_heap[0];
+		ecm_deadline_delete(er);
+		er->deadline = ecm_next_deadline(er, now_ms, 1);
+		if(er->deadline)
+			{ ecm_deadline_insert(er); }
+	}
+	if(ecm_deadline_count)
+		{ next_check = ecm_deadline_heap[0]->deadline - now_ms; }
+	cs_writeunlock(__func__, &ecm_deadline_lock);
+
+	return next_check;
+}
+
+static void *cw_process(void)
+{
+	set_thread_name(__func__);
+	int64_t next_check, n_request_next;
+	struct timeb t_now, ecmc_time, cache_time, n_request_time;
+	time_t ecm_maxcachetime;
 
 #ifdef CS_ANTICASC
 	int32_t ac_next;
@@ -263,11 +843,7 @@ static void *cw_process(void)
 
 	while(!exit_oscam)
 	{
-		if(cw_process_wakeups == 0) // No waiting wakeups, proceed to sleep
-		{
-			sleepms_on_cond(__func__, &cw_process_sleep_cond_mutex, &cw_process_sleep_cond, msec_wait);
-		}
-		cw_process_wakeups = 0; // We've been woken up, reset the counter
+		sleepms_on_wakeup(&cw_process_wakeup, NULL, 0, msec_wait); // returns at once if woken up meanwhile
 		if(exit_oscam)
 			{ break; }
 
@@ -280,87 +856,7 @@ static void *cw_process(void)
 		msec_wait = 0;
 
 		cs_ftime(&t_now);
-		cs_readlock(__func__, &ecmcache_lock);
-		for(er = ecmcwcache; er; er = er->next)
-		{
-
-			if((er->from_cacheex || er->from_csp) // ignore ecms from cacheex/csp
-				|| er->readers_timeout_check      // ignore already checked
-				|| !check_client(er->client))     // ignore ecm of killed clients
-			{
-				continue;
-			}
-
-			if(er->rc >= E_UNHANDLED)
-			{
-#ifdef CS_CACHEEX
-				// cacheex_wait_time
-				if(er->cacheex_wait_time && !er->cacheex_wait_time_expired)
-				{
-					tbc = er->tps;
-					time_to_check_cacheex_mode1_delay = 0;
-					time_to_check_cacheex_wait_time = add_ms_to_timeb_diff(&tbc, lb_auto_timeout(er, er->cacheex_wait_time));
-
-					if(comp_timeb(&t_now, &tbc) >= 0)
-					{
-						add_job(er->client, ACTION_CACHEEX_TIMEOUT, (void *)er, 0);
-						time_to_check_cacheex_wait_time = 0;
-
-					}
-					else if(er->cacheex_mode1_delay && !er->stage && er->cacheex_reader_count>0)
-					{
-						// check for cacheex_mode1_delay
-						tbc = er->tps;
-						time_to_check_cacheex_mode1_delay = add_ms_to_timeb_diff(&tbc, lb_auto_timeout(er, er->cacheex_mode1_delay));
-
-						if(comp_timeb(&t_now, &tbc) >= 0)
-						{
-							add_job(er->client, ACTION_CACHEEX1_DELAY, (void *)er, 0);
-							time_to_check_cacheex_mode1_delay = 0;
-						}
-					}
-
-					if(!next_check || (time_to_check_cacheex_wait_time > 0 && time_to_check_cacheex_wait_time < next_check))
-						{ next_check = time_to_check_cacheex_wait_time; }
-
-					if(!next_check || (time_to_check_cacheex_mode1_delay > 0 && time_to_check_cacheex_mode1_delay < next_check))
-						{ next_check = time_to_check_cacheex_mode1_delay; }
-				}
-#endif
-				if(er->stage < 4)
-				{
-					// fbtimeout
-					tbc = er->tps;
-					time_to_check_fbtimeout = add_ms_to_timeb_diff(&tbc, lb_auto_timeout(er, get_fallbacktimeout(er->caid)));
-
-					if(comp_timeb(&t_now, &tbc) >= 0)
-					{
-						add_job(er->client, ACTION_FALLBACK_TIMEOUT, (void *)er, 0);
-						time_to_check_fbtimeout = 0;
-					}
-
-					if(!next_check || (time_to_check_fbtimeout > 0 && time_to_check_fbtimeout < next_check))
-						{ next_check = time_to_check_fbtimeout; }
-				}
-			}
-
-			// clienttimeout
-			if(!er->readers_timeout_check) // ecm stays in cache at least ctimeout+2seconds!
-			{
-				tbc = er->tps;
-				time_to_check_ctimeout = add_ms_to_timeb_diff(&tbc, lb_auto_timeout(er, cfg.ctimeout));
-
-				if(comp_timeb(&t_now, &tbc) >= 0)
-				{
-					add_job(er->client, ACTION_CLIENT_TIMEOUT, (void *)er, 0);
-					time_to_check_ctimeout = 0;
-				}
-
-				if(!next_check || (time_to_check_ctimeout > 0 && time_to_check_ctimeout < next_check))
-					{ next_check = time_to_check_ctimeout; }
-			}
-		}
-		cs_readunlock(__func__, &ecmcache_lock);
+		next_check = ecm_deadline_process(&t_now);
 #ifdef CS_ANTICASC
 		if(cfg.ac_enabled && (ac_next = comp_timeb(&ac_time, &t_now)) <= 10)
 		{
@@ -388,6 +884,12 @@ static void *cw_process(void)
 						{ prv->next = NULL; }
 					else
 						{ ecmcwcache = NULL; }
+					for(; ecm; ecm = ecm->next)
+					{
+						ecmcwcache_index_remove(ecm);
+						ecmchain_remove(ecm);
+						ecm_flight_drop(ecm); // waiters are timed out as well
+					}
 					cs_writeunlock(__func__, &ecmcache_lock);
 					break;
 				}
@@ -441,6 +943,7 @@ static void *cw_process(void)
 		{
 			cleanup_cache(false);
 			cacheex_cleanup_hitcache(false);
+			save_cache_snapshot(false);
 
 			cs_ftime(&cache_time);
 			cache_next = add_ms_to_timeb_diff(&cache_time, 3000);
@@ -478,13 +981,13 @@ static void *cw_process(void)
 
 void cw_process_thread_start(void)
 {
+	cs_wakeup_init(&cw_process_wakeup);
 	start_thread("cw_process", (void *) &cw_process, NULL, NULL, 1, 1);
 }
 
 void cw_process_thread_wakeup(void)
 {
-	cw_process_wakeups++; // Do not sleep...
-	SAFE_COND_SIGNAL(&cw_process_sleep_cond);
+	cs_wakeup(&cw_process_wakeup);
 }
 
 void convert_to_beta(struct s_client *cl, ECM_REQUEST *er, uint16_t caidto)
@@ -607,6 +1110,30 @@ static void remove_ecm_from_reader(ECM_REQUEST *ecm)
 	}
 }
 
+static POOL ecm_pool;
+static POOL ea_pool;
+
+void init_ecm_pools(void)
+{
+	pool_init(&ecm_pool, "ECM_REQUEST", sizeof(ECM_REQUEST), 1024);
+	pool_init(&ea_pool, "s_ecm_answer", sizeof(struct s_ecm_answer), 4096);
+}
+
+/**
+ * zeroed ECM_REQUEST out of the ecm pool. Release it by free_ecm() or
+ * release_ecm(), plain free() isn't counted and the pool stats show it in use.
+ **/
+ECM_REQUEST *alloc_ecm(void)
+{
+	return pool_alloc(&ecm_pool);
+}
+
+// returns an ecm nobody else references (e.g. a cache answer) to the pool at once
+void release_ecm(ECM_REQUEST *ecm)
+{
+	pool_free(&ecm_pool, ecm);
+}
+
 void free_ecm(ECM_REQUEST *ecm)
 {
 	struct s_ecm_answer *ea, *nxt;
@@ -615,6 +1142,7 @@ void free_ecm(ECM_REQUEST *ecm)
 	// remove this ecm from reader queue to avoid segfault on very late answers (when ecm is already disposed)
 	// first check for outstanding answers:
 	remove_ecm_from_reader(ecm);
+	ecm_deadline_unregister(ecm);
 	// free matching_rdr list:
 	ea = ecm->matching_rdr;
 	ecm->matching_rdr = NULL;
@@ -622,12 +1150,12 @@ void free_ecm(ECM_REQUEST *ecm)
 	{
 		nxt = ea->next;
 		cs_lock_destroy(__func__, &ea->ecmanswer_lock);
-		add_garbage(ea);
+		add_garbage_pool(&ea_pool, ea);
 		ea = nxt;
 	}
 	if(ecm->src_data)
 		{ add_garbage(ecm->src_data); }
-	add_garbage(ecm);
+	add_garbage_pool(&ecm_pool, ecm);
 }
 
 
@@ -637,7 +1165,7 @@ void free_push_in_ecm(ECM_REQUEST *ecm)
 	gbox_free_cards_pending(ecm);
 	if(ecm->src_data)
 		{ NULLFREE(ecm->src_data); }
-	NULLFREE(ecm);
+	release_ecm(ecm);
 }
 
 ECM_REQUEST *get_ecmtask(void)
@@ -646,9 +1174,10 @@ ECM_REQUEST *get_ecmtask(void)
 	struct s_client *cl = cur_client();
 	if(!cl)
 		{ return NULL; }
-	if(!cs_malloc(&er, sizeof(ECM_REQUEST)))
+	if(!(er = alloc_ecm()))
 		{ return NULL; }
 	cs_ftime(&er->tps);
+	er->lat_recv = lat_now();
 	er->rc = E_UNHANDLED;
 	er->client = cl;
 	er->grp = 0; // no readers/cacheex-clients answers yet
@@ -660,18 +1189,29 @@ void cleanup_ecmtasks(struct s_client *cl)
 {
 	if(!cl) { return; }
 
-	ECM_REQUEST *ecm;
+	ECM_REQUEST *ecm, *nxt, *next, *waiters, *release = NULL;
 
 	// remove this clients ecm from queue. because of cache, just null the client:
-	cs_readlock(__func__, &ecmcache_lock);
-	for(ecm = ecmcwcache; ecm && cl; ecm = ecm->next)
+	cs_writelock(__func__, &ecmcache_lock);
+	for(ecm = cl->ecmchain; ecm; ecm = nxt)
 	{
-		if(ecm->client == cl)
+		nxt = ecm->client_next;
+		ecm->client_prev = NULL;
+		ecm->client_next = NULL;
+		ecm->client = NULL;
+
+		// nobody will answer the waiters of this ecm anymore
+		for(waiters = ecm_flight_drop(ecm); waiters; waiters = next)
 		{
-			ecm->client = NULL;
+			next = waiters->flight_next;
+			waiters->flight_next = release;
+			release = waiters;
 		}
 	}
-	cs_readunlock(__func__, &ecmcache_lock);
+	cl->ecmchain = NULL;
+	cs_writeunlock(__func__, &ecmcache_lock);
+
+	ecm_flight_release_waiters(release);
 
 	// remove client from rdr ecm-queue:
 	cs_readlock(__func__, &readerlist_lock);
@@ -790,6 +1330,8 @@ void distribute_ea(struct s_ecm_answer *ea)
 
 int32_t send_dcw(struct s_client *client, ECM_REQUEST *er)
 {
+	ecm_flight_answer(er);
+
 	if(!check_client(client) || client->typ != 'c')
 		{ return 0; }
 
@@ -1262,7 +1804,10 @@ int32_t send_dcw(struct s_client *client, ECM_REQUEST *er)
 		er->rc = E_FOUND;
 	}
 
+	int64_t lat_start = lat_now();
 	get_module(client)->send_dcw(client, er);
+	lat_add(er, er->selected_reader, LAT_SEND_DCW, lat_start);
+	lat_add(er, er->selected_reader, LAT_TOTAL, er->lat_recv);
 
 	add_cascade_data(client, er);
 
@@ -1430,7 +1975,7 @@ void add_cache_from_reader(ECM_REQUEST *er, struct s_reader *rdr, uint32_t csp_h
 )
 {
 	ECM_REQUEST *ecm;
-	if (cs_malloc(&ecm, sizeof(ECM_REQUEST)))
+	if ((ecm = alloc_ecm()))
 	{
 		cs_ftime(&ecm->tps);
 
@@ -1463,7 +2008,7 @@ void add_cache_from_reader(ECM_REQUEST *er, struct s_reader *rdr, uint32_t csp_h
 		ecm_pushed_deleted = ecm;
 		cs_writeunlock(__func__, &ecm_pushed_deleted_lock);
 #else
-		NULLFREE(ecm);
+		release_ecm(ecm);
 #endif
 	}
 }
@@ -1479,6 +2024,8 @@ void chk_dcw(struct s_ecm_answer *ea)
 	if(!ert || !eardr)
 		{ return; }
 
+	lat_add(ert, eardr, LAT_CHK_DCW, ea->lat_answer);
+
 	// ecm request already answered!
 	if(ert->rc < E_99)
 	{
@@ -1980,6 +2527,7 @@ int32_t write_ecm_answer(struct s_reader *reader, ECM_REQUEST *er, int8_t rc, ui
 	ea->rc = rc;
 	ea->ecm_time = comp_timeb(&now, &ea->time_request_sent);
 	if(ea->ecm_time < 1) { ea->ecm_time = 1; } // set ecm_time 1 if answer immediately
+	ea->lat_answer = lat_now();
 	ea->rcEx = rcEx;
 	if(cw) { memcpy(ea->cw, cw, 16); }
 	if(msglog) { memcpy(ea->msglog, msglog, MSGLOGSIZE); }
@@ -2038,6 +2586,9 @@ int32_t write_ecm_answer(struct s_reader *reader, ECM_REQUEST *er, int8_t rc, ui
 			send_reader_stat(reader, er, ea, ea->rc);
 		}
 
+		if((ea->status & REQUEST_SENT) && (ea->rc == E_FOUND || ea->rc == E_NOTFOUND))
+			{ lat_add(er, reader, LAT_READER, ea->lat_answer - (int64_t)ea->ecm_time * 1000); }
+
 		// reader checks
 #ifdef WITH_DEBUG
 	if(cs_dblevel & D_TRACE)
@@ -2379,6 +2930,8 @@ static bool ecm_cache_check(ECM_REQUEST *er)
 			int64_t gone_diff = 0;
 			gone_diff = comp_timeb(&er->tps, &ecm_cache->first_recv_time);
 			cs_ftime(&ecm_cache->upd_time);
+			remove_elem_list(&ll_ecm_cache, &ecm_cache->ll_node); // keep the list in upd_time order
+			tommy_list_insert_tail(&ll_ecm_cache, &ecm_cache->ll_node, ecm_cache);
 
 			if(gone_diff >= cfg.ecm_cache_droptime * 1000)
 			{
@@ -2422,6 +2975,7 @@ void get_cw(struct s_client *client, ECM_REQUEST *er)
 	er->client = client;
 	er->rc = E_UNHANDLED; // set default rc status to unhandled
 	er->cwc_next_cw_cycle = 2; // set it to: we dont know
+	lat_add(er, NULL, LAT_RECEIVE, er->lat_recv);
 
 	// user was on freetv or didn't request for some time
 	// so we reset lastswitch to get correct stats/webif display
@@ -2770,7 +3324,9 @@ void get_cw(struct s_client *client, ECM_REQUEST *er)
 
 	//******** CHECK IF FOUND ECM IN CACHE
 	struct ecm_request_t *ecm = NULL;
+	int64_t lat_start = lat_now();
 	ecm = check_cache(er, client);
+	lat_add(er, NULL, LAT_CACHE, lat_start);
 	if(ecm) // found in cache
 	{
 		cs_log_dbg(D_LB,"{client %s, caid %04X, prid %06X, srvid %04X} [get_cw] cw found immediately in cache! ", (check_client(er->client)?er->client->account->usr:"-"),er->caid, er->prid, er->srvid);
@@ -2778,7 +3334,7 @@ void get_cw(struct s_client *client, ECM_REQUEST *er)
 		struct s_write_from_cache *wfc = NULL;
 		if(!cs_malloc(&wfc, sizeof(struct s_write_from_cache)))
 		{
-			NULLFREE(ecm);
+			release_ecm(ecm);
 			free_ecm(er);
 			return;
 		}
@@ -2787,7 +3343,7 @@ void get_cw(struct s_client *client, ECM_REQUEST *er)
 		wfc->er_cache = ecm;
 		write_ecm_answer_fromcache(wfc);
 		NULLFREE(wfc);
-		NULLFREE(ecm);
+		release_ecm(ecm);
 		free_ecm(er);
 
 		return;
@@ -2829,7 +3385,7 @@ void get_cw(struct s_client *client, ECM_REQUEST *er)
 				{ continue; }
 #endif
 
-			if(!cs_malloc(&ea, sizeof(struct s_ecm_answer)))
+			if(!(ea = pool_alloc(&ea_pool)))
 				{ goto OUT; }
 
 #ifdef WITH_EXTENDED_CW
@@ -2933,11 +3489,22 @@ OUT:
 		return;
 	}
 
+	// single-flight only for ecms asking the readers at once
+	ECM_REQUEST *leader;
+	uint8_t flight = cfg.ecm_singleflight ? 1 : 0;
+#ifdef CS_CACHEEX
+	if(cacheex_wait_time)
+		{ flight = 0; }
+#endif
+
 	//insert it in ecmcwcache!
 	cs_writelock(__func__, &ecmcache_lock);
 	er->next = ecmcwcache;
 	ecmcwcache = er;
 	ecmcwcache_size++;
+	ecmcwcache_index_add(er);
+	ecmchain_add(er);
+	leader = ecm_flight_attach(er, flight);
 	cs_writeunlock(__func__, &ecmcache_lock);
 
 	er->rcEx = 0;
@@ -2961,7 +3528,18 @@ OUT:
 	}
 	else
 #endif
+	if(leader)
+	{
+		cs_log_dbg(D_LB, "{client %s, caid %04X, prid %06X, srvid %04X} [get_cw] same ecm in flight from client %s, wait for its answer",
+					(check_client(er->client) ? er->client->account->usr : "-"), er->caid, er->prid, er->srvid,
+					(check_client(leader->client) ? leader->client->account->usr : "-"));
+	}
+	else
+	{
+		lat_start = lat_now();
 		request_cw_from_readers(er, 0);
+		lat_add(er, NULL, LAT_DISPATCH, lat_start);
+	}
 
 #ifdef WITH_DEBUG
 	if(D_CLIENTECM & cs_dblevel)
@@ -2972,7 +3550,7 @@ OUT:
 	}
 #endif
 
-	cw_process_thread_wakeup();
+	ecm_deadline_register(er);
 }
 
 int32_t ecmfmt(char *result, size_t size, uint16_t caid, uint16_t onid, uint32_t prid, uint16_t chid, uint16_t pid,
@@ -16,10 +16,14 @@ uint32_t get_subid(ECM_REQUEST *er);
 uint32_t chk_provid(uint8_t *ecm, uint16_t caid);
 
 int32_t send_dcw(struct s_client *client, ECM_REQUEST *er);
+void init_ecm_pools(void);
+ECM_REQUEST *alloc_ecm(void);
+void release_ecm(ECM_REQUEST *ecm);
 void free_ecm(ECM_REQUEST *ecm);
 void free_push_in_ecm(ECM_REQUEST *ecm);
 void write_ecm_answer_fromcache(struct s_write_from_cache *wfc);
 void fallback_timeout(ECM_REQUEST *er);
+void ecm_flight_release(ECM_REQUEST *er);
 void ecm_timeout(ECM_REQUEST *er);
 void reader_get_ecm(struct s_reader *reader, ECM_REQUEST *er);
 ECM_REQUEST *get_ecmtask(void);
@@ -27,6 +31,9 @@ struct s_ecm_answer *get_ecm_answer(struct s_reader *reader, ECM_REQUEST *er);
 void cleanup_ecmtasks(struct s_client *cl);
 void remove_reader_from_ecm(struct s_reader *rdr);
 
+ECM_REQUEST *ecmcwcache_first_same(ECM_REQUEST *er);
+ECM_REQUEST *ecmcwcache_next_same(ECM_REQUEST *ecm, ECM_REQUEST *er);
+
 void chk_dcw(struct s_ecm_answer *ea);
 void request_cw_from_readers(ECM_REQUEST *er, uint8_t stop_stage);
 
@@ -38,6 +45,8 @@ void init_ecm_cache(void);
 void free_ecm_cache(void);
 
 void ecm_cache_cleanup(bool force);
+void ecm_cache_foreach(void (*fn)(uint32_t csp_hash, struct timeb *first_recv_time, struct timeb *upd_time, void *arg), void *arg);
+void ecm_cache_restore(uint32_t csp_hash, struct timeb *first_recv_time, struct timeb *upd_time);
 #endif
 
 #define debug_ecm(mask, args...) \
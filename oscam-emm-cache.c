@@ -181,7 +181,7 @@ void load_emmstat_from_file(void)
 				if(!rdr->emmstat)
 				{
 					rdr->emmstat = ll_create("emmstat");
-					cs_lock_create(__func__, &rdr->emmstat_lock, rdr->label, DEFAULT_LOCK_TIMEOUT);
+					cs_lock_create(__func__, &rdr->emmstat_lock, "emmstat_lock", DEFAULT_LOCK_TIMEOUT);
 				}
 
 				ll_append(rdr->emmstat, s);
@@ -3,98 +3,365 @@
 #include "globals.h"
 #include "oscam-garbage.h"
 #include "oscam-lock.h"
+#include "oscam-pool.h"
 #include "oscam-string.h"
 #include "oscam-time.h"
+#ifdef WITH_DEBUG
+#include "oscam-hashtable.h"
+#endif
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
 
-#define HASH_BUCKETS 250
+/*
+ * Deferred frees with epoch based reclamation. Every thread has a record with
+ * the epoch it announced on epoch_enter() and its own list of retired objects,
+ * a retire is a push onto that list and takes no global lock. The collector
+ * advances the global epoch, takes over the retire lists and frees an object as
+ * soon as no thread announced an epoch older than the one it was retired in.
+ *
+ * add_garbage_epoch() is for objects whose readers use epoch_enter()/epoch_leave().
+ * Plain add_garbage() callers rely on readers that never announce themselves, so
+ * their objects are also kept for 2 * ctimeout + 6 seconds like before.
+ */
 
 struct cs_garbage
 {
-	time_t time;
+	time_t time;       // add_garbage(): free not before, 0 = add_garbage_epoch()
+	uint32_t epoch;    // epoch at retire time
 	void *data;
+	POOL *pool;        // deferred free returns data to this pool
 #ifdef WITH_DEBUG
 	char *file;
 	uint32_t line;
+	node ht_node;      // -g 2: pending objects by data
+	node ll_node;
 #endif
 	struct cs_garbage *next;
 };
 
-static int32_t counter = 0;
-static pthread_mutex_t add_lock;
-static struct cs_garbage *garbage_first[HASH_BUCKETS];
-static CS_MUTEX_LOCK garbage_lock[HASH_BUCKETS];
+struct s_epoch_rec
+{
+	volatile uint32_t active;    // epoch seen by epoch_enter(), 0 = not reading
+	uint32_t depth;              // nested epoch_enter() calls
+	int8_t in_use;               // owned by a thread, records are reused after thread exit
+	struct cs_garbage *volatile retired; // pushed by the owner, taken by the collector
+	struct s_epoch_rec *next;
+	uint8_t pad[32];             // keep records of different threads on different cachelines
+};
+
+static volatile uint32_t epoch_global = 1;
+static struct s_epoch_rec *epoch_first;
+static pthread_mutex_t epoch_rec_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t epoch_key;
+static pthread_once_t epoch_key_once = PTHREAD_ONCE_INIT;
+
+static POOL garbage_pool;
+static struct cs_garbage *orphan_first; // retired by threads without a record
+static pthread_mutex_t orphan_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// owned by the collector thread
+static struct cs_garbage *epoch_pending;                 // add_garbage_epoch(), unordered
+static struct cs_garbage *timed_first, *timed_last;      // add_garbage(), about in time order
+#ifdef WITH_DEBUG
+static hash_table garbage_ht;
+static list garbage_ll;
+#endif
+
 static pthread_t garbage_thread;
 static int32_t garbage_collector_active;
 static int32_t garbage_debug;
+static int32_t garbage_delay;
 
-#ifdef WITH_DEBUG
-void add_garbage_debug(void *data, char *file, uint32_t line)
-{
-#else
-void add_garbage(void *data)
+static void garbage_free(POOL *pool, void *data)
 {
+	if(garbage_debug == 3) // poison, late readers see 0x6b instead of plausible data
+	{
+		size_t size = 0;
+		if(pool)
+			{ size = pool->size; }
+#ifdef __GLIBC__
+		else
+			{ size = malloc_usable_size(data); }
 #endif
-	if(!data)
-		{ return; }
+		memset(data, 0x6b, size);
+	}
 
-	if(!garbage_collector_active || garbage_debug == 1)
+	if(pool)
+		{ pool_free(pool, data); }
+	else
+		{ free(data); }
+}
+
+// thread exit: leave the record for the next thread, the collector still takes its retire list
+static void epoch_rec_release(void *ptr)
+{
+	struct s_epoch_rec *rec = ptr;
+	rec->depth = 0;
+	rec->active = 0;
+	__sync_synchronize();
+	rec->in_use = 0;
+}
+
+static void epoch_key_create(void)
+{
+	if(pthread_key_create(&epoch_key, epoch_rec_release))
+		{ cs_log("Could not create epoch key, lock-free readers are unprotected!"); }
+}
+
+static struct s_epoch_rec *epoch_get_rec(void)
+{
+	struct s_epoch_rec *rec;
+
+	pthread_once(&epoch_key_once, epoch_key_create);
+	if((rec = pthread_getspecific(epoch_key)))
+		{ return rec; }
+
+	SAFE_MUTEX_LOCK(&epoch_rec_lock);
+	for(rec = epoch_first; rec && rec->in_use; rec = rec->next) { ; }
+	if(!rec && cs_malloc(&rec, sizeof(struct s_epoch_rec)))
 	{
-		NULLFREE(data);
-		return;
+		rec->next = epoch_first;
+		epoch_first = rec;
 	}
+	if(rec)
+		{ rec->in_use = 1; }
+	SAFE_MUTEX_UNLOCK(&epoch_rec_lock);
 
-	SAFE_MUTEX_LOCK(&add_lock);
+	if(rec && pthread_setspecific(epoch_key, rec))
+	{
+		rec->in_use = 0;
+		rec = NULL;
+	}
+	return rec;
+}
 
-	int32_t bucket = counter++;
+void epoch_enter(void)
+{
+	struct s_epoch_rec *rec = epoch_get_rec();
 
-	if(counter >= HASH_BUCKETS)
+	if(!rec || rec->depth++)
+		{ return; }
+
+	rec->active = epoch_global;
+	__sync_synchronize(); // announcement is visible before we load shared pointers
+}
+
+void epoch_leave(void)
+{
+	struct s_epoch_rec *rec = pthread_getspecific(epoch_key);
+
+	if(!rec || !rec->depth || --rec->depth)
+		{ return; }
+
+	__sync_synchronize(); // all loads are done before we leave
+	rec->active = 0;
+}
+
+#ifdef WITH_DEBUG
+static void garbage_retire(POOL *pool, void *data, time_t time, char *file, uint32_t line)
+#else
+static void garbage_retire(POOL *pool, void *data, time_t time)
+#endif
+{
+	struct s_epoch_rec *rec;
+	struct cs_garbage *garbage, *old;
+
+	if(!data)
+		{ return; }
+
+	if(!garbage_collector_active || garbage_debug == 1)
 	{
-		counter = 0;
+		garbage_free(pool, data);
+		return;
 	}
 
-	SAFE_MUTEX_UNLOCK(&add_lock);
-
-	struct cs_garbage *garbage = (struct cs_garbage*)malloc(sizeof(struct cs_garbage));
-	if(garbage == NULL)
+	if(!(garbage = pool_alloc(&garbage_pool)))
 	{
 		cs_log("*** MEMORY FULL -> FREEING DIRECT MAY LEAD TO INSTABILITY!!! ***");
-		NULLFREE(data);
+		garbage_free(pool, data);
 		return;
 	}
-	garbage->time = time(NULL);
+	garbage->time = time;
 	garbage->data = data;
-	garbage->next = NULL;
+	garbage->pool = pool;
 #ifdef WITH_DEBUG
 	garbage->file = file;
 	garbage->line = line;
 #endif
+	__sync_synchronize(); // data was unlinked before we read the epoch
+	garbage->epoch = epoch_global;
 
-	cs_writelock(__func__, &garbage_lock[bucket]);
+	if((rec = epoch_get_rec()))
+	{
+		do
+		{
+			old = rec->retired;
+			garbage->next = old;
+		}
+		while(!__sync_bool_compare_and_swap(&rec->retired, old, garbage));
+	}
+	else
+	{
+		SAFE_MUTEX_LOCK(&orphan_lock);
+		garbage->next = orphan_first;
+		orphan_first = garbage;
+		SAFE_MUTEX_UNLOCK(&orphan_lock);
+	}
+}
 
+#ifdef WITH_DEBUG
+void add_garbage_debug(POOL *pool, void *data, char *file, uint32_t line)
+{
+	garbage_retire(pool, data, time(NULL) + garbage_delay, file, line);
+}
+
+void add_garbage_epoch_int(POOL *pool, void *data)
+{
+	garbage_retire(pool, data, 0, __FILE__, __LINE__);
+}
+#else
+void add_garbage_int(POOL *pool, void *data)
+{
+	garbage_retire(pool, data, time(NULL) + garbage_delay);
+}
+
+void add_garbage_epoch_int(POOL *pool, void *data)
+{
+	garbage_retire(pool, data, 0);
+}
+#endif
+
+#ifdef WITH_DEBUG
+static int32_t garbage_data_cmp(const void *arg, const void *obj)
+{
+	return (*(void * const *)arg != ((const struct cs_garbage *)obj)->data);
+}
+
+// -g 2: an object that is pending already was retired twice, keep the first one only
+static int8_t garbage_check_twice(struct cs_garbage *garbage)
+{
+	struct cs_garbage *first;
+
+	if(garbage_debug != 2)
+		{ return 0; }
+
+	if((first = find_hash_table(&garbage_ht, &garbage->data, sizeof(void *), &garbage_data_cmp)))
+	{
+		cs_log("Found a try to add garbage twice. Not adding the element to garbage list...");
+		cs_log("Current garbage addition: %s, line %d.", garbage->file, garbage->line);
+		cs_log("Original garbage addition: %s, line %d.", first->file, first->line);
+		pool_free(&garbage_pool, garbage);
+		return 1;
+	}
+	add_hash_table(&garbage_ht, &garbage->ht_node, &garbage_ll, &garbage->ll_node, garbage, &garbage->data, sizeof(void *));
+	return 0;
+}
+#endif
+
+static void garbage_release(struct cs_garbage *garbage)
+{
 #ifdef WITH_DEBUG
 	if(garbage_debug == 2)
 	{
-		struct cs_garbage *garbagecheck = garbage_first[bucket];
-		while(garbagecheck)
+		remove_elem_hash_table(&garbage_ht, &garbage->ht_node);
+		remove_elem_list(&garbage_ll, &garbage->ll_node);
+	}
+#endif
+	garbage_free(garbage->pool, garbage->data);
+	pool_free(&garbage_pool, garbage);
+}
+
+// moves freshly retired objects to the collector lists
+static void garbage_take(struct cs_garbage *chain)
+{
+	struct cs_garbage *garbage, *next, *timed = NULL;
+
+	for(garbage = chain; garbage; garbage = next) // lists are newest first
+	{
+		next = garbage->next;
+#ifdef WITH_DEBUG
+		if(garbage_check_twice(garbage))
+			{ continue; }
+#endif
+		if(!garbage->time)
 		{
-			if(garbagecheck->data == data)
-			{
-				cs_log("Found a try to add garbage twice. Not adding the element to garbage list...");
-				cs_log("Current garbage addition: %s, line %d.", file, line);
-				cs_log("Original garbage addition: %s, line %d.", garbagecheck->file, garbagecheck->line);
-				cs_writeunlock(__func__, &garbage_lock[bucket]);
-				NULLFREE(garbage);
-				return;
-			}
-			garbagecheck = garbagecheck->next;
+			garbage->next = epoch_pending;
+			epoch_pending = garbage;
+		}
+		else
+		{
+			garbage->next = timed;
+			timed = garbage;
 		}
 	}
-#endif
 
-	garbage->next = garbage_first[bucket];
-	garbage_first[bucket] = garbage;
+	if(!timed)
+		{ return; }
+
+	if(timed_last)
+		{ timed_last->next = timed; }
+	else
+		{ timed_first = timed; }
+	for(timed_last = timed; timed_last->next; timed_last = timed_last->next) { ; }
+}
+
+// only called by the collector thread or on shutdown
+static void garbage_collect(int8_t force)
+{
+	struct s_epoch_rec *rec;
+	struct cs_garbage *garbage, *next, *keep = NULL;
+	uint32_t min, active;
+	time_t now = time(NULL);
+
+	// advance the epoch, readers entering from now on can't see objects retired before
+	min = epoch_global + 1;
+	if(!min)
+		{ min = 1; }
+	epoch_global = min;
+	__sync_synchronize();
+
+	SAFE_MUTEX_LOCK(&epoch_rec_lock);
+	for(rec = epoch_first; rec; rec = rec->next)
+	{
+		active = rec->active;
+		if(active && (int32_t)(active - min) < 0)
+			{ min = active; }
+		if(rec->retired)
+			{ garbage_take(__sync_lock_test_and_set(&rec->retired, NULL)); }
+	}
+	SAFE_MUTEX_UNLOCK(&epoch_rec_lock);
+
+	if(orphan_first)
+	{
+		SAFE_MUTEX_LOCK(&orphan_lock);
+		garbage = orphan_first;
+		orphan_first = NULL;
+		SAFE_MUTEX_UNLOCK(&orphan_lock);
+		garbage_take(garbage);
+	}
 
-	cs_writeunlock(__func__, &garbage_lock[bucket]);
+	for(garbage = epoch_pending; garbage; garbage = next)
+	{
+		next = garbage->next;
+		if(force || (int32_t)(min - garbage->epoch) > 0)
+			{ garbage_release(garbage); }
+		else
+		{
+			garbage->next = keep;
+			keep = garbage;
+		}
+	}
+	epoch_pending = keep;
+
+	// stop at the first one that is not due, the rest came later
+	while((garbage = timed_first) && (force || (garbage->time <= now && (int32_t)(min - garbage->epoch) > 0)))
+	{
+		timed_first = garbage->next;
+		garbage_release(garbage);
+	}
+	if(!timed_first)
+		{ timed_last = NULL; }
 }
 
 static pthread_cond_t sleep_cond;
@@ -102,55 +369,13 @@ static pthread_mutex_t sleep_cond_mutex;
 
 static void garbage_collector(void)
 {
-	int32_t i,j;
-	struct cs_garbage *garbage, *next, *prev, *first;
 	set_thread_name(__func__);
-	int32_t timeout_time = 2 * cfg.ctimeout / 1000 + 6;
 
 	while(garbage_collector_active)
 	{
-		time_t deltime = time(NULL) - timeout_time;
-
-		for(i = 0; i < HASH_BUCKETS; ++i)
-		{
-			j = 0;
-			cs_writelock(__func__, &garbage_lock[i]);
-			first = garbage_first[i];
-
-			for(garbage = first, prev = NULL; garbage; prev = garbage, garbage = garbage->next, j++)
-			{
-				if(j == 2)
- 				{
-					j++;
-					cs_writeunlock(__func__, &garbage_lock[i]);
-				}
-
-				if(garbage->time < deltime) // all following elements are too new
-				{
-					if(prev)
-					{
-						prev->next = NULL;
-					}
-					else
-					{
-						garbage_first[i] = NULL;
-					}
-					break;
-				}
-			}
-
-			cs_writeunlock(__func__, &garbage_lock[i]);
-
-			// list has been taken out before so we don't need a lock here anymore!
-			while(garbage)
-			{
-				next = garbage->next;
-				free(garbage->data);
-				free(garbage);
-				garbage = next;
-			}
-		}
-		sleepms_on_cond(__func__, &sleep_cond_mutex, &sleep_cond, 500);
+		garbage_collect(0);
+		// objects of lock-free readers go within a few runs, timed ones are due once a second at most
+		sleepms_on_cond(__func__, &sleep_cond_mutex, &sleep_cond, epoch_pending ? 200 : 1000);
 	}
 	pthread_exit(NULL);
 }
@@ -158,16 +383,12 @@ static void garbage_collector(void)
 void start_garbage_collector(int32_t debug)
 {
 	garbage_debug = debug;
-	int32_t i;
-
-	SAFE_MUTEX_INIT(&add_lock, NULL);
-
-	for(i = 0; i < HASH_BUCKETS; ++i)
-	{
-		cs_lock_create(__func__, &garbage_lock[i], "garbage_lock", 9000);
+	garbage_delay = 2 * cfg.ctimeout / 1000 + 6;
 
-		garbage_first[i] = NULL;
-	}
+	pool_init(&garbage_pool, "cs_garbage", sizeof(struct cs_garbage), 4096);
+#ifdef WITH_DEBUG
+	init_hash_table(&garbage_ht, &garbage_ll);
+#endif
 	cs_pthread_cond_init(__func__, &sleep_cond_mutex, &sleep_cond);
 
 	garbage_collector_active = 1;
@@ -183,35 +404,17 @@ void stop_garbage_collector(void)
 {
 	if(garbage_collector_active)
 	{
-		int32_t i;
-
 		garbage_collector_active = 0;
 		SAFE_COND_SIGNAL(&sleep_cond);
 		cs_sleepms(300);
 		SAFE_COND_SIGNAL(&sleep_cond);
 		SAFE_THREAD_JOIN(garbage_thread, NULL);
 
-		for(i = 0; i < HASH_BUCKETS; ++i)
-			{ cs_writelock(__func__, &garbage_lock[i]); }
+		garbage_collect(1);
 
-		for(i = 0; i < HASH_BUCKETS; ++i)
-		{
-			while(garbage_first[i])
-			{
-				struct cs_garbage *next = garbage_first[i]->next;
-				NULLFREE(garbage_first[i]->data);
-				NULLFREE(garbage_first[i]);
-				garbage_first[i] = next;
-			}
-		}
-
-		for(i = 0; i < HASH_BUCKETS; ++i)
-		{
-			cs_writeunlock(__func__, &garbage_lock[i]);
-			cs_lock_destroy(__func__, &garbage_lock[i]);
-		}
-
-		pthread_mutex_destroy(&add_lock);
+#ifdef WITH_DEBUG
+		deinitialize_hash_table(&garbage_ht);
+#endif
 		pthread_cond_destroy(&sleep_cond);
 		pthread_mutex_destroy(&sleep_cond_mutex);
 	}
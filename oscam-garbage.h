@@ -1,12 +1,23 @@
 #ifndef OSCAM_GARBAGE_H_
 #define OSCAM_GARBAGE_H_
 
+struct s_pool;
+
 #ifdef WITH_DEBUG
-extern void add_garbage_debug(void *data, char *file, uint32_t line);
-#define add_garbage(x) add_garbage_debug(x, __FILE__, __LINE__)
+extern void add_garbage_debug(struct s_pool *pool, void *data, char *file, uint32_t line);
+#define add_garbage(x) add_garbage_debug(NULL, x, __FILE__, __LINE__)
+#define add_garbage_pool(p, x) add_garbage_debug(p, x, __FILE__, __LINE__)
 #else
-extern void add_garbage(void *data);
+extern void add_garbage_int(struct s_pool *pool, void *data);
+#define add_garbage(x) add_garbage_int(NULL, x)
+#define add_garbage_pool(p, x) add_garbage_int(p, x)
 #endif
+// lock-free readers: objects retired with add_garbage_epoch() stay valid until every
+// thread that was inside epoch_enter()/epoch_leave() at retire time has left
+extern void epoch_enter(void);
+extern void epoch_leave(void);
+extern void add_garbage_epoch_int(struct s_pool *pool, void *data);
+#define add_garbage_epoch(x) add_garbage_epoch_int(NULL, x)
 extern void start_garbage_collector(int32_t);
 extern void stop_garbage_collector(void);
 
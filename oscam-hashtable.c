@@ -6,6 +6,7 @@
 #include "tommyDS_hashlin/tommyhash.c"
 #include "tommyDS_hashlin/tommyhashlin.c"
 #include "tommyDS_hashlin/tommylist.c"
+#include "oscam-hashtable.h"
 
 void init_hash_table(void *ht, void *ll)
 {
@@ -67,10 +68,80 @@ void *get_first_elem_list(void *ll)
 		return NULL;
 }
 
-void *get_data_from_node(void *node)
+void *get_data_from_node(void *_node)
 {
-	if (node)
-		return ((tommy_node *)node)->data;
+	if (_node)
+		return ((tommy_node *)_node)->data;
 	else
 		return NULL;
 }
+
+void init_expiry_ring(expiry_ring *ring)
+{
+	int i;
+
+	for(i = 0; i < EXPIRY_RING_SLOTS; i++)
+		tommy_list_init(&ring->slot[i]);
+	ring->next = 0;
+}
+
+// the slot index is kept in the node index (unused by lists), removal needs it
+void add_expiry_ring(expiry_ring *ring, node *ring_node, void *obj, time_t expire)
+{
+	uint32_t idx;
+
+	if (!ring->next)
+		ring->next = expire;
+	if (expire < ring->next)
+		expire = ring->next;
+	else if (expire - ring->next >= EXPIRY_RING_SLOTS)
+		expire = ring->next + EXPIRY_RING_SLOTS - 1;
+
+	idx = (uint32_t)expire % EXPIRY_RING_SLOTS;
+	tommy_list_insert_tail(&ring->slot[idx], ring_node, obj);
+	ring_node->index = idx;
+}
+
+void remove_expiry_ring(expiry_ring *ring, node *ring_node)
+{
+	tommy_list_remove_existing(&ring->slot[ring_node->index], ring_node);
+}
+
+void move_expiry_ring(expiry_ring *ring, node *ring_node, time_t expire)
+{
+	void *obj = ring_node->data;
+
+	remove_expiry_ring(ring, ring_node);
+	add_expiry_ring(ring, ring_node, obj, expire);
+}
+
+// moves everything expiring up to now to due, O(1) per second passed
+void due_expiry_ring(expiry_ring *ring, time_t now, list *due)
+{
+	time_t n;
+
+	if (!ring->next || now < ring->next)
+		return;
+
+	n = now - ring->next + 1;
+	if (n > EXPIRY_RING_SLOTS)
+		n = EXPIRY_RING_SLOTS;
+
+	for (; n > 0; n--, ring->next++)
+	{
+		tommy_list_concat(due, &ring->slot[(uint32_t)ring->next % EXPIRY_RING_SLOTS]);
+		tommy_list_init(&ring->slot[(uint32_t)ring->next % EXPIRY_RING_SLOTS]);
+	}
+	ring->next = now + 1;
+}
+
+void all_expiry_ring(expiry_ring *ring, list *all)
+{
+	int i;
+
+	for(i = 0; i < EXPIRY_RING_SLOTS; i++)
+	{
+		tommy_list_concat(all, &ring->slot[i]);
+		tommy_list_init(&ring->slot[i]);
+	}
+}
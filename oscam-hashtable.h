@@ -1,3 +1,4 @@
+#include <time.h>
 #include "tommyDS_hashlin/tommytypes.h"
 #include "tommyDS_hashlin/tommyhashlin.h"
 #include "tommyDS_hashlin/tommylist.h"
@@ -10,11 +11,31 @@ void init_hash_table(void *ht, void *ll);
 void add_hash_table(void *ht, void *ht_node, void *ll, void *ll_node, void *obj, void *key, int key_len);
 void *find_hash_table(void *ht, void *key, int key_len, void *compare);
 void *search_remove_elem_hash_table(void *ht, void *key, int key_len, void *compare);
-void *remove_elem_hash_table(void *ht, void *ht_node);
+void remove_elem_hash_table(void *ht, void *ht_node);
 int count_hash_table(void *ht);
 void deinitialize_hash_table(void *ht);
 void sort_list(void *ll, void *cmp);
-void *remove_elem_list(void *ll, void *ll_node);
+void remove_elem_list(void *ll, void *ll_node);
 void *get_first_node_list(void *ll);
 void *get_first_elem_list(void *ll);
 void *get_data_from_node(void *_node);
+
+/*
+ * expiry ring: one list per second of expire time, so cleanups only touch the entries
+ * that are due. Expire times beyond the ring are parked in its last second, the owner
+ * requeues them when they come due.
+ */
+#define EXPIRY_RING_SLOTS 256
+
+typedef struct expiry_ring
+{
+	list		slot[EXPIRY_RING_SLOTS];
+	time_t		next;				// first second not handed out yet, 0 = unused
+} expiry_ring;
+
+void init_expiry_ring(expiry_ring *ring);
+void add_expiry_ring(expiry_ring *ring, node *ring_node, void *obj, time_t expire);
+void remove_expiry_ring(expiry_ring *ring, node *ring_node);
+void move_expiry_ring(expiry_ring *ring, node *ring_node, time_t expire);
+void due_expiry_ring(expiry_ring *ring, time_t now, list *due);
+void all_expiry_ring(expiry_ring *ring, list *all);
@@ -0,0 +1,237 @@
+#define MODULE_LOG_PREFIX "latency"
+
+#include "globals.h"
+#include "oscam-chk.h"
+#include "oscam-latency.h"
+#include "oscam-string.h"
+
+/*
+ * Recording is lock free: bucket counters are bumped with atomic adds, so
+ * stage timings can be taken on any thread. The series themselves are only
+ * created (under lat_lock) and never freed, lookups read the published
+ * pointers without locking.
+ */
+
+#define LAT_MAX_SERIES	512
+#define LAT_CAID_SLOTS	256
+
+static LAT_SERIES *lat_first;
+static LAT_SERIES *lat_proto[CS_MAX_MOD];
+static LAT_SERIES *lat_caid[LAT_CAID_SLOTS];
+static uint32_t lat_series_count;
+static pthread_mutex_t lat_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *lat_stage_names[LAT_STAGES] = { "receive", "cache", "dispatch", "reader", "chk_dcw", "send_dcw", "total" };
+static const char *lat_type_names[LAT_TYPES] = { "protocol", "reader", "caid" };
+
+int64_t lat_now(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static inline uint32_t lat_bucket(uint32_t us)
+{
+	uint32_t shift = 0, v = us;
+
+	if(us >= (1u << LAT_MAX_BITS))
+		{ return LAT_BUCKETS - 1; }
+
+	while(v >= (2u << LAT_SUB_BITS))
+	{
+		v >>= 1;
+		shift++;
+	}
+	return (shift << LAT_SUB_BITS) + v;
+}
+
+// highest value counted in bucket idx
+static uint32_t lat_bucket_high(uint32_t idx)
+{
+	uint32_t shift, mant;
+
+	if(idx < (2u << LAT_SUB_BITS))
+		{ return idx; }
+
+	shift = (idx >> LAT_SUB_BITS) - 1;
+	mant = idx - (shift << LAT_SUB_BITS);
+	return ((mant + 1) << shift) - 1;
+}
+
+void lat_record(LAT_HIST *hist, int64_t us)
+{
+	uint32_t val, max;
+
+	if(us < 0)
+		{ us = 0; }
+	val = us > UINT32_MAX ? UINT32_MAX : (uint32_t)us;
+
+	__sync_fetch_and_add(&hist->buckets[lat_bucket(val)], 1);
+	__sync_fetch_and_add(&hist->count, 1);
+	while((max = hist->max) < val && !__sync_bool_compare_and_swap(&hist->max, max, val)) { ; }
+}
+
+// lat_lock must be held
+static LAT_SERIES *lat_create(int8_t type, uint32_t key, const char *name)
+{
+	LAT_SERIES *series;
+
+	if(lat_series_count >= LAT_MAX_SERIES || !cs_malloc(&series, sizeof(LAT_SERIES)))
+		{ return NULL; }
+
+	series->type = type;
+	series->key = key;
+	cs_strncpy(series->name, name, sizeof(series->name));
+	series->next = lat_first;
+	__sync_synchronize(); // series is complete before it gets visible
+	lat_first = series;
+	lat_series_count++;
+	return series;
+}
+
+static LAT_SERIES *lat_get_protocol(struct s_client *cl)
+{
+	LAT_SERIES *series;
+	uint8_t idx;
+
+	if(!check_client(cl) || cl->typ != 'c' || (idx = cl->module_idx) >= CS_MAX_MOD)
+		{ return NULL; }
+
+	if((series = lat_proto[idx]))
+		{ return series; }
+
+	SAFE_MUTEX_LOCK(&lat_lock);
+	if(!(series = lat_proto[idx]) && (series = lat_create(LAT_TYPE_PROTOCOL, idx, get_module(cl)->desc)))
+		{ lat_proto[idx] = series; }
+	SAFE_MUTEX_UNLOCK(&lat_lock);
+	return series;
+}
+
+static LAT_SERIES *lat_get_caid(uint16_t caid)
+{
+	LAT_SERIES *series;
+	uint32_t i, slot = (caid * 0x9E3779B1) >> 24;
+	char name[8];
+
+	for(i = 0; i < LAT_CAID_SLOTS; i++, slot = (slot + 1) & (LAT_CAID_SLOTS - 1))
+	{
+		if(!(series = lat_caid[slot]))
+			{ break; }
+		if(series->key == caid)
+			{ return series; }
+	}
+	if(i == LAT_CAID_SLOTS)
+		{ return NULL; }
+
+	SAFE_MUTEX_LOCK(&lat_lock);
+	// slots are only filled under lat_lock, continue probing from the first empty one
+	for(; i < LAT_CAID_SLOTS; i++, slot = (slot + 1) & (LAT_CAID_SLOTS - 1))
+	{
+		if(!(series = lat_caid[slot]))
+		{
+			snprintf(name, sizeof(name), "%04X", caid);
+			if((series = lat_create(LAT_TYPE_CAID, caid, name)))
+				{ lat_caid[slot] = series; }
+			break;
+		}
+		if(series->key == caid)
+			{ break; }
+	}
+	SAFE_MUTEX_UNLOCK(&lat_lock);
+	return i < LAT_CAID_SLOTS ? series : NULL;
+}
+
+static LAT_SERIES *lat_get_reader(struct s_reader *rdr)
+{
+	LAT_SERIES *series;
+
+	if((series = rdr->lat_series))
+		{ return series; }
+
+	// readers keep their series by label over reloads
+	SAFE_MUTEX_LOCK(&lat_lock);
+	for(series = lat_first; series; series = series->next)
+	{
+		if(series->type == LAT_TYPE_READER && !strcmp(series->name, rdr->label))
+			{ break; }
+	}
+	if(!series)
+		{ series = lat_create(LAT_TYPE_READER, 0, rdr->label); }
+	rdr->lat_series = series;
+	SAFE_MUTEX_UNLOCK(&lat_lock);
+	return series;
+}
+
+/**
+ * records now - start for the given stage of er, per client protocol,
+ * per caid and, if rdr is set, per reader. start == 0 means not measured.
+ **/
+void lat_add(ECM_REQUEST *er, struct s_reader *rdr, int8_t stage, int64_t start)
+{
+	LAT_SERIES *series;
+	int64_t us;
+
+	if(!start || !er || stage < 0 || stage >= LAT_STAGES)
+		{ return; }
+
+	us = lat_now() - start;
+
+	if((series = lat_get_protocol(er->client)))
+		{ lat_record(&series->hist[stage], us); }
+	if((series = lat_get_caid(er->caid)))
+		{ lat_record(&series->hist[stage], us); }
+	if(rdr && (series = lat_get_reader(rdr)))
+		{ lat_record(&series->hist[stage], us); }
+}
+
+// value below which permille/1000 of the recorded values are, in us
+uint32_t lat_percentile(LAT_HIST *hist, uint32_t permille)
+{
+	uint64_t target, seen = 0;
+	uint32_t i, count = hist->count, high;
+
+	if(!count)
+		{ return 0; }
+
+	target = ((uint64_t)count * permille + 999) / 1000;
+	if(!target)
+		{ target = 1; }
+
+	for(i = 0; i < LAT_BUCKETS; i++)
+	{
+		seen += hist->buckets[i];
+		if(seen >= target)
+		{
+			high = lat_bucket_high(i);
+			return high < hist->max ? high : hist->max;
+		}
+	}
+	return hist->max;
+}
+
+LAT_SERIES *lat_get_first(void)
+{
+	return lat_first;
+}
+
+const char *lat_stage_name(int8_t stage)
+{
+	return (stage >= 0 && stage < LAT_STAGES) ? lat_stage_names[stage] : "";
+}
+
+const char *lat_type_name(int8_t type)
+{
+	return (type >= 0 && type < LAT_TYPES) ? lat_type_names[type] : "";
+}
+
+// concurrent recordings may survive the reset, that is fine for statistics
+void lat_reset(void)
+{
+	LAT_SERIES *series;
+
+	SAFE_MUTEX_LOCK(&lat_lock);
+	for(series = lat_first; series; series = series->next)
+		{ memset(series->hist, 0, sizeof(series->hist)); }
+	SAFE_MUTEX_UNLOCK(&lat_lock);
+}
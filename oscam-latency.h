@@ -0,0 +1,60 @@
+/* per stage ecm latency histograms */
+
+#ifndef OSCAM_LATENCY_H_
+#define OSCAM_LATENCY_H_
+
+enum lat_stage
+{
+	LAT_RECEIVE = 0,		// ecm received -> get_cw()
+	LAT_CACHE,				// cache lookup in get_cw()
+	LAT_DISPATCH,			// request_cw_from_readers()
+	LAT_READER,				// request sent -> reader answer
+	LAT_CHK_DCW,			// reader answer -> chk_dcw()
+	LAT_SEND_DCW,			// send_dcw() to the client
+	LAT_TOTAL,				// ecm received -> answer sent
+	LAT_STAGES
+};
+
+enum lat_type
+{
+	LAT_TYPE_PROTOCOL = 0,
+	LAT_TYPE_READER,
+	LAT_TYPE_CAID,
+	LAT_TYPES
+};
+
+/*
+ * log-linear buckets (HDR style) over microseconds: values below 16 us are exact,
+ * above that every power of two is split into 8 buckets (max. 12.5% error).
+ */
+#define LAT_SUB_BITS	3
+#define LAT_MAX_BITS	26	// 2^26 us = 67 s, larger values go to the last bucket
+#define LAT_BUCKETS		((LAT_MAX_BITS - LAT_SUB_BITS + 1) << LAT_SUB_BITS)
+
+typedef struct s_lat_hist
+{
+	uint32_t		count;
+	uint32_t		max;							// us
+	uint32_t		buckets[LAT_BUCKETS];
+} LAT_HIST;
+
+typedef struct s_lat_series LAT_SERIES;
+struct s_lat_series
+{
+	int8_t			type;							// enum lat_type
+	uint32_t		key;							// caid, module index or 0 for readers
+	char			name[32];						// protocol, reader label or caid
+	LAT_HIST		hist[LAT_STAGES];
+	LAT_SERIES		*next;
+};
+
+int64_t lat_now(void);						// us timestamp for the lat_* stage functions
+void lat_add(ECM_REQUEST *er, struct s_reader *rdr, int8_t stage, int64_t start);
+void lat_record(LAT_HIST *hist, int64_t us);		// adds one value in us, lock free
+uint32_t lat_percentile(LAT_HIST *hist, uint32_t permille);
+LAT_SERIES *lat_get_first(void);			// all series, iterate with series->next
+const char *lat_stage_name(int8_t stage);
+const char *lat_type_name(int8_t type);
+void lat_reset(void);
+
+#endif
@@ -1,4 +1,4 @@
-/* singularly linked-list */
+/* singularly linked-list of node chunks */
 
 #include "globals.h"
 #include "oscam-garbage.h"
@@ -12,7 +12,12 @@ extern char *LOG_LIST;
 
   mutex lock is needed when...
   1. l->initial + l->last is modified/accessed
-  2. LL_NODE nxt modified/accessed
+  2. LL_NODE nxt, count or obj modified/accessed
+
+  Every node holds up to LL_CHUNK objs, empty nodes are unlinked at once.
+  Modifications are wrapped in ll_write_begin()/ll_write_end() so ll_iter_next()
+  can step without the lock and retry locked if a writer was active. Removed nodes
+  go through add_garbage() so an optimistic step never reads freed memory.
 */
 
 #ifdef WITH_DEBUG
@@ -22,6 +27,28 @@ static int8_t chk_debuglog(LLIST *l)
 }
 #endif
 
+static inline void ll_write_begin(LLIST *l)
+{
+	l->seq++;
+	__sync_synchronize();
+}
+
+static inline void ll_write_end(LLIST *l)
+{
+	__sync_synchronize();
+	l->seq++;
+}
+
+static LL_NODE *ll_node_create(LLIST *l)
+{
+	LL_NODE *n;
+	uint16_t cap = l->count < LL_CHUNK ? LL_CHUNK_SMALL : LL_CHUNK;
+	if(!cs_malloc(&n, sizeof(LL_NODE) + cap * sizeof(n->obj[0])))
+		{ return NULL; }
+	n->cap = cap;
+	return n;
+}
+
 static void _destroy(LLIST *l)
 {
 	if(!l) { return; }
@@ -72,87 +99,170 @@ void ll_destroy_free_data(LLIST **pl)
 
 	//*********************************
 	cs_writelock(__func__, &l->lock);
+	ll_write_begin(l);
 
 	LL_NODE *n=l->initial, *nxt;
+	int32_t i;
 	while(n)
 	{
 		nxt = n->nxt;
-		NULLFREE(n->obj);
-		NULLFREE(n);
+		for(i = 0; i < n->count; i++)
+			{ NULLFREE(n->obj[i]); }
+		add_garbage(n);
 		n = nxt;
 	}
 	l->version++;
 	l->count = 0;
 	l->initial = 0;
 	l->last = 0;
+	ll_write_end(l);
 	cs_writeunlock(__func__, &l->lock);
 	//**********************************
 
-	if(!l->flag++)
-	{
-		cs_writelock(__func__, &l->lock); //just getting sure noone is using it
-		cs_writeunlock(__func__, &l->lock);
+	_destroy(l);
+}
 
-		cs_lock_destroy(__func__, &l->lock);
-		NULLFREE(l);
+/* Searches obj in node n, starting at the index it was last seen. Removals shift objs down, so look there first. */
+static int32_t ll_node_find(const LL_NODE *n, const void *obj, int32_t idx)
+{
+	int32_t i;
+	for(i = MIN(idx, n->count - 1); i >= 0; i--)
+	{
+		if(n->obj[i] == obj)
+			{ return i; }
 	}
+	for(i = idx + 1; i < n->count; i++)
+	{
+		if(n->obj[i] == obj)
+			{ return i; }
+	}
+	return -1;
 }
 
+/* Returns the node in front of it->cur. it->prv is only a hint, it is not kept up to date by other iterators. */
+static LL_NODE *ll_node_prev(const LL_ITER *it)
+{
+	LL_NODE *p;
+	if(it->cur == it->l->initial)
+		{ return NULL; }
+	if(it->prv && it->prv->nxt == it->cur)
+		{ return it->prv; }
+	for(p = it->l->initial; p && p->nxt != it->cur; p = p->nxt) { ; }
+	return p;
+}
 
-/* Internal iteration function. Make sure that you don't have a lock and that it and it->l are set. */
-static void *ll_iter_next_nolock(LL_ITER *it)
+/* Puts the iterator on the obj in front of index idx of node n, p is the node in front of n. */
+static void ll_iter_set_before(LL_ITER *it, LL_NODE *n, LL_NODE *p, int32_t idx)
 {
-	if(it->l->version != it->ll_version)
+	if(idx > 0)
+	{
+		it->cur = n;
+		it->prv = p;
+		it->idx = idx - 1;
+		it->obj = n->obj[it->idx];
+	}
+	else if(p)
 	{
+		it->cur = p;
+		it->prv = NULL;
+		it->idx = p->count - 1;
+		it->obj = p->obj[it->idx];
+	}
+	else
+		{ ll_iter_reset(it); }
+}
+
+/* Finds the current obj again after the list was modified. Returns 0 if it is gone, the iterator is then
+   placed in front of the obj that took its place, or reset if that can't be found. */
+static int32_t ll_iter_locate(LL_ITER *it)
+{
+	LL_NODE *n, *p = NULL;
+	int32_t i, prv_found = 0;
+
 #ifdef WITH_DEBUG
-		if(chk_debuglog(it->l))
-			{ cs_log_dbg(D_TRACE, "list changed, searching new position"); }
+	if(chk_debuglog(it->l))
+		{ cs_log_dbg(D_TRACE, "list changed, searching new position"); }
 #endif
 
-		LL_NODE *ptr;
-		//cs_readlock(__func__, &it->l->lock);
-		if(!it->cur && !it->prv)
+	if(!it->cur) // not started or at the end
+		{ return 0; }
+
+	for(n = it->l->initial; n && n != it->cur; n = n->nxt)
+	{
+		if(n == it->prv)
+			{ prv_found = 1; }
+		p = n;
+	}
+	if(n)
+	{
+		it->prv = p;
+		if((i = ll_node_find(n, it->obj, it->idx)) >= 0)
 		{
-			it->cur = it->l->initial;
+			it->idx = i;
+			return 1;
 		}
-		else
+		ll_iter_set_before(it, n, p, MIN(it->idx, n->count));
+		return 0;
+	}
+
+	// node was dropped, the obj may have moved elsewhere
+	for(p = NULL, n = it->l->initial; n; p = n, n = n->nxt)
+	{
+		if((i = ll_node_find(n, it->obj, 0)) >= 0)
 		{
-			for(ptr = it->l->initial; ptr; ptr = ptr->nxt)
-			{
-				if(ptr == it->cur)
-				{
-					it->prv = ptr;
-					it->cur = ptr->nxt;
-					break;
-				}
-			}
-			if(!ptr)
-			{
-				ll_iter_reset(it); // restart iteration
-				it->cur = it->l->initial;
-			}
+			it->cur = n;
+			it->prv = p;
+			it->idx = i;
+			return 1;
 		}
-		it->ll_version = it->l->version;
-		//cs_readunlock(__func__, &it->l->lock);
-
-		if(it->cur)
-			{ return it->cur->obj; }
-
 	}
+	if(prv_found) // continue behind the node in front of the dropped one
+		{ ll_iter_set_before(it, it->prv, NULL, it->prv->count); }
 	else
+		{ ll_iter_reset(it); } // restart iteration
+	return 0;
+}
+
+/* Advances the iterator by one obj. The list must be unchanged since the iterator was last positioned. */
+static void *ll_iter_step(LL_ITER *it)
+{
+	if(it->cur)
 	{
-		if(it->cur)
+		if(it->idx + 1 < it->cur->count)
+			{ it->idx++; }
+		else
 		{
 			it->prv = it->cur;
 			it->cur = it->cur->nxt;
+			if(!it->cur)
+			{
+				it->idx = -1;
+				it->obj = NULL;
+				return NULL;
+			}
+			it->idx = 0;
 		}
-		else if(it->l->initial && !it->prv)
-			{ it->cur = it->l->initial; }
+		return (it->obj = it->cur->obj[it->idx]);
+	}
 
-		if(it->cur)
-			{ return it->cur->obj; }
+	if(it->idx < 0 || !it->l->initial || !it->l->initial->count) // at the end or empty
+		{ return NULL; }
+
+	it->cur = it->l->initial;
+	it->prv = NULL;
+	it->idx = 0;
+	return (it->obj = it->cur->obj[0]);
+}
+
+/* Internal iteration function. Make sure that you don't have a lock and that it and it->l are set. */
+static void *ll_iter_next_nolock(LL_ITER *it)
+{
+	if(it->l->version != it->ll_version)
+	{
+		ll_iter_locate(it);
+		it->ll_version = it->l->version;
 	}
-	return NULL;
+	return ll_iter_step(it);
 }
 
 static void ll_clear_int(LLIST *l, int32_t clear_data)
@@ -160,13 +270,18 @@ static void ll_clear_int(LLIST *l, int32_t clear_data)
 	if(!l || l->flag) { return; }
 
 	cs_writelock(__func__, &l->lock);
+	ll_write_begin(l);
 
 	LL_NODE *n = l->initial, *nxt;
+	int32_t i;
 	while(n)
 	{
 		nxt = n->nxt;
 		if(clear_data)
-			{ add_garbage(n->obj); }
+		{
+			for(i = 0; i < n->count; i++)
+				{ add_garbage(n->obj[i]); }
+		}
 		add_garbage(n);
 		n = nxt;
 	}
@@ -174,6 +289,7 @@ static void ll_clear_int(LLIST *l, int32_t clear_data)
 	l->count = 0;
 	l->initial = 0;
 	l->last = 0;
+	ll_write_end(l);
 	cs_writeunlock(__func__, &l->lock);
 }
 
@@ -193,19 +309,31 @@ static LL_NODE *ll_append_nolock(LLIST *l, void *obj)
 {
 	if(l && obj && !l->flag)
 	{
-		LL_NODE *new;
-		if(!cs_malloc(&new, sizeof(LL_NODE)))
-			{ return NULL; }
-		new->obj = obj;
-
-		if(l->last)
-			{ l->last->nxt = new; }
+		LL_NODE *n = l->last;
+		if(!n || n->count == n->cap)
+		{
+			if(!(n = ll_node_create(l)))
+				{ return NULL; }
+			n->obj[0] = obj;
+			n->count = 1;
+
+			ll_write_begin(l);
+			if(l->last)
+				{ l->last->nxt = n; }
+			else
+				{ l->initial = n; }
+			l->last = n;
+		}
 		else
-			{ l->initial = new; }
-		l->last = new;
+		{
+			ll_write_begin(l);
+			n->obj[n->count] = obj;
+			n->count++;
+		}
 
 		l->count++;
-		return new;
+		ll_write_end(l);
+		return n;
 	}
 
 	return NULL;
@@ -228,22 +356,38 @@ LL_NODE *ll_prepend(LLIST *l, void *obj)
 {
 	if(l && obj && !l->flag)
 	{
-		LL_NODE *new;
-		if(!cs_malloc(&new, sizeof(LL_NODE)))
-			{ return NULL; }
-		new->obj = obj;
-
 		cs_writelock(__func__, &l->lock);
 
-		new->nxt = l->initial;
-
-		l->initial = new;
-		if(!l->last)
-			{ l->last = l->initial; }
+		LL_NODE *n = l->initial;
+		if(n && n->count < n->cap)
+		{
+			ll_write_begin(l);
+			memmove(&n->obj[1], &n->obj[0], n->count * sizeof(n->obj[0]));
+			n->obj[0] = obj;
+			n->count++;
+			l->version++; // objs of the first node moved
+		}
+		else
+		{
+			if(!(n = ll_node_create(l)))
+			{
+				cs_writeunlock(__func__, &l->lock);
+				return NULL;
+			}
+			n->obj[0] = obj;
+			n->count = 1;
+
+			ll_write_begin(l);
+			n->nxt = l->initial;
+			l->initial = n;
+			if(!l->last)
+				{ l->last = n; }
+		}
 		l->count++;
+		ll_write_end(l);
 		cs_writeunlock(__func__, &l->lock);
 
-		return new;
+		return n;
 	}
 
 	return NULL;
@@ -263,63 +407,70 @@ void *ll_iter_next(LL_ITER *it)
 {
 	if(it && it->l && !it->l->flag)
 	{
-		cs_readlock(__func__, &it->l->lock);
-		void *res = ll_iter_next_nolock(it);
-		cs_readunlock(__func__, &it->l->lock);
+		LLIST *l = it->l;
+		uint32_t seq = l->seq;
+		void *res;
+
+		// step without the lock if no writer interfered, else retry locked
+		__sync_synchronize();
+		if(!(seq & 1) && it->ll_version == l->version)
+		{
+			LL_ITER tmp = *it;
+			res = ll_iter_step(&tmp);
+			__sync_synchronize();
+			if(l->seq == seq)
+			{
+				*it = tmp;
+				return res;
+			}
+		}
+
+		cs_readlock(__func__, &l->lock);
+		res = ll_iter_next_nolock(it);
+		cs_readunlock(__func__, &l->lock);
 		return res;
 	}
 	return NULL;
 }
 
-void *ll_iter_remove_nolock(LL_ITER *it)
+/* Removes the current obj, the iterator moves to the obj in front of it. Make sure you have a write lock. */
+static void *ll_iter_remove_nolock(LL_ITER *it)
 {
 	void *obj = NULL;
-	if(it)
+	if(it && it->cur)
 	{
-		LL_NODE *del = it->cur;
-		if(del)
+		LLIST *l = it->l;
+		if(it->ll_version != l->version) // List has been modified so it->cur might be wrong!
 		{
-			obj = del->obj;
-			LL_NODE *prv = it->prv;
-			if(it->ll_version != it->l->version || !prv) // List has been modified so it->prv might be wrong!
-			{
-				LL_NODE *n = it->l->initial;
-				prv = NULL;
-				while(n && n != del)
-				{
-					prv = n;
-					n = n->nxt;
-				}
-				if(n != del)
-					{ return NULL; }
-			}
+			int32_t found = ll_iter_locate(it);
+			it->ll_version = l->version;
+			if(!found)
+				{ return NULL; }
+		}
 
-			if(prv)
-				{ prv->nxt = del->nxt; }
-			else
-				{ it->l->initial = del->nxt; }
-			if(!it->l->initial)
-				{ it->l->last = NULL; }
-			else if(del == it->l->last)
-				{ it->l->last = prv; }
-
-			it->cur = it->l->initial;
-			it->prv = NULL;
-			if(prv != NULL)
-			{
-				while(it->cur && it->cur != prv)
-				{
-					it->prv = it->cur;
-					it->cur = it->cur->nxt;
-				}
-			}
-			else
-				{ it->cur = NULL; }
-			it->l->count--;
-			it->ll_version = ++it->l->version;
+		LL_NODE *n = it->cur, *p;
+		int32_t idx = it->idx;
+		obj = n->obj[idx];
+		p = idx ? it->prv : ll_node_prev(it); // only needed to unlink or to step back to the previous node
 
-			add_garbage(del);
+		ll_write_begin(l);
+		memmove(&n->obj[idx], &n->obj[idx + 1], (n->count - idx - 1) * sizeof(n->obj[0]));
+		n->count--;
+		if(!n->count)
+		{
+			if(p)
+				{ p->nxt = n->nxt; }
+			else
+				{ l->initial = n->nxt; }
+			if(l->last == n)
+				{ l->last = p; }
+			add_garbage(n);
 		}
+		l->count--;
+		it->ll_version = ++l->version;
+		ll_write_end(l);
+
+		ll_iter_set_before(it, n, p, idx);
 	}
 	return obj;
 }
@@ -345,7 +496,7 @@ void *ll_iter_move(LL_ITER *it, int32_t offset)
 		void *res = NULL;
 		for(i = 0; i < offset; i++)
 		{
-			res = ll_iter_next_nolock(it);
+			res = ll_iter_next(it);
 			if(!res) { break; }
 		}
 
@@ -358,23 +509,27 @@ void *ll_iter_peek(const LL_ITER *it, int32_t offset)
 {
 	if(it && it->l && !it->l->flag)
 	{
-		cs_readlock(__func__, &((LL_ITER *)it)->l->lock);
-
-		LL_NODE *n = it->cur;
+		LL_ITER pos = *it;
+		LL_NODE *n;
+		void *res = NULL;
 		int32_t i;
 
-		for(i = 0; i < offset; i++)
+		cs_readlock(__func__, &pos.l->lock);
+		if(pos.ll_version != pos.l->version)
+			{ ll_iter_locate(&pos); }
+
+		n = pos.cur;
+		i = pos.idx + offset;
+		while(n && i >= n->count)
 		{
-			if(n)
-				{ n = n->nxt; }
-			else
-				{ break; }
+			i -= n->count;
+			n = n->nxt;
 		}
-		cs_readunlock(__func__, &((LL_ITER *)it)->l->lock);
+		if(n && i >= 0)
+			{ res = n->obj[i]; }
+		cs_readunlock(__func__, &pos.l->lock);
 
-		if(!n)
-			{ return NULL; }
-		return n->obj;
+		return res;
 	}
 	return NULL;
 }
@@ -385,6 +540,8 @@ void ll_iter_reset(LL_ITER *it)
 	{
 		it->prv = NULL;
 		it->cur = NULL;
+		it->obj = NULL;
+		it->idx = 0;
 	}
 }
 
@@ -392,27 +549,60 @@ void ll_iter_insert(LL_ITER *it, void *obj)
 {
 	if(it && obj && !it->l->flag)
 	{
-		cs_writelock(__func__, &it->l->lock);
+		LLIST *l = it->l;
+		cs_writelock(__func__, &l->lock);
+
+		if(it->ll_version != l->version)
+		{
+			ll_iter_locate(it);
+			it->ll_version = l->version;
+		}
 
-		if(!it->cur || !it->cur->nxt)
-			{ ll_append_nolock(it->l, obj); }
+		LL_NODE *n = it->cur, *m = NULL;
+		int32_t i = it->idx + 1;
+		if(!n || (n == l->last && i == n->count))
+			{ ll_append_nolock(l, obj); }
 		else
 		{
-			LL_NODE *n;
-			if(!cs_malloc(&n, sizeof(LL_NODE)))
+			if(n->count == n->cap && (i < n->count || n->nxt->count == n->nxt->cap))
 			{
-				cs_writeunlock(__func__, &it->l->lock);
-				return;
+				if(!(m = ll_node_create(l)))
+				{
+					cs_writeunlock(__func__, &l->lock);
+					return;
+				}
 			}
 
-			n->obj = obj;
-			n->nxt = it->cur->nxt;
-			it->cur->nxt = n;
-
-			it->l->count++;
-			it->ll_version = ++it->l->version;
+			ll_write_begin(l);
+			if(n->count < n->cap)
+			{
+				memmove(&n->obj[i + 1], &n->obj[i], (n->count - i) * sizeof(n->obj[0]));
+				n->obj[i] = obj;
+				n->count++;
+			}
+			else if(!m) // behind the last obj of a full node, the next one has room
+			{
+				n = n->nxt;
+				memmove(&n->obj[1], &n->obj[0], n->count * sizeof(n->obj[0]));
+				n->obj[0] = obj;
+				n->count++;
+			}
+			else // split the node
+			{
+				m->obj[0] = obj;
+				memcpy(&m->obj[1], &n->obj[i], (n->count - i) * sizeof(n->obj[0]));
+				m->count = 1 + n->count - i;
+				n->count = i;
+				m->nxt = n->nxt;
+				n->nxt = m;
+				if(l->last == n)
+					{ l->last = m; }
+			}
+			l->count++;
+			it->ll_version = ++l->version;
+			ll_write_end(l);
 		}
-		cs_writeunlock(__func__, &it->l->lock);
+		cs_writeunlock(__func__, &l->lock);
 	}
 }
 
@@ -422,8 +612,7 @@ void *ll_iter_remove(LL_ITER *it)
 	void *obj = NULL;
 	if(it && it->l && !it->l->flag)
 	{
-		LL_NODE *del = it->cur;
-		if(del)
+		if(it->cur)
 		{
 			cs_writelock(__func__, &it->l->lock);
 			obj = ll_iter_remove_nolock(it);
@@ -440,45 +629,76 @@ int32_t ll_iter_move_first(LL_ITER *it)
 	int32_t moved = 0;
 	if(it && it->l && !it->l->flag)
 	{
-		LL_NODE *move = it->cur;
-		if(move)
-		{
-			if(move == it->l->initial)  //Can't move self to first
-				{ return 1; }
+		LLIST *l = it->l;
+		if(!it->cur)
+			{ return moved; }
+		if(it->cur == l->initial && !it->idx && it->ll_version == l->version)  //Can't move self to first
+			{ return 1; }
 
-			LL_NODE *prv = it->prv;
-			cs_writelock(__func__, &it->l->lock);
-			if(it->ll_version != it->l->version || !prv) // List has been modified so it->prv might be wrong!
+		cs_writelock(__func__, &l->lock);
+		if(it->ll_version != l->version) // List has been modified so it->cur might be wrong!
+		{
+			int32_t found = ll_iter_locate(it);
+			it->ll_version = l->version;
+			if(!found)
 			{
-				LL_NODE *n = it->l->initial;
-				prv = NULL;
-				while(n && n != move)
-				{
-					prv = n;
-					n = n->nxt;
-				}
-				if(n != move)
-				{
-					cs_writeunlock(__func__, &it->l->lock);
-					return moved;
-				}
+				cs_writeunlock(__func__, &l->lock);
+				return moved;
 			}
+		}
 
-			if(prv)
-				{ prv->nxt = move->nxt; }
-			else
-				{ it->l->initial = move->nxt; }
+		LL_NODE *n = it->cur, *h = l->initial, *m = NULL, *p;
+		int32_t idx = it->idx;
+		void *obj = n->obj[idx];
 
-			if(prv && it->l->last == move)
-				{ it->l->last = prv; }
-			move->nxt = it->l->initial;
-			it->l->initial = move;
+		if(n == h)
+		{
+			ll_write_begin(l);
+			memmove(&h->obj[1], &h->obj[0], idx * sizeof(h->obj[0]));
+			h->obj[0] = obj;
+		}
+		else
+		{
+			if(h->count == h->cap && !(m = ll_node_create(l)))
+			{
+				cs_writeunlock(__func__, &l->lock);
+				return moved;
+			}
+			p = ll_node_prev(it);
 
-			it->ll_version = ++it->l->version;
-			it->prv = NULL;
-			cs_writeunlock(__func__, &it->l->lock);
-			moved = 1;
+			ll_write_begin(l);
+			memmove(&n->obj[idx], &n->obj[idx + 1], (n->count - idx - 1) * sizeof(n->obj[0]));
+			n->count--;
+			if(!n->count)
+			{
+				p->nxt = n->nxt;
+				if(l->last == n)
+					{ l->last = p; }
+				add_garbage(n);
+			}
+			if(m)
+			{
+				m->obj[0] = obj;
+				m->count = 1;
+				m->nxt = h;
+				l->initial = m;
+			}
+			else
+			{
+				memmove(&h->obj[1], &h->obj[0], h->count * sizeof(h->obj[0]));
+				h->obj[0] = obj;
+				h->count++;
+			}
 		}
+		it->ll_version = ++l->version;
+		ll_write_end(l);
+
+		it->cur = l->initial;
+		it->prv = NULL;
+		it->idx = 0;
+		it->obj = obj;
+		cs_writeunlock(__func__, &l->lock);
+		moved = 1;
 	}
 	return moved;
 }
@@ -491,16 +711,19 @@ void ll_iter_remove_data(LL_ITER *it)
 
 void *ll_has_elements(const LLIST *l)
 {
-	if(!l || !l->initial || l->flag)
+	LL_NODE *n;
+	if(!l || l->flag || !(n = l->initial) || !n->count)
 		{ return NULL; }
-	return l->initial->obj;
+	return n->obj[0];
 }
 
 void *ll_last_element(const LLIST *l)
 {
-	if(!l || !l->last || l->flag)
+	LL_NODE *n;
+	int32_t count;
+	if(!l || l->flag || !(n = l->last) || !(count = n->count))
 		{ return NULL; }
-	return l->last->obj;
+	return n->obj[count - 1];
 }
 
 int32_t ll_contains(const LLIST *l, const void *obj)
@@ -605,14 +828,15 @@ void **ll_sort(const LLIST *l, void *compare, int32_t *size)
 	}
 	for(n = l->initial; n; n = n->nxt)
 	{
-		p[i++] = n->obj;
+		memcpy(&p[i], n->obj, n->count * sizeof(p[0]));
+		i += n->count;
 	}
 	cs_readunlock(__func__, &((LLIST *)l)->lock);
 #ifdef WITH_DEBUG
 	//if (chk_debugLog(it->l))
 	//cs_log_dbg(D_TRACE, "sort: count %d size %d", l->count, sizeof(p[0]));
 #endif
-	qsort(p, l->count, sizeof(p[0]), compare);
+	qsort(p, *size, sizeof(p[0]), compare);
 
 	return p;
 }
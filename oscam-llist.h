@@ -1,13 +1,18 @@
-/* singularly linked-list */
+/* singularly linked-list of node chunks */
 
 #ifndef OSCAM_LLIST_H_
 #define OSCAM_LLIST_H_
 
+#define LL_CHUNK		16	// objs per node
+#define LL_CHUNK_SMALL	4	// objs per node while the list is short
+
 typedef struct llnode LL_NODE;
 struct llnode
 {
-	void *obj;
 	LL_NODE *nxt;
+	uint16_t count;
+	uint16_t cap;
+	void *obj[];
 };
 
 typedef struct llist LLIST;
@@ -19,14 +24,17 @@ struct llist
 	int32_t count;
 	CS_MUTEX_LOCK lock;
 	int32_t flag;
-	uint32_t version; // updated on every modification of the list - exception is on prepends and appends as this should not have impacts on iterations!
+	uint32_t version; // updated on every modification of the list - exception is on appends as this should not have impacts on iterations!
+	volatile uint32_t seq; // odd while a writer modifies the list, lets ll_iter_next() step without taking the lock
 };
 
 typedef struct lliter LL_ITER;
 struct lliter
 {
 	LLIST *l;
-	LL_NODE *cur, *prv;
+	LL_NODE *cur, *prv;	// node of the current obj and its predecessor
+	void *obj;			// current obj
+	int32_t idx;		// index of obj in cur, -1 at the end of the list
 	uint32_t ll_version;
 };
 
@@ -1,7 +1,9 @@
 #define MODULE_LOG_PREFIX "lock"
 
 #include "globals.h"
+#include "oscam-latency.h"
 #include "oscam-lock.h"
+#include "oscam-string.h"
 #include "oscam-time.h"
 
 extern char *LOG_LIST;
@@ -70,10 +72,275 @@ void cs_lock_destroy(const char *pn, CS_MUTEX_LOCK *l)
 #endif
 }
 
+// wait time for the lock profiler
+static int64_t lock_wait_us(struct timespec *start)
+{
+	struct timespec now;
+	int64_t us;
+
+	cs_gettime(&now);
+	us = (int64_t)(now.tv_sec - start->tv_sec) * 1000000 + (now.tv_nsec - start->tv_nsec) / 1000;
+	return us < 0 ? 0 : us;
+}
+
+/*
+ * Lock profiler, enabled by lock_profile = 1 in [global]. Locks are grouped
+ * by name. Acquisitions and hold times are counted in per thread blocks, so
+ * the uncontended path does no atomic operation, readers of the statistics
+ * sum up the blocks. Waits are slow anyway, they go to a shared histogram.
+ * Hold times are only taken for write locks, readers may overlap.
+ */
+#define LOCK_PROF_MAX	256
+#define LOCK_PROF_SLOTS	512
+
+typedef struct s_lock_prof LOCK_PROF;
+struct s_lock_prof
+{
+	char			name[32];
+	int32_t			id;								// index into the per thread counters
+	uint64_t		wait_us;
+	uint32_t		timeouts;
+	LAT_HIST		wait;							// us
+	LOCK_PROF		*next;
+};
+
+struct lock_prof_thread
+{
+	uint64_t		locks[LOCK_PROF_MAX];
+	uint64_t		writelocks[LOCK_PROF_MAX];
+	uint64_t		hold_us[LOCK_PROF_MAX];
+	uint32_t		hold_max[LOCK_PROF_MAX];
+	int8_t			in_use;							// owned by a thread, blocks are reused after thread exit
+	struct lock_prof_thread *next;
+};
+
+static LOCK_PROF *lock_prof_first;
+static LOCK_PROF *lock_prof_slots[LOCK_PROF_SLOTS];
+static int32_t lock_prof_count;
+static struct lock_prof_thread *lock_prof_threads;
+static pthread_mutex_t lock_prof_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t lock_prof_key;
+static pthread_once_t lock_prof_once = PTHREAD_ONCE_INIT;
+static int8_t lock_prof_nokey;
+
+static int64_t lock_now_us(void)
+{
+	struct timespec now;
+	cs_gettime(&now);
+	return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+// thread exit: the counters stay, the next thread continues with them
+static void lock_prof_thread_release(void *ptr)
+{
+	((struct lock_prof_thread *)ptr)->in_use = 0;
+}
+
+// no cs_log, we may be inside the log lock. Without a key profiling stays off.
+static void lock_prof_key_create(void)
+{
+	if(pthread_key_create(&lock_prof_key, lock_prof_thread_release))
+		{ lock_prof_nokey = 1; }
+}
+
+static struct lock_prof_thread *lock_prof_get_thread(void)
+{
+	struct lock_prof_thread *t;
+
+	pthread_once(&lock_prof_once, lock_prof_key_create);
+	if(lock_prof_nokey)
+		{ return NULL; }
+	if((t = pthread_getspecific(lock_prof_key)))
+		{ return t; }
+
+	SAFE_MUTEX_LOCK_NOLOG(&lock_prof_lock);
+	for(t = lock_prof_threads; t && t->in_use; t = t->next) { ; }
+	if(!t && (t = calloc(1, sizeof(struct lock_prof_thread)))) // no cs_malloc, it would log from inside the log lock
+	{
+		t->next = lock_prof_threads;
+		lock_prof_threads = t;
+	}
+	if(t)
+		{ t->in_use = 1; }
+	SAFE_MUTEX_UNLOCK_NOLOG(&lock_prof_lock);
+
+	if(t && pthread_setspecific(lock_prof_key, t))
+	{
+		t->in_use = 0;
+		t = NULL;
+	}
+	return t;
+}
+
+static uint32_t lock_prof_hash(const char *name)
+{
+	uint32_t h = 5381;
+	while(*name)
+		{ h = h * 33 + (uint8_t)*name++; }
+	return h & (LOCK_PROF_SLOTS - 1);
+}
+
+// lookups are lock free, slots are only filled under lock_prof_lock
+static LOCK_PROF *lock_prof_find(const char *name)
+{
+	LOCK_PROF *prof;
+	uint32_t i, slot = lock_prof_hash(name);
+
+	for(i = 0; i < LOCK_PROF_SLOTS; i++, slot = (slot + 1) & (LOCK_PROF_SLOTS - 1))
+	{
+		if(!(prof = lock_prof_slots[slot]))
+			{ break; }
+		if(!strncmp(prof->name, name, sizeof(prof->name) - 1))
+			{ return prof; }
+	}
+
+	SAFE_MUTEX_LOCK_NOLOG(&lock_prof_lock);
+	for(; i < LOCK_PROF_SLOTS; i++, slot = (slot + 1) & (LOCK_PROF_SLOTS - 1))
+	{
+		if(!(prof = lock_prof_slots[slot]))
+		{
+			if(lock_prof_count < LOCK_PROF_MAX && (prof = calloc(1, sizeof(LOCK_PROF))))
+			{
+				cs_strncpy(prof->name, name, sizeof(prof->name));
+				prof->id = lock_prof_count++;
+				prof->next = lock_prof_first;
+				__sync_synchronize(); // prof is complete before it gets visible
+				lock_prof_first = prof;
+				lock_prof_slots[slot] = prof;
+			}
+			break;
+		}
+		if(!strncmp(prof->name, name, sizeof(prof->name) - 1))
+			{ break; }
+	}
+	SAFE_MUTEX_UNLOCK_NOLOG(&lock_prof_lock);
+	return i < LOCK_PROF_SLOTS ? prof : NULL;
+}
+
+// the caller holds l, wait_us < 0 means the lock was free
+static void lock_prof_locked(CS_MUTEX_LOCK *l, int8_t type, int64_t wait_us, int8_t timeout)
+{
+	struct lock_prof_thread *t;
+	const char *name = l->name;
+	LOCK_PROF *prof = l->prof;
+
+	if(!prof && (!name || !(prof = l->prof = lock_prof_find(name))))
+		{ return; }
+	if(!(t = lock_prof_get_thread()))
+		{ return; }
+
+	t->locks[prof->id]++;
+	if(wait_us >= 0)
+	{
+		lat_record(&prof->wait, wait_us);
+		__sync_fetch_and_add(&prof->wait_us, wait_us);
+	}
+	if(timeout)
+		{ __sync_fetch_and_add(&prof->timeouts, 1); }
+	if(type == WRITELOCK)
+	{
+		t->writelocks[prof->id]++;
+		l->hold_start = lock_now_us();
+	}
+}
+
+// the caller still holds the write lock
+static void lock_prof_unlocked(CS_MUTEX_LOCK *l)
+{
+	struct lock_prof_thread *t;
+	int64_t hold = lock_now_us() - l->hold_start;
+	uint32_t us = hold < 0 ? 0 : (hold > UINT32_MAX ? UINT32_MAX : (uint32_t)hold);
+
+	l->hold_start = 0;
+	if(!l->prof || !(t = lock_prof_get_thread()))
+		{ return; }
+
+	t->hold_us[l->prof->id] += us;
+	if(us > t->hold_max[l->prof->id])
+		{ t->hold_max[l->prof->id] = us; }
+}
+
+static int lock_prof_cmp(const void *a, const void *b)
+{
+	const LOCK_PROF_STAT *x = a, *y = b;
+	if(x->wait_us != y->wait_us)
+		{ return x->wait_us < y->wait_us ? 1 : -1; }
+	return x->locks < y->locks ? 1 : (x->locks > y->locks ? -1 : 0);
+}
+
+/**
+ * statistics of all profiled locks, most contended (by total wait time) first.
+ * Free the result with NULLFREE.
+ **/
+LOCK_PROF_STAT *lock_prof_get(int32_t *count)
+{
+	LOCK_PROF_STAT *stats, *s;
+	struct lock_prof_thread *t;
+	LOCK_PROF *prof;
+	int32_t n = 0;
+
+	*count = 0;
+	if(!lock_prof_count || !cs_malloc(&stats, lock_prof_count * sizeof(LOCK_PROF_STAT)))
+		{ return NULL; }
+
+	SAFE_MUTEX_LOCK_NOLOG(&lock_prof_lock);
+	for(prof = lock_prof_first; prof && n < lock_prof_count; prof = prof->next)
+	{
+		s = &stats[n];
+		s->name = prof->name;
+		for(t = lock_prof_threads; t; t = t->next)
+		{
+			s->locks += t->locks[prof->id];
+			s->writelocks += t->writelocks[prof->id];
+			s->hold_us += t->hold_us[prof->id];
+			if(t->hold_max[prof->id] > s->hold_max)
+				{ s->hold_max = t->hold_max[prof->id]; }
+		}
+		if(!s->locks)
+			{ continue; }
+		s->waits = prof->wait.count;
+		s->timeouts = prof->timeouts;
+		s->wait_us = prof->wait_us;
+		s->wait_p50 = lat_percentile(&prof->wait, 500);
+		s->wait_p99 = lat_percentile(&prof->wait, 990);
+		s->wait_max = prof->wait.max;
+		n++;
+	}
+	SAFE_MUTEX_UNLOCK_NOLOG(&lock_prof_lock);
+
+	qsort(stats, n, sizeof(LOCK_PROF_STAT), lock_prof_cmp);
+	*count = n;
+	return stats;
+}
+
+// concurrent updates may survive the reset, that is fine for statistics
+void lock_prof_reset(void)
+{
+	struct lock_prof_thread *t;
+	LOCK_PROF *prof;
+
+	SAFE_MUTEX_LOCK_NOLOG(&lock_prof_lock);
+	for(prof = lock_prof_first; prof; prof = prof->next)
+	{
+		prof->wait_us = 0;
+		prof->timeouts = 0;
+		memset(&prof->wait, 0, sizeof(prof->wait));
+	}
+	for(t = lock_prof_threads; t; t = t->next)
+	{
+		memset(t->locks, 0, sizeof(t->locks));
+		memset(t->writelocks, 0, sizeof(t->writelocks));
+		memset(t->hold_us, 0, sizeof(t->hold_us));
+		memset(t->hold_max, 0, sizeof(t->hold_max));
+	}
+	SAFE_MUTEX_UNLOCK_NOLOG(&lock_prof_lock);
+}
+
 void cs_rwlock_int(const char *n, CS_MUTEX_LOCK *l, int8_t type)
 {
-	struct timespec ts;
-	int8_t ret = 0;
+	struct timespec ts, start;
+	int64_t wait_us = -1;
+	int8_t ret = 0, prof = cfg.lock_profile;
 
 	if(!l || !l->name || l->flag)
 		{ return; }
@@ -87,14 +354,26 @@ void cs_rwlock_int(const char *n, CS_MUTEX_LOCK *l, int8_t type)
 		l->writelock++;
 		// if read- or writelock is busy, wait for unlock
 		if(l->writelock > 1 || l->readlock > 0)
-			{ ret = pthread_cond_timedwait(&l->writecond, &l->lock, &ts); }
+		{
+			if(prof)
+				{ cs_gettime(&start); }
+			ret = pthread_cond_timedwait(&l->writecond, &l->lock, &ts);
+			if(prof)
+				{ wait_us = lock_wait_us(&start); }
+		}
 	}
 	else
 	{
 		l->readlock++;
 		// if writelock is busy, wait for unlock
 		if(l->writelock > 0)
-			{ ret = pthread_cond_timedwait(&l->readcond, &l->lock, &ts); }
+		{
+			if(prof)
+				{ cs_gettime(&start); }
+			ret = pthread_cond_timedwait(&l->readcond, &l->lock, &ts);
+			if(prof)
+				{ wait_us = lock_wait_us(&start); }
+		}
 	}
 
 	if(ret > 0)
@@ -110,6 +389,9 @@ void cs_rwlock_int(const char *n, CS_MUTEX_LOCK *l, int8_t type)
 	}
 
 	SAFE_MUTEX_UNLOCK_R(&l->lock, n);
+
+	if(prof)
+		{ lock_prof_locked(l, type, wait_us, ret > 0); }
 #ifdef WITH_MUTEXDEBUG
 	//cs_log_dbg(D_TRACE, "lock %s locked", l->name);
 #endif
@@ -118,8 +400,9 @@ void cs_rwlock_int(const char *n, CS_MUTEX_LOCK *l, int8_t type)
 
 void cs_rwlock_int_nolog(const char *n, CS_MUTEX_LOCK *l, int8_t type)
 {
-	struct timespec ts;
-	int8_t ret = 0;
+	struct timespec ts, start;
+	int64_t wait_us = -1;
+	int8_t ret = 0, prof = cfg.lock_profile;
 
 	if(!l || !l->name || l->flag)
 		{ return; }
@@ -133,14 +416,26 @@ void cs_rwlock_int_nolog(const char *n, CS_MUTEX_LOCK *l, int8_t type)
 		l->writelock++;
 		// if read- or writelock is busy, wait for unlock
 		if(l->writelock > 1 || l->readlock > 0)
-			{ ret = pthread_cond_timedwait(&l->writecond, &l->lock, &ts); }
+		{
+			if(prof)
+				{ cs_gettime(&start); }
+			ret = pthread_cond_timedwait(&l->writecond, &l->lock, &ts);
+			if(prof)
+				{ wait_us = lock_wait_us(&start); }
+		}
 	}
 	else
 	{
 		l->readlock++;
 		// if writelock is busy, wait for unlock
 		if(l->writelock > 0)
-			{ ret = pthread_cond_timedwait(&l->readcond, &l->lock, &ts); }
+		{
+			if(prof)
+				{ cs_gettime(&start); }
+			ret = pthread_cond_timedwait(&l->readcond, &l->lock, &ts);
+			if(prof)
+				{ wait_us = lock_wait_us(&start); }
+		}
 	}
 
 	if(ret > 0)
@@ -156,6 +451,9 @@ void cs_rwlock_int_nolog(const char *n, CS_MUTEX_LOCK *l, int8_t type)
 	}
 
 	SAFE_MUTEX_UNLOCK_NOLOG_R(&l->lock, n);
+
+	if(prof)
+		{ lock_prof_locked(l, type, wait_us, ret > 0); }
 #ifdef WITH_MUTEXDEBUG
 	//cs_log_dbg(D_TRACE, "lock %s locked", l->name);
 #endif
@@ -167,6 +465,9 @@ void cs_rwunlock_int(const char *n, CS_MUTEX_LOCK *l, int8_t type)
 
 	if(!l || l->flag) { return; }
 
+	if(type == WRITELOCK && l->hold_start)
+		{ lock_prof_unlocked(l); }
+
 	SAFE_MUTEX_LOCK_R(&l->lock, n);
 
 	if(type == WRITELOCK)
@@ -202,6 +503,9 @@ void cs_rwunlock_int_nolog(const char *n, CS_MUTEX_LOCK *l, int8_t type)
 
 	if(!l || l->flag) { return; }
 
+	if(type == WRITELOCK && l->hold_start)
+		{ lock_prof_unlocked(l); }
+
 	SAFE_MUTEX_LOCK_NOLOG_R(&l->lock, n);
 
 	if(type == WRITELOCK)
@@ -258,6 +562,9 @@ int8_t cs_try_rwlock_int(const char *n, CS_MUTEX_LOCK *l, int8_t type)
 
 	SAFE_MUTEX_UNLOCK_R(&l->lock, n);
 
+	if(!status && cfg.lock_profile)
+		{ lock_prof_locked(l, type, -1, 0); }
+
 #ifdef WITH_MUTEXDEBUG
 #ifdef WITH_DEBUG
 	if(l->name != LOG_LIST)
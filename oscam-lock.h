@@ -25,4 +25,21 @@ void cs_rwunlock_int_nolog(const char *n, CS_MUTEX_LOCK *l, int8_t type);
 #define cs_writelock_nolog(n, l) cs_rwlock_int_nolog(n, l, WRITELOCK)
 #define cs_writeunlock_nolog(n, l) cs_rwunlock_int_nolog(n, l, WRITELOCK)
 
+// lock profiler (lock_profile = 1), statistics per lock name
+typedef struct s_lock_prof_stat
+{
+	const char		*name;
+	uint64_t		locks;							// acquisitions
+	uint64_t		writelocks;						// ... of which write locks
+	uint32_t		waits;							// acquisitions that had to wait
+	uint32_t		timeouts;						// acquisitions forced after the lock timeout
+	uint64_t		wait_us;						// total wait time
+	uint32_t		wait_p50, wait_p99, wait_max;	// us
+	uint64_t		hold_us;						// total write lock hold time
+	uint32_t		hold_max;						// us, longest write lock hold
+} LOCK_PROF_STAT;
+
+LOCK_PROF_STAT *lock_prof_get(int32_t *count);
+void lock_prof_reset(void);
+
 #endif
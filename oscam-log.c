@@ -23,10 +23,8 @@ static FILE *fp;
 static FILE *fps;
 static LLIST *log_list;
 static bool log_running;
-static int log_list_queued;
 static pthread_t log_thread;
-static pthread_cond_t log_thread_sleep_cond;
-static pthread_mutex_t log_thread_sleep_cond_mutex;
+static struct s_wakeup log_thread_wakeup;
 static int32_t syslog_socket = -1;
 static struct SOCKADDR syslog_addr;
 
@@ -156,7 +154,7 @@ static void log_list_flush(void)
 	if(logStarted == 0)
 		{ return; }
 
-	SAFE_COND_SIGNAL_NOLOG(&log_thread_sleep_cond);
+	cs_wakeup(&log_thread_wakeup);
 	int32_t i = 0;
 	while(ll_count(log_list) > 0 && i < 200)
 	{
@@ -171,7 +169,6 @@ static void log_list_add(struct s_log *log)
 		{ return; }
 
 	int32_t count = ll_count(log_list);
-	log_list_queued++;
 	if(count < MAX_LOG_LIST_BACKLOG)
 	{
 		ll_append(log_list, log);
@@ -182,7 +179,7 @@ static void log_list_add(struct s_log *log)
 		NULLFREE(log);
 		cs_write_log("-------------> Too much data in log_list, dropping log message.\n", 1, 0, 0);
 	}
-	SAFE_COND_SIGNAL_NOLOG(&log_thread_sleep_cond);
+	cs_wakeup(&log_thread_wakeup);
 }
 
 static void cs_write_log_int(char *txt)
@@ -731,7 +728,6 @@ void log_list_thread(void)
 	set_thread_name(__func__);
 	do
 	{
-		log_list_queued = 0;
 		LL_ITER it = ll_iter_create(log_list);
 		struct s_log *log;
 		while((log = ll_iter_next_remove(&it)))
@@ -746,8 +742,8 @@ void log_list_thread(void)
 			NULLFREE(log->txt);
 			NULLFREE(log);
 		}
-		if(!log_list_queued) // The list is empty, sleep until new data comes in and we are woken up
-			sleepms_on_cond(__func__, &log_thread_sleep_cond_mutex, &log_thread_sleep_cond, 60 * 1000);
+		// The list is empty, sleep until new data comes in and we are woken up
+		sleepms_on_wakeup(&log_thread_wakeup, NULL, 0, 60 * 1000);
 	}
 	while(log_running);
 	ll_destroy(&log_list);
@@ -779,7 +775,7 @@ int32_t cs_init_log(void)
 		init_syslog_socket();
 		SAFE_MUTEX_INIT_NOLOG(&log_mutex, NULL);
 
-		cs_pthread_cond_init_nolog(__func__, &log_thread_sleep_cond_mutex, &log_thread_sleep_cond);
+		cs_wakeup_init(&log_thread_wakeup);
 
 #if defined(WEBIF) || defined(MODULE_MONITOR)
 		log_history = ll_create("log history");
@@ -852,6 +848,7 @@ void log_free(void)
 
 	cs_close_log();
 	log_running = 0;
-	SAFE_COND_SIGNAL_NOLOG(&log_thread_sleep_cond);
+	cs_wakeup(&log_thread_wakeup);
 	SAFE_THREAD_JOIN_NOLOG(log_thread, NULL);
+	cs_wakeup_close(&log_thread_wakeup);
 }
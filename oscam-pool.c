@@ -0,0 +1,192 @@
+#define MODULE_LOG_PREFIX "pool"
+
+#include "globals.h"
+#include "oscam-pool.h"
+#include "oscam-string.h"
+
+/*
+ * Objects are plain malloc() blocks of pool->size bytes that are recycled instead of
+ * being given back to the system, so an object leaving the pool by free() is harmless.
+ * Every thread keeps up to POOL_CACHE_SIZE objects per pool and only touches the shared
+ * free list (and its mutex) every POOL_CACHE_SIZE / 2 allocations or frees.
+ */
+
+struct s_pool_cache
+{
+	POOL			*pool;
+	uint32_t		count;
+	uint32_t		allocs;							// not yet accounted in pool statistics
+	uint32_t		reused;
+	uint32_t		frees;
+	void			*objs[POOL_CACHE_SIZE];
+};
+
+static POOL *pool_first;
+static pthread_mutex_t pool_list_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// pool->lock must be held
+static void pool_account(POOL *pool, struct s_pool_cache *cache)
+{
+	pool->allocs += cache->allocs;
+	pool->reused += cache->reused;
+	pool->frees += cache->frees;
+	cache->allocs = 0;
+	cache->reused = 0;
+	cache->frees = 0;
+}
+
+// gives count objects of the thread cache back to the shared list
+static void pool_flush(struct s_pool_cache *cache, uint32_t count)
+{
+	POOL *pool = cache->pool;
+	void *obj;
+
+	SAFE_MUTEX_LOCK(&pool->lock);
+	pool_account(pool, cache);
+	while(count-- && cache->count)
+	{
+		obj = cache->objs[--cache->count];
+		if(pool->free_count < pool->max_free)
+		{
+			*(void **)obj = pool->free_list;
+			pool->free_list = obj;
+			pool->free_count++;
+		}
+		else
+		{
+			free(obj);
+			pool->released++;
+		}
+	}
+	SAFE_MUTEX_UNLOCK(&pool->lock);
+}
+
+static void pool_refill(struct s_pool_cache *cache)
+{
+	POOL *pool = cache->pool;
+
+	SAFE_MUTEX_LOCK(&pool->lock);
+	pool_account(pool, cache);
+	while(pool->free_list && cache->count < POOL_CACHE_SIZE / 2)
+	{
+		cache->objs[cache->count++] = pool->free_list;
+		pool->free_list = *(void **)pool->free_list;
+		pool->free_count--;
+	}
+	SAFE_MUTEX_UNLOCK(&pool->lock);
+}
+
+// thread exit: give the cached objects back
+static void pool_cache_destroy(void *ptr)
+{
+	struct s_pool_cache *cache = ptr;
+	pool_flush(cache, POOL_CACHE_SIZE);
+	free(cache);
+}
+
+static struct s_pool_cache *pool_get_cache(POOL *pool)
+{
+	struct s_pool_cache *cache = pthread_getspecific(pool->cache_key);
+	if(!cache)
+	{
+		if(!cs_malloc(&cache, sizeof(struct s_pool_cache)))
+			{ return NULL; }
+		cache->pool = pool;
+		if(pthread_setspecific(pool->cache_key, cache))
+		{
+			NULLFREE(cache);
+			return NULL;
+		}
+	}
+	return cache;
+}
+
+void pool_init(POOL *pool, const char *name, size_t size, uint32_t max_free)
+{
+	if(pool->init_done)
+		{ return; }
+
+	memset(pool, 0, sizeof(POOL));
+	pool->name = name;
+	pool->size = size < sizeof(void *) ? sizeof(void *) : size;
+	pool->max_free = max_free;
+	SAFE_MUTEX_INIT(&pool->lock, NULL);
+	if(pthread_key_create(&pool->cache_key, pool_cache_destroy))
+	{
+		cs_log("Could not create pool key for %s, pool disabled", name);
+		return;
+	}
+	pool->init_done = 1;
+
+	SAFE_MUTEX_LOCK(&pool_list_lock);
+	pool->next = pool_first;
+	pool_first = pool;
+	SAFE_MUTEX_UNLOCK(&pool_list_lock);
+}
+
+void *pool_alloc(POOL *pool)
+{
+	void *obj = NULL;
+	struct s_pool_cache *cache = pool->init_done ? pool_get_cache(pool) : NULL;
+
+	if(cache)
+	{
+		if(!cache->count)
+			{ pool_refill(cache); }
+
+		cache->allocs++;
+		if(cache->count)
+		{
+			obj = cache->objs[--cache->count];
+			cache->reused++;
+			memset(obj, 0, pool->size);
+			return obj;
+		}
+	}
+
+	if(!cs_malloc(&obj, pool->size))
+		{ return NULL; }
+	return obj;
+}
+
+void pool_free(POOL *pool, void *obj)
+{
+	if(!obj)
+		{ return; }
+
+	struct s_pool_cache *cache = pool->init_done ? pool_get_cache(pool) : NULL;
+	if(!cache)
+	{
+		free(obj);
+		return;
+	}
+
+	if(cache->count == POOL_CACHE_SIZE)
+		{ pool_flush(cache, POOL_CACHE_SIZE / 2); }
+
+	cache->objs[cache->count++] = obj;
+	cache->frees++;
+}
+
+void pool_get_stats(POOL *pool, POOL_STATS *stats)
+{
+	SAFE_MUTEX_LOCK(&pool->lock);
+	stats->allocs = pool->allocs;
+	stats->reused = pool->reused;
+	stats->frees = pool->frees;
+	stats->released = pool->released;
+	stats->free_count = pool->free_count;
+	SAFE_MUTEX_UNLOCK(&pool->lock);
+	stats->in_use = (int64_t)stats->allocs - (int64_t)stats->frees;
+	if(stats->in_use < 0)
+		{ stats->in_use = 0; }
+}
+
+POOL *pool_get_first(void)
+{
+	POOL *pool;
+	SAFE_MUTEX_LOCK(&pool_list_lock);
+	pool = pool_first;
+	SAFE_MUTEX_UNLOCK(&pool_list_lock);
+	return pool;
+}
@@ -0,0 +1,43 @@
+/* fixed-size object pools with per thread caches */
+
+#ifndef OSCAM_POOL_H_
+#define OSCAM_POOL_H_
+
+#define POOL_CACHE_SIZE 32 // objects cached per thread and pool
+
+typedef struct s_pool POOL;
+struct s_pool
+{
+	const char		*name;
+	size_t			size;							// object size
+	uint32_t		max_free;						// max objects kept in the shared free list
+	pthread_mutex_t	lock;
+	pthread_key_t	cache_key;						// per thread struct s_pool_cache
+	void			*free_list;						// shared free objects, linked through their first word
+	uint32_t		free_count;
+	int8_t			init_done;
+	// statistics, updated under lock when thread caches are refilled or flushed
+	uint64_t		allocs;							// objects handed out
+	uint64_t		reused;							// ... of which came out of the pool
+	uint64_t		frees;							// objects given back
+	uint64_t		released;						// objects returned to the system (pool full)
+	POOL			*next;
+};
+
+typedef struct s_pool_stats
+{
+	uint64_t		allocs;
+	uint64_t		reused;
+	uint64_t		frees;
+	uint64_t		released;
+	uint32_t		free_count;
+	int64_t			in_use;
+} POOL_STATS;
+
+void pool_init(POOL *pool, const char *name, size_t size, uint32_t max_free);
+void *pool_alloc(POOL *pool);              // returns a zeroed object or NULL
+void pool_free(POOL *pool, void *obj);     // obj may also come from plain malloc() with pool->size bytes
+void pool_get_stats(POOL *pool, POOL_STATS *stats);
+POOL *pool_get_first(void);                // registered pools, iterate with pool->next
+
+#endif
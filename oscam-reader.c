@@ -21,7 +21,6 @@
 
 extern CS_MUTEX_LOCK system_lock;
 extern CS_MUTEX_LOCK ecmcache_lock;
-extern struct ecm_request_t *ecmcwcache;
 extern const struct s_cardsystem *cardsystems[];
 
 const char *RDR_CD_TXT[] =
@@ -164,7 +163,7 @@ static int32_t ecm_ratelimit_findspace(struct s_reader *reader, ECM_REQUEST *er,
 								write_ecm_answer(reader, er, E_NOTFOUND, E2_RATELIMIT, NULL, "Ratelimiter: no slots free!", 0, NULL);
 							}
 
-							NULLFREE(ecm);
+							release_ecm(ecm);
 							return -2;
 						}
 					}
@@ -1120,7 +1119,8 @@ void reader_get_ecm(struct s_reader *reader, ECM_REQUEST *er)
 
 	cs_readlock(__func__, &ecmcache_lock);
 
-		for(ecm = ecmcwcache; ecm; ecm = ecm->next)
+		// same ecm (caid + ecmd5) only
+		for(ecm = ecmcwcache_first_same(er); ecm; ecm = ecmcwcache_next_same(ecm, er))
 		{
 			timeout = time(NULL) - ((cfg.ctimeout+500)/1000+1);
 			if(ecm->tps.time <= timeout)
@@ -1128,14 +1128,10 @@ void reader_get_ecm(struct s_reader *reader, ECM_REQUEST *er)
 
 			if(!ecm->matching_rdr || ecm == er || ecm->rc == E_99) { continue; }
 
-			// match same ecm
-			if(er->caid == ecm->caid && !memcmp(er->ecmd5, ecm->ecmd5, CS_ECMSTORESIZE))
-			{
-				//check if ask this reader
-				ea = get_ecm_answer(reader, ecm);
-				if(ea && !ea->is_pending && (ea->status & REQUEST_SENT) && ea->rc != E_TIMEOUT && ea->rcEx != E2_RATELIMIT) { break; }
-				ea = NULL;
-			}
+			//check if ask this reader
+			ea = get_ecm_answer(reader, ecm);
+			if(ea && !ea->is_pending && (ea->status & REQUEST_SENT) && ea->rc != E_TIMEOUT && ea->rcEx != E2_RATELIMIT) { break; }
+			ea = NULL;
 		}
 
 		cs_readunlock(__func__, &ecmcache_lock);
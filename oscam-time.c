@@ -1,6 +1,11 @@
 #include "globals.h"
 #include "oscam-time.h"
 
+#if defined(__linux__) && defined(__GLIBC__) && !defined(__UCLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 8))
+#define WITH_EVENTFD 1
+#include <sys/eventfd.h>
+#endif
+
 static enum clock_type clock_type = CLOCK_TYPE_UNKNOWN;
 
 int64_t comp_timeb(struct timeb *tpa, struct timeb *tpb)
@@ -306,6 +311,97 @@ void sleepms_on_cond(const char *n, pthread_mutex_t *mutex, pthread_cond_t *cond
 	SAFE_MUTEX_UNLOCK_R(mutex, n);
 }
 
+/*
+ Wakeups through an eventfd (a pipe where there is none), so a thread can
+ sleep on it together with its sockets and a wakeup is a single write.
+ cs_wakeup() only writes while the thread sleeps; a wakeup while it is busy
+ makes its next sleepms_on_wakeup() return at once.
+*/
+int32_t cs_wakeup_init(struct s_wakeup *w)
+{
+	int32_t i;
+
+	// pending is kept, cs_wakeup() may already have been called
+#ifdef WITH_EVENTFD
+	w->fd[0] = w->fd[1] = eventfd(0, 0);
+	if(w->fd[0] > 0)
+	{
+		fcntl(w->fd[0], F_SETFL, fcntl(w->fd[0], F_GETFL) | O_NONBLOCK);
+		fcntl(w->fd[0], F_SETFD, FD_CLOEXEC);
+		return 1;
+	}
+#endif
+	if(pipe(w->fd) == -1)
+	{
+		w->fd[0] = w->fd[1] = 0;
+		return 0;
+	}
+	for(i = 0; i < 2; i++)
+	{
+		fcntl(w->fd[i], F_SETFL, fcntl(w->fd[i], F_GETFL) | O_NONBLOCK);
+		fcntl(w->fd[i], F_SETFD, FD_CLOEXEC);
+	}
+	return 1;
+}
+
+void cs_wakeup_close(struct s_wakeup *w)
+{
+	if(w->fd[1] > 0 && w->fd[1] != w->fd[0])
+		{ close(w->fd[1]); }
+	if(w->fd[0] > 0)
+		{ close(w->fd[0]); }
+	w->fd[0] = w->fd[1] = 0;
+}
+
+void cs_wakeup(struct s_wakeup *w)
+{
+	uint64_t one = 1;
+
+	// pending before sleeping here, sleeping before pending in sleepms_on_wakeup(): one of both sees the other
+	if(__sync_fetch_and_or(&w->pending, 1) || !w->sleeping || w->fd[1] <= 0)
+		{ return; }
+
+	if(write(w->fd[1], &one, w->fd[0] == w->fd[1] ? sizeof(one) : 1) == -1)
+		{ ; } // full pipe or eventfd, the thread wakes up anyway
+}
+
+// sleeps until one of nfds pfd entries is ready, cs_wakeup() or timeout; pfd needs room for nfds + 1 entries
+int32_t sleepms_on_wakeup(struct s_wakeup *w, struct pollfd *pfd, int32_t nfds, uint32_t msec)
+{
+	struct pollfd own[1];
+	uint8_t buf[64];
+	int32_t rc = 0;
+
+	if(!pfd)
+		{ pfd = own; nfds = 0; }
+	if(msec > INT32_MAX)
+		{ msec = INT32_MAX; }
+
+	if(w->fd[0] <= 0) // no fd for wakeups, poll in short steps
+	{
+		if(!__sync_fetch_and_and(&w->pending, 0))
+			{ rc = poll(pfd, nfds, msec < 50 ? msec : 50); }
+		return rc;
+	}
+
+	pfd[nfds].fd = w->fd[0];
+	pfd[nfds].events = POLLIN;
+	pfd[nfds].revents = 0;
+
+	__sync_fetch_and_or(&w->sleeping, 1);
+	if(!w->pending)
+		{ rc = poll(pfd, nfds + 1, msec); }
+	__sync_fetch_and_and(&w->sleeping, 0);
+	__sync_fetch_and_and(&w->pending, 0);
+
+	if(rc > 0 && pfd[nfds].revents)
+	{
+		while(read(w->fd[0], buf, sizeof(buf)) > 0) { ; }
+		rc--;
+	}
+	return rc;
+}
+
 void cs_pthread_cond_init(const char *n, pthread_mutex_t *mutex, pthread_cond_t *cond)
 {
 	SAFE_MUTEX_INIT_R(mutex, NULL, n);
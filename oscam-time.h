@@ -38,4 +38,9 @@ void cs_pthread_cond_init_nolog(const char *n, pthread_mutex_t *mutex, pthread_c
 
 void sleepms_on_cond(const char *n, pthread_mutex_t *mutex, pthread_cond_t *cond, uint32_t msec);
 
+int32_t cs_wakeup_init(struct s_wakeup *w);
+void cs_wakeup_close(struct s_wakeup *w);
+void cs_wakeup(struct s_wakeup *w);
+int32_t sleepms_on_wakeup(struct s_wakeup *w, struct pollfd *pfd, int32_t nfds, uint32_t msec);
+
 #endif
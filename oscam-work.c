@@ -5,6 +5,7 @@
 #include "oscam-client.h"
 #include "oscam-ecm.h"
 #include "oscam-emm.h"
+#include "oscam-garbage.h"
 #include "oscam-lock.h"
 #include "oscam-net.h"
 #include "oscam-reader.h"
@@ -16,19 +17,189 @@
 #include "module-cccshare.h"
 #include "oscam-time.h"
 
+#ifdef __linux__
+#define WITH_WORK_POOL 1
+#include <sys/epoll.h>
+#endif
+
 extern CS_MUTEX_LOCK system_lock;
 extern int32_t thread_pipe[2];
 
 struct job_data
 {
 	enum actions action;
-	struct s_reader *rdr;
-	struct s_client *cl;
+	uint16_t len;
+	int8_t spilled;	// record lives in cl->job_spill, not in the ring
 	void *ptr;
 	struct timeb time;
-	uint16_t len;
 };
 
+/*
+ Job queue: a bounded lock free ring of inline job records per client, many
+ producers and one consumer (the thread running the client). A producer
+ claims a cell by moving head forward with a CAS and publishes the record
+ through the cell sequence. The consumer leaves the cell of the running job
+ taken until the job is done, so free_joblist() also frees the job that ended
+ its thread with cs_exit(). While the ring is full, jobs go to the spill list
+ under thread_lock and run after the ring, so bursts of answers are not lost.
+ cl->job_spilled is set before the first spilled job is appended and cleared
+ by the consumer when the list is empty again, in between all jobs spill.
+ Cache push-outs are dropped before that, see cacheex_check_queue_length().
+*/
+#define JOB_RING_CLIENT		256
+#define JOB_RING_READER		1024
+
+struct job_cell
+{
+	volatile uint32_t	seq;
+	struct job_data		data;
+};
+
+struct job_ring
+{
+	uint32_t			mask;
+	volatile uint32_t	head;	// next cell to claim
+	volatile uint32_t	tail;	// next cell to run
+	struct job_cell		*cell;
+};
+
+static uint32_t job_ring_size(struct s_client *cl)
+{
+	return (cl->typ == 'r' || cl->typ == 'p') ? JOB_RING_READER : JOB_RING_CLIENT;
+}
+
+static struct job_ring *job_ring_get(struct s_client *cl)
+{
+	struct job_ring *ring;
+	uint32_t i, size;
+
+	if(cl->job_ring)
+		{ return cl->job_ring; }
+
+	size = job_ring_size(cl);
+	if(!cs_malloc(&ring, sizeof(struct job_ring) + size * sizeof(struct job_cell)))
+		{ return NULL; }
+
+	ring->mask = size - 1;
+	ring->cell = (struct job_cell *)(ring + 1);
+	for(i = 0; i < size; i++)
+		{ ring->cell[i].seq = i; }
+
+	if(!__sync_bool_compare_and_swap(&cl->job_ring, NULL, ring))
+		{ NULLFREE(ring); }
+	return cl->job_ring;
+}
+
+uint32_t job_queue_length(struct s_client *cl)
+{
+	struct job_ring *ring = cl->job_ring;
+	return (ring ? ring->head - ring->tail : 0) + ll_count(cl->job_spill);
+}
+
+uint32_t job_queue_size(struct s_client *cl)
+{
+	struct job_ring *ring = cl->job_ring;
+	return ring ? ring->mask + 1 : job_ring_size(cl);
+}
+
+static void job_highwater_set(struct s_client *cl, uint32_t fill)
+{
+	uint32_t max;
+	while((max = cl->job_highwater) < fill && !__sync_bool_compare_and_swap(&cl->job_highwater, max, fill)) { ; }
+}
+
+static int8_t job_ring_push(struct s_client *cl, struct job_ring *ring, enum actions action, void *ptr, int32_t len)
+{
+	struct job_cell *cell;
+	uint32_t pos, seq;
+
+	while(1)
+	{
+		pos = ring->head;
+		cell = &ring->cell[pos & ring->mask];
+		seq = cell->seq;
+		if(seq == pos)
+		{
+			if(__sync_bool_compare_and_swap(&ring->head, pos, pos + 1))
+				{ break; }
+		}
+		else if((int32_t)(seq - pos) < 0)
+			{ return 0; } // full
+	}
+
+	cell->data.action = action;
+	cell->data.ptr = ptr;
+	cell->data.len = len;
+	cs_ftime(&cell->data.time);
+	__sync_synchronize(); // record is complete before it gets visible
+	cell->seq = pos + 1;
+
+	job_highwater_set(cl, pos + 1 - ring->tail);
+	return 1;
+}
+
+// ring is full, the job waits in the spill list
+static int8_t job_spill_push(struct s_client *cl, enum actions action, void *ptr, int32_t len)
+{
+	struct job_data *data;
+
+	if(!cs_malloc(&data, sizeof(struct job_data)))
+		{ return 0; }
+
+	data->action = action;
+	data->ptr = ptr;
+	data->len = len;
+	data->spilled = 1;
+	cs_ftime(&data->time);
+
+	SAFE_MUTEX_LOCK(&cl->thread_lock);
+	if(!cl->job_spill)
+		{ cl->job_spill = ll_create("job_spill"); }
+	if(cl->job_spill)
+	{
+		cl->job_spilled = 1;
+		__sync_synchronize(); // producers see the flag before the spilled job can run
+		ll_append(cl->job_spill, data);
+	}
+	SAFE_MUTEX_UNLOCK(&cl->thread_lock);
+
+	if(!cl->job_spill)
+	{
+		NULLFREE(data);
+		return 0;
+	}
+
+	job_highwater_set(cl, job_queue_length(cl));
+	return 1;
+}
+
+// next job, it keeps its cell until job_ring_done()
+static struct job_data *job_ring_peek(struct job_ring *ring)
+{
+	struct job_cell *cell;
+	uint32_t pos;
+
+	if(!ring)
+		{ return NULL; }
+
+	pos = ring->tail;
+	cell = &ring->cell[pos & ring->mask];
+	if(cell->seq != pos + 1)
+		{ return NULL; }
+	__sync_synchronize(); // read the record after its sequence
+	return &cell->data;
+}
+
+static void job_ring_done(struct job_ring *ring)
+{
+	uint32_t pos = ring->tail;
+
+	__sync_synchronize(); // record is consumed before producers may reuse the cell
+	ring->cell[pos & ring->mask].seq = pos + ring->mask + 1;
+	ring->tail = pos + 1;
+}
+
+// frees what the job owns, not the record itself
 static void free_job_data(struct job_data *data)
 {
 	if(!data)
@@ -38,32 +209,75 @@ static void free_job_data(struct job_data *data)
 		// special free checks
 		if(data->action==ACTION_ECM_ANSWER_CACHE)
 		{
-			NULLFREE(((struct s_write_from_cache *)data->ptr)->er_cache);
+			release_ecm(((struct s_write_from_cache *)data->ptr)->er_cache);
 		}
 
 		NULLFREE(data->ptr);
 	}
+}
+
+// thread_lock must be held or the caller must be the consumer
+static int8_t job_pending(struct s_client *cl)
+{
+	return job_ring_peek(cl->job_ring) || cl->job_spilled;
+}
+
+// next job of cl: the ring first, then what was spilled while it was full
+static struct job_data *job_next(struct s_client *cl)
+{
+	struct job_data *data;
+
+	if((data = job_ring_peek(cl->job_ring)) || !cl->job_spilled)
+		{ return data; }
+
+	SAFE_MUTEX_LOCK(&cl->thread_lock);
+	data = ll_has_elements(cl->job_spill);
+	SAFE_MUTEX_UNLOCK(&cl->thread_lock);
+	return data;
+}
+
+// frees the job returned by job_next() and gives its slot back
+static void job_done(struct s_client *cl, struct job_data *data)
+{
+	free_job_data(data);
+	if(!data->spilled)
+	{
+		job_ring_done(cl->job_ring);
+		return;
+	}
+
+	SAFE_MUTEX_LOCK(&cl->thread_lock);
+	ll_remove_first(cl->job_spill);
+	if(!ll_count(cl->job_spill))
+		{ cl->job_spilled = 0; } // drained, back to the ring
+	SAFE_MUTEX_UNLOCK(&cl->thread_lock);
 	NULLFREE(data);
 }
 
 void free_joblist(struct s_client *cl)
 {
 	int32_t lock_status = pthread_mutex_trylock(&cl->thread_lock);
-	LL_ITER it = ll_iter_create(cl->joblist);
-
+	struct job_ring *ring = cl->job_ring;
 	struct job_data *data;
-	while((data = ll_iter_next(&it)))
+
+	while((data = job_ring_peek(ring)))
 	{
 		free_job_data(data);
+		job_ring_done(ring);
 	}
 
-	ll_destroy(&cl->joblist);
-	cl->account = NULL;
-
-	if(cl->work_job_data) // Free job_data that was not freed by work_thread
-		{ free_job_data(cl->work_job_data); }
+	LL_ITER it = ll_iter_create(cl->job_spill);
+	while((data = ll_iter_next(&it)))
+		{ free_job_data(data); }
+	ll_destroy_data(&cl->job_spill);
+	cl->job_spilled = 0;
 
-	cl->work_job_data = NULL;
+	if(ring)
+	{
+		cl->job_ring = NULL;
+		add_garbage(ring); // late producers may still look at it
+	}
+	cl->account = NULL;
 
 	if(lock_status == 0)
 		{ SAFE_MUTEX_UNLOCK(&cl->thread_lock); }
@@ -80,42 +294,327 @@ void free_joblist(struct s_client *cl)
    XX     - two digit action code from enum actions
    label  - reader label or client username (see username() function)
 */
-static void set_work_thread_name(struct job_data *data)
+static void set_work_thread_name(struct s_client *cl, struct job_data *data)
 {
 	char thread_name[16 + 1];
 	snprintf(thread_name, sizeof(thread_name), "w%c%02d-%s",
 			 data->action < ACTION_CLIENT_FIRST ? 'r' : 'c',
 			 data->action,
-			 username(data->cl)
+			 username(cl)
 			);
 	set_thread_name(thread_name);
 }
 
+static int8_t work_job_expired(struct s_client *cl, struct job_data *data)
+{
+	struct timeb actualtime;
+	if(data->action == ACTION_CLIENT_UNHIDECARDS)
+		{ return 0; } // late is better than leaving the cards hidden
+	cs_ftime(&actualtime);
+	int64_t gone = comp_timeb(&actualtime, &data->time);
+	if(gone > (int) cfg.ctimeout+1000)
+	{
+		cs_log_dbg(D_TRACE, "dropping client data for %s time %"PRId64" ms", username(cl), gone);
+		return 1;
+	}
+	return 0;
+}
+
+// runs one job of cl, the caller frees data
+#ifdef CS_ANTICASC
+// hides the shared cards from cl for hidetime seconds or shows them again with hidetime 0
+static void work_hidecards(struct s_client *cl, int32_t hidetime)
+{
+	int32_t hide_count;
+	int32_t cardsize;
+	int32_t ii, uu=0;
+	LLIST **sharelist = get_and_lock_sharelist();
+	LLIST *sharelist2 = ll_create("hidecards-sharelist");
+
+	for(ii = 0; ii < CAID_KEY; ii++)
+	{
+		if(sharelist[ii])
+		{
+			ll_putall(sharelist2, sharelist[ii]);
+		}
+	}
+
+	unlock_sharelist();
+
+	struct cc_card **cardarray = get_sorted_card_copy(sharelist2, 0, &cardsize);
+	ll_destroy(&sharelist2);
+
+	for(ii = 0; ii < cardsize; ii++)
+	{
+		if(hidecards_card_valid_for_client(cl, cardarray[ii]))
+		{
+			if (cardarray[ii]->id)
+			{
+				if(hidetime)
+				{
+					hide_count = hide_card_to_client(cardarray[ii], cl);
+					if(hide_count)
+					{
+						cs_log_dbg(D_TRACE, "Hiding card_%d caid=%04x remoteid=%08x from %s for %d %s",
+							 uu, cardarray[ii]->caid, cardarray[ii]->remote_id, username(cl), hidetime, hidetime>1 ? "secconds" : "seccond");
+						uu += 1;
+					}
+				}
+				else
+				{
+					hide_count = unhide_card_to_client(cardarray[ii], cl);
+					if(hide_count)
+					{
+						cs_log_dbg(D_TRACE, "Unhiding card_%d caid=%04x remoteid=%08x for %s",
+						 uu, cardarray[ii]->caid, cardarray[ii]->remote_id, username(cl));
+						uu += 1;
+					}
+				}
+			}
+		}
+	}
+
+	NULLFREE(cardarray);
+}
+#endif
+
+static void work_job(struct s_client *cl, struct job_data *data, uint8_t *mbuf, uint16_t bufsize, int8_t *restart_reader)
+{
+	struct s_reader *reader = cl->reader;
+	struct s_module *module = get_module(cl);
+	int32_t n = 0, rc = 0, i, idx, s;
+	uint8_t dcw[16];
+
+	switch(data->action)
+	{
+		case ACTION_READER_IDLE:
+			reader_do_idle(reader);
+			break;
+
+		case ACTION_READER_REMOTE:
+			s = check_fd_for_data(cl->pfd);
+			if(s == 0) // no data, another thread already read from fd?
+				{ break; }
+			if(s < 0)
+			{
+				if(cl->reader->ph.type == MOD_CONN_TCP)
+					{ network_tcp_connection_close(reader, "disconnect"); }
+				break;
+			}
+			rc = cl->reader->ph.recv(cl, mbuf, bufsize);
+			if(rc < 0)
+			{
+				if(cl->reader->ph.type == MOD_CONN_TCP)
+					{
+						network_tcp_connection_close(reader, "disconnect on receive");
+#ifdef CS_CACHEEX_AIO
+						cl->cacheex_aio_checked = 0;
+#endif
+					}
+				break;
+			}
+			cl->last = time(NULL); // *********************************** TO BE REPLACE BY CS_FTIME() LATER ****************
+			idx = cl->reader->ph.c_recv_chk(cl, dcw, &rc, mbuf, rc);
+			if(idx < 0) { break; }  // no dcw received
+			if(!idx) { idx = cl->last_idx; }
+			cl->reader->last_g = time(NULL); // *********************************** TO BE REPLACE BY CS_FTIME() LATER **************** // for reconnect timeout
+			for(i = 0, n = 0; i < cfg.max_pending && n == 0; i++)
+			{
+				if(cl->ecmtask[i].idx == idx)
+				{
+					cl->pending--;
+					casc_check_dcw(reader, i, rc, dcw);
+					n++;
+				}
+			}
+			break;
+
+		case ACTION_READER_RESET:
+			cardreader_do_reset(reader);
+			break;
+
+		case ACTION_READER_ECM_REQUEST:
+			reader_get_ecm(reader, data->ptr);
+			break;
+
+		case ACTION_READER_EMM:
+			reader_do_emm(reader, data->ptr);
+			break;
+
+		case ACTION_READER_CARDINFO:
+			reader_do_card_info(reader);
+			break;
+
+		case ACTION_READER_POLL_STATUS:
+			cardreader_poll_status(reader);
+			break;
+
+		case ACTION_READER_INIT:
+			if(!cl->init_done)
+				{ reader_init(reader); }
+			break;
+
+		case ACTION_READER_RESTART:
+			cl->kill = 1;
+			*restart_reader = 1;
+			break;
+
+		case ACTION_READER_RESET_FAST:
+			cl->reader->card_status = CARD_NEED_INIT;
+			cardreader_do_reset(reader);
+			break;
+
+		case ACTION_READER_CHECK_HEALTH:
+			cardreader_do_checkhealth(reader);
+			break;
+
+		case ACTION_READER_CAPMT_NOTIFY:
+			if(cl->reader->ph.c_capmt) { cl->reader->ph.c_capmt(cl, data->ptr); }
+			break;
+
+		case ACTION_CLIENT_UDP:
+			n = module->recv(cl, data->ptr, data->len);
+			if(n < 0) { break; }
+			module->s_handler(cl, data->ptr, n);
+			break;
+
+		case ACTION_CLIENT_TCP:
+			s = check_fd_for_data(cl->pfd);
+			if(s == 0) // no data, another thread already read from fd?
+				{ break; }
+			if(s < 0) // system error or fd wants to be closed
+			{
+				cl->kill = 1; // kill client on next run
+				break;
+			}
+			n = module->recv(cl, mbuf, bufsize);
+			if(n < 0)
+			{
+				cl->kill = 1; // kill client on next run
+				break;
+			}
+			module->s_handler(cl, mbuf, n);
+			break;
+
+		case ACTION_CACHEEX1_DELAY:
+			cacheex_mode1_delay(data->ptr);
+			break;
+
+		case ACTION_CACHEEX_TIMEOUT:
+			cacheex_timeout(data->ptr);
+			break;
+
+		case ACTION_FALLBACK_TIMEOUT:
+			fallback_timeout(data->ptr);
+			break;
+
+		case ACTION_ECM_FLIGHT_RELEASE:
+			ecm_flight_release(data->ptr);
+			break;
+
+		case ACTION_CLIENT_TIMEOUT:
+			ecm_timeout(data->ptr);
+			break;
+
+		case ACTION_ECM_ANSWER_READER:
+			chk_dcw(data->ptr);
+			break;
+
+		case ACTION_ECM_ANSWER_CACHE:
+			write_ecm_answer_fromcache(data->ptr);
+			break;
+
+		case ACTION_CLIENT_INIT:
+			if(module->s_init)
+				{ module->s_init(cl); }
+			cl->is_udp = module->type == MOD_CONN_UDP;
+			cl->init_done = 1;
+			break;
+
+		case ACTION_CLIENT_IDLE:
+			if(module->s_idle)
+				{ module->s_idle(cl); }
+			else
+			{
+				cs_log("user %s reached %d sec idle limit.", username(cl), cfg.cmaxidle);
+				cl->kill = 1;
+			}
+			break;
+
+		case ACTION_CACHE_PUSH_OUT:
+			cacheex_push_out(cl, data->ptr);
+			break;
+
+		case ACTION_CLIENT_KILL:
+			cl->kill = 1;
+			break;
+
+		case ACTION_CLIENT_SEND_MSG:
+		{
+			if (config_enabled(MODULE_CCCAM))
+			{
+				struct s_clientmsg *clientmsg = (struct s_clientmsg *)data->ptr;
+				cc_cmd_send(cl, clientmsg->msg, clientmsg->len, clientmsg->cmd);
+			}
+			break;
+		}
+
+		case ACTION_PEER_IDLE:
+			if(module->s_peer_idle)
+				{ module->s_peer_idle(cl); }
+			break;
+
+		case ACTION_CLIENT_HIDECARDS:
+		{
+#ifdef CS_ANTICASC
+			if(config_enabled(MODULE_CCCSHARE))
+			{
+				int32_t hidetime = (cl->account->acosc_penalty_duration == -1 ? cfg.acosc_penalty_duration : cl->account->acosc_penalty_duration);
+				if(hidetime)
+				{
+					work_hidecards(cl, hidetime);
+					// client_check_status() queues the unhide, a pool worker must not sleep here
+					cl->hidecards_until = time(NULL) + hidetime;
+				}
+			}
+#endif
+			break;
+		} // case ACTION_CLIENT_HIDECARDS
+
+		case ACTION_CLIENT_UNHIDECARDS:
+		{
+#ifdef CS_ANTICASC
+			if(config_enabled(MODULE_CCCSHARE))
+				{ work_hidecards(cl, 0); }
+#endif
+			break;
+		} // case ACTION_CLIENT_UNHIDECARDS
+
+	}
+}
+
 #define __free_job_data(client, job_data) \
 	do { \
-		client->work_job_data = NULL; \
 		if(job_data && job_data != &tmp_data) { \
-			free_job_data(job_data); \
+			job_done(client, job_data); \
 		} \
 		job_data = NULL; \
 	} while(0)
 
 void *work_thread(void *ptr)
 {
-	struct job_data *data = (struct job_data *)ptr;
-	struct s_client *cl = data->cl;
+	struct s_client *cl = (struct s_client *)ptr;
+	struct job_data *data = NULL;
 	struct s_reader *reader = cl->reader;
 	struct timeb start, end; // start time poll, end time poll
 
 	struct job_data tmp_data;
-	struct pollfd pfd[1];
+	struct pollfd pfd[2]; // client socket and cl->work_wakeup
 
 	SAFE_SETSPECIFIC(getclient, cl);
 	cl->thread = pthread_self();
 	cl->thread_active = 1;
 
-	set_work_thread_name(data);
-
 	struct s_module *module = get_module(cl);
 	uint16_t bufsize = module->bufsize; // CCCam needs more than 1024bytes!
 	if(!bufsize)
@@ -126,8 +625,7 @@ void *work_thread(void *ptr)
 		{ return NULL; }
 
 	cl->work_mbuf = mbuf; // Track locally allocated data, because some callback may call cs_exit/cs_disconect_client/pthread_exit and then mbuf would be leaked
-	int32_t n = 0, rc = 0, i, idx, s;
-	uint8_t dcw[16];
+	int32_t rc = 0;
 	int8_t restart_reader = 0;
 
 	while(cl->thread_active)
@@ -160,16 +658,8 @@ void *work_thread(void *ptr)
 				if(!cl->kill && cl->typ != 'r')
 					{ client_check_status(cl); } // do not call for physical readers as this might cause an endless job loop
 
-				SAFE_MUTEX_LOCK(&cl->thread_lock);
-				if(cl->joblist && ll_count(cl->joblist) > 0)
-				{
-					LL_ITER itr = ll_iter_create(cl->joblist);
-					data = ll_iter_next_remove(&itr);
-					if(data)
-						{ set_work_thread_name(data); }
-					//cs_log_dbg(D_TRACE, "start next job from list action=%d", data->action);
-				}
-				SAFE_MUTEX_UNLOCK(&cl->thread_lock);
+				if((data = job_next(cl)))
+					{ set_work_thread_name(cl, data); }
 			}
 
 			if(!data)
@@ -182,15 +672,10 @@ void *work_thread(void *ptr)
 				pfd[0].fd = cl->pfd;
 				pfd[0].events = POLLIN | POLLPRI;
 
-				SAFE_MUTEX_LOCK(&cl->thread_lock);
-				cl->thread_active = 2;
-				SAFE_MUTEX_UNLOCK(&cl->thread_lock);
+				if(!cl->work_wakeup.fd[0])
+					{ cs_wakeup_init(&cl->work_wakeup); } // closed by free_client()
 
-				rc = poll(pfd, 1, 3000);
-
-				SAFE_MUTEX_LOCK(&cl->thread_lock);
-				cl->thread_active = 1;
-				SAFE_MUTEX_UNLOCK(&cl->thread_lock);
+				rc = sleepms_on_wakeup(&cl->work_wakeup, pfd, 1, 3000);
 
 				if(rc > 0)
 				{
@@ -232,266 +717,13 @@ void *work_thread(void *ptr)
 			if(!data->action)
 				{ break; }
 
-			struct timeb actualtime;
-			cs_ftime(&actualtime);
-			int64_t gone = comp_timeb(&actualtime, &data->time);
-			if(data != &tmp_data && gone > (int) cfg.ctimeout+1000)
+			if(data != &tmp_data && work_job_expired(cl, data))
 			{
-				cs_log_dbg(D_TRACE, "dropping client data for %s time %"PRId64" ms", username(cl), gone);
 				__free_job_data(cl, data);
 				continue;
 			}
 
-			if(data != &tmp_data)
-				{ cl->work_job_data = data; } // Track the current job_data
-
-			switch(data->action)
-			{
-				case ACTION_READER_IDLE:
-					reader_do_idle(reader);
-					break;
-
-				case ACTION_READER_REMOTE:
-					s = check_fd_for_data(cl->pfd);
-					if(s == 0) // no data, another thread already read from fd?
-						{ break; }
-					if(s < 0)
-					{
-						if(cl->reader->ph.type == MOD_CONN_TCP)
-							{ network_tcp_connection_close(reader, "disconnect"); }
-						break;
-					}
-					rc = cl->reader->ph.recv(cl, mbuf, bufsize);
-					if(rc < 0)
-					{
-						if(cl->reader->ph.type == MOD_CONN_TCP)
-							{
-								network_tcp_connection_close(reader, "disconnect on receive");
-#ifdef CS_CACHEEX_AIO
-								cl->cacheex_aio_checked = 0;
-#endif
-							}
-						break;
-					}
-					cl->last = time(NULL); // *********************************** TO BE REPLACE BY CS_FTIME() LATER ****************
-					idx = cl->reader->ph.c_recv_chk(cl, dcw, &rc, mbuf, rc);
-					if(idx < 0) { break; }  // no dcw received
-					if(!idx) { idx = cl->last_idx; }
-					cl->reader->last_g = time(NULL); // *********************************** TO BE REPLACE BY CS_FTIME() LATER **************** // for reconnect timeout
-					for(i = 0, n = 0; i < cfg.max_pending && n == 0; i++)
-					{
-						if(cl->ecmtask[i].idx == idx)
-						{
-							cl->pending--;
-							casc_check_dcw(reader, i, rc, dcw);
-							n++;
-						}
-					}
-					break;
-
-				case ACTION_READER_RESET:
-					cardreader_do_reset(reader);
-					break;
-
-				case ACTION_READER_ECM_REQUEST:
-					reader_get_ecm(reader, data->ptr);
-					break;
-
-				case ACTION_READER_EMM:
-					reader_do_emm(reader, data->ptr);
-					break;
-
-				case ACTION_READER_CARDINFO:
-					reader_do_card_info(reader);
-					break;
-
-				case ACTION_READER_POLL_STATUS:
-					cardreader_poll_status(reader);
-					break;
-
-				case ACTION_READER_INIT:
-					if(!cl->init_done)
-						{ reader_init(reader); }
-					break;
-
-				case ACTION_READER_RESTART:
-					cl->kill = 1;
-					restart_reader = 1;
-					break;
-
-				case ACTION_READER_RESET_FAST:
-					cl->reader->card_status = CARD_NEED_INIT;
-					cardreader_do_reset(reader);
-					break;
-
-				case ACTION_READER_CHECK_HEALTH:
-					cardreader_do_checkhealth(reader);
-					break;
-
-				case ACTION_READER_CAPMT_NOTIFY:
-					if(cl->reader->ph.c_capmt) { cl->reader->ph.c_capmt(cl, data->ptr); }
-					break;
-
-				case ACTION_CLIENT_UDP:
-					n = module->recv(cl, data->ptr, data->len);
-					if(n < 0) { break; }
-					module->s_handler(cl, data->ptr, n);
-					break;
-
-				case ACTION_CLIENT_TCP:
-					s = check_fd_for_data(cl->pfd);
-					if(s == 0) // no data, another thread already read from fd?
-						{ break; }
-					if(s < 0) // system error or fd wants to be closed
-					{
-						cl->kill = 1; // kill client on next run
-						continue;
-					}
-					n = module->recv(cl, mbuf, bufsize);
-					if(n < 0)
-					{
-						cl->kill = 1; // kill client on next run
-						continue;
-					}
-					module->s_handler(cl, mbuf, n);
-					break;
-
-				case ACTION_CACHEEX1_DELAY:
-					cacheex_mode1_delay(data->ptr);
-					break;
-
-				case ACTION_CACHEEX_TIMEOUT:
-					cacheex_timeout(data->ptr);
-					break;
-
-				case ACTION_FALLBACK_TIMEOUT:
-					fallback_timeout(data->ptr);
-					break;
-
-				case ACTION_CLIENT_TIMEOUT:
-					ecm_timeout(data->ptr);
-					break;
-
-				case ACTION_ECM_ANSWER_READER:
-					chk_dcw(data->ptr);
-					break;
-
-				case ACTION_ECM_ANSWER_CACHE:
-					write_ecm_answer_fromcache(data->ptr);
-					break;
-
-				case ACTION_CLIENT_INIT:
-					if(module->s_init)
-						{ module->s_init(cl); }
-					cl->is_udp = module->type == MOD_CONN_UDP;
-					cl->init_done = 1;
-					break;
-
-				case ACTION_CLIENT_IDLE:
-					if(module->s_idle)
-						{ module->s_idle(cl); }
-					else
-					{
-						cs_log("user %s reached %d sec idle limit.", username(cl), cfg.cmaxidle);
-						cl->kill = 1;
-					}
-					break;
-
-				case ACTION_CACHE_PUSH_OUT:
-					cacheex_push_out(cl, data->ptr);
-					break;
-
-				case ACTION_CLIENT_KILL:
-					cl->kill = 1;
-					break;
-
-				case ACTION_CLIENT_SEND_MSG:
-				{
-					if (config_enabled(MODULE_CCCAM))
-					{
-						struct s_clientmsg *clientmsg = (struct s_clientmsg *)data->ptr;
-						cc_cmd_send(cl, clientmsg->msg, clientmsg->len, clientmsg->cmd);
-					}
-					break;
-				}
-
-				case ACTION_PEER_IDLE:
-					if(module->s_peer_idle)
-						{ module->s_peer_idle(cl); }
-					break;
-
-				case ACTION_CLIENT_HIDECARDS:
-				{
-#ifdef CS_ANTICASC
-					if(config_enabled(MODULE_CCCSHARE))
-					{
-						int32_t hidetime = (cl->account->acosc_penalty_duration == -1 ? cfg.acosc_penalty_duration : cl->account->acosc_penalty_duration);
-						if(hidetime)
-						{
-							int32_t hide_count;
-							int32_t cardsize;
-							int32_t ii, uu=0;
-							LLIST **sharelist = get_and_lock_sharelist();
-							LLIST *sharelist2 = ll_create("hidecards-sharelist");
-
-							for(ii = 0; ii < CAID_KEY; ii++)
-							{
-								if(sharelist[ii])
-								{
-									ll_putall(sharelist2, sharelist[ii]);
-								}
-							}
-
-							unlock_sharelist();
-
-							struct cc_card **cardarray = get_sorted_card_copy(sharelist2, 0, &cardsize);
-							ll_destroy(&sharelist2);
-
-							for(ii = 0; ii < cardsize; ii++)
-							{
-								if(hidecards_card_valid_for_client(cl, cardarray[ii]))
-								{
-									if (cardarray[ii]->id)
-									{
-										hide_count = hide_card_to_client(cardarray[ii], cl);
-										if(hide_count)
-										{
-											cs_log_dbg(D_TRACE, "Hiding card_%d caid=%04x remoteid=%08x from %s for %d %s",
-												 uu, cardarray[ii]->caid, cardarray[ii]->remote_id, username(cl), hidetime, hidetime>1 ? "secconds" : "seccond");
-											uu += 1;
-										}
-									}
-								}
-							}
-
-							cs_sleepms(hidetime * 1000);
-							uu = 0;
-
-							for(ii = 0; ii < cardsize; ii++)
-							{
-								if(hidecards_card_valid_for_client(cl, cardarray[ii]))
-								{
-									if (cardarray[ii]->id)
-									{
-										hide_count = unhide_card_to_client(cardarray[ii], cl);
-										if(hide_count)
-										{
-											cs_log_dbg(D_TRACE, "Unhiding card_%d caid=%04x remoteid=%08x for %s",
-											 uu, cardarray[ii]->caid, cardarray[ii]->remote_id, username(cl));
-											uu += 1;
-										}
-									}
-								}
-							}
-
-							NULLFREE(cardarray);
-						}
-					}
-#endif
-					break;
-				} // case ACTION_CLIENT_HIDECARDS
-
-			} // switch
+			work_job(cl, data, mbuf, bufsize, &restart_reader);
 
 			__free_job_data(cl, data);
 		}
@@ -507,7 +739,7 @@ void *work_thread(void *ptr)
 
 		// Check for some race condition where while we ended, another thread added a job
 		SAFE_MUTEX_LOCK(&cl->thread_lock);
-		if(cl->joblist && ll_count(cl->joblist) > 0)
+		if(job_pending(cl))
 		{
 			SAFE_MUTEX_UNLOCK(&cl->thread_lock);
 			continue;
@@ -519,13 +751,367 @@ void *work_thread(void *ptr)
 			break;
 		}
 	}
-	cl->thread_active = 0;
 	cl->work_mbuf = NULL; // Prevent free_client from freeing mbuf (->work_mbuf)
 	NULLFREE(mbuf);
 	pthread_exit(NULL);
 	return NULL;
 }
 
+#ifdef WITH_WORK_POOL
+/*
+ Worker pool (threading_mode = 1)
+
+ Network clients do not get a work thread of their own. One reactor thread
+ waits on all their sockets with epoll and a fixed number of workers run the
+ queued jobs and socket reads. A client is in the run queue at most once and
+ only one worker runs it at a time, so its jobs keep their order. Sockets are
+ registered EPOLLONESHOT and re-armed by the worker after reading.
+
+ cl->work_state is changed with atomic operations only: whoever sets
+ WORK_QUEUED on an idle client puts it into the run queue, so adding a job to
+ a queued or running client takes no lock.
+*/
+
+#define WORK_QUEUED		0x01	// in the run queue or running on a worker
+#define WORK_PENDING	0x02	// jobs were added while queued
+#define WORK_READABLE	0x04	// socket event from the reactor
+#define WORK_HANGUP		0x08	// socket was closed or failed
+#define WORK_ARMED		0x10	// socket is registered with epoll, changed under work_lock
+#define WORK_DEAD		0x20	// client is being freed, ignore its events
+#define WORK_RUN		(WORK_PENDING | WORK_READABLE | WORK_HANGUP)
+#define WORK_BATCH		16		// jobs run before the client goes back to the end of the queue
+#define WORK_EVENTS		64
+
+struct work_worker
+{
+	uint8_t		*mbuf;
+	uint16_t	bufsize;
+};
+
+static int8_t work_pool_running;
+static int32_t work_epfd = -1;
+static int32_t work_workers;
+static struct s_client *work_queue_first, *work_queue_last;
+static pthread_mutex_t work_lock;
+static pthread_cond_t work_cond;
+
+static void *work_worker(void *arg);
+
+static void work_queue_add(struct s_client *cl)
+{
+	SAFE_MUTEX_LOCK(&work_lock);
+	cl->work_next = NULL;
+	if(work_queue_last)
+		{ work_queue_last->work_next = cl; }
+	else
+		{ work_queue_first = cl; }
+	work_queue_last = cl;
+	SAFE_COND_SIGNAL(&work_cond);
+	SAFE_MUTEX_UNLOCK(&work_lock);
+}
+
+static void work_schedule(struct s_client *cl, uint32_t flags)
+{
+	uint32_t old = __sync_fetch_and_or(&cl->work_state, flags | WORK_QUEUED);
+	if(!(old & (WORK_QUEUED | WORK_DEAD)))
+		{ work_queue_add(cl); }
+}
+
+// work_lock must be held
+static void work_arm(struct s_client *cl)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | EPOLLPRI | EPOLLONESHOT;
+	ev.data.ptr = cl;
+	if(epoll_ctl(work_epfd, (cl->work_state & WORK_ARMED) ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, cl->pfd, &ev) == 0)
+	{
+		__sync_fetch_and_or(&cl->work_state, WORK_ARMED);
+		return;
+	}
+	cs_log_dbg(D_TRACE, "can't watch fd %d of %s (errno=%d %s)", cl->pfd, username(cl), errno, strerror(errno));
+	__sync_fetch_and_or(&cl->work_state, WORK_HANGUP);
+}
+
+void work_pool_detach(struct s_client *cl)
+{
+	struct epoll_event ev;
+	uint32_t old;
+
+	if(!cl->work_pool)
+		{ return; }
+
+	SAFE_MUTEX_LOCK(&work_lock);
+	old = __sync_fetch_and_or(&cl->work_state, WORK_DEAD);
+	if((old & WORK_ARMED) && cl->pfd)
+	{
+		memset(&ev, 0, sizeof(ev)); // kernels before 2.6.9 want an event for EPOLL_CTL_DEL
+		epoll_ctl(work_epfd, EPOLL_CTL_DEL, cl->pfd, &ev);
+	}
+	__sync_fetch_and_and(&cl->work_state, ~WORK_ARMED);
+	SAFE_MUTEX_UNLOCK(&work_lock);
+}
+
+static void *work_free_client(void *ptr)
+{
+	struct s_client *cl = (struct s_client *)ptr;
+
+	SAFE_SETSPECIFIC(getclient, cl);
+	set_thread_name(__func__);
+	cs_log_dbg(D_TRACE, "ending client %s (kill)", username(cl));
+	free_client(cl);
+	return NULL;
+}
+
+// free_client() waits for other threads to let go of the client, do not block a worker with it
+static void work_pool_kill(struct s_client *cl)
+{
+	work_pool_detach(cl);
+	if(start_thread("client free", work_free_client, (void *)cl, NULL, 1, 1))
+		{ free_client(cl); }
+}
+
+// cs_exit() from a job: free the client like work_pool_kill(), the worker thread ends and is replaced
+int8_t work_pool_exit(struct s_client *cl)
+{
+	if(!cl->work_pool || !pthread_equal(cl->thread, pthread_self()))
+		{ return 0; }
+
+	work_pool_kill(cl);
+	return 1;
+}
+
+static void work_pool_run(struct s_client *cl, struct work_worker *w)
+{
+	struct s_module *module = get_module(cl);
+	struct job_data *data, tmp_data;
+	uint16_t bufsize = module->bufsize ? module->bufsize : DEFAULT_MODULE_BUFSIZE;
+	uint32_t state, flags = 0;
+	int32_t jobs = 0;
+	int8_t readable, rearm = 0, restart_reader = 0;
+
+	SAFE_SETSPECIFIC(getclient, cl);
+	cl->thread = pthread_self();
+
+	state = __sync_fetch_and_and(&cl->work_state, ~WORK_RUN);
+	if(state & WORK_HANGUP)
+		{ cl->kill = 1; }
+	readable = (state & WORK_READABLE) ? 1 : 0;
+
+	if(w->bufsize < bufsize)
+	{
+		NULLFREE(w->mbuf);
+		w->bufsize = cs_malloc(&w->mbuf, bufsize) ? bufsize : 0;
+	}
+
+	while(jobs < WORK_BATCH && w->bufsize)
+	{
+		if(cl->kill || !is_valid_client(cl))
+		{
+			work_pool_kill(cl);
+			SAFE_SETSPECIFIC(getclient, NULL);
+			return;
+		}
+
+		if(!(data = job_next(cl)) && readable)
+		{
+			readable = 0;
+			rearm = 1;
+			data = &tmp_data;
+			memset(data, 0, sizeof(tmp_data));
+			data->action = ACTION_CLIENT_TCP;
+		}
+
+		if(!data)
+			{ break; }
+		jobs++;
+
+		if(data == &tmp_data)
+			{ work_job(cl, data, w->mbuf, bufsize, &restart_reader); }
+		else
+		{
+			if(data->action >= ACTION_CLIENT_FIRST && !work_job_expired(cl, data))
+				{ work_job(cl, data, w->mbuf, bufsize, &restart_reader); }
+			job_done(cl, data);
+		}
+	}
+
+	if(readable)
+		{ flags |= WORK_READABLE; }
+	if(jobs >= WORK_BATCH || !w->bufsize)
+		{ flags |= WORK_PENDING; }
+	if(flags)
+		{ __sync_fetch_and_or(&cl->work_state, flags); }
+
+	if(cl->pfd && !cl->is_udp && cl->init_done && (rearm || !(cl->work_state & WORK_ARMED)))
+	{
+		SAFE_MUTEX_LOCK(&work_lock);
+		if(!(cl->work_state & WORK_DEAD))
+			{ work_arm(cl); }
+		SAFE_MUTEX_UNLOCK(&work_lock);
+	}
+
+	// go idle unless something came in meanwhile
+	while(!((state = cl->work_state) & WORK_DEAD))
+	{
+		if(state & WORK_RUN)
+		{
+			work_queue_add(cl);
+			break;
+		}
+		if(__sync_bool_compare_and_swap(&cl->work_state, state, state & ~WORK_QUEUED))
+			{ break; }
+	}
+	SAFE_SETSPECIFIC(getclient, NULL);
+}
+
+// also runs when a job ends the worker with cs_exit(), a new worker takes its place then
+static void work_worker_exit(void *arg)
+{
+	struct work_worker *w = (struct work_worker *)arg;
+	int8_t restart;
+
+	NULLFREE(w->mbuf);
+	SAFE_MUTEX_LOCK(&work_lock);
+	work_workers--;
+	restart = work_pool_running;
+	SAFE_MUTEX_UNLOCK(&work_lock);
+
+	if(restart)
+		{ start_thread("work pool", work_worker, NULL, NULL, 1, 1); }
+}
+
+static void *work_worker(void *UNUSED(arg))
+{
+	struct work_worker w;
+	struct s_client *cl;
+
+	memset(&w, 0, sizeof(w));
+	set_thread_name(__func__);
+
+	SAFE_MUTEX_LOCK(&work_lock);
+	work_workers++;
+	SAFE_MUTEX_UNLOCK(&work_lock);
+
+	pthread_cleanup_push(work_worker_exit, &w);
+
+	SAFE_MUTEX_LOCK(&work_lock);
+	while(work_pool_running)
+	{
+		if(!(cl = work_queue_first))
+		{
+			SAFE_COND_WAIT(&work_cond, &work_lock);
+			continue;
+		}
+
+		if(!(work_queue_first = cl->work_next))
+			{ work_queue_last = NULL; }
+		if(cl->work_state & WORK_DEAD)
+			{ continue; }
+
+		SAFE_MUTEX_UNLOCK(&work_lock);
+		work_pool_run(cl, &w);
+		SAFE_MUTEX_LOCK(&work_lock);
+	}
+	SAFE_MUTEX_UNLOCK(&work_lock);
+
+	pthread_cleanup_pop(1);
+	return NULL;
+}
+
+static void *work_reactor(void *UNUSED(arg))
+{
+	struct epoll_event ev[WORK_EVENTS];
+	int32_t i, n;
+
+	set_thread_name(__func__);
+
+	while(work_pool_running)
+	{
+		n = epoll_wait(work_epfd, ev, WORK_EVENTS, 1000);
+		if(n < 0 && errno != EINTR)
+		{
+			cs_log("epoll_wait failed (errno=%d %s)", errno, strerror(errno));
+			cs_sleepms(100);
+		}
+
+		// the fds are disarmed now until their worker re-arms them
+		for(i = 0; i < n; i++)
+		{
+			work_schedule((struct s_client *)ev[i].data.ptr,
+						  (ev[i].events & (EPOLLHUP | EPOLLERR)) ? WORK_READABLE | WORK_HANGUP : WORK_READABLE);
+		}
+	}
+	return NULL;
+}
+
+static int8_t work_pool_client(struct s_client *cl)
+{
+	return work_pool_running && cl->typ == 'c' && (get_module(cl)->type & MOD_CONN_NET);
+}
+
+void work_pool_start(void)
+{
+	int32_t i, workers = cfg.threading_workers;
+
+	if(cfg.threading_mode != 1 || work_pool_running)
+		{ return; }
+
+	if(workers <= 0)
+	{
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		workers = cpus > 0 ? cpus : 1;
+	}
+
+	if((work_epfd = epoll_create(1024)) < 0)
+	{
+		cs_log("can't create epoll fd (errno=%d %s), using one thread per client", errno, strerror(errno));
+		return;
+	}
+
+	cs_pthread_cond_init(__func__, &work_lock, &work_cond);
+	work_pool_running = 1;
+
+	if(start_thread("work reactor", work_reactor, NULL, NULL, 1, 1))
+	{
+		work_pool_running = 0;
+		close(work_epfd);
+		work_epfd = -1;
+		return;
+	}
+
+	for(i = 0; i < workers; i++)
+		{ start_thread("work pool", work_worker, NULL, NULL, 1, 1); }
+
+	cs_log("worker pool started with %d workers", workers);
+}
+
+// the threads end on their own, work_epfd stays open for workers that are still busy
+void work_pool_stop(void)
+{
+	if(!work_pool_running)
+		{ return; }
+
+	SAFE_MUTEX_LOCK(&work_lock);
+	work_pool_running = 0;
+	SAFE_COND_BROADCAST(&work_cond);
+	SAFE_MUTEX_UNLOCK(&work_lock);
+}
+#else
+void work_pool_start(void)
+{
+	if(cfg.threading_mode == 1)
+		{ cs_log("threading_mode 1 needs epoll, using one thread per client"); }
+}
+
+void work_pool_stop(void) { }
+
+void work_pool_detach(struct s_client *UNUSED(cl)) { }
+
+int8_t work_pool_exit(struct s_client *UNUSED(cl)) { return 0; }
+#endif
+
 /**
  * adds a job to the job queue
  * if ptr should be free() after use, set len to the size
@@ -533,6 +1119,8 @@ void *work_thread(void *ptr)
 **/
 int32_t add_job(struct s_client *cl, enum actions action, void *ptr, int32_t len)
 {
+	struct job_ring *ring;
+
 	if(!cl || cl->kill)
 	{
 		if(!cl)
@@ -544,37 +1132,51 @@ int32_t add_job(struct s_client *cl, enum actions action, void *ptr, int32_t len
 
 	if(action == ACTION_CACHE_PUSH_OUT && cacheex_check_queue_length(cl))
 	{
+		__sync_fetch_and_add(&cl->job_drops, 1);
 		if(len && ptr)
 			{ NULLFREE(ptr); }
 		return 0;
 	}
 
-	struct job_data *data;
-	if(!cs_malloc(&data, sizeof(struct job_data)))
+	// keep the order: once jobs spilled, the next ones follow them
+	if(!(ring = job_ring_get(cl))
+		|| ((cl->job_spilled || !job_ring_push(cl, ring, action, ptr, len))
+			&& !job_spill_push(cl, action, ptr, len)))
 	{
-		if(len && ptr)
-			{ NULLFREE(ptr); }
+		struct job_data data;
+
+		__sync_fetch_and_add(&cl->job_drops, 1);
+		data.action = action;
+		data.ptr = ptr;
+		data.len = len;
+		free_job_data(&data);
 		return 0;
 	}
 
-	data->action = action;
-	data->ptr = ptr;
-	data->cl = cl;
-	data->len = len;
-	cs_ftime(&data->time);
+#ifdef WITH_WORK_POOL
+	if(!cl->work_pool && work_pool_client(cl))
+	{
+		SAFE_MUTEX_LOCK(&cl->thread_lock);
+		if(!cl->thread_active)
+			{ cl->work_pool = 1; }
+		SAFE_MUTEX_UNLOCK(&cl->thread_lock);
+	}
+
+	if(cl->work_pool)
+	{
+		work_schedule(cl, WORK_PENDING);
+		return 1;
+	}
+#endif
 
 	SAFE_MUTEX_LOCK(&cl->thread_lock);
-	if(cl && !cl->kill && cl->thread_active)
+	if(!cl->kill && cl->thread_active)
 	{
-		if(!cl->joblist)
-			{ cl->joblist = ll_create("joblist"); }
-		ll_append(cl->joblist, data);
-		if(cl->thread_active == 2)
-			{ pthread_kill(cl->thread, OSCAM_SIGNAL_WAKEUP); }
+		cs_wakeup(&cl->work_wakeup); // in case it polls its socket
 		SAFE_MUTEX_UNLOCK(&cl->thread_lock);
-		cs_log_dbg(D_TRACE, "add %s job action %d queue length %d %s",
+		cs_log_dbg(D_TRACE, "add %s job action %d queue length %u %s",
 					action > ACTION_CLIENT_FIRST ? "client" : "reader", action,
-					ll_count(cl->joblist), username(cl));
+					job_queue_length(cl), username(cl));
 		return 1;
 	}
 
@@ -590,15 +1192,14 @@ int32_t add_job(struct s_client *cl, enum actions action, void *ptr, int32_t len
 					action > ACTION_CLIENT_FIRST ? "client" : "reader", action);
 	}
 
-	int32_t ret = start_thread("client work", work_thread, (void *)data, &cl->thread, 1, modify_stacksize);
+	int32_t ret = start_thread("client work", work_thread, (void *)cl, &cl->thread, 1, modify_stacksize);
 	if(ret)
 	{
 		cs_log("ERROR: can't create thread for %s (errno=%d %s)",
 				action > ACTION_CLIENT_FIRST ? "client" : "reader", ret, strerror(ret));
-		free_job_data(data);
 	}
-
-	cl->thread_active = 1;
+	else
+		{ cl->thread_active = 1; }
 	SAFE_MUTEX_UNLOCK(&cl->thread_lock);
 	return 1;
 }
@@ -31,12 +31,20 @@ enum actions
 	ACTION_ECM_ANSWER_CACHE    = 33,    // wc33
 	ACTION_CACHEEX1_DELAY      = 34,    // wc34
 	ACTION_PEER_IDLE           = 35,    // wc35
-	ACTION_CLIENT_HIDECARDS    = 36     // wc36
+	ACTION_CLIENT_HIDECARDS    = 36,    // wc36
+	ACTION_ECM_FLIGHT_RELEASE  = 37,    // wc37
+	ACTION_CLIENT_UNHIDECARDS  = 38     // wc38
 };
 
 #define ACTION_CLIENT_FIRST 20 // This just marks where client actions start
 
 int32_t add_job(struct s_client *cl, enum actions action, void *ptr, int32_t len);
 void free_joblist(struct s_client *cl);
+uint32_t job_queue_length(struct s_client *cl);
+uint32_t job_queue_size(struct s_client *cl);
+void work_pool_start(void);
+void work_pool_stop(void);
+void work_pool_detach(struct s_client *cl);
+int8_t work_pool_exit(struct s_client *cl);
 
 #endif
@@ -122,6 +122,9 @@ CS_MUTEX_LOCK ecmcache_lock;
 struct ecm_request_t *ecmcwcache = NULL;
 uint32_t ecmcwcache_size = 0;
 
+// pending ecm stage timeouts
+CS_MUTEX_LOCK ecm_deadline_lock;
+
 // pushout deleted list
 CS_MUTEX_LOCK ecm_pushed_deleted_lock;
 struct ecm_request_t *ecm_pushed_deleted = NULL;
@@ -220,6 +223,7 @@ static void show_usage(void)
 	printf(" -g, --gcollect <mode>   | Garbage collector debug mode:\n");
 	printf("                         .   1 - Immediate free.\n");
 	printf("                         .   2 - Check for double frees.\n");
+	printf("                         .   3 - Poison freed objects.\n");
 	printf("\n Information:\n");
 	printf(" -h, --help              | Show command line help text.\n");
 	printf(" -V, --build-info        | Show OSCam binary configuration and version.\n");
@@ -802,7 +806,8 @@ void cs_exit(int32_t sig)
 	{
 		cs_log_dbg(D_TRACE, "thread %8lX ended!", (unsigned long)pthread_self());
 
-		free_client(cl);
+		if(!work_pool_exit(cl))
+			{ free_client(cl); }
 
 		// Restore signals before exiting thread
 		set_signal_handler(SIGPIPE, 0, cs_sigpipe);
@@ -1234,7 +1239,7 @@ static void process_clients(void)
 		// connected tcp clients
 		for(cl = first_client->next; cl; cl = cl->next)
 		{
-			if(cl->init_done && !cl->kill && cl->pfd && cl->typ == 'c' && !cl->is_udp)
+			if(cl->init_done && !cl->kill && cl->pfd && cl->typ == 'c' && !cl->is_udp && !cl->work_pool)
 			{
 				if(cl->pfd && !cl->thread_active)
 				{
@@ -1573,6 +1578,17 @@ __attribute__ ((noreturn)) static void run_tests(void)
 static void run_tests(void) { }
 #endif
 
+#ifdef BUILD_BENCH
+extern void run_ecm_bench(void);
+__attribute__ ((noreturn)) static void run_bench(void)
+{
+	run_ecm_bench();
+	exit(0);
+}
+#else
+static void run_bench(void) { }
+#endif
+
 const struct s_cardsystem *cardsystems[] =
 {
 #ifdef READER_NAGRA
@@ -1779,6 +1795,9 @@ int32_t main(int32_t argc, char *argv[])
 #endif
 #ifdef HAVE_DVBAPI
 		module_dvbapi,
+#endif
+#ifdef BUILD_BENCH
+		module_bench,
 #endif
 		0
 	};
@@ -1815,17 +1834,19 @@ int32_t main(int32_t argc, char *argv[])
 	cs_lock_create(__func__, &readerlist_lock, "readerlist_lock", 5000);
 	cs_lock_create(__func__, &fakeuser_lock, "fakeuser_lock", 5000);
 	cs_lock_create(__func__, &ecmcache_lock, "ecmcache_lock", 5000);
+	cs_lock_create(__func__, &ecm_deadline_lock, "ecm_deadline_lock", 5000);
 	cs_lock_create(__func__, &ecm_pushed_deleted_lock, "ecm_pushed_deleted_lock", 5000);
 	cs_lock_create(__func__, &readdir_lock, "readdir_lock", 5000);
 	cs_lock_create(__func__, &cwcycle_lock, "cwcycle_lock", 5000);
-	init_cache();
+	init_ecm_pools();
 	cacheex_init_hitcache();
 	init_config();
+	cs_init_log();
 #ifdef CS_CACHEEX_AIO
 	init_cw_cache();
 	init_ecm_cache();
 #endif
-	cs_init_log();
+	init_cache(); // needs cfg.cache_shards, loads the snapshot into all caches
 	init_machine_info();
 	init_check();
 	if(!oscam_pidfile && cfg.pidfile)
@@ -1901,6 +1922,7 @@ int32_t main(int32_t argc, char *argv[])
 
 	webif_init();
 
+	work_pool_start();
 	start_thread("reader check", (void *) &reader_check, NULL, NULL, 1, 1);
 	cw_process_thread_start();
 	checkcache_process_thread_start();
@@ -1931,6 +1953,8 @@ int32_t main(int32_t argc, char *argv[])
 			{ module->s_handler(NULL, NULL, i); }
 	}
 
+	run_bench();
+
 	// main loop function
 	process_clients();
 
@@ -1990,6 +2014,7 @@ int32_t main(int32_t argc, char *argv[])
 
 	// sleep a bit, so hopefully all threads are stopped when we continue
 	cs_sleepms(200);
+	work_pool_stop();
 
 	free_cache();
 #ifdef CS_CACHEEX_AIO
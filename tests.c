@@ -6,6 +6,8 @@
 #include "globals.h"
 
 #include "oscam-array.h"
+#include "oscam-chk.h"
+#include "oscam-config.h"
 #include "oscam-string.h"
 #include "oscam-conf-chk.h"
 #include "oscam-conf-mk.h"
@@ -72,6 +74,428 @@ static void run_parser_test(struct test_type *t)
 	t->clear_fn(t->data_c);
 }
 
+/*
+ * Lookup tests: the compiled tables (CAIDTAB and FTAB indexes, CLASSTAB
+ * bitmaps, sorted SIDTAB copies) must answer like the linear scans they
+ * replaced. Each setting is parsed and then probed with every caid, class
+ * or a set of values around its entries.
+ */
+typedef int32_t (LOOKUP_FN)(void *);
+
+struct lookup_test
+{
+	char      *desc;        // Test textual description
+	void      *data;        // Pointer to basic data structure
+	size_t    data_sz;      // Data structure size
+	CHK_FN    *chk_fn;      // chk_XXX() func for the data type
+	CLEAR_FN  *clear_fn;    // clear_XXX() func for the data type
+	LOOKUP_FN *lookup_fn;   // Compares the lookups with linear scans, returns the differences
+	const struct test_vec *test_vec; // Array of test vectors, 'out' is not used
+};
+
+static void run_lookup_test(struct lookup_test *t)
+{
+	memset(t->data, 0, t->data_sz);
+	printf("%s\n", t->desc);
+	const struct test_vec *vec = t->test_vec;
+	while (vec->in)
+	{
+		printf(" Testing \"%s\"", vec->in);
+		char *input_setting = cs_strdup(vec->in);
+		t->chk_fn(input_setting, t->data);
+		int32_t bad = t->lookup_fn(t->data);
+		t->clear_fn(t->data);
+		if (!bad)
+		{
+			printf(" [OK]\n");
+		} else {
+			printf("\n");
+			printf(" === ERROR ===\n");
+			printf("  Input data:   \"%s\"\n", vec->in);
+			printf("  %d lookups differ from the linear scan\n", bad);
+			printf("\n");
+		}
+		free(input_setting);
+		fflush(stdout);
+		vec++;
+	}
+}
+
+static const uint16_t test_caids[] = { 0x0000, 0x0100, 0x0500, 0x0604, 0x09C4, 0x1702, 0x1722, 0x1830, 0x183D, 0xFFFF };
+static const uint32_t test_idents[] = { 0x000000, 0x000001, 0x000012, 0x005411, 0x123456, 0x234567, 0xFFFFFF };
+static const uint16_t test_srvids[] = { 0x0000, 0x0001, 0x1234, 0x7FFF, 0xFFFF };
+
+static int32_t lookup_diff(const char *what, uint32_t caid, uint32_t id, int32_t scan, int32_t lookup)
+{
+	if (!scan == !lookup)
+		return 0;
+	printf("\n  %s(%04X, %06X): linear scan %d, lookup %d", what, caid, id, scan, lookup);
+	return 1;
+}
+
+// chk_ctab() before the caid bitmap, an entry without caid ends the table
+static int32_t caidtab_scan(uint16_t caid, CAIDTAB *ctab)
+{
+	int32_t i;
+	if (!caid || !ctab->ctnum)
+		return 1;
+	for (i = 0; i < ctab->ctnum; i++)
+	{
+		CAIDTAB_DATA *d = &ctab->ctdata[i];
+		if (!d->caid)
+			return 0;
+		if ((caid & d->mask) == d->caid)
+			return 1;
+	}
+	return 0;
+}
+
+static int32_t caidtab_lookup(CAIDTAB *ctab)
+{
+	int32_t bad = 0;
+	uint32_t caid;
+	for (caid = 0; caid <= 0xFFFF; caid++)
+		bad += lookup_diff("chk_ctab", caid, 0, caidtab_scan(caid, ctab), chk_ctab(caid, ctab));
+	return bad;
+}
+
+// caid < 0 matches the idents of any filter
+static int32_t ftab_scan(FTAB *ftab, int32_t caid, uint32_t ident)
+{
+	int32_t i, j;
+	for (i = 0; i < ftab->nfilts; i++)
+	{
+		if (caid >= 0 && ftab->filts[i].caid != caid)
+			continue;
+		for (j = 0; j < ftab->filts[i].nprids; j++)
+			if (ftab->filts[i].prids[j] == ident)
+				return 1;
+	}
+	return 0;
+}
+
+// chk_ident_filter() before the ident index, filters with caid 0 match any caid
+static int32_t ident_filter_scan(uint16_t rcaid, uint32_t rprid, FTAB *ftab)
+{
+	int32_t i, j, rc = 1;
+	if (ftab->nfilts)
+	{
+		for (rc = i = 0; !rc && i < ftab->nfilts; i++)
+		{
+			uint16_t caid = ftab->filts[i].caid;
+			if (caid == rcaid || caid == 0)
+				for (j = 0; !rc && j < ftab->filts[i].nprids; j++)
+					if (ftab->filts[i].prids[j] == rprid)
+						rc = 1;
+		}
+	}
+	return rc;
+}
+
+static int32_t ftab_lookup_ident(FTAB *ftab, uint16_t caid, uint32_t ident)
+{
+	int32_t bad = 0;
+	bad += lookup_diff("ftab_has_ident", caid, ident, ftab_scan(ftab, caid, ident), ftab_has_ident(ftab, caid, ident));
+	bad += lookup_diff("ftab_has_any_ident", 0, ident, ftab_scan(ftab, -1, ident), ftab_has_any_ident(ftab, ident));
+	bad += lookup_diff("chk_ident_filter", caid, ident, ident_filter_scan(caid, ident, ftab), chk_ident_filter(caid, ident, ftab));
+	return bad;
+}
+
+static int32_t ftab_lookup_caid(FTAB *ftab, uint16_t caid)
+{
+	int32_t i, j, found = 0, bad = 0;
+	uint32_t k;
+	for (i = 0; i < ftab->nfilts; i++)
+		if (ftab->filts[i].caid == caid)
+			found = 1;
+	bad += lookup_diff("ftab_has_caid", caid, 0, found, ftab_has_caid(ftab, caid));
+	for (k = 0; k < ARRAY_SIZE(test_idents); k++)
+		bad += ftab_lookup_ident(ftab, caid, test_idents[k]);
+	for (i = 0; i < ftab->nfilts; i++)
+		for (j = 0; j < ftab->filts[i].nprids; j++)
+			for (k = 0; k < 2; k++)
+				bad += ftab_lookup_ident(ftab, caid, ftab->filts[i].prids[j] + k);
+	return bad;
+}
+
+static int32_t ftab_lookup_all(FTAB *ftab)
+{
+	int32_t i, bad = 0;
+	uint32_t k;
+	for (k = 0; k < ARRAY_SIZE(test_caids); k++)
+		bad += ftab_lookup_caid(ftab, test_caids[k]);
+	for (i = 0; i < ftab->nfilts; i++)
+	{
+		bad += ftab_lookup_caid(ftab, ftab->filts[i].caid);
+		bad += ftab_lookup_caid(ftab, ftab->filts[i].caid ^ 1);
+	}
+	return bad;
+}
+
+// chk_ftab() skips caid 0, CCcam.cfg F lines set it in place: probe the first filter as wildcard too
+static int32_t ftab_lookup(FTAB *ftab)
+{
+	int32_t bad = ftab_lookup_all(ftab);
+	if (ftab->nfilts)
+	{
+		uint16_t caid = ftab->filts[0].caid;
+		ftab->filts[0].caid = 0;
+		ftab_index(ftab);
+		bad += ftab_lookup_all(ftab);
+		ftab->filts[0].caid = caid;
+		ftab_index(ftab);
+	}
+	return bad;
+}
+
+static void cltab_clear(CLASSTAB *clstab)
+{
+	NULLFREE(clstab->aclass);
+	NULLFREE(clstab->bclass);
+	memset(clstab, 0, sizeof(*clstab));
+}
+
+static int32_t cltab_scan(uint8_t *classes, int32_t num, uint8_t ecm_class)
+{
+	int32_t i;
+	for (i = 0; i < num; i++)
+		if (classes[i] == ecm_class)
+			return 1;
+	return 0;
+}
+
+static int32_t cltab_lookup(CLASSTAB *clstab)
+{
+	int32_t bad = 0;
+	uint32_t c;
+	for (c = 0; c < 256; c++)
+	{
+		bad += lookup_diff("allowed class", 0, c, cltab_scan(clstab->aclass, clstab->an, c), clstab->abits[c >> 5] & (1U << (c & 31)));
+		bad += lookup_diff("blocked class", 0, c, cltab_scan(clstab->bclass, clstab->bn, c), clstab->bbits[c >> 5] & (1U << (c & 31)));
+	}
+	return bad;
+}
+
+// "caid;provid;srvid", like the three sidtab settings in oscam.services
+static void sidtab_chk(char *value, SIDTAB *sidtab)
+{
+	static const char *token[] = { "caid", "provid", "srvid" };
+	char *ptr, *end;
+	int32_t i;
+	for (i = 0, ptr = value; i < 3 && ptr; i++, ptr = end)
+	{
+		if ((end = strchr(ptr, ';')))
+			*end++ = '\0';
+		if (*ptr)
+			chk_sidtab((char *)token[i], ptr, sidtab);
+	}
+}
+
+static void sidtab_clear(SIDTAB *sidtab)
+{
+	NULLFREE(sidtab->caid);
+	NULLFREE(sidtab->provid);
+	NULLFREE(sidtab->srvid);
+	NULLFREE(sidtab->caid_sorted);
+	NULLFREE(sidtab->provid_sorted);
+	NULLFREE(sidtab->srvid_sorted);
+	memset(sidtab, 0, sizeof(*sidtab));
+}
+
+static int32_t sidtab_scan_caid(SIDTAB *sidtab, uint16_t caid)
+{
+	int32_t i;
+	for (i = 0; i < sidtab->num_caid; i++)
+		if (sidtab->caid[i] == caid)
+			return 1;
+	return !sidtab->num_caid;
+}
+
+static int32_t sidtab_scan_provid(SIDTAB *sidtab, uint32_t provid)
+{
+	int32_t i;
+	for (i = 0; i < sidtab->num_provid; i++)
+		if (sidtab->provid[i] == provid)
+			return 1;
+	return !sidtab->num_provid;
+}
+
+static int32_t sidtab_scan_srvid(SIDTAB *sidtab, uint16_t srvid)
+{
+	int32_t i;
+	for (i = 0; i < sidtab->num_srvid; i++)
+		if (sidtab->srvid[i] == srvid)
+			return 1;
+	return !sidtab->num_srvid;
+}
+
+// an ecm without provid matches any provid
+static int32_t sidtab_lookup_ecm(SIDTAB *sidtab, uint16_t caid, uint32_t provid, uint16_t srvid)
+{
+	ECM_REQUEST er;
+	int32_t bad = 0;
+	memset(&er, 0, sizeof(er));
+	er.caid = caid;
+	er.prid = provid;
+	er.srvid = srvid;
+	bad += lookup_diff("chk_srvid_match", caid, provid,
+		sidtab_scan_caid(sidtab, caid) && (!provid || sidtab_scan_provid(sidtab, provid)) && sidtab_scan_srvid(sidtab, srvid),
+		chk_srvid_match(&er, sidtab));
+	bad += lookup_diff("chk_srvid_match_by_caid_prov", caid, provid,
+		sidtab_scan_caid(sidtab, caid) && sidtab_scan_provid(sidtab, provid),
+		chk_srvid_match_by_caid_prov(caid, provid, sidtab));
+	return bad;
+}
+
+static int32_t sidtab_lookup_provid(SIDTAB *sidtab, uint16_t caid, uint32_t provid)
+{
+	int32_t i, bad = 0;
+	uint32_t k;
+	for (k = 0; k < ARRAY_SIZE(test_srvids); k++)
+		bad += sidtab_lookup_ecm(sidtab, caid, provid, test_srvids[k]);
+	for (i = 0; i < sidtab->num_srvid; i++)
+		for (k = 0; k < 2; k++)
+			bad += sidtab_lookup_ecm(sidtab, caid, provid, sidtab->srvid[i] + k);
+	return bad;
+}
+
+static int32_t sidtab_lookup_caid(SIDTAB *sidtab, uint16_t caid)
+{
+	int32_t i, bad = 0;
+	uint32_t k;
+	for (k = 0; k < ARRAY_SIZE(test_idents); k++)
+		bad += sidtab_lookup_provid(sidtab, caid, test_idents[k]);
+	for (i = 0; i < sidtab->num_provid; i++)
+		for (k = 0; k < 2; k++)
+			bad += sidtab_lookup_provid(sidtab, caid, sidtab->provid[i] + k);
+	return bad;
+}
+
+static int32_t sidtab_lookup_all(SIDTAB *sidtab)
+{
+	int32_t i, bad = 0;
+	uint32_t k;
+	for (k = 0; k < ARRAY_SIZE(test_caids); k++)
+		bad += sidtab_lookup_caid(sidtab, test_caids[k]);
+	for (i = 0; i < sidtab->num_caid; i++)
+		for (k = 0; k < 2; k++)
+			bad += sidtab_lookup_caid(sidtab, sidtab->caid[i] + k);
+	return bad;
+}
+
+// with the sorted copies (binary search) and without them (linear fallback)
+static int32_t sidtab_lookup(SIDTAB *sidtab)
+{
+	uint16_t *caid_sorted = sidtab->caid_sorted, *srvid_sorted = sidtab->srvid_sorted;
+	uint32_t *provid_sorted = sidtab->provid_sorted;
+	int32_t bad = sidtab_lookup_all(sidtab);
+
+	sidtab->caid_sorted = NULL;
+	sidtab->provid_sorted = NULL;
+	sidtab->srvid_sorted = NULL;
+	bad += sidtab_lookup_all(sidtab);
+
+	sidtab->caid_sorted = caid_sorted;
+	sidtab->provid_sorted = provid_sorted;
+	sidtab->srvid_sorted = srvid_sorted;
+	return bad;
+}
+
+static void run_lookup_tests(void)
+{
+	CAIDTAB caidtab;
+	struct lookup_test caidtab_test =
+	{
+		.desc      = "caidtab lookup (chk_ctab)",
+		.data      = &caidtab,
+		.data_sz   = sizeof(caidtab),
+		.chk_fn    = (CHK_FN *)&chk_caidtab,
+		.clear_fn  = (CLEAR_FN *)&caidtab_clear,
+		.lookup_fn = (LOOKUP_FN *)&caidtab_lookup,
+		.test_vec  = (const struct test_vec[])
+		{
+			{ .in = "0100" },
+			{ .in = "0702,0722,1833&FFF0" },
+			{ .in = "0200&FF00:0300,0400&00FF:0500" },
+			{ .in = "0702&FFDF" },
+			{ .in = "1800&FF00,0D00&FF00,0500" },
+			{ .in = "0100,0&0:0500,0200" },
+			{ .in = "0&0:0500" },
+			{ .in = "" },
+			{ .in = NULL },
+		},
+	};
+	run_lookup_test(&caidtab_test);
+
+	FTAB ftab;
+	struct lookup_test ftab_test =
+	{
+		.desc      = "ftab lookup (ftab_has_caid, ftab_has_ident, ftab_has_any_ident, chk_ident_filter)",
+		.data      = &ftab,
+		.data_sz   = sizeof(ftab),
+		.chk_fn    = (CHK_FN *)&chk_ftab,
+		.clear_fn  = (CLEAR_FN *)&ftab_clear,
+		.lookup_fn = (LOOKUP_FN *)&ftab_lookup,
+		.test_vec  = (const struct test_vec[])
+		{
+			{ .in = "0100:123456,234567;0200:345678,456789" },
+			{ .in = "183D:000000,005411" },
+			{ .in = "0100:000012;0604:0000BA,000101,00010E,000141" },
+			{ .in = "1234:234567;0010:345678,876543" },
+			{ .in = "0500:000000,FFFFFF;0500:000012;1702:000000" },
+			{ .in = "0100:000001;0200:000001;0100:000002" },
+			{ .in = "" },
+			{ .in = NULL },
+		},
+	};
+	run_lookup_test(&ftab_test);
+
+	CLASSTAB cltab;
+	struct lookup_test cltab_test =
+	{
+		.desc      = "class lookup (chk_class allow and deny bitmaps)",
+		.data      = &cltab,
+		.data_sz   = sizeof(cltab),
+		.chk_fn    = (CHK_FN *)&chk_cltab,
+		.clear_fn  = (CLEAR_FN *)&cltab_clear,
+		.lookup_fn = (LOOKUP_FN *)&cltab_lookup,
+		.test_vec  = (const struct test_vec[])
+		{
+			{ .in = "01,02,!03" },
+			{ .in = "!00,!FF" },
+			{ .in = "80,7F,!80" },
+			{ .in = "1F,20,3F,40,5F,60,9F,A0,DF,E0,FF" },
+			{ .in = "!1F,!20,00" },
+			{ .in = "" },
+			{ .in = NULL },
+		},
+	};
+	run_lookup_test(&cltab_test);
+
+	SIDTAB sidtab;
+	struct lookup_test sidtab_test =
+	{
+		.desc      = "sidtab lookup (chk_srvid_match, chk_srvid_match_by_caid_prov), setting is caid;provid;srvid",
+		.data      = &sidtab,
+		.data_sz   = sizeof(sidtab),
+		.chk_fn    = (CHK_FN *)&sidtab_chk,
+		.clear_fn  = (CLEAR_FN *)&sidtab_clear,
+		.lookup_fn = (LOOKUP_FN *)&sidtab_lookup,
+		.test_vec  = (const struct test_vec[])
+		{
+			{ .in = "0100,0500;;" },
+			{ .in = ";000000;" },
+			{ .in = "0500;000000,123456;0001,1234" },
+			{ .in = "1702,0100,1702;;FFFF,0000,7FFF" },
+			{ .in = "0100;123456,000001,FFFFFF;" },
+			{ .in = ";;0010,0001,0100,0011,1000,0101,FFFE,1001,0110,1100,0020,0002" },
+			{ .in = ";;" },
+			{ .in = NULL },
+		},
+	};
+	run_lookup_test(&sidtab_test);
+}
+
 void run_all_tests(void)
 {
 	ECM_WHITELIST ecm_whitelist, ecm_whitelist_c;
@@ -314,4 +738,6 @@ void run_all_tests(void)
 		},
 	};
 	run_parser_test(&caidtab_test);
+
+	run_lookup_tests();
 }
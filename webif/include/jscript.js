@@ -1069,6 +1069,8 @@ function updateCacheextotals(data) {
 	$("#total_cachexhit").text(data.oscam.totals.total_cachexhit);
 	$("#rel_cachexhit").text(data.oscam.totals.rel_cachexhit);
 	$("#total_cachesize").text(data.oscam.totals.total_cachesize);
+	$("#total_cachemem").text(data.oscam.totals.total_cachemem);
+	$("#cachemem_cw").text(data.oscam.totals.cachemem_cw);
 }
 
 /*
@@ -1412,14 +1414,15 @@ function updateStatuspage(data) {
 		}
 
 		if (!is_nopoll('statuscol15')) {
+			var jobs = '\nJobs: ' + item.jobs.queued + ' (max ' + item.jobs.highwater + ', dropped ' + item.jobs.dropped + ')';
 			if ($("#onlineidle").text() != 'Login*') {
 				$(uid + " > td.statuscol15")
 					.html(item.times.online.toHHMMSS() + '<br>' + item.times.idle.toHHMMSS())
-					.attr('title', 'Login: ' + item.times.loginfmt);
+					.attr('title', 'Login: ' + item.times.loginfmt + jobs);
 			} else {
 				$(uid + " > td.statuscol15")
 					.html(item.times.loginfmt.substring(0, 8) + '<br>' + item.times.loginfmt.substring(10, 18))
-					.attr('title', 'Online: ' + item.times.online.toHHMMSS() + '\nIDLE: ' + item.times.idle.toHHMMSS());
+					.attr('title', 'Online: ' + item.times.online.toHHMMSS() + '\nIDLE: ' + item.times.idle.toHHMMSS() + jobs);
 			}
 		}
 